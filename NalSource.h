@@ -0,0 +1,164 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef NAL_SOURCE
+#define NAL_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// live555
+#include <liveMedia.hh>
+
+// project
+#include "nalsock.h"
+
+// ---------------------------------
+//   NalSource
+// ---------------------------------
+// Live source of the NAL units an encoder sends on a Unix socket (see
+// nalsock.h), one NAL unit per frame with the presentation time given by
+// the encoder. It feeds a H264 or H265 discrete framer: no start code to
+// look for, and a NAL unit is delivered as soon as it is received.
+class NalSource : public FramedSource
+{
+ public:
+  static NalSource* createNew(UsageEnvironment& env, int fd) { return new NalSource(env, fd); }
+
+  // listen on path for the encoder, a stale socket file is replaced
+  static int listenOn(char const* path)
+  {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+      return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+ protected:
+ NalSource(UsageEnvironment& env, int fd) : FramedSource(env), m_fd(fd), m_got(0)
+  {
+    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+  };
+
+  virtual ~NalSource()
+  {
+    envir().taskScheduler().disableBackgroundHandling(m_fd);
+    ::close(m_fd);  // not Medium::close
+  }
+
+  virtual void doGetNextFrame()
+  {
+    envir().taskScheduler().setBackgroundHandling(m_fd, SOCKET_READABLE | SOCKET_EXCEPTION, readable, this);
+  }
+
+  virtual void doStopGettingFrames()
+  {
+    envir().taskScheduler().disableBackgroundHandling(m_fd);
+  }
+
+ private:
+  static void readable(void* clientData, int /*mask*/)
+  {
+    ((NalSource*)clientData)->readNal();
+  }
+
+  // false when the read has to wait for more data or the encoder is gone
+  bool got(ssize_t n)
+  {
+    if (n > 0) {
+      m_got += n;
+      return true;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return false;
+    // encoder closed, the sink ends playing
+    envir().taskScheduler().disableBackgroundHandling(m_fd);
+    handleClosure();
+    return false;
+  }
+
+  // reads what the socket has of the header then of the NAL unit, which is
+  // delivered when complete. The bytes beyond the room of the sink are
+  // dropped and reported as truncated.
+  void readNal()
+  {
+    char skip[4096];
+    size_t off, n;
+
+    while (m_got < sizeof(m_head)) {
+      if (!got(read(m_fd, (char*)&m_head + m_got, sizeof(m_head) - m_got)))
+	return;
+    }
+    if (m_head.magic != NALSOCK_MAGIC) {
+      envir() << "Bad NAL unit header from the encoder\n";
+      envir().taskScheduler().disableBackgroundHandling(m_fd);
+      handleClosure();
+      return;
+    }
+    fFrameSize = (m_head.size < fMaxSize) ? m_head.size : fMaxSize;
+    fNumTruncatedBytes = m_head.size - fFrameSize;
+    while ((off = m_got - sizeof(m_head)) < m_head.size) {
+      if (off < fFrameSize) {
+	if (!got(read(m_fd, fTo + off, fFrameSize - off)))
+	  return;
+      }
+      else {
+	n = m_head.size - off;
+	if (!got(read(m_fd, skip, (n < sizeof(skip)) ? n : sizeof(skip))))
+	  return;
+      }
+    }
+    m_got = 0;
+
+    fPresentationTime.tv_sec = m_head.time / 1000000;
+    fPresentationTime.tv_usec = m_head.time % 1000000;
+    fDurationInMicroseconds = 0;
+    envir().taskScheduler().disableBackgroundHandling(m_fd);
+    FramedSource::afterGetting(this);
+  }
+
+ protected:
+  int m_fd;
+  struct nalsock_s m_head;      // header of the NAL unit being read
+  size_t m_got;                 // bytes of the header and NAL unit read
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Check of the bitstream writer against the one it replaced.
+ *
+ * Random sequences of put_ui, put_ue, put_se and byte aligning go through
+ * both writers and the buffers are compared, then both are timed on the
+ * same sequences. The old writer is kept here as it was, allocating its
+ * buffer for every bitstream.
+ *
+ *   make bitstream-test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "bitstream.h"
+
+#define OPS         400         /* operations per bitstream */
+#define STREAMS     20000       /* bitstreams compared */
+#define ROUNDS      20          /* timing rounds over the same bitstreams */
+
+// -----------------------------------------------------------------------------
+//  Old writer
+// -----------------------------------------------------------------------------
+struct old_bitstream_s {
+    unsigned int *buffer;
+    int bit_offset;
+    int max_size_in_dword;
+};
+
+static unsigned int old_swap32(unsigned int val)
+{
+    unsigned char *pval = (unsigned char *)&val;
+
+    return ((pval[0] << 24) | (pval[1] << 16) | (pval[2] << 8) | (pval[3] << 0));
+}
+
+static void old_start(struct old_bitstream_s *bs)
+{
+    bs->max_size_in_dword = 4096;
+    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
+    assert(bs->buffer);
+    bs->bit_offset = 0;
+}
+
+static void old_end(struct old_bitstream_s *bs)
+{
+    int pos = (bs->bit_offset >> 5);
+    int bit_offset = (bs->bit_offset & 0x1f);
+    int bit_left = 32 - bit_offset;
+
+    if (bit_offset)
+        bs->buffer[pos] = old_swap32((bs->buffer[pos] << bit_left));
+}
+
+static void old_put_ui(struct old_bitstream_s *bs, unsigned int val, int size_in_bits)
+{
+    int pos = (bs->bit_offset >> 5);
+    int bit_offset = (bs->bit_offset & 0x1f);
+    int bit_left = 32 - bit_offset;
+
+    if (!size_in_bits)
+        return;
+
+    bs->bit_offset += size_in_bits;
+
+    if (bit_left > size_in_bits) {
+        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
+    } else {
+        size_in_bits -= bit_left;
+        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
+        bs->buffer[pos] = old_swap32(bs->buffer[pos]);
+
+        if (pos + 1 == bs->max_size_in_dword) {
+            bs->max_size_in_dword += 4096;
+            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
+            assert(bs->buffer);
+        }
+        bs->buffer[pos + 1] = val;
+    }
+}
+
+static void old_put_ue(struct old_bitstream_s *bs, unsigned int val)
+{
+    int size_in_bits = 0;
+    int tmp_val = ++val;
+
+    while (tmp_val) {
+        tmp_val >>= 1;
+        size_in_bits++;
+    }
+    old_put_ui(bs, 0, size_in_bits - 1);
+    old_put_ui(bs, val, size_in_bits);
+}
+
+static void old_put_se(struct old_bitstream_s *bs, int val)
+{
+    old_put_ue(bs, (val <= 0) ? -2 * val : 2 * val - 1);
+}
+
+static void old_byte_aligning(struct old_bitstream_s *bs, int bit)
+{
+    int bit_left = 8 - (bs->bit_offset & 0x7);
+
+    if (bit_left != 8)
+        old_put_ui(bs, bit ? (1 << bit_left) - 1 : 0, bit_left);
+}
+
+// -----------------------------------------------------------------------------
+//  Random operations, within what the old writer handles: values masked to
+//  their size, no 32 bits write on a dword boundary past the first one and
+//  Exp-Golomb codes below 2^30
+// -----------------------------------------------------------------------------
+struct op_s {
+    int op;
+    int size;
+    unsigned int val;
+};
+
+static unsigned int rnd32(void)
+{
+    return ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+}
+
+static void gen(struct op_s *ops, int n)
+{
+    int i, bits = 0;
+
+    for (i = 0; i < n; i++) {
+        struct op_s *o = &ops[i];
+
+        o->op = rand() % 4;
+        switch (o->op) {
+        case 0:
+            o->size = rand() % 33;
+            if (o->size == 32 && bits && (bits & 31) == 0)
+                o->size = 31;
+            o->val = (o->size < 32) ? rnd32() & ((1u << o->size) - 1) : rnd32();
+            bits += o->size;
+            break;
+        case 1:
+            o->val = (rnd32() >> (rand() % 32)) & 0x3fffffff;
+            bits += 2 * (32 - __builtin_clz(o->val + 1)) - 1;
+            break;
+        case 2:
+            o->val = rnd32() >> (3 + rand() % 29);
+            if (rand() & 1)
+                o->val = -o->val;
+            bits += 2 * (32 - __builtin_clz(((int)o->val <= 0) ? -2 * (int)o->val + 1 : 2 * (int)o->val)) - 1;
+            break;
+        case 3:
+            o->val = rand() & 1;
+            bits = (bits + 7) & ~7;
+            break;
+        }
+    }
+}
+
+static void run_new(bitstream *bs, const struct op_s *ops, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        switch (ops[i].op) {
+        case 0: bitstream_put_ui(bs, ops[i].val, ops[i].size); break;
+        case 1: bitstream_put_ue(bs, ops[i].val); break;
+        case 2: bitstream_put_se(bs, (int)ops[i].val); break;
+        case 3: bitstream_byte_aligning(bs, ops[i].val); break;
+        }
+    }
+    bitstream_end(bs);
+}
+
+static void run_old(struct old_bitstream_s *bs, const struct op_s *ops, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        switch (ops[i].op) {
+        case 0: old_put_ui(bs, ops[i].val, ops[i].size); break;
+        case 1: old_put_ue(bs, ops[i].val); break;
+        case 2: old_put_se(bs, (int)ops[i].val); break;
+        case 3: old_byte_aligning(bs, ops[i].val); break;
+        }
+    }
+    old_end(bs);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned int buffer[8192];
+    struct op_s *ops;
+    struct old_bitstream_s ob;
+    bitstream nb;
+    double t0, t1, t2, total;
+    int *count;
+    int i, r;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    /* bitstreams of 1 to OPS operations, OPS entries apart */
+    ops = malloc(sizeof(*ops) * OPS * STREAMS);
+    count = malloc(sizeof(*count) * STREAMS);
+    assert(ops && count);
+    for (i = 0, total = 0; i < STREAMS; i++) {
+        count[i] = 1 + rand() % OPS;
+        gen(ops + i * OPS, count[i]);
+        total += count[i];
+    }
+
+    /* bit exactness, with a caller buffer and with a heap one */
+    for (i = 0; i < STREAMS; i++) {
+        if (i & 1)
+            bitstream_start(&nb);
+        else
+            bitstream_init(&nb, buffer, sizeof(buffer) / sizeof(buffer[0]));
+        old_start(&ob);
+        run_new(&nb, ops + i * OPS, count[i]);
+        run_old(&ob, ops + i * OPS, count[i]);
+        if (nb.bit_offset != ob.bit_offset || memcmp(nb.buffer, ob.buffer, (nb.bit_offset + 7) / 8)) {
+            printf("bitstream %d differs (%d bits, old writer %d bits)\n", i, nb.bit_offset, ob.bit_offset);
+            return 1;
+        }
+        if (i & 1)
+            free(nb.buffer);
+        free(ob.buffer);
+    }
+    printf("%d bitstreams bit-exact\n", STREAMS);
+
+    /* the new writer in a reused buffer, as the encoders do, the old one
+       with its allocation */
+    t0 = now();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < STREAMS; i++) {
+            bitstream_init(&nb, buffer, sizeof(buffer) / sizeof(buffer[0]));
+            run_new(&nb, ops + i * OPS, count[i]);
+        }
+    }
+    t1 = now();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < STREAMS; i++) {
+            old_start(&ob);
+            run_old(&ob, ops + i * OPS, count[i]);
+            free(ob.buffer);
+        }
+    }
+    t2 = now();
+    printf("new writer %.1f ns/op, old writer %.1f ns/op, %.2fx\n",
+           (t1 - t0) * 1e9 / (ROUNDS * total),
+           (t2 - t1) * 1e9 / (ROUNDS * total), (t2 - t1) / (t1 - t0));
+    free(count);
+    free(ops);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bitstream.h"
 
 #define BITSTREAM_ALLOCATE_STEPPING     4096
@@ -7,19 +8,30 @@
 // -----------------------------------------------------------------------------
 //
 // -----------------------------------------------------------------------------
-static unsigned int
+static inline unsigned int
 va_swap32(unsigned int val)
 {
-    unsigned char *pval = (unsigned char *)&val;
+    return __builtin_bswap32(val);
+}
+
+// -----------------------------------------------------------------------------
+//   Make sure dword 'pos' can be written. Buffers supplied by the caller
+//   through bitstream_init() are never reallocated.
+// -----------------------------------------------------------------------------
+static inline void
+bitstream_reserve(bitstream *bs, int pos)
+{
+    if (pos < bs->max_size_in_dword)
+        return;
 
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
+    assert(bs->owned);
+    bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
+    bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
+    assert(bs->buffer);
 }
 
 // -----------------------------------------------------------------------------
-//
+//   Heap allocated bitstream, the caller has to free bs->buffer
 // -----------------------------------------------------------------------------
 void
 bitstream_start(bitstream *bs)
@@ -28,6 +40,24 @@ bitstream_start(bitstream *bs)
     bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
     assert(bs->buffer);
     bs->bit_offset = 0;
+    bs->acc = 0;
+    bs->acc_bits = 0;
+    bs->owned = 1;
+}
+
+// -----------------------------------------------------------------------------
+//   Bitstream writing into a caller supplied buffer, no allocation is done.
+//   The same buffer can be reused by calling bitstream_init() again.
+// -----------------------------------------------------------------------------
+void
+bitstream_init(bitstream *bs, unsigned int *buffer, int size_in_dword)
+{
+    bs->max_size_in_dword = size_in_dword;
+    bs->buffer = buffer;
+    bs->bit_offset = 0;
+    bs->acc = 0;
+    bs->acc_bits = 0;
+    bs->owned = 0;
 }
 
 // -----------------------------------------------------------------------------
@@ -37,62 +67,59 @@ void
 bitstream_end(bitstream *bs)
 {
     int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
 
-    if (bit_offset) {
-        bs->buffer[pos] = va_swap32((bs->buffer[pos] << bit_left));
+    if (bs->acc_bits) {
+        bitstream_reserve(bs, pos);
+        bs->buffer[pos] = va_swap32((unsigned int)(bs->acc << (32 - bs->acc_bits)));
     }
 }
 
 // -----------------------------------------------------------------------------
-//
+//   Bits are accumulated in a 64 bits register and flushed one dword at a
+//   time, at most 31 bits are pending so 32 more bits always fit.
 // -----------------------------------------------------------------------------
 void
 bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
 {
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
     if (!size_in_bits)
         return;
 
+    if (size_in_bits < 32)
+        val &= (1u << size_in_bits) - 1;
+
+    bs->acc = (bs->acc << size_in_bits) | val;
+    bs->acc_bits += size_in_bits;
     bs->bit_offset += size_in_bits;
 
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = va_swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-            assert(bs->buffer);
-        }
+    if (bs->acc_bits >= 32) {
+        int pos = (bs->bit_offset >> 5) - 1;
 
-        bs->buffer[pos + 1] = val;
+        bs->acc_bits -= 32;
+        bitstream_reserve(bs, pos);
+        bs->buffer[pos] = va_swap32((unsigned int)(bs->acc >> bs->acc_bits));
     }
 }
 
 // -----------------------------------------------------------------------------
-//
+//   Exp-Golomb: (size - 1) leading zeros followed by val + 1 on size bits
 // -----------------------------------------------------------------------------
 void
 bitstream_put_ue(bitstream *bs, unsigned int val)
 {
-    int size_in_bits = 0;
-    int tmp_val = ++val;
+    uint64_t code = (uint64_t)val + 1;
+    int size_in_bits = 64 - __builtin_clzll(code);
 
-    while (tmp_val) {
-        tmp_val >>= 1;
-        size_in_bits++;
+    if (size_in_bits <= 16) {
+        /* leading zeros and value fit in a single write */
+        bitstream_put_ui(bs, (unsigned int)code, 2 * size_in_bits - 1);
+    } else {
+        bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
+        if (size_in_bits > 32) {
+            bitstream_put_ui(bs, 1, 1);
+            size_in_bits = 32;
+        }
+        bitstream_put_ui(bs, (unsigned int)code, size_in_bits);
     }
-
-    bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
-    bitstream_put_ui(bs, val, size_in_bits);
 }
 
 // -----------------------------------------------------------------------------
@@ -133,3 +160,27 @@ bitstream_byte_aligning(bitstream *bs, int bit)
 
     bitstream_put_ui(bs, new_val, bit_left);
 }
+
+// -----------------------------------------------------------------------------
+//   Copy a NAL unit written with its start code, emulation_prevention_three_byte
+//   are inserted as the VA drivers do for packed headers. Returns the number of
+//   bytes written.
+// -----------------------------------------------------------------------------
+int
+bitstream_copy_nal(unsigned char *dst, const unsigned char *nal, int length_in_bits)
+{
+    int len = (length_in_bits + 7) / 8, zeros = 0, i, o;
+
+    /* the start code is copied verbatim */
+    o = (nal[2] == 1) ? 3 : 4;
+    memcpy(dst, nal, o);
+    for (i = o; i < len; i++) {
+        if (zeros >= 2 && nal[i] <= 3) {
+            dst[o++] = 3;
+            zeros = 0;
+        }
+        dst[o++] = nal[i];
+        zeros = nal[i] ? 0 : zeros + 1;
+    }
+    return o;
+}
@@ -1,18 +1,25 @@
 #ifndef __BITSTREAM_H__
 #define __BITSTREAM_H__
 
+#include <stdint.h>
+
 struct __bitstream {
     unsigned int *buffer;
     int bit_offset;
     int max_size_in_dword;
+    uint64_t acc;               /* pending bits, not yet flushed to buffer */
+    int acc_bits;               /* number of valid bits in acc (< 32) */
+    int owned;                  /* buffer allocated by bitstream_start() */
 };
 typedef struct __bitstream bitstream;
 
 void bitstream_start(bitstream *bs);
+void bitstream_init(bitstream *bs, unsigned int *buffer, int size_in_dword);
 void bitstream_end(bitstream *bs);
 void bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits);
 void bitstream_put_ue(bitstream *bs, unsigned int val);
 void bitstream_put_se(bitstream *bs, int val);
 void bitstream_byte_aligning(bitstream *bs, int bit);
+int bitstream_copy_nal(unsigned char *dst, const unsigned char *nal, int length_in_bits);
 
 #endif
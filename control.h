@@ -0,0 +1,156 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+/*
+ * Command socket of the encoder service.
+ *
+ * A Unix stream socket accepting one client at a time. Commands are text
+ * lines, each one gets a one line reply.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_LINE    512
+
+struct control_s {
+    int lfd;                    /* listening socket */
+    int cfd;                    /* connected client, -1 if none */
+    char buf[CONTROL_LINE];     /* pending input of the client */
+    int len;
+    char line[CONTROL_LINE];    /* last command read */
+    const char *path;
+};
+
+// -----------------------------------------------------------------------------
+//  Listen on path, a stale socket file is replaced. Returns -1 on error.
+// -----------------------------------------------------------------------------
+static int control_open(struct control_s *c, const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(c, 0, sizeof(*c));
+    c->cfd = -1;
+    c->path = path;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    c->lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c->lfd == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(c->lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(c->lfd, 4) == -1) {
+        close(c->lfd);
+        return -1;
+    }
+    return 0;
+}
+
+static void control_close(struct control_s *c)
+{
+    if (c->cfd != -1)
+        close(c->cfd);
+    close(c->lfd);
+    unlink(c->path);
+}
+
+// -----------------------------------------------------------------------------
+//  Wait at most timeout ms for a client, returns -1 when interrupted by a
+//  signal, 0 otherwise. The signals are let in with sigmask while waiting,
+//  when it is not NULL.
+// -----------------------------------------------------------------------------
+static int control_pwait(struct control_s *c, int timeout, const sigset_t *sigmask)
+{
+    struct timespec ts;
+    fd_set rfds;
+    int fd, n;
+
+    fd = (c->cfd == -1) ? c->lfd : c->cfd;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    n = pselect(fd + 1, &rfds, NULL, NULL, &ts, sigmask);
+    if (n == -1)
+        return (errno == EINTR) ? -1 : 0;
+    if (n == 0)
+        return 0;
+
+    if (c->cfd == -1) {
+        c->cfd = accept(c->lfd, NULL, NULL);
+        c->len = 0;
+        return 0;
+    }
+
+    n = read(c->cfd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n <= 0 || (c->len += n) == sizeof(c->buf) - 1) {
+        /* client gone, or a line too long for us */
+        close(c->cfd);
+        c->cfd = -1;
+    }
+    return 0;
+}
+
+static int control_wait(struct control_s *c, int timeout)
+{
+    return control_pwait(c, timeout, NULL);
+}
+
+// -----------------------------------------------------------------------------
+//  Next complete command, NULL if none
+// -----------------------------------------------------------------------------
+static char *control_line(struct control_s *c)
+{
+    char *eol;
+    int n;
+
+    if (c->cfd == -1)
+        return NULL;
+    c->buf[c->len] = 0;
+    eol = strchr(c->buf, '\n');
+    if (eol == NULL)
+        return NULL;
+
+    n = eol - c->buf;
+    memcpy(c->line, c->buf, n);
+    c->line[n] = 0;
+    if (n && c->line[n - 1] == '\r')
+        c->line[n - 1] = 0;
+    c->len -= n + 1;
+    memmove(c->buf, eol + 1, c->len);
+    return c->line;
+}
+
+static void control_reply(struct control_s *c, const char *fmt, ...)
+{
+    char msg[CONTROL_LINE];
+    va_list ap;
+    int n;
+
+    if (c->cfd == -1)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
+    va_end(ap);
+    if (n > (int)sizeof(msg) - 2)
+        n = sizeof(msg) - 2;
+    msg[n++] = '\n';
+    if (send(c->cfd, msg, n, MSG_NOSIGNAL) != n) {
+        close(c->cfd);
+        c->cfd = -1;
+    }
+}
+
+#endif
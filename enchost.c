@@ -0,0 +1,338 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Encoder host
+ *
+ * Converts every frame of offscreen to NV12 once and feeds several encoder
+ * sessions with it. Each session is an h264enc or h265enc process with its
+ * own options (bitrate, GOP, output file...) reading the NV12 copy in place.
+ * enchost is registered in offscreen like a single encoder.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+#include "frameinfo.h"
+#include "nv12.h"
+
+#define DEF_WIDTH 720
+#define DEF_HEIGHT 576
+#define DEF_INPUT "/tmp/frame"
+#define DEF_FRAMES 180
+#define DEF_FPS 30
+
+#define MAX_SESSIONS 8
+#define MAX_ARGS 64
+
+int   g_width  = DEF_WIDTH;
+int   g_height = DEF_HEIGHT;
+int   g_frames = DEF_FRAMES;
+int   g_fps    = DEF_FPS;
+char *g_input  = DEF_INPUT;
+char *g_session[MAX_SESSIONS];
+int   g_nsession = 0;
+pid_t g_pid[MAX_SESSIONS];
+
+static int _sigusr1 = 0;
+static int _done = 0;
+
+/*
+ * --------------------------------------------------------------------------
+ *   Usage
+ * --------------------------------------------------------------------------
+ */
+void usage( int argc, char *argv[], int optind )
+{
+   char *what = (optind > 0) ? "error" : "usage";
+   fprintf( stderr, "%s: %s [-?] [-i file] [-w width] [-h height] [-n frames] [-f fps] -s session ...\n",
+            what, argv[0]);
+
+   fprintf( stderr, "\t-?\t\tPrints this message.\n");
+   fprintf( stderr, "\t-i\t\tSets input video frame file (default %s).\n", DEF_INPUT);
+   fprintf( stderr, "\t-w\t\tSets the width of the image (default %d).\n", DEF_WIDTH);
+   fprintf( stderr, "\t-h\t\tSets the height of the image (default %d).\n", DEF_HEIGHT);
+   fprintf( stderr, "\t-n\t\tSets the number of frames to encode (default %d).\n", DEF_FRAMES);
+   fprintf( stderr, "\t-f\t\tSets the frame rate (default %d).\n", DEF_FPS);
+   fprintf( stderr, "\t-s\t\tAdds an encoder session, a command line like \"./h264enc -o out.h264 --bitrate 4000\".\n");
+   fprintf( stderr, "\t\t\tSize, frame count, frame rate and source are given by enchost. At most %d sessions.\n", MAX_SESSIONS);
+
+   /* exit with error only if option parsng failed */
+   exit(optind > 0);
+}
+
+/* --------------------------------------------------------------------------
+ *   Signal handlers
+ * --------------------------------------------------------------------------*/
+static void sigusr1 (int dummy)
+{
+  _sigusr1 = 1;
+}
+
+static void sigint (int dummy)
+{
+  _done = 1;
+}
+
+/* a session ended, only wakes up the main loop */
+static void sigchld (int dummy)
+{
+}
+
+/* --------------------------------------------------------------------------
+ *   Time in milliseconds
+ * --------------------------------------------------------------------------*/
+static unsigned int GetTickCount()
+{
+   struct timeval tv;
+   if (gettimeofday(&tv, NULL))
+      return 0;
+   return tv.tv_usec / 1000 + tv.tv_sec * 1000;
+}
+
+/* --------------------------------------------------------------------------
+ *   Start an encoder session on the NV12 copy of the frames
+ * --------------------------------------------------------------------------*/
+static pid_t start_session (char *session, const char *nv12, const char *roi)
+{
+   char w[16], h[16], n[16], f[16];
+   char *argv[MAX_ARGS + 16], *tok;
+   int argc = 0;
+   pid_t pid;
+
+   sprintf (w, "%d", g_width);
+   sprintf (h, "%d", g_height);
+   sprintf (n, "%d", g_frames);
+   sprintf (f, "%d", g_fps);
+
+   tok = strtok (session, " \t");
+   if (tok == NULL) return -1;
+   argv[argc++] = tok;
+   argv[argc++] = "-w"; argv[argc++] = w;
+   argv[argc++] = "-h"; argv[argc++] = h;
+   argv[argc++] = "-n"; argv[argc++] = n;
+   argv[argc++] = "-f"; argv[argc++] = f;
+   argv[argc++] = "--srcyuv"; argv[argc++] = (char *) nv12;
+   argv[argc++] = "--roifile"; argv[argc++] = (char *) roi;
+   argv[argc++] = "--nv12";
+   /* options of the session come last and override the ones above */
+   while (argc < MAX_ARGS + 15 && (tok = strtok (NULL, " \t")) != NULL)
+      argv[argc++] = tok;
+   argv[argc] = NULL;
+
+   pid = fork ();
+   if (pid == -1) {
+      perror ("fork()");
+      return -1;
+   }
+   if (pid == 0) {
+      /* frames signalled before the encoder is ready are lost, not fatal */
+      signal (SIGUSR1, SIG_IGN);
+      execvp (argv[0], argv);
+      perror ("execvp()");
+      _exit (1);
+   }
+   printf ("Session %d started: %s\n", pid, argv[0]);
+   return pid;
+}
+
+/* --------------------------------------------------------------------------
+ *   Forget the sessions which exited, returns the number still running
+ * --------------------------------------------------------------------------*/
+static int reap_sessions (int options)
+{
+   int i, status, running = 0;
+   pid_t pid;
+
+   while ((pid = waitpid (-1, &status, options)) > 0) {
+      for (i = 0; i < g_nsession; ++i) {
+         if (g_pid[i] == pid) {
+            printf ("Session %d ended\n", pid);
+            g_pid[i] = 0;
+         }
+      }
+   }
+   for (i = 0; i < g_nsession; ++i) {
+      if (g_pid[i] > 0) running++;
+   }
+   return running;
+}
+
+/* --------------------------------------------------------------------------
+ *   Main program
+ * --------------------------------------------------------------------------*/
+int main (int argc, char *argv[])
+{
+   int opt, fbfd, nvfd, i, frame = 0, dups = 0;
+   unsigned char *pixels, *nv12;
+   unsigned int tmp, ticks = 0;
+   char *nv12fn, *roifn;
+   size_t nv12sz, pixsz, infosz;
+   struct frameinfo_s *info = NULL;
+   uint64_t seq, last = 0, time;
+   struct timespec period;
+   sigset_t set, orig;
+
+   while ( (opt = getopt( argc, argv, "?i:w:h:n:f:s:")) != -1 ) {
+      switch( opt ) {
+      case '?':  usage( argc, argv, 0); break;
+      case 'i':  g_input = optarg; break;
+      case 'w':  g_width = atoi(optarg); break;
+      case 'h':  g_height = atoi(optarg); break;
+      case 'n':  g_frames = atoi(optarg); break;
+      case 'f':  g_fps = atoi(optarg); break;
+      case 's':
+         if (g_nsession == MAX_SESSIONS) {
+            fprintf (stderr, "Too many sessions.\n");
+            exit(1);
+         }
+         g_session[g_nsession++] = optarg;
+         break;
+      default:
+         usage(argc, argv, optind);
+      }
+   }
+   if (g_nsession == 0) {
+      usage(argc, argv, optind);
+   }
+
+   fbfd = open( g_input, O_RDONLY );
+   if (fbfd == -1) {
+      perror("Error: cannot open input file");
+      exit(1);
+   }
+   /* the frame number of offscreen follows the pixels */
+   pixsz = g_width * g_height * 4;
+   infosz = frameinfo_size (fbfd, pixsz);
+   pixels = (unsigned char *)mmap(0, pixsz + infosz, PROT_READ, MAP_SHARED, fbfd, 0);
+   if (pixels == MAP_FAILED) {
+      perror("Error: failed to map input file to memory");
+      exit(1);
+   }
+   if (infosz) info = (struct frameinfo_s *)(pixels + pixsz);
+
+   /* the NV12 copy is shared with the sessions, the ROI file of offscreen
+      stays next to the frame. The frame number is copied after the NV12
+      image for the sessions */
+   nv12fn = malloc(strlen(g_input) + 6);
+   roifn = malloc(strlen(g_input) + 5);
+   sprintf (nv12fn, "%s.nv12", g_input);
+   sprintf (roifn, "%s.roi", g_input);
+   nv12sz = g_width * g_height * 3 / 2;
+   nvfd = open( nv12fn, O_RDWR | O_CREAT, 0644 );
+   if (nvfd == -1 || ftruncate (nvfd, nv12sz + sizeof(struct frameinfo_s)) == -1) {
+      perror("Error: cannot create NV12 file");
+      exit(1);
+   }
+   nv12 = (unsigned char *)mmap(0, nv12sz + sizeof(struct frameinfo_s), PROT_READ | PROT_WRITE, MAP_SHARED, nvfd, 0);
+   if (nv12 == MAP_FAILED) {
+      perror("Error: failed to map NV12 file to memory");
+      exit(1);
+   }
+
+   signal (SIGUSR1, sigusr1);
+   signal (SIGINT, sigint);
+   signal (SIGCHLD, sigchld);
+
+   for (i = 0; i < g_nsession; ++i) {
+      g_pid[i] = start_session (g_session[i], nv12fn, roifn);
+   }
+
+   /* the signals are only let in while waiting, so that one coming between
+      the checks and the wait is not missed. The sessions are started before,
+      they don't inherit the mask */
+   sigemptyset (&set);
+   sigaddset (&set, SIGUSR1);
+   sigaddset (&set, SIGINT);
+   sigaddset (&set, SIGCHLD);
+   sigprocmask (SIG_BLOCK, &set, &orig);
+   period.tv_sec = 0;
+   period.tv_nsec = 1000000000L / (g_fps > 0 ? g_fps : DEF_FPS);
+
+   /* sessions stop by themselves after their last frame, which comes after
+      g_frames when they did not start on the first one */
+   while (!_done && reap_sessions (WNOHANG) > 0) {
+      if (!_sigusr1 &&
+          pselect (0, NULL, NULL, NULL, info ? &period : NULL, &orig) == -1 && errno != EINTR) {
+         perror ("pselect()");
+         break;
+      }
+
+      /* a frame signalled twice is converted once. With a frame number, a
+         frame whose signal was lost is found on its number after a period */
+      if (frameinfo_read (info, &seq, &time) == 0) {
+         if (seq == last) {
+            if (_sigusr1) dups++;
+            _sigusr1 = 0;
+            continue;
+         }
+         last = seq;
+      }
+      else {
+         if (!_sigusr1) continue;
+         seq = ++last;
+         time = 0;
+      }
+      _sigusr1 = 0;
+
+      tmp = GetTickCount ();
+      tfnv12 (g_width, g_height, pixels, nv12, nv12 + g_width*g_height);
+      ticks += GetTickCount () - tmp;
+      frameinfo_publish ((struct frameinfo_s *)(nv12 + nv12sz), seq, time, g_fps, FRAMEINFO_YUV);
+      frame++;
+
+      for (i = 0; i < g_nsession; ++i) {
+         if (g_pid[i] > 0) kill (g_pid[i], SIGUSR1);
+      }
+   }
+
+   for (i = 0; i < g_nsession; ++i) {
+      if (g_pid[i] > 0) kill (g_pid[i], SIGINT);
+   }
+   reap_sessions (0);
+
+   printf ("%d frames converted once for %d sessions, %.2f ms per frame\n",
+           frame, g_nsession, frame ? (double) ticks / frame : 0.0);
+   if (dups)
+      printf ("%d frames signalled twice ignored\n", dups);
+
+   munmap (nv12, nv12sz + sizeof(struct frameinfo_s));
+   munmap (pixels, pixsz + infosz);
+   close (nvfd);
+   close (fbfd);
+   unlink (nv12fn);
+   free (nv12fn);
+   free (roifn);
+
+   return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Check of the bitrate adaptation through the feedback socket.
+ *
+ * Receiver reports and bitrate commands are sent to a control socket one
+ * line at a time, as the streamers and the clients of the service do. The
+ * lines are handled as the encoders handle them and each reply is checked
+ * against the bitrate expected.
+ *
+ *   make feedback-test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "feedback.h"
+
+#define TOP_RATE    4000000
+
+static const struct {
+    const char *line;
+    const char *reply;
+} steps[] = {
+    { "feedback 0 0",           "ok 4000000" },     /* already at the top */
+    { "feedback 0.5 0",         "ok 3000000" },     /* cut by half the loss */
+    { "feedback 0.05 0",        "ok 3000000" },     /* held */
+    { "feedback 0 0",           "ok 3150000" },     /* raised by 5% */
+    { "feedback 0 100",         "ok 2677500" },     /* jitter growing fast, 15% less */
+    { "feedback 1 100",         "ok 1338750" },
+    { "feedback 1 100",         "ok 669375" },
+    { "feedback 1 100",         "ok 500000" },      /* an eighth of the top */
+    { "bitrate 8000000",        "ok 8000000" },     /* new top, taken at once */
+    { "feedback 0.2 0",         "ok 7200000" },
+    { "feedback 0 0",           "ok 7560000" },
+    { "bitrate 0",              "error bad arguments" },
+    { "bitrate 15999",          "error bad arguments" },
+    { "bitrate 200000001",      "error bad arguments" },
+    { "bitrate 4294967296",     "error bad arguments" },
+    { "bitrate 4m",             "error bad arguments" },
+    { "feedback 1.5 0",         "error bad arguments" },
+    { "feedback 0 -1",          "error bad arguments" },
+    { "feedback 0 0",           "ok 7938000" },     /* the errors changed nothing */
+    { "bitrate",                "error unknown command" },
+    { "quit",                   "error unknown command" },
+};
+
+// -----------------------------------------------------------------------------
+//  The encoder side: a rate command, or an error
+// -----------------------------------------------------------------------------
+static void handle(struct control_s *ctl, struct feedback_s *f, char *line)
+{
+    char *argv[4];
+    int argc = 0;
+    long long rate;
+
+    while (argc < 4 && (argv[argc] = strtok(argc ? NULL : line, " \t")) != NULL)
+        argc++;
+    rate = feedback_command(f, argc, argv);
+    if (rate == 0)
+        control_reply(ctl, "error unknown command");
+    else if (rate < 0)
+        control_reply(ctl, "error bad arguments");
+    else
+        control_reply(ctl, "ok %lld", rate);
+}
+
+// -----------------------------------------------------------------------------
+//  The client side: one line read from the socket
+// -----------------------------------------------------------------------------
+static int read_reply(int fd, char *buf, int size)
+{
+    int n = 0;
+
+    while (n < size - 1 && read(fd, buf + n, 1) == 1) {
+        if (buf[n] == '\n') {
+            buf[n] = 0;
+            return 0;
+        }
+        n++;
+    }
+    return -1;
+}
+
+int main(void)
+{
+    struct sockaddr_un addr;
+    struct control_s ctl;
+    struct feedback_s f;
+    char path[64], reply[CONTROL_LINE], *line;
+    int fd, i, tries, failed = 0;
+
+    snprintf(path, sizeof(path), "/tmp/feedback-test.%d", (int)getpid());
+    if (control_open(&ctl, path) == -1) {
+        printf("Can't listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        printf("Can't connect to %s: %s\n", path, strerror(errno));
+        control_close(&ctl);
+        return 1;
+    }
+    feedback_init(&f, TOP_RATE);
+
+    for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        if (send(fd, steps[i].line, strlen(steps[i].line), 0) == -1 || send(fd, "\n", 1, 0) == -1)
+            break;
+        /* the first waits accept the client */
+        for (tries = 0, line = NULL; line == NULL && tries < 10; tries++) {
+            control_wait(&ctl, 100);
+            line = control_line(&ctl);
+        }
+        if (line == NULL) {
+            printf("\"%s\" not received\n", steps[i].line);
+            failed++;
+            break;
+        }
+        handle(&ctl, &f, line);
+        if (read_reply(fd, reply, sizeof(reply)) == -1) {
+            printf("\"%s\" got no reply\n", steps[i].line);
+            failed++;
+            break;
+        }
+        if (strcmp(reply, steps[i].reply)) {
+            printf("\"%s\" got \"%s\", expected \"%s\"\n", steps[i].line, reply, steps[i].reply);
+            failed++;
+        }
+    }
+    close(fd);
+    control_close(&ctl);
+
+    if (failed)
+        return 1;
+    printf("%d feedback and bitrate lines answered as expected\n", i);
+    return 0;
+}
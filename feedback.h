@@ -0,0 +1,104 @@
+#ifndef __FEEDBACK_H__
+#define __FEEDBACK_H__
+
+/*
+ * Bitrate adaptation to the receiver reports of the streamers.
+ *
+ * The streamers forward the worst fraction lost and interarrival jitter
+ * found in the RTCP receiver reports of their clients. The bitrate is cut
+ * in proportion of the loss above FEEDBACK_LOSS_HIGH, or by 15% when the
+ * jitter grows fast because queues are building up somewhere. It is held
+ * while the loss stays between the two thresholds and raised by 5% per
+ * report while the receivers are fine, up to the bitrate given at startup.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define FEEDBACK_LOSS_LOW   0.02
+#define FEEDBACK_LOSS_HIGH  0.10
+#define FEEDBACK_MIN_RATIO  8       /* never below 1/8 of the top bitrate */
+#define FEEDBACK_MIN_RATE   16000LL         /* range of the bitrate command */
+#define FEEDBACK_MAX_RATE   200000000LL
+
+struct feedback_s {
+    unsigned int max;           /* bitrate given at startup or by command */
+    unsigned int bitrate;       /* current target */
+    double loss;                /* last report */
+    double jitter;              /* ms */
+    unsigned int reports;
+};
+
+static void feedback_init(struct feedback_s *f, unsigned int bitrate)
+{
+    f->max = f->bitrate = bitrate;
+    f->loss = f->jitter = 0;
+    f->reports = 0;
+}
+
+/* a new top bitrate, taken at once */
+static unsigned int feedback_set(struct feedback_s *f, unsigned int bitrate)
+{
+    feedback_init(f, bitrate);
+    return bitrate;
+}
+
+// -----------------------------------------------------------------------------
+//  Receiver report: loss is the fraction lost (0-1), jitter in ms. Returns
+//  the new target bitrate.
+// -----------------------------------------------------------------------------
+static unsigned int feedback_report(struct feedback_s *f, double loss, double jitter)
+{
+    double rate = f->bitrate;
+    int growing = f->reports && jitter > 2 * f->jitter + 10;
+
+    if (loss > FEEDBACK_LOSS_HIGH)
+        rate *= 1 - loss / 2;
+    else if (growing)
+        rate *= 0.85;
+    else if (loss < FEEDBACK_LOSS_LOW)
+        rate *= 1.05;
+
+    if (rate > f->max)
+        rate = f->max;
+    if (rate < f->max / FEEDBACK_MIN_RATIO)
+        rate = f->max / FEEDBACK_MIN_RATIO;
+
+    f->loss = loss;
+    f->jitter = jitter;
+    f->reports++;
+    f->bitrate = (unsigned int)rate;
+    return f->bitrate;
+}
+
+// -----------------------------------------------------------------------------
+//  Rate commands shared by the encoders, argv as split by the command parser:
+//    bitrate <bits per second>
+//    feedback <fraction lost> <jitter ms>
+//  Returns the new bitrate, 0 if the command is not one of them and -1 if its
+//  arguments are wrong or the bitrate out of range.
+// -----------------------------------------------------------------------------
+static long long feedback_command(struct feedback_s *f, int argc, char **argv)
+{
+    char *end;
+    double loss, jitter;
+    long long rate;
+
+    if (argc == 2 && !strcmp(argv[0], "bitrate")) {
+        rate = strtoll(argv[1], &end, 10);
+        if (*end || rate < FEEDBACK_MIN_RATE || rate > FEEDBACK_MAX_RATE)
+            return -1;
+        return feedback_set(f, (unsigned int)rate);
+    }
+    if (argc == 3 && !strcmp(argv[0], "feedback")) {
+        loss = strtod(argv[1], &end);
+        if (*end || loss < 0 || loss > 1)
+            return -1;
+        jitter = strtod(argv[2], &end);
+        if (*end || jitter < 0)
+            return -1;
+        return feedback_report(f, loss, jitter);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __FRAMEINFO_H__
+#define __FRAMEINFO_H__
+
+/*
+ * Frame information shared with the pixels.
+ *
+ * offscreen appends it to the frame file, after the w*h*4 bytes of the image,
+ * and enchost after its NV12 copy. It holds the number of the frame, starting
+ * at 1, the time it was captured and whether the pixels are RGB or YUV.
+ * Readers mapping only the pixels do not see it, the encoders use it to tell
+ * a new frame from one they already have and to count the frames they missed.
+ *
+ * The writer clears seq while it updates the record, a reader retries until
+ * it reads the same non zero seq before and after the time.
+ */
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define FRAMEINFO_MAGIC     0x7366666f      /* "offs" */
+
+#define FRAMEINFO_RGB       0
+#define FRAMEINFO_YUV       1
+
+struct frameinfo_s {
+    uint32_t magic;
+    uint32_t fps;               /* frame rate of the writer */
+    uint64_t seq;               /* number of the frame, 0 while updated */
+    uint64_t time;              /* capture time, microseconds since the Epoch */
+    uint32_t colorspace;        /* FRAMEINFO_RGB or FRAMEINFO_YUV */
+    uint32_t reserved;
+};
+
+// -----------------------------------------------------------------------------
+//  Size to map after the size bytes of pixels of fd: the record if the file
+//  holds one, else nothing
+// -----------------------------------------------------------------------------
+static size_t frameinfo_size(int fd, size_t size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= size + sizeof(struct frameinfo_s))
+        return sizeof(struct frameinfo_s);
+    return 0;
+}
+
+static void frameinfo_publish(volatile struct frameinfo_s *fi, uint64_t seq, uint64_t time, int fps, int colorspace)
+{
+    fi->seq = 0;
+    __sync_synchronize();
+    fi->magic = FRAMEINFO_MAGIC;
+    fi->fps = fps;
+    fi->time = time;
+    fi->colorspace = colorspace;
+    __sync_synchronize();
+    fi->seq = seq;
+}
+
+// -----------------------------------------------------------------------------
+//  Read the record, returns -1 if there is none
+// -----------------------------------------------------------------------------
+static int frameinfo_read(const volatile struct frameinfo_s *fi, uint64_t *seq, uint64_t *time)
+{
+    uint64_t s;
+    int retry;
+
+    if (fi == NULL || fi->magic != FRAMEINFO_MAGIC)
+        return -1;
+    for (retry = 0; retry < 100; retry++) {
+        s = fi->seq;
+        __sync_synchronize();
+        *time = fi->time;
+        __sync_synchronize();
+        if (s != 0 && s == fi->seq) {
+            *seq = s;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -31,18 +31,25 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
-#include <png.h>
+#include <time.h>
+#include "pngwrite.h"
 
 #define DEF_WIDTH 720
 #define DEF_HEIGHT 576
 #define DEF_INPUT "/tmp/frame"
 #define DEF_OUTPUT "/tmp/capture.png"
+#define DEF_LEVEL 6
+
+static const char *filters[] = { "none", "sub", "up", "avg", "paeth", "adaptive", NULL };
 
 int   g_signal = 0;
 int   g_width  = DEF_WIDTH;
 int   g_height = DEF_HEIGHT;
 char *g_input  = DEF_INPUT;
 char *g_output = DEF_OUTPUT;
+int   g_level  = DEF_LEVEL;
+int   g_filter = PNGWRITE_UP;
+int   g_threads = 0;
 
 /*
  * --------------------------------------------------------------------------
@@ -61,113 +68,14 @@ void usage( int argc, char *argv[], int optind )
    fprintf( stderr, "\t-w\t\tSets the width of the image (default %d).\n", DEF_WIDTH);
    fprintf( stderr, "\t-h\t\tSets the height of the image (default %d).\n", DEF_HEIGHT);
    fprintf (stderr, "\t-s\t\tEncode input on SIGUSR1 signal. Wait at most 10 sec for signal.\n");
+   fprintf( stderr, "\t-l\t\tSets the compression level 0-9 (default %d).\n", DEF_LEVEL);
+   fprintf( stderr, "\t-f\t\tSets the row filter none/sub/up/avg/paeth/adaptive (default up).\n");
+   fprintf( stderr, "\t-t\t\tSets the number of compression threads (default one per processor).\n");
   
    /* exit with error only if option parsng failed */
    exit(optind > 0);
 }
 
-// --------------------------------------------------------------------------
-//   Save PNG image
-// --------------------------------------------------------------------------
-static int save_png(const char *filename, int width, int height,
-                    int bitdepth, int colortype,
-                    unsigned char* data, int pitch, int transform)
-{
-   int i = 0;
-   int r = 0;
-   FILE* fp = NULL;
-   png_structp png_ptr = NULL;
-   png_infop info_ptr = NULL;
-   png_bytep* row_pointers = NULL;
- 
-   if (NULL == data) {
-      printf("Error: failed to save the png because the given data is NULL.\n");
-      r = -1;
-      goto error;
-   }
- 
-   if (0 == strlen(filename)) {
-      printf("Error: failed to save the png because the given filename length is 0.\n");
-      r = -2;
-      goto error;
-   }
- 
-   if (0 == pitch) {
-      printf("Error: failed to save the png because the given pitch is 0.\n");
-      r = -3;
-      goto error;
-   }
- 
-   fp = fopen(filename, "wb");
-   if (NULL == fp) {
-      printf("Error: failed to open the png file: %s\n", filename);
-      r = -4;
-      goto error;
-   }
- 
-   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-   if (NULL == png_ptr) {
-      printf("Error: failed to create the png write struct.\n");
-      r = -5;
-      goto error;
-   }
- 
-   info_ptr = png_create_info_struct(png_ptr);
-   if (NULL == info_ptr) {
-      printf("Error: failed to create the png info struct.\n");
-      r = -6;
-      goto error;
-   }
- 
-   png_set_IHDR(png_ptr,
-                info_ptr,
-                width,
-                height,
-                bitdepth,                 /* e.g. 8 */
-                colortype,                /* PNG_COLOR_TYPE_{GRAY, PALETTE, RGB, RGB_ALPHA, GRAY_ALPHA, RGBA, GA} */
-                PNG_INTERLACE_NONE,       /* PNG_INTERLACE_{NONE, ADAM7 } */
-                PNG_COMPRESSION_TYPE_BASE,
-                PNG_FILTER_TYPE_BASE);
- 
-   row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-
-   // note: y flip
-   for (i = 0; i < height; ++i) {
-      row_pointers[i] = data + (height-i) * pitch;
-   }
- 
-   png_init_io(png_ptr, fp);
-   png_set_rows(png_ptr, info_ptr, row_pointers);
-   png_write_png(png_ptr, info_ptr, transform, NULL);
- 
- error:
- 
-   if (NULL != fp) {
-      fclose(fp);
-      fp = NULL;
-   }
- 
-   if (NULL != png_ptr) {
- 
-      if (NULL == info_ptr) {
-         printf("Error: info ptr is null. not supposed to happen here.\n");
-      }
- 
-      png_destroy_write_struct(&png_ptr, &info_ptr);
-      png_ptr = NULL;
-      info_ptr = NULL;
-   }
- 
-   if (NULL != row_pointers) {
-      free(row_pointers);
-      row_pointers = NULL;
-   }
- 
-   printf("And we're all free.\n");
- 
-   return r;
-}
-
 /* --------------------------------------------------------------------------
  *   Signal handler
  * --------------------------------------------------------------------------*/
@@ -181,10 +89,11 @@ void sigusr1 (int dummy)
  * --------------------------------------------------------------------------*/
 int main (int argc, char *argv[])
 {
-   int opt, fbfd;
+   int opt, fbfd, i;
    unsigned char *pixels;
+   struct timespec start, finish;
    
-   while ( (opt = getopt( argc, argv, "?si:o:w:h:")) != -1 ) {
+   while ( (opt = getopt( argc, argv, "?si:o:w:h:l:f:t:")) != -1 ) {
       switch( opt ) {
       case '?':  usage( argc, argv, 0); break;
       case 'i':  g_input = optarg; break;
@@ -192,6 +101,14 @@ int main (int argc, char *argv[])
       case 'w':  g_width = atoi(optarg); break;
       case 'h':  g_height = atoi(optarg); break;
       case 's':  g_signal = 1; break;
+      case 'l':  g_level = atoi(optarg); break;
+      case 'f':
+         for (i = 0; filters[i] && strcmp(filters[i], optarg); i++);
+         if (filters[i] == NULL)
+            usage(argc, argv, optind);
+         g_filter = i;
+         break;
+      case 't':  g_threads = atoi(optarg); break;
       default:
          usage(argc, argv, optind);
       }
@@ -227,7 +144,13 @@ int main (int argc, char *argv[])
    }
    
    puts("Saving PNG file");
-   save_png(g_output, g_width, g_height, 8, PNG_COLOR_TYPE_RGBA, pixels, g_width*4, PNG_TRANSFORM_IDENTITY);
+   // frame is reversed last scanline comes first, alpha is always opaque
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   if (pngwrite_save(g_output, pixels, g_width, g_height, g_width*4, PNGWRITE_FLIP, g_level, g_filter, g_threads) == -1)
+      printf("Error: failed to save the png file %s: %s\n", g_output, strerror(errno));
+   clock_gettime(CLOCK_MONOTONIC, &finish);
+   printf("Saved in %.1f ms\n",
+          (finish.tv_sec - start.tv_sec) * 1e3 + (finish.tv_nsec - start.tv_nsec) / 1e6);
 
    puts("Clean");
    munmap(pixels, g_width*g_height*4);
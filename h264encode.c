@@ -52,6 +52,16 @@
 
 #include "bitstream.h"
 #include "loadsurface.h"
+#include "h264soft.h"
+#include "roi.h"
+#include "scene.h"
+#include "control.h"
+#include "mux.h"
+#include "telemetry.h"
+#include "frameinfo.h"
+#include "nv12.h"
+#include "vapool.h"
+#include "feedback.h"
 
 #define NAL_REF_IDC_NONE        0
 #define NAL_REF_IDC_LOW         1
@@ -80,7 +90,7 @@
 #define PROFILE_IDC_HIGH        100
 
 
-#define SURFACE_NUM 16 /* 16 surfaces for source YUV */
+#define SURFACE_NUM VAPOOL_MAX /* at most 16 surfaces for source YUV */
 static  VADisplay va_dpy;
 static  VAProfile h264_profile = ~0;
 static  VAConfigAttrib attrib[VAConfigAttribTypeMax];
@@ -89,6 +99,7 @@ static  int config_attrib_num = 0, enc_packed_header_idx;
 static  VASurfaceID src_surface[SURFACE_NUM];
 static  VABufferID  coded_buf[SURFACE_NUM];
 static  VASurfaceID ref_surface[SURFACE_NUM];
+static  struct vapool_s pool = { 1, 1, 0, 0 };  /* surfaces and coded buffers in use */
 static  VAConfigID config_id;
 static  VAContextID context_id;
 static  VAEncSequenceParameterBufferH264 seq_param;
@@ -116,11 +127,29 @@ static  int h264_maxref = (1 << 16 | 1);
 static  int h264_entropy_mode = 1; /* cabac */
 
 static  char *coded_fn = NULL, *srcyuv_fn = NULL;
-static  FILE *coded_fp = NULL, *srcyuv_fp = NULL;
+static  FILE *srcyuv_fp = NULL;
+static  struct mux_s mux;                /* coded stream in its container */
+static  int mux_forced = -1;            /* --mux, else from the file extension */
 static  unsigned long long srcyuv_frames = 0;
 static  int srcyuv_fourcc = VA_FOURCC_NV12;
 static  unsigned char *srcyuv_ptr = NULL;
 static  unsigned char *nv12 = NULL;
+static  int srcyuv_nv12 = 0;    /* source already converted by enchost */
+static  char *control_fn = NULL;        /* command socket of the encoder service */
+static  char *feedback_fn = NULL;       /* rate feedback socket of the streamer */
+static  struct control_s feedback_ctl;
+static  struct feedback_s feedback;
+static  int bitrate_changed = 0;        /* given to the driver with the next picture */
+
+/* frame number and time of the source, frames missed are repeated, frames
+ * signalled twice are encoded once */
+static  struct frameinfo_s *frame_info = NULL;
+static  unsigned long long frame_seq = 0;       /* last frame taken */
+static  unsigned long long frame_time = 0;      /* its capture time, 0 if unknown */
+static  unsigned int repeating = 0;     /* repeats left before the frame */
+static  unsigned int frames_dropped = 0;
+static  unsigned int frames_repeated = 0;
+static  unsigned int frames_duplicated = 0;
 
 static  int frame_width = 720;
 static  int frame_height = 576;
@@ -153,11 +182,82 @@ static  unsigned long long current_frame_display = 0;
 static  unsigned long long current_IDR_display = 0;
 static  unsigned int current_frame_num = 0;
 static  int current_frame_type;
-#define current_slot (current_frame_display % SURFACE_NUM)
+#define current_slot (current_frame_display % pool.src)
+
+/* packed headers are written into static buffers, SPS and PPS don't change
+ * during the encoding session so they are only built once */
+#define PACKED_HEADER_DWORDS 1024
+static  unsigned int packedseq_data[PACKED_HEADER_DWORDS];
+static  unsigned int packedpic_data[PACKED_HEADER_DWORDS];
+static  unsigned int packedslice_data[PACKED_HEADER_DWORDS];
+static  unsigned int packedsei_data[PACKED_HEADER_DWORDS];
+static  int packedseq_bits = 0;
+static  int packedpic_bits = 0;
 
 static  int misc_priv_type = 0;
 static  int misc_priv_value = 0;
 
+/* low latency mode, only the first picture is an IDR and intra coding is
+ * spread over the P pictures of a refresh cycle */
+#define LOW_LATENCY_SLICES      8       /* default slice count */
+#define LOW_LATENCY_CPB_FRAMES  2       /* HRD buffer size, in pictures */
+static  int low_latency = 0;
+static  int intra_refresh = VA_ENC_INTRA_REFRESH_NONE;  /* VA rolling refresh */
+static  int refresh_size = 0;           /* MB columns or rows refreshed per picture */
+static  int refresh_cycle = 0;          /* pictures to refresh the whole picture */
+static  unsigned long long capture_time = 0;    /* microseconds since the Epoch */
+
+/* regions of interest, the VA driver ROI support is used when available,
+ * otherwise they are turned into a QP offset per macroblock */
+static  struct roi_list_s rois;
+static  signed char *roi_qp_map = NULL;
+static  int roi_va_regions = 0;         /* regions supported by the driver */
+static  int roi_va_qp_delta = 0;        /* driver takes QP offsets, not priorities */
+static  VAEncROI roi_va[ROI_MAX];
+
+/* content analysis, off unless asked for: a scene cut starts a new GOP with
+ * an IDR picture, a static picture is replaced by a non reference picture of
+ * P_Skip macroblocks */
+#define STATIC_MAX_DIFF         1       /* luma difference of a pixel */
+#define STATIC_MAX_SAD          32      /* sum of the luma differences of a macroblock */
+static  struct scene_s scene;
+static  int scenecut = 0;
+static  int skip_static = 0;
+static  int static_skip = 0;            /* current picture is skipped */
+static  unsigned int static_run = 0;    /* consecutive skipped pictures */
+static  unsigned long long gop_start = 0;       /* encoding order of the last scene cut */
+static  unsigned int scene_cuts = 0;
+static  unsigned int static_frames = 0;
+
+/* encoder backend, auto uses VA-API when a driver is usable */
+#define BACKEND_AUTO    0
+#define BACKEND_VA      1
+#define BACKEND_SW      2
+#define BACKEND_NULL    3
+static  int backend_type = BACKEND_AUTO;
+
+struct encoder_backend {
+    const char *name;
+    int (*init)(void);                  /* allocate encoder ressources */
+    int (*encode_picture)(void);        /* encode nv12 as current_frame_encoding */
+    int (*release)(void);
+};
+
+/* software backend */
+static  h264soft *sw_enc = NULL;
+static  unsigned int *sw_slice_data = NULL;
+static  int sw_slice_dwords = 0;
+static  unsigned char *sw_frame_data = NULL;
+static  int sw_qp;
+static  long long sw_rc_fullness = 0;
+
+/* null backend: the VA calls are replaced by a delay and synthetic slices */
+static  int null_delay = -1;            /* us per picture, -1 scales with the size */
+static  unsigned char *null_surface = NULL;
+static  unsigned int *null_slice_data = NULL;
+static  int null_slice_dwords = 0;
+static  unsigned char *null_frame_data = NULL;
+
 #define MIN(a, b) ((a)>(b)?(b):(a))
 #define MAX(a, b) ((a)>(b)?(a):(b))
 
@@ -165,14 +265,10 @@ static  int misc_priv_value = 0;
 static  int srcsurface_status[SURFACE_NUM];
 
 /* for performance profiling */
-static unsigned int UploadPictureTicks = 0;
-static unsigned int BeginPictureTicks = 0;
-static unsigned int RenderPictureTicks = 0;
-static unsigned int EndPictureTicks = 0;
-static unsigned int SyncPictureTicks = 0;
-static unsigned int SavePictureTicks = 0;
-static unsigned int ProcessPictureTicks = 0;
 static unsigned int TotalTicks = 0;
+static struct telemetry_s tm;                   /* time of each stage, in ns */
+static struct telemetry_frame_s tm_frame;       /* frame being encoded */
+static char *telemetry_fn = NULL;
 
 //Default entrypoint for Encode
 static VAEntrypoint requested_entrypoint = -1;
@@ -190,7 +286,6 @@ static VAEntrypoint selected_entrypoint = -1;
  */
 VADisplay va_open_display_drm(void);
 void va_close_display_drm(VADisplay va_dpy);
-void tfnv12 (int w, int h, unsigned char *rgba, unsigned char *y, unsigned char *uv);
 
 
 // -----------------------------------------------------------------------------
@@ -464,14 +559,17 @@ build_packed_pic_buffer(unsigned char **header_buffer)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
-    nal_start_code_prefix(&bs);
-    nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
-    pps_rbsp(&bs);
-    bitstream_end(&bs);
+    if (packedpic_bits == 0) {
+        bitstream_init(&bs, packedpic_data, PACKED_HEADER_DWORDS);
+        nal_start_code_prefix(&bs);
+        nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
+        pps_rbsp(&bs);
+        bitstream_end(&bs);
+        packedpic_bits = bs.bit_offset;
+    }
 
-    *header_buffer = (unsigned char *)bs.buffer;
-    return bs.bit_offset;
+    *header_buffer = (unsigned char *)packedpic_data;
+    return packedpic_bits;
 }
 
 // -----------------------------------------------------------------------------
@@ -482,42 +580,114 @@ build_packed_seq_buffer(unsigned char **header_buffer)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
-    nal_start_code_prefix(&bs);
-    nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
-    sps_rbsp(&bs);
-    bitstream_end(&bs);
+    if (packedseq_bits == 0) {
+        bitstream_init(&bs, packedseq_data, PACKED_HEADER_DWORDS);
+        nal_start_code_prefix(&bs);
+        nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
+        sps_rbsp(&bs);
+        bitstream_end(&bs);
+        packedseq_bits = bs.bit_offset;
+    }
 
-    *header_buffer = (unsigned char *)bs.buffer;
-    return bs.bit_offset;
+    *header_buffer = (unsigned char *)packedseq_data;
+    return packedseq_bits;
 }
 
 
 // -----------------------------------------------------------------------------
 //
 // -----------------------------------------------------------------------------
-static int build_packed_slice_buffer(unsigned char **header_buffer)
+static void slice_nal_header(bitstream *bs)
 {
-    bitstream bs;
     int is_idr = !!pic_param.pic_fields.bits.idr_pic_flag;
     int is_ref = !!pic_param.pic_fields.bits.reference_pic_flag;
 
-    bitstream_start(&bs);
-    nal_start_code_prefix(&bs);
+    nal_start_code_prefix(bs);
 
     if (IS_I_SLICE(slice_param.slice_type)) {
-        nal_header(&bs, NAL_REF_IDC_HIGH, is_idr ? NAL_IDR : NAL_NON_IDR);
+        nal_header(bs, NAL_REF_IDC_HIGH, is_idr ? NAL_IDR : NAL_NON_IDR);
     } else if (IS_P_SLICE(slice_param.slice_type)) {
-        nal_header(&bs, NAL_REF_IDC_MEDIUM, NAL_NON_IDR);
+        nal_header(bs, is_ref ? NAL_REF_IDC_MEDIUM : NAL_REF_IDC_NONE, NAL_NON_IDR);
     } else {
         assert(IS_B_SLICE(slice_param.slice_type));
-        nal_header(&bs, is_ref ? NAL_REF_IDC_LOW : NAL_REF_IDC_NONE, NAL_NON_IDR);
+        nal_header(bs, is_ref ? NAL_REF_IDC_LOW : NAL_REF_IDC_NONE, NAL_NON_IDR);
     }
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+static int build_packed_slice_buffer(unsigned char **header_buffer)
+{
+    bitstream bs;
 
+    bitstream_init(&bs, packedslice_data, PACKED_HEADER_DWORDS);
+    slice_nal_header(&bs);
     slice_header(&bs);
     bitstream_end(&bs);
 
-    *header_buffer = (unsigned char *)bs.buffer;
+    *header_buffer = (unsigned char *)packedslice_data;
+    return bs.bit_offset;
+}
+
+// -----------------------------------------------------------------------------
+//  Number of bits of an ue(v) code
+// -----------------------------------------------------------------------------
+static int ue_size(unsigned int val)
+{
+    int size = 1;
+
+    for (val++; val > 1; val >>= 1)
+        size += 2;
+    return size;
+}
+
+// -----------------------------------------------------------------------------
+//  SEI of the low latency mode. A recovery point starts every intra refresh
+//  cycle and each picture carries its capture time in a user data unregistered
+//  message: capture_time_uuid then the microseconds since the Epoch as a 64
+//  bits big endian number.
+// -----------------------------------------------------------------------------
+static const unsigned char capture_time_uuid[16] = {
+    0x6f, 0x66, 0x66, 0x73, 0x63, 0x72, 0x65, 0x65,
+    0x6e, 0x2d, 0x67, 0x6c, 0x65, 0x73, 0x2d, 0x74
+};
+
+static int build_packed_sei_buffer(unsigned char **header_buffer, int recovery_point)
+{
+    bitstream bs;
+    int i;
+
+    bitstream_init(&bs, packedsei_data, PACKED_HEADER_DWORDS);
+    nal_start_code_prefix(&bs);
+    nal_header(&bs, NAL_REF_IDC_NONE, NAL_SEI);
+
+    if (recovery_point) {
+        int recovery_frame_cnt = refresh_cycle - 1;
+
+        bitstream_put_ui(&bs, 6, 8);                        /* payloadType: recovery_point */
+        bitstream_put_ui(&bs, (ue_size(recovery_frame_cnt) + 4 + 7) / 8, 8);  /* payloadSize */
+        bitstream_put_ue(&bs, recovery_frame_cnt);          /* recovery_frame_cnt */
+        bitstream_put_ui(&bs, 0, 1);                        /* exact_match_flag */
+        bitstream_put_ui(&bs, 0, 1);                        /* broken_link_flag */
+        bitstream_put_ui(&bs, 0, 2);                        /* changing_slice_group_idc */
+        if (bs.bit_offset & 7) {
+            bitstream_put_ui(&bs, 1, 1);                    /* bit_equal_to_one */
+            bitstream_byte_aligning(&bs, 0);
+        }
+    }
+
+    bitstream_put_ui(&bs, 5, 8);                            /* payloadType: user_data_unregistered */
+    bitstream_put_ui(&bs, sizeof(capture_time_uuid) + 8, 8);    /* payloadSize */
+    for (i = 0; i < sizeof(capture_time_uuid); i++)
+        bitstream_put_ui(&bs, capture_time_uuid[i], 8);     /* uuid_iso_iec_11578 */
+    bitstream_put_ui(&bs, capture_time >> 32, 32);
+    bitstream_put_ui(&bs, capture_time & 0xffffffff, 32);
+
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+
+    *header_buffer = (unsigned char *)packedsei_data;
     return bs.bit_offset;
 }
 
@@ -631,6 +801,20 @@ static char* get_frame_type (int ft)
   }
 }
 
+// -----------------------------------------------------------------------------
+//  Position of the current picture in the intra refresh cycle, a new cycle
+//  repeats SPS and PPS for the decoders joining the stream
+// -----------------------------------------------------------------------------
+static int refresh_unit(void)
+{
+    return (current_frame_display - current_IDR_display) % refresh_cycle;
+}
+
+static int refresh_start(void)
+{
+    return refresh_cycle && current_frame_type == FRAME_P && refresh_unit() == 0;
+}
+
 // -----------------------------------------------------------------------------
 //  Convert 4CC to string
 // -----------------------------------------------------------------------------
@@ -745,6 +929,24 @@ static int print_help(void)
     printf("   --entropy <0|1>, 1 means cabac, 0 cavlc\n");
     printf("   --profile <BP|MP|HP>\n");
     printf("   --low_power <num> 0: Normal mode, 1: Low power mode, others: auto mode\n");
+    printf("   --backend <auto|va|sw|null> sw is a software Constrained Baseline encoder,\n");
+    printf("                          auto uses it when VA-API can't encode H264,\n");
+    printf("                          null simulates the hardware to measure the rest\n");
+    printf("   --null_delay <us> encode time simulated by the null backend (default 5 ms at 1080p)\n");
+    printf("   --slices <number> split pictures into slices of whole macroblock rows\n");
+    printf("   --lowlatency no periodic IDR but intra refresh, small HRD buffer and\n");
+    printf("                capture time SEI\n");
+    printf("   --roi <x,y,w,h[,qp_delta]> region of interest, may be repeated\n");
+    printf("   --roifile <filename> regions of interest, default is <srcyuv>.roi\n");
+    printf("   --scenecut <number> mean luma difference starting a new GOP, 0 disables (default),\n");
+    printf("                        30 detects a switch to another scene\n");
+    printf("   --skipstatic <0|1> repeat the previous picture when the image did not change (default 0)\n");
+    printf("   --nv12 source is NV12 converted by enchost\n");
+    printf("   --daemon <socket> stay ready and record on commands received on a Unix socket\n");
+    printf("   --feedback <socket> adapt the bitrate to the receiver reports forwarded by the streamer\n");
+    printf("   --mux <raw|mp4|ts|nal> container of the coded file, default from its extension\n");
+    printf("   --telemetry <file> per frame timing exported on exit and on SIGUSR2,\n");
+    printf("                      CSV records if file ends in .csv, else JSON histograms\n");
     return 0;
 }
 
@@ -770,6 +972,19 @@ static int process_cmdline(int argc, char *argv[])
         {"entropy", required_argument, NULL, 17 },
         {"profile", required_argument, NULL, 18 },
         {"low_power", required_argument, NULL, 19 },
+        {"backend", required_argument, NULL, 20 },
+        {"slices", required_argument, NULL, 21 },
+        {"lowlatency", no_argument, NULL, 22 },
+        {"roi", required_argument, NULL, 23 },
+        {"roifile", required_argument, NULL, 24 },
+        {"scenecut", required_argument, NULL, 25 },
+        {"skipstatic", required_argument, NULL, 26 },
+        {"nv12", no_argument, NULL, 27 },
+        {"daemon", required_argument, NULL, 28 },
+        {"mux", required_argument, NULL, 29 },
+        {"telemetry", required_argument, NULL, 30 },
+        {"null_delay", required_argument, NULL, 31 },
+        {"feedback", required_argument, NULL, 32 },
         {NULL, no_argument, NULL, 0 }
     };
     int long_index;
@@ -856,6 +1071,67 @@ static int process_cmdline(int argc, char *argv[])
                 requested_entrypoint = -1;
         }
         break;
+        case 20:
+            if (strcmp(optarg, "va") == 0)
+                backend_type = BACKEND_VA;
+            else if (strcmp(optarg, "sw") == 0)
+                backend_type = BACKEND_SW;
+            else if (strcmp(optarg, "null") == 0)
+                backend_type = BACKEND_NULL;
+            else if (strcmp(optarg, "auto") == 0)
+                backend_type = BACKEND_AUTO;
+            else {
+                print_help();
+                exit(1);
+            }
+            break;
+        case 21:
+            frame_slices = atoi(optarg);
+            break;
+        case 22:
+            low_latency = 1;
+            break;
+        case 23:
+            if (roi_parse(&rois, optarg) == -1) {
+                printf(" bad region of interest %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 24:
+            free(rois.fn);
+            rois.fn = strdup(optarg);
+            break;
+        case 25:
+            scenecut = atoi(optarg);
+            break;
+        case 26:
+            skip_static = atoi(optarg);
+            break;
+        case 27:
+            srcyuv_nv12 = 1;
+            break;
+        case 28:
+            free(control_fn);
+            control_fn = strdup(optarg);
+            break;
+        case 29:
+            mux_forced = mux_parse(optarg);
+            if (mux_forced == -1) {
+                print_help();
+                exit(1);
+            }
+            break;
+        case 30:
+            free(telemetry_fn);
+            telemetry_fn = strdup(optarg);
+            break;
+        case 31:
+            null_delay = atoi(optarg);
+            break;
+        case 32:
+            free(feedback_fn);
+            feedback_fn = strdup(optarg);
+            break;
         case ':':
         case '?':
             print_help();
@@ -863,6 +1139,10 @@ static int process_cmdline(int argc, char *argv[])
         }
     }
 
+    /* B pictures would delay the output */
+    if (low_latency)
+        ip_period = 1;
+
     if (ip_period < 1) {
         printf(" ip_period must be greater than 0\n");
         exit(0);
@@ -875,6 +1155,10 @@ static int process_cmdline(int argc, char *argv[])
         printf(" intra_idr_period must be a multiplier of intra_period\n");
         exit(0);
     }
+    if (frame_slices < 1) {
+        printf(" slices must be greater than 0\n");
+        exit(0);
+    }
 
     if (frame_bitrate == 0)
         frame_bitrate = (long long int) frame_width * frame_height * 12 * frame_rate / 50;
@@ -883,21 +1167,31 @@ static int process_cmdline(int argc, char *argv[])
     if (!srcyuv_fn) srcyuv_fn = strdup("/tmp/frame");
     srcyuv_fp = fopen(srcyuv_fn, "r");
 
+    /* offscreen publishes the overlay text box next to the frame */
+    if (!rois.fn) {
+        rois.fn = malloc(strlen(srcyuv_fn) + 5);
+        sprintf(rois.fn, "%s.roi", srcyuv_fn);
+    }
+
     if (srcyuv_fp == NULL) {
       printf("Open source YUV file %s failed\n", srcyuv_fn);
       exit (1);
     }
     else {
       srcyuv_frames = 1;  // <-- source file contains only one frame
-      int mmap_size = frame_width * frame_height * 4;
-      srcyuv_ptr = (unsigned char *)mmap(0, mmap_size, PROT_READ, MAP_SHARED,
+      int mmap_size = frame_width * frame_height * (srcyuv_nv12 ? 3 : 8) / 2;
+      size_t info_size = frameinfo_size(fileno(srcyuv_fp), mmap_size);
+      srcyuv_ptr = (unsigned char *)mmap(0, mmap_size + info_size, PROT_READ, MAP_SHARED,
                                          fileno(srcyuv_fp), 0);
       if (srcyuv_ptr == MAP_FAILED) {
         printf("Failed to mmap YUV file (%s)\n", strerror(errno));
         exit(1);
       }
+      if (info_size)
+        frame_info = (struct frameinfo_s *)(srcyuv_ptr + mmap_size);
 
-      nv12 = (unsigned char*) malloc( 3*mmap_size / 8);
+      /* enchost converted the frame, it is encoded in place */
+      nv12 = srcyuv_nv12 ? srcyuv_ptr : (unsigned char*) malloc( 3*mmap_size / 8);
       if (nv12 == NULL) {
         fprintf (stderr, "memory allocation error.\n");
         exit (1);
@@ -917,9 +1211,9 @@ static int process_cmdline(int argc, char *argv[])
         assert(coded_fn);
     }
 
-    /* store coded data into a file */
-    coded_fp = fopen(coded_fn, "w+");
-    if (coded_fp == NULL) {
+    /* store coded data into a file, the service opens one per recording */
+    if (control_fn == NULL &&
+        mux_open(&mux, coded_fn, mux_forced, MUX_H264, frame_width, frame_height, frame_rate) == -1) {
         printf("Open file %s failed, exit\n", coded_fn);
         exit(1);
     }
@@ -933,7 +1227,58 @@ static int process_cmdline(int argc, char *argv[])
                frame_width_mbaligned, frame_height_mbaligned
               );
     }
+    if (low_latency && frame_slices == 1)
+        frame_slices = LOW_LATENCY_SLICES;
+    if (frame_slices > frame_height_mbaligned / 16) {
+        frame_slices = frame_height_mbaligned / 16;
+        printf("Slices are made of macroblock rows, using %d slices\n", frame_slices);
+    }
+
+    roi_qp_map = malloc(frame_width_mbaligned * frame_height_mbaligned / 256);
+    if (roi_qp_map == NULL) {
+        fprintf(stderr, "memory allocation error.\n");
+        exit(1);
+    }
+    roi_update(&rois);
+    roi_map(&rois, 16, frame_width_mbaligned / 16, frame_height_mbaligned / 16, roi_qp_map);
+
+    if (scene_init(&scene, frame_width, frame_height, skip_static) == -1) {
+        fprintf(stderr, "memory allocation error.\n");
+        exit(1);
+    }
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Check if VA-API can encode H264, the display stays open for init_va()
+// -----------------------------------------------------------------------------
+static int probe_va(void)
+{
+    VAProfile profile_list[] = {VAProfileH264High, VAProfileH264Main, VAProfileH264ConstrainedBaseline};
+    VAEntrypoint *entrypoints;
+    int num_entrypoints, major_ver, minor_ver, i, j, found = 0;
+
+    va_dpy = va_open_display_drm();
+    if (va_dpy && vaInitialize(va_dpy, &major_ver, &minor_ver) == VA_STATUS_SUCCESS) {
+        entrypoints = malloc(vaMaxNumEntrypoints(va_dpy) * sizeof(*entrypoints));
+        for (i = 0; entrypoints && !found && i < sizeof(profile_list) / sizeof(profile_list[0]); i++) {
+            if (vaQueryConfigEntrypoints(va_dpy, profile_list[i], entrypoints, &num_entrypoints) != VA_STATUS_SUCCESS)
+                continue;
+            for (j = 0; j < num_entrypoints; j++)
+                if (entrypoints[j] == VAEntrypointEncSlice || entrypoints[j] == VAEntrypointEncSliceLP)
+                    found = 1;
+        }
+        free(entrypoints);
+        if (found)
+            return 1;
+        vaTerminate(va_dpy);
+    }
 
+    printf("VA-API can't encode H264, falling back to software encoder\n");
+    if (va_dpy)
+        va_close_display_drm(va_dpy);
+    va_dpy = NULL;
     return 0;
 }
 
@@ -950,9 +1295,11 @@ static int init_va(void)
     VAStatus va_status;
     unsigned int i;
 
-    va_dpy = va_open_display_drm();
-    va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
-    CHECK_VASTATUS(va_status, "vaInitialize");
+    if (va_dpy == NULL) {
+        va_dpy = va_open_display_drm();
+        va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
+        CHECK_VASTATUS(va_status, "vaInitialize");
+    }
 
     num_entrypoints = vaMaxNumEntrypoints(va_dpy);
     entrypoints = malloc(num_entrypoints * sizeof(*entrypoints));
@@ -1106,6 +1453,11 @@ static int init_va(void)
             config_attrib[config_attrib_num].value |= VA_ENC_PACKED_HEADER_MISC;
         }
 
+        if (tmp & VA_ENC_PACKED_HEADER_RAW_DATA) {
+            printf("Support packed raw data headers\n");
+            config_attrib[config_attrib_num].value |= VA_ENC_PACKED_HEADER_RAW_DATA;
+        }
+
         enc_packed_header_idx = config_attrib_num;
         config_attrib_num++;
     }
@@ -1136,8 +1488,44 @@ static int init_va(void)
                h264_maxref & 0xffff, (h264_maxref >> 16) & 0xffff);
     }
 
-    if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED)
+    if (low_latency && attrib[VAConfigAttribEncIntraRefresh].value != VA_ATTRIB_NOT_SUPPORTED) {
+        int tmp = attrib[VAConfigAttribEncIntraRefresh].value;
+
+        printf("Support VAConfigAttribEncIntraRefresh\n");
+
+        if (tmp & VA_ENC_INTRA_REFRESH_ROLLING_COLUMN)
+            intra_refresh = VA_ENC_INTRA_REFRESH_ROLLING_COLUMN;
+        else if (tmp & VA_ENC_INTRA_REFRESH_ROLLING_ROW)
+            intra_refresh = VA_ENC_INTRA_REFRESH_ROLLING_ROW;
+
+        if (intra_refresh != VA_ENC_INTRA_REFRESH_NONE) {
+            config_attrib[config_attrib_num].type = VAConfigAttribEncIntraRefresh;
+            config_attrib[config_attrib_num].value = intra_refresh;
+            config_attrib_num++;
+        }
+    }
+
+    if (attrib[VAConfigAttribEncROI].value != VA_ATTRIB_NOT_SUPPORTED) {
+        VAConfigAttribValEncROI roi_attrib = { .value = attrib[VAConfigAttribEncROI].value };
+
+        printf("Support %d regions of interest\n", roi_attrib.bits.num_roi_regions);
+
+        roi_va_regions = roi_attrib.bits.num_roi_regions;
+        roi_va_qp_delta = roi_attrib.bits.roi_rc_qp_delta_support || rc_mode == VA_RC_CQP;
+        if (roi_va_regions) {
+            config_attrib[config_attrib_num].type = VAConfigAttribEncROI;
+            config_attrib[config_attrib_num].value = attrib[VAConfigAttribEncROI].value;
+            config_attrib_num++;
+        }
+    }
+
+    if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED) {
         printf("Support %d slices\n", attrib[VAConfigAttribEncMaxSlices].value);
+        if (frame_slices > attrib[VAConfigAttribEncMaxSlices].value) {
+            frame_slices = attrib[VAConfigAttribEncMaxSlices].value;
+            printf("Using %d slices\n", frame_slices);
+        }
+    }
 
     if (attrib[VAConfigAttribEncSliceStructure].value != VA_ATTRIB_NOT_SUPPORTED) {
         int tmp = attrib[VAConfigAttribEncSliceStructure].value;
@@ -1159,6 +1547,50 @@ static int init_va(void)
     return 0;
 }
 
+// -----------------------------------------------------------------------------
+//  Coded buffers of pool.coded_size bytes, the old ones are replaced when they
+//  grow
+// -----------------------------------------------------------------------------
+static void create_coded_buffers(void)
+{
+    static unsigned int created = 0;
+    VAStatus va_status;
+    unsigned int i;
+
+    for (i = 0; i < pool.src; i++) {
+        /* create coded buffer once for all
+         * other VA buffers which won't be used again after vaRenderPicture.
+         * so APP can always vaCreateBuffer for every frame
+         * but coded buffer need to be mapped and accessed after vaRenderPicture/vaEndPicture
+         * so VA won't maintain the coded buffer
+         */
+        if (i < created)
+            vaDestroyBuffer(va_dpy, coded_buf[i]);
+        va_status = vaCreateBuffer(va_dpy, context_id, VAEncCodedBufferType,
+                                   pool.coded_size, 1, NULL, &coded_buf[i]);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    }
+    created = pool.src;
+}
+
+// -----------------------------------------------------------------------------
+//  Reconstructed surface of the current picture: one that is not a reference
+// -----------------------------------------------------------------------------
+static VASurfaceID free_ref_surface(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < pool.ref; i++) {
+        for (j = 0; j < numShortTerm; j++)
+            if (ReferenceFrames[j].picture_id == ref_surface[i])
+                break;
+        if (j == numShortTerm)
+            return ref_surface[i];
+    }
+    /* not reached, there is one more surface than references */
+    return ref_surface[0];
+}
+
 // -----------------------------------------------------------------------------
 //  Initialize data for encoder
 // -----------------------------------------------------------------------------
@@ -1166,16 +1598,19 @@ static int setup_encode()
 {
     VAStatus va_status;
     VASurfaceID *tmp_surfaceid;
-    int codedbuf_size, i;
 
     va_status = vaCreateConfig(va_dpy, h264_profile, selected_entrypoint,
                                &config_attrib[0], config_attrib_num, &config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
 
+    /* pictures are stored as soon as they are coded, one is in flight */
+    vapool_size(&pool, frame_width_mbaligned, frame_height_mbaligned, num_ref_frames + (ip_period > 1), 1,
+                (rc_mode == VA_RC_CQP) ? 0 : frame_bitrate, frame_rate);
+
     /* create source surfaces */
     va_status = vaCreateSurfaces(va_dpy,
                                  VA_RT_FORMAT_YUV420, frame_width_mbaligned, frame_height_mbaligned,
-                                 &src_surface[0], SURFACE_NUM,
+                                 &src_surface[0], pool.src,
                                  NULL, 0);
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
@@ -1183,38 +1618,27 @@ static int setup_encode()
     va_status = vaCreateSurfaces(
                     va_dpy,
                     VA_RT_FORMAT_YUV420, frame_width_mbaligned, frame_height_mbaligned,
-                    &ref_surface[0], SURFACE_NUM,
+                    &ref_surface[0], pool.ref,
                     NULL, 0
                 );
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
-    tmp_surfaceid = calloc(2 * SURFACE_NUM, sizeof(VASurfaceID));
+    tmp_surfaceid = calloc(pool.src + pool.ref, sizeof(VASurfaceID));
     assert(tmp_surfaceid);
-    memcpy(tmp_surfaceid, src_surface, SURFACE_NUM * sizeof(VASurfaceID));
-    memcpy(tmp_surfaceid + SURFACE_NUM, ref_surface, SURFACE_NUM * sizeof(VASurfaceID));
+    memcpy(tmp_surfaceid, src_surface, pool.src * sizeof(VASurfaceID));
+    memcpy(tmp_surfaceid + pool.src, ref_surface, pool.ref * sizeof(VASurfaceID));
 
     /* Create a context for this encode pipe */
     va_status = vaCreateContext(va_dpy, config_id,
                                 frame_width_mbaligned, frame_height_mbaligned,
                                 VA_PROGRESSIVE,
-                                tmp_surfaceid, 2 * SURFACE_NUM,
+                                tmp_surfaceid, pool.src + pool.ref,
                                 &context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
     free(tmp_surfaceid);
 
-    codedbuf_size = ((long long int)frame_width_mbaligned * frame_height_mbaligned * 400) / (16 * 16);
-
-    for (i = 0; i < SURFACE_NUM; i++) {
-        /* create coded buffer once for all
-         * other VA buffers which won't be used again after vaRenderPicture.
-         * so APP can always vaCreateBuffer for every frame
-         * but coded buffer need to be mapped and accessed after vaRenderPicture/vaEndPicture
-         * so VA won't maintain the coded buffer
-         */
-        va_status = vaCreateBuffer(va_dpy, context_id, VAEncCodedBufferType,
-                                   codedbuf_size, 1, NULL, &coded_buf[i]);
-        CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    }
+    create_coded_buffers();
+    vapool_report(&pool, frame_width_mbaligned, frame_height_mbaligned);
 
     return 0;
 }
@@ -1299,7 +1723,7 @@ static int update_ReferenceFrames(void)
 {
     int i;
 
-    if (current_frame_type == FRAME_B)
+    if (current_frame_type == FRAME_B || static_skip)
         return 0;
 
     CurrentCurrPic.flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
@@ -1348,13 +1772,8 @@ static int update_RefPicList(void)
 // -----------------------------------------------------------------------------
 //
 // -----------------------------------------------------------------------------
-static int render_sequence(void)
+static void fill_sequence(void)
 {
-    VABufferID seq_param_buf, rc_param_buf, misc_param_tmpbuf, render_id[2];
-    VAStatus va_status;
-    VAEncMiscParameterBuffer *misc_param, *misc_param_tmp;
-    VAEncMiscParameterRateControl *misc_rate_ctrl;
-
     seq_param.level_idc = 41 /*SH_LEVEL_3*/;
     seq_param.picture_width_in_mbs = frame_width_mbaligned / 16;
     seq_param.picture_height_in_mbs = frame_height_mbaligned / 16;
@@ -1387,12 +1806,56 @@ static int render_sequence(void)
         seq_param.frame_crop_top_offset = 0;
         seq_param.frame_crop_bottom_offset = (frame_height_mbaligned - frame_height) / 2;
     }
+}
+
+// -----------------------------------------------------------------------------
+//  HRD buffer size of the low latency mode
+// -----------------------------------------------------------------------------
+static long long cpb_size(void)
+{
+    return (long long)frame_bitrate * LOW_LATENCY_CPB_FRAMES / frame_rate;
+}
+
+// -----------------------------------------------------------------------------
+//  A small HRD buffer keeps the size of each picture close to the average
+// -----------------------------------------------------------------------------
+static int render_hrd(void)
+{
+    VABufferID hrd_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterHRD *misc_hrd;
 
     va_status = vaCreateBuffer(va_dpy, context_id,
-                               VAEncSequenceParameterBufferType,
-                               sizeof(seq_param), 1, &seq_param, &seq_param_buf);
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterHRD),
+                               1, NULL, &hrd_param_buf);
     CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
+    vaMapBuffer(va_dpy, hrd_param_buf, (void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeHRD;
+    misc_hrd = (VAEncMiscParameterHRD *)misc_param->data;
+    misc_hrd->buffer_size = cpb_size();
+    misc_hrd->initial_buffer_fullness = misc_hrd->buffer_size / 2;
+    vaUnmapBuffer(va_dpy, hrd_param_buf);
+
+    va_status = vaRenderPicture(va_dpy, context_id, &hrd_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Rate control parameters, with every sequence and when the bitrate changes
+//  in the middle of one
+// -----------------------------------------------------------------------------
+static int render_rate_control(void)
+{
+    VABufferID rc_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterRateControl *misc_rate_ctrl;
+
     va_status = vaCreateBuffer(va_dpy, context_id,
                                VAEncMiscParameterBufferType,
                                sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl),
@@ -1411,12 +1874,37 @@ static int render_sequence(void)
     misc_rate_ctrl->basic_unit_size = 0;
     vaUnmapBuffer(va_dpy, rc_param_buf);
 
-    render_id[0] = seq_param_buf;
-    render_id[1] = rc_param_buf;
+    va_status = vaRenderPicture(va_dpy, context_id, &rc_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    if (low_latency)
+        render_hrd();
+    bitrate_changed = 0;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+static int render_sequence(void)
+{
+    VABufferID seq_param_buf, misc_param_tmpbuf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param_tmp;
+
+    fill_sequence();
 
-    va_status = vaRenderPicture(va_dpy, context_id, &render_id[0], 2);
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                               VAEncSequenceParameterBufferType,
+                               sizeof(seq_param), 1, &seq_param, &seq_param_buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    va_status = vaRenderPicture(va_dpy, context_id, &seq_param_buf, 1);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
 
+    render_rate_control();
+
     if (misc_priv_type != 0) {
         va_status = vaCreateBuffer(va_dpy, context_id,
                                    VAEncMiscParameterBufferType,
@@ -1461,7 +1949,7 @@ static int calc_poc(int pic_order_cnt_lsb)
 
     TopFieldOrderCnt = PicOrderCntMsb + pic_order_cnt_lsb;
 
-    if (current_frame_type != FRAME_B) {
+    if (current_frame_type != FRAME_B && !static_skip) {
         PicOrderCntMsb_ref = PicOrderCntMsb;
         pic_order_cnt_lsb_ref = pic_order_cnt_lsb;
     }
@@ -1472,13 +1960,11 @@ static int calc_poc(int pic_order_cnt_lsb)
 // -----------------------------------------------------------------------------
 //
 // -----------------------------------------------------------------------------
-static int render_picture(void)
+static void fill_picture(void)
 {
-    VABufferID pic_param_buf;
-    VAStatus va_status;
     int i = 0;
 
-    pic_param.CurrPic.picture_id = ref_surface[current_slot];
+    pic_param.CurrPic.picture_id = free_ref_surface();
     pic_param.CurrPic.frame_idx = current_frame_num;
     pic_param.CurrPic.flags = 0;
     pic_param.CurrPic.TopFieldOrderCnt = calc_poc((current_frame_display - current_IDR_display) % MaxPicOrderCntLsb);
@@ -1492,13 +1978,24 @@ static int render_picture(void)
     }
 
     pic_param.pic_fields.bits.idr_pic_flag = (current_frame_type == FRAME_IDR);
-    pic_param.pic_fields.bits.reference_pic_flag = (current_frame_type != FRAME_B);
+    pic_param.pic_fields.bits.reference_pic_flag = (current_frame_type != FRAME_B && !static_skip);
     pic_param.pic_fields.bits.entropy_coding_mode_flag = h264_entropy_mode;
     pic_param.pic_fields.bits.deblocking_filter_control_present_flag = 1;
     pic_param.frame_num = current_frame_num;
     pic_param.coded_buf = coded_buf[current_slot];
     pic_param.last_picture = (current_frame_encoding == frame_count);
     pic_param.pic_init_qp = initial_qp;
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+static int render_picture(void)
+{
+    VABufferID pic_param_buf;
+    VAStatus va_status;
+
+    fill_picture();
 
     va_status = vaCreateBuffer(va_dpy, context_id, VAEncPictureParameterBufferType,
                                sizeof(pic_param), 1, &pic_param, &pic_param_buf);
@@ -1546,8 +2043,6 @@ static int render_packedsequence(void)
     va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-    free(packedseq_buffer);
-
     return 0;
 }
 
@@ -1587,8 +2082,6 @@ static int render_packedpicture(void)
     va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-    free(packedpic_buffer);
-
     return 0;
 }
 
@@ -1627,48 +2120,185 @@ static void render_packedslice()
     render_id[1] = packedslice_data_bufid;
     va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
-
-    free(packedslice_buffer);
 }
 
 // -----------------------------------------------------------------------------
-//
+//  SEI of the low latency mode, needs packed misc or raw data headers
 // -----------------------------------------------------------------------------
-static int render_slice(void)
+static void render_packedsei(void)
 {
-    VABufferID slice_param_buf;
+    VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
+    VABufferID packedsei_para_bufid, packedsei_data_bufid, render_id[2];
+    unsigned int length_in_bits;
+    unsigned char *packedsei_buffer = NULL;
     VAStatus va_status;
-    int i;
 
-    update_RefPicList();
+    if (!h264_packedheader)
+        return;
+    if (config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_MISC)
+        packedheader_param_buffer.type = VAEncPackedHeaderH264_SEI;
+    else if (config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_RAW_DATA)
+        packedheader_param_buffer.type = VAEncPackedHeaderRawData;
+    else
+        return;
 
-    /* one frame, one slice */
-    slice_param.macroblock_address = 0;
-    slice_param.num_macroblocks = frame_width_mbaligned * frame_height_mbaligned / (16 * 16); /* Measured by MB */
-    slice_param.slice_type = (current_frame_type == FRAME_IDR) ? 2 : current_frame_type;
-    if (current_frame_type == FRAME_IDR) {
-        if (current_frame_encoding != 0)
-            ++slice_param.idr_pic_id;
-    } else if (current_frame_type == FRAME_P) {
-        int refpiclist0_max = h264_maxref & 0xffff;
-        memcpy(slice_param.RefPicList0, RefPicList0_P, ((refpiclist0_max > 32) ? 32 : refpiclist0_max)*sizeof(VAPictureH264));
+    length_in_bits = build_packed_sei_buffer(&packedsei_buffer, refresh_start());
+    packedheader_param_buffer.bit_length = length_in_bits;
+    packedheader_param_buffer.has_emulation_bytes = 0;
 
-        for (i = refpiclist0_max; i < 32; i++) {
-            slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
-            slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
-        }
-    } else if (current_frame_type == FRAME_B) {
-        int refpiclist0_max = h264_maxref & 0xffff;
-        int refpiclist1_max = (h264_maxref >> 16) & 0xffff;
+    va_status = vaCreateBuffer(va_dpy,
+                               context_id,
+                               VAEncPackedHeaderParameterBufferType,
+                               sizeof(packedheader_param_buffer), 1, &packedheader_param_buffer,
+                               &packedsei_para_bufid);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-        memcpy(slice_param.RefPicList0, RefPicList0_B, ((refpiclist0_max > 32) ? 32 : refpiclist0_max)*sizeof(VAPictureH264));
-        for (i = refpiclist0_max; i < 32; i++) {
-            slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
-            slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
-        }
+    va_status = vaCreateBuffer(va_dpy,
+                               context_id,
+                               VAEncPackedHeaderDataBufferType,
+                               (length_in_bits + 7) / 8, 1, packedsei_buffer,
+                               &packedsei_data_bufid);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-        memcpy(slice_param.RefPicList1, RefPicList1_B, ((refpiclist1_max > 32) ? 32 : refpiclist1_max)*sizeof(VAPictureH264));
-        for (i = refpiclist1_max; i < 32; i++) {
+    render_id[0] = packedsei_para_bufid;
+    render_id[1] = packedsei_data_bufid;
+    va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+}
+
+// -----------------------------------------------------------------------------
+//  Regions of interest, with the driver ROI support or as a QP per macroblock
+//  which drivers only take in CQP mode
+// -----------------------------------------------------------------------------
+static int render_roi(void)
+{
+    VABufferID roi_param_buf;
+    VAStatus va_status;
+    int i;
+
+    if (roi_va_regions) {
+        VAEncMiscParameterBuffer *misc_param;
+        VAEncMiscParameterBufferROI *misc_roi;
+        int n = MIN(rois.n, roi_va_regions);
+
+        for (i = 0; i < n; i++) {
+            roi_va[i].roi_rectangle.x = rois.r[i].x;
+            roi_va[i].roi_rectangle.y = rois.r[i].y;
+            roi_va[i].roi_rectangle.width = rois.r[i].w;
+            roi_va[i].roi_rectangle.height = rois.r[i].h;
+            /* a higher priority for a lower QP */
+            roi_va[i].roi_value = roi_va_qp_delta ? rois.r[i].delta : -rois.r[i].delta;
+        }
+
+        va_status = vaCreateBuffer(va_dpy, context_id,
+                                   VAEncMiscParameterBufferType,
+                                   sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterBufferROI),
+                                   1, NULL, &roi_param_buf);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+        vaMapBuffer(va_dpy, roi_param_buf, (void **)&misc_param);
+        misc_param->type = VAEncMiscParameterTypeROI;
+        misc_roi = (VAEncMiscParameterBufferROI *)misc_param->data;
+        memset(misc_roi, 0, sizeof(*misc_roi));
+        misc_roi->num_roi = n;
+        misc_roi->max_delta_qp = 51;
+        misc_roi->min_delta_qp = -51;
+        misc_roi->roi = roi_va;
+        misc_roi->roi_flags.bits.roi_value_is_qp_delta = roi_va_qp_delta;
+        vaUnmapBuffer(va_dpy, roi_param_buf);
+    } else if (rc_mode == VA_RC_CQP) {
+        VAEncQPBufferH264 *qp_map;
+        int mbs = frame_width_mbaligned * frame_height_mbaligned / 256;
+
+        va_status = vaCreateBuffer(va_dpy, context_id, VAEncQPBufferType,
+                                   sizeof(VAEncQPBufferH264) * mbs, 1, NULL, &roi_param_buf);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+        vaMapBuffer(va_dpy, roi_param_buf, (void **)&qp_map);
+        for (i = 0; i < mbs; i++)
+            qp_map[i].qp = MAX(minimal_qp, MIN(51, initial_qp + roi_qp_map[i]));
+        vaUnmapBuffer(va_dpy, roi_param_buf);
+    } else {
+        return 0;
+    }
+
+    va_status = vaRenderPicture(va_dpy, context_id, &roi_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Rolling intra refresh of the driver, refresh_size MB columns or rows
+//  of each P picture are coded intra
+// -----------------------------------------------------------------------------
+static int render_intra_refresh(void)
+{
+    VABufferID rir_param_buf;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterRIR *misc_rir;
+    int units = (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_COLUMN) ?
+                frame_width_mbaligned / 16 : frame_height_mbaligned / 16;
+    int location = refresh_unit() * refresh_size;
+
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRIR),
+                               1, NULL, &rir_param_buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    vaMapBuffer(va_dpy, rir_param_buf, (void **)&misc_param);
+    misc_param->type = VAEncMiscParameterTypeRIR;
+    misc_rir = (VAEncMiscParameterRIR *)misc_param->data;
+    memset(misc_rir, 0, sizeof(*misc_rir));
+    misc_rir->rir_flags.bits.enable_rir_column = (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_COLUMN);
+    misc_rir->rir_flags.bits.enable_rir_row = (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_ROW);
+    misc_rir->intra_insertion_location = location;
+    misc_rir->intra_insert_size = MIN(refresh_size, units - location);
+    misc_rir->qp_delta_for_inserted_intra = 0;
+    vaUnmapBuffer(va_dpy, rir_param_buf);
+
+    va_status = vaRenderPicture(va_dpy, context_id, &rir_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+static void fill_slice(void)
+{
+    int i;
+
+    update_RefPicList();
+
+    /* macroblock_address and num_macroblocks are set by slice_range() */
+    slice_param.slice_type = (current_frame_type == FRAME_IDR) ? 2 : current_frame_type;
+    if (current_frame_type == FRAME_IDR) {
+        if (current_frame_encoding != 0)
+            ++slice_param.idr_pic_id;
+    } else if (current_frame_type == FRAME_P) {
+        int refpiclist0_max = h264_maxref & 0xffff;
+        memcpy(slice_param.RefPicList0, RefPicList0_P, ((refpiclist0_max > 32) ? 32 : refpiclist0_max)*sizeof(VAPictureH264));
+
+        for (i = refpiclist0_max; i < 32; i++) {
+            slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+            slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+        }
+    } else if (current_frame_type == FRAME_B) {
+        int refpiclist0_max = h264_maxref & 0xffff;
+        int refpiclist1_max = (h264_maxref >> 16) & 0xffff;
+
+        memcpy(slice_param.RefPicList0, RefPicList0_B, ((refpiclist0_max > 32) ? 32 : refpiclist0_max)*sizeof(VAPictureH264));
+        for (i = refpiclist0_max; i < 32; i++) {
+            slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+            slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+        }
+
+        memcpy(slice_param.RefPicList1, RefPicList1_B, ((refpiclist1_max > 32) ? 32 : refpiclist1_max)*sizeof(VAPictureH264));
+        for (i = refpiclist1_max; i < 32; i++) {
             slice_param.RefPicList1[i].picture_id = VA_INVALID_SURFACE;
             slice_param.RefPicList1[i].flags = VA_PICTURE_H264_INVALID;
         }
@@ -1678,51 +2308,101 @@ static int render_slice(void)
     slice_param.slice_beta_offset_div2 = 0;
     slice_param.direct_spatial_mv_pred_flag = 1;
     slice_param.pic_order_cnt_lsb = (current_frame_display - current_IDR_display) % MaxPicOrderCntLsb;
+}
 
+// -----------------------------------------------------------------------------
+//  Macroblocks of a slice, the picture rows are spread evenly over the slices
+// -----------------------------------------------------------------------------
+static void slice_range(int slice)
+{
+    int width_in_mbs = frame_width_mbaligned / 16;
+    int height_in_mbs = frame_height_mbaligned / 16;
+    int first_row = slice * height_in_mbs / frame_slices;
+    int last_row = (slice + 1) * height_in_mbs / frame_slices;
 
-    if (h264_packedheader &&
-        config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SLICE)
-        render_packedslice();
+    slice_param.macroblock_address = first_row * width_in_mbs;
+    slice_param.num_macroblocks = (last_row - first_row) * width_in_mbs;
 
-    va_status = vaCreateBuffer(va_dpy, context_id, VAEncSliceParameterBufferType,
-                               sizeof(slice_param), 1, &slice_param, &slice_param_buf);
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");;
+    /* without VA intra refresh, one slice of each P picture is intra */
+    if (refresh_cycle && intra_refresh == VA_ENC_INTRA_REFRESH_NONE && current_frame_type == FRAME_P)
+        slice_param.slice_type = (slice == refresh_unit()) ? SLICE_TYPE_I : SLICE_TYPE_P;
+}
 
-    va_status = vaRenderPicture(va_dpy, context_id, &slice_param_buf, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+static int render_slice(void)
+{
+    VABufferID slice_param_buf;
+    VAStatus va_status;
+    int i;
+
+    fill_slice();
+
+    for (i = 0; i < frame_slices; i++) {
+        slice_range(i);
+
+        if (h264_packedheader &&
+            config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SLICE)
+            render_packedslice();
+
+        va_status = vaCreateBuffer(va_dpy, context_id, VAEncSliceParameterBufferType,
+                                   sizeof(slice_param), 1, &slice_param, &slice_param_buf);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");;
+
+        va_status = vaRenderPicture(va_dpy, context_id, &slice_param_buf, 1);
+        CHECK_VASTATUS(va_status, "vaRenderPicture");
+    }
 
     return 0;
 }
 
 
+// -----------------------------------------------------------------------------
+//   Progress line
+// -----------------------------------------------------------------------------
+static void print_progress(unsigned long long encode_order, unsigned int coded_size)
+{
+    static char *progress = "|/-\\";
+
+    printf("\r      "); /* return back to startpoint */
+    printf ("%c", progress[encode_order % 4]);
+    printf ("%-5s", get_frame_type (current_frame_type));
+    printf("%08lld", encode_order);
+    printf("(%06d bytes coded)", coded_size);
+    fflush (stdout);
+}
+
 // -----------------------------------------------------------------------------
 //   Save h264 encoded vide
 // -----------------------------------------------------------------------------
 static int save_codeddata(unsigned long long display_order, unsigned long long encode_order)
 {
-  static char *progress = "|/-\\";
-    VACodedBufferSegment *buf_list = NULL;
+    VACodedBufferSegment *buf_list = NULL, *seg;
     VAStatus va_status;
     unsigned int coded_size = 0;
 
-    va_status = vaMapBuffer(va_dpy, coded_buf[display_order % SURFACE_NUM], (void **)(&buf_list));
+    va_status = vaMapBuffer(va_dpy, coded_buf[display_order % pool.src], (void **)(&buf_list));
     CHECK_VASTATUS(va_status, "vaMapBuffer");
+
+    /* a picture that did not fit is coded again in larger buffers */
+    for (seg = buf_list; seg != NULL; seg = (VACodedBufferSegment *) seg->next) {
+        if ((seg->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) && vapool_grow(&pool)) {
+            vaUnmapBuffer(va_dpy, coded_buf[display_order % pool.src]);
+            printf("\nCoded buffer overflow, growing to %u KB\n", pool.coded_size / 1024);
+            create_coded_buffers();
+            return -1;
+        }
+    }
+
     while (buf_list != NULL) {
-        coded_size += fwrite(buf_list->buf, 1, buf_list->size, coded_fp);
+        coded_size += mux_write(&mux, buf_list->buf, buf_list->size);
         buf_list = (VACodedBufferSegment *) buf_list->next;
-
-        frame_size += coded_size;
     }
-    vaUnmapBuffer(va_dpy, coded_buf[display_order % SURFACE_NUM]);
+    frame_size += coded_size;
+    vaUnmapBuffer(va_dpy, coded_buf[display_order % pool.src]);
 
-    printf("\r      "); /* return back to startpoint */
-    printf ("%c", progress[encode_order % 4]);
-    printf ("%-5s", get_frame_type (current_frame_type));
-    printf("%08lld", encode_order);
-    printf("(%06d bytes coded)", coded_size);
-    fflush (stdout);
-    
-    fflush(coded_fp);
+    print_progress(encode_order, coded_size);
 
     return 0;
 }
@@ -1730,56 +2410,27 @@ static int save_codeddata(unsigned long long display_order, unsigned long long e
 // -----------------------------------------------------------------------------
 //  Saves coded data to h264 file
 // -----------------------------------------------------------------------------
-static void storage_task(unsigned long long display_order, unsigned long long encode_order)
+static int storage_task(unsigned long long display_order, unsigned long long encode_order)
 {
-    unsigned int tmp;
+    unsigned long long tmp;
     VAStatus va_status;
+    int ret;
 
-    tmp = GetTickCount();
-    va_status = vaSyncSurface(va_dpy, src_surface[display_order % SURFACE_NUM]);
+    tmp = telemetry_now();
+    va_status = vaSyncSurface(va_dpy, src_surface[display_order % pool.src]);
     CHECK_VASTATUS(va_status, "vaSyncSurface");
-    SyncPictureTicks += GetTickCount() - tmp;
-    tmp = GetTickCount();
-    save_codeddata(display_order, encode_order);
-    SavePictureTicks += GetTickCount() - tmp;
+    telemetry_add(&tm_frame, TELEMETRY_SYNC, tmp);
+    tmp = telemetry_now();
+    ret = save_codeddata(display_order, encode_order);
+    telemetry_add(&tm_frame, TELEMETRY_SAVE, tmp);
 
+    return ret;
 }
 
 
-/* --------------------------------------------------------------------------
- *  NV12 conversion
- *  in nv12 u and v are w/2*h/2 and interleaved
- * --------------------------------------------------------------------------*/
-void tfnv12 (int w, int h, unsigned char *rgba, unsigned char *y, unsigned char *uv)
-{
-  unsigned short ru[w], rv[w];
-  unsigned char *prgba, *py = y, *puv = uv;
-  int l, c, ww = w>>1;
-
-  memset (ru, 0, sizeof(ru));
-  memset (rv, 0, sizeof(rv));
-
-  for (l = 1; l <= h; ++l) {
-    prgba = rgba + (h-l)*w*4;
-    for (c = 0; c < w; ++c) {
-      // original 4 bytes pixels are YUVA
-      *py++ = *prgba++;
-      ru[c>>1] += *prgba++;
-      rv[c>>1] += *prgba++;
-      prgba++;
-    }
-    if ((l & 0x01) == 0) {
-      for (c = 0; c < ww; ++c) {
-        *puv++ = (unsigned char) (ru[c] >> 2) & 0xff;
-        *puv++ = (unsigned char) (rv[c] >> 2) & 0xff;
-        ru[c] = rv[c] = 0;
-      }
-    }
-  }
-}
-
 // @todo: move
 static int _sigusr1 = 0;
+static int _sigusr2 = 0;
 static int _done = 0;
 
 /* --------------------------------------------------------------------------
@@ -1802,6 +2453,23 @@ static void sigint (int dummy)
   _done = 1;
 }
 
+/* --------------------------------------------------------------------------
+ *  Signal handler
+ *  SIGUSR2 asks for the telemetry export
+ * --------------------------------------------------------------------------*/
+static void sigusr2 (int dummy)
+{
+  _sigusr2 = 1;
+}
+
+static void export_telemetry ()
+{
+  _sigusr2 = 0;
+  signal (SIGUSR2, sigusr2);
+  if (telemetry_export (&tm) == -1)
+    printf ("\nCan't write telemetry to %s: %s\n", telemetry_fn, strerror (errno));
+}
+
 /* --------------------------------------------------------------------------
  *  Wait for an image to arrive
  * --------------------------------------------------------------------------*/
@@ -1810,6 +2478,8 @@ static void waitforimage ()
   while (!_done) {
     if (usleep (500000) == -1) {
       if (errno == EINTR) {
+        if (_sigusr2)
+          export_telemetry ();
         if (_sigusr1) { 
           _sigusr1 = 0;
           signal (SIGUSR1, sigusr1);
@@ -1828,101 +2498,848 @@ static void waitforimage ()
 }
 
 // -----------------------------------------------------------------------------
-//  Encoding loop
+//  Free encoder VA ressources
 // -----------------------------------------------------------------------------
-static int encode_loop ()
+static int release_encode()
 {
-  unsigned int tmp;
-  VAStatus va_status;
-  
-  for (current_frame_encoding = 0; current_frame_encoding < frame_count; current_frame_encoding++) {
-    // wait for an image to be ready
-    waitforimage ();
-    if (_done) break;
+    int i;
+
+    vaDestroySurfaces(va_dpy, &src_surface[0], pool.src);
+    vaDestroySurfaces(va_dpy, &ref_surface[0], pool.ref);
+
+    for (i = 0; i < pool.src; i++)
+        vaDestroyBuffer(va_dpy, coded_buf[i]);
+
+    vaDestroyContext(va_dpy, context_id);
+    vaDestroyConfig(va_dpy, config_id);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Stops VA
+// -----------------------------------------------------------------------------
+static int deinit_va()
+{
+    vaTerminate(va_dpy);
+    va_close_display_drm(va_dpy);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Encode one picture with VA-API
+// -----------------------------------------------------------------------------
+static int va_encode_picture(void)
+{
+    unsigned long long tmp;
+    VAStatus va_status;
 
-    // process image
-    tmp = GetTickCount ();
-    tfnv12 (frame_width, frame_height, srcyuv_ptr, nv12, nv12 + frame_width*frame_height);
-    ProcessPictureTicks += GetTickCount() - tmp;
-    
-    // compute this frame type
-    encoding2display_order(current_frame_encoding, intra_period, intra_idr_period, ip_period,
-                           &current_frame_display, &current_frame_type);
-    
     // load image
-    tmp = GetTickCount ();
+    tmp = telemetry_now();
     upload_surface_yuv (va_dpy, src_surface[current_slot], VA_FOURCC_NV12, frame_width, frame_height,
 			nv12, nv12 + frame_width*frame_height, NULL);
-    UploadPictureTicks += GetTickCount() - tmp;
+    telemetry_add(&tm_frame, TELEMETRY_UPLOAD, tmp);
+
+    // coded again after a coded buffer overflow
+    do {
+        // begin picture
+        tmp = telemetry_now();
+        va_status = vaBeginPicture(va_dpy, context_id, src_surface[current_slot]);
+        CHECK_VASTATUS(va_status, "vaBeginPicture");
+        telemetry_add(&tm_frame, TELEMETRY_BEGIN, tmp);
+
+        // encode image
+        tmp = telemetry_now();
+        if (current_frame_type == FRAME_IDR) {
+          render_sequence();
+          render_picture();
+          if (h264_packedheader) {
+            render_packedsequence();
+            render_packedpicture();
+          }
+        } else if (bitrate_changed && low_latency) {
+          // the sequence follows the bitrate, for the HRD and the parameter
+          // sets made by the driver: the intra refresh may bring no IDR
+          render_sequence();
+          render_picture();
+          if (h264_packedheader) {
+            render_packedsequence();
+            render_packedpicture();
+          }
+        } else {
+          if (bitrate_changed)
+            render_rate_control();
+          render_picture();
+          if (h264_packedheader && refresh_start()) {
+            render_packedsequence();
+            render_packedpicture();
+          }
+        }
+        if (low_latency) {
+          render_packedsei();
+          if (intra_refresh != VA_ENC_INTRA_REFRESH_NONE && current_frame_type == FRAME_P)
+            render_intra_refresh();
+        }
+        if (rois.n)
+          render_roi();
+        render_slice();
+        telemetry_add(&tm_frame, TELEMETRY_RENDER, tmp);
+
+        // end picture
+        tmp = telemetry_now();
+        va_status = vaEndPicture(va_dpy, context_id);
+        CHECK_VASTATUS(va_status, "vaEndPicture");;
+        telemetry_add(&tm_frame, TELEMETRY_END, tmp);
+
+        // store to file
+    } while (storage_task(current_frame_display, current_frame_encoding) == -1);
+    return 0;
+}
 
-    if (current_frame_type == FRAME_IDR) {
-      numShortTerm = 0;
-      current_frame_num = 0;
-      current_IDR_display = current_frame_display;
+// -----------------------------------------------------------------------------
+//  VA-API backend
+// -----------------------------------------------------------------------------
+static int va_backend_init(void)
+{
+    init_va();
+    setup_encode();
+
+    if (!roi_va_regions && rc_mode != VA_RC_CQP && (rois.n || access(rois.fn, F_OK) == 0))
+        printf("Regions of interest need VA ROI support or --rcmode CQP, they are ignored\n");
+    return 0;
+}
+
+static int va_backend_release(void)
+{
+    release_encode();
+    deinit_va();
+    return 0;
+}
+
+static const struct encoder_backend va_backend = {
+    "va", va_backend_init, va_encode_picture, va_backend_release
+};
+
+// -----------------------------------------------------------------------------
+//  Software backend
+//  Headers are built by the same code as the VA packed headers, the
+//  macroblock layer comes from h264soft.c.
+// -----------------------------------------------------------------------------
+static int sw_backend_init(void)
+{
+    int mbs = (frame_width_mbaligned / 16) * (frame_height_mbaligned / 16);
+
+    if (h264_profile != ~0 && h264_profile != VAProfileH264ConstrainedBaseline)
+        printf("Software encoder only supports Constrained Baseline profile\n");
+    printf("Use profile VAProfileH264ConstrainedBaseline\n");
+    h264_profile = VAProfileH264ConstrainedBaseline;
+    constraint_set_flag |= (1 << 0 | 1 << 1); /* Annex A.2.1 & A.2.2 */
+    ip_period = 1;
+    h264_entropy_mode = ENTROPY_MODE_CAVLC;
+    pic_param.pic_fields.bits.transform_8x8_mode_flag = 0;
+    /* reconstructed pictures are not filtered */
+    slice_param.disable_deblocking_filter_idc = 1;
+
+    if (rc_mode == -1 || !(rc_mode & (VA_RC_CBR | VA_RC_VBR | VA_RC_CQP))) {
+        if (rc_mode != -1)
+            printf("Warning: Don't support the specified RateControl mode: %s!!!, switch to ", rc_to_string(rc_mode));
+        rc_mode = VA_RC_VBR;
+        printf("RateControl mode: %s\n", rc_to_string(rc_mode));
     }
+    sw_qp = initial_qp;
+
+    sw_enc = h264soft_create(frame_width, frame_height);
+    /* worst case macroblock is far below 1600 bytes with CAVLC */
+    sw_slice_dwords = (mbs * 1600 + 4096) / 4;
+    sw_slice_data = malloc(sw_slice_dwords * 4);
+    /* room for SPS, PPS and emulation prevention bytes */
+    sw_frame_data = malloc(sw_slice_dwords * 6 + 2 * PACKED_HEADER_DWORDS * 4);
+    if (!sw_enc || !sw_slice_data || !sw_frame_data) {
+        fprintf(stderr, "memory allocation error.\n");
+        exit(1);
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Frame level rate control for the software backend. QP moves one step per
+//  frame while the virtual buffer drifts away from its target, the buffer
+//  holds one second of stream with CBR and two with VBR, or the HRD buffer
+//  in low latency mode.
+// -----------------------------------------------------------------------------
+static void sw_rate_control(unsigned int bits)
+{
+    long long window = low_latency ? cpb_size() :
+                       (long long)frame_bitrate * (rc_mode == VA_RC_CBR ? 1 : 2);
+    long long target = frame_bitrate / frame_rate;
+
+    if (rc_mode == VA_RC_CQP)
+        return;
 
-    // begin picture
-    tmp = GetTickCount();
-    va_status = vaBeginPicture(va_dpy, context_id, src_surface[current_slot]);
-    CHECK_VASTATUS(va_status, "vaBeginPicture");
-    BeginPictureTicks += GetTickCount() - tmp;
+    sw_rc_fullness += bits - target;
+    sw_rc_fullness = MAX(-window, MIN(window, sw_rc_fullness));
+
+    if (sw_rc_fullness > window / 8 && bits > target)
+        sw_qp++;
+    else if (sw_rc_fullness < -window / 8 && bits < target)
+        sw_qp--;
+    sw_qp = MAX(MAX(minimal_qp, 1), MIN(51, sw_qp));
+}
+
+static int sw_encode_picture(void)
+{
+    bitstream bs;
+    unsigned char *header;
+    unsigned long long tmp;
+    unsigned int size = 0, len = 0;
+    int bits, i;
+
+    // load image
+    tmp = telemetry_now();
+    h264soft_load_nv12(sw_enc, nv12, nv12 + frame_width * frame_height, frame_width, frame_height);
+    h264soft_set_qp_delta(sw_enc, roi_qp_map);
+    telemetry_add(&tm_frame, TELEMETRY_UPLOAD, tmp);
 
     // encode image
-    tmp = GetTickCount();
+    tmp = telemetry_now();
     if (current_frame_type == FRAME_IDR) {
-      render_sequence();
-      render_picture();
-      if (h264_packedheader) {
-        render_packedsequence();
-        render_packedpicture();
-      }
+        fill_sequence();
+        fill_picture();
     } else {
-      render_picture();
+        fill_picture();
+    }
+    if (current_frame_type == FRAME_IDR || refresh_start()) {
+        bits = build_packed_seq_buffer(&header);
+        len += bitstream_copy_nal(sw_frame_data + len, header, bits);
+        bits = build_packed_pic_buffer(&header);
+        len += bitstream_copy_nal(sw_frame_data + len, header, bits);
     }
-    render_slice();
-    RenderPictureTicks += GetTickCount() - tmp;
+    if (low_latency) {
+        bits = build_packed_sei_buffer(&header, refresh_start());
+        len += bitstream_copy_nal(sw_frame_data + len, header, bits);
+    }
+    fill_slice();
+    slice_param.slice_qp_delta = sw_qp - pic_param.pic_init_qp;
+
+    for (i = 0; i < frame_slices; i++) {
+        slice_range(i);
+        bitstream_init(&bs, sw_slice_data, sw_slice_dwords);
+        slice_nal_header(&bs);
+        slice_header(&bs);
+        h264soft_encode_slice(sw_enc, &bs, slice_param.slice_type, sw_qp,
+                              slice_param.macroblock_address, slice_param.num_macroblocks);
+        rbsp_trailing_bits(&bs);
+        bitstream_end(&bs);
+        len += bitstream_copy_nal(sw_frame_data + len, (unsigned char *)sw_slice_data, bs.bit_offset);
+
+        /* slices are stored as soon as they are coded, the reader can send
+           the top of the picture while the rest is being encoded */
+        mux_write(&mux, sw_frame_data, len);
+        size += len;
+        len = 0;
+    }
+
+    h264soft_end_picture(sw_enc);
+    sw_rate_control(size * 8);
+    telemetry_add(&tm_frame, TELEMETRY_RENDER, tmp);
+
+    frame_size += size;
+    print_progress(current_frame_encoding, size);
+
+    return 0;
+}
 
-    // end picture
-    tmp = GetTickCount();
-    va_status = vaEndPicture(va_dpy, context_id);
-    CHECK_VASTATUS(va_status, "vaEndPicture");;
-    EndPictureTicks += GetTickCount() - tmp;
+static int sw_backend_release(void)
+{
+    h264soft_destroy(sw_enc);
+    free(sw_slice_data);
+    free(sw_frame_data);
+    return 0;
+}
+
+static const struct encoder_backend sw_backend = {
+    "sw", sw_backend_init, sw_encode_picture, sw_backend_release
+};
+
+// -----------------------------------------------------------------------------
+//  Null backend
+//  Everything but the hardware runs: the picture is copied as if uploaded,
+//  headers are built as packed headers, then the slices get a header and
+//  filler bytes of the size a picture of its type takes at the bitrate, and
+//  are stored after the simulated encode time. The stream is not decodable.
+// -----------------------------------------------------------------------------
+static int null_backend_init(void)
+{
+    int mbs = (frame_width_mbaligned / 16) * (frame_height_mbaligned / 16);
+
+    switch (h264_profile) {
+    case VAProfileH264ConstrainedBaseline:
+        constraint_set_flag |= (1 << 0 | 1 << 1); /* Annex A.2.2 */
+        ip_period = 1;
+        break;
+    case VAProfileH264Main:
+        constraint_set_flag |= (1 << 1); /* Annex A.2.2 */
+        break;
+    default:
+        h264_profile = VAProfileH264High;
+        constraint_set_flag |= (1 << 3); /* Annex A.2.4 */
+        break;
+    }
+    if (rc_mode == -1)
+        rc_mode = VA_RC_VBR;
+    if (null_delay < 0)
+        null_delay = (long long)frame_width * frame_height * 5000 / (1920 * 1080);
+    printf("Simulated encode time %d us per picture\n", null_delay);
+
+    null_surface = malloc(frame_width * frame_height * 3 / 2);
+    /* same worst case as the VA coded buffers */
+    null_slice_dwords = (mbs * 400 + 4096) / 4;
+    null_slice_data = malloc(null_slice_dwords * 4);
+    null_frame_data = malloc(null_slice_dwords * 6 + 3 * PACKED_HEADER_DWORDS * 4);
+    if (!null_surface || !null_slice_data || !null_frame_data) {
+        fprintf(stderr, "memory allocation error.\n");
+        exit(1);
+    }
+    return 0;
+}
+
+static int null_encode_picture(void)
+{
+    unsigned long long tmp, now, done;
+    unsigned char *header;
+    unsigned int size, len = 0;
+    struct timespec ts;
+    bitstream bs;
+    int bits, i, n;
+
+    // load image
+    tmp = telemetry_now();
+    memcpy(null_surface, nv12, frame_width * frame_height * 3 / 2);
+    telemetry_add(&tm_frame, TELEMETRY_UPLOAD, tmp);
+
+    // encode image: a P picture at the mean size of the bitrate, an intra
+    // picture four times as large and a B picture half of it
+    tmp = telemetry_now();
+    if (current_frame_type == FRAME_IDR)
+        fill_sequence();
+    fill_picture();
+    if (current_frame_type == FRAME_IDR || refresh_start()) {
+        bits = build_packed_seq_buffer(&header);
+        len += bitstream_copy_nal(null_frame_data + len, header, bits);
+        bits = build_packed_pic_buffer(&header);
+        len += bitstream_copy_nal(null_frame_data + len, header, bits);
+    }
+    if (low_latency) {
+        bits = build_packed_sei_buffer(&header, refresh_start());
+        len += bitstream_copy_nal(null_frame_data + len, header, bits);
+    }
+    fill_slice();
+
+    size = frame_bitrate / 8 / frame_rate;
+    if (current_frame_type == FRAME_IDR || current_frame_type == FRAME_I)
+        size *= 4;
+    else if (current_frame_type == FRAME_B)
+        size /= 2;
+    /* the cap is for the whole picture, null_frame_data holds one */
+    size = MIN(size, (null_slice_dwords - PACKED_HEADER_DWORDS) * 4) / frame_slices;
+
+    for (i = 0; i < frame_slices; i++) {
+        slice_range(i);
+        bitstream_init(&bs, null_slice_data, null_slice_dwords);
+        slice_nal_header(&bs);
+        slice_header(&bs);
+        for (n = 0; n < size; n++)
+            bitstream_put_ui(&bs, 0xaa, 8);
+        rbsp_trailing_bits(&bs);
+        bitstream_end(&bs);
+        len += bitstream_copy_nal(null_frame_data + len, (unsigned char *)null_slice_data, bs.bit_offset);
+    }
+    telemetry_add(&tm_frame, TELEMETRY_RENDER, tmp);
+
+    // wait for the simulated hardware
+    tmp = telemetry_now();
+    done = tmp + null_delay * 1000ULL;
+    for (now = tmp; now < done; now = telemetry_now()) {
+        ts.tv_sec = (done - now) / 1000000000ULL;
+        ts.tv_nsec = (done - now) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+    telemetry_add(&tm_frame, TELEMETRY_SYNC, tmp);
 
     // store to file
-    storage_task(current_frame_display, current_frame_encoding);
-    
-    update_ReferenceFrames();
-  }
-  return 0;
+    tmp = telemetry_now();
+    size = mux_write(&mux, null_frame_data, len);
+    frame_size += size;
+    print_progress(current_frame_encoding, size);
+    telemetry_add(&tm_frame, TELEMETRY_SAVE, tmp);
+
+    return 0;
 }
 
+static int null_backend_release(void)
+{
+    free(null_surface);
+    free(null_slice_data);
+    free(null_frame_data);
+    return 0;
+}
+
+static const struct encoder_backend null_backend = {
+    "null", null_backend_init, null_encode_picture, null_backend_release
+};
 
 // -----------------------------------------------------------------------------
-//  Free encoder VA ressources
+//  Static picture: a non reference P picture made of P_Skip macroblocks
+//  repeats the previous one without running the encoder. It is CAVLC coded,
+//  CABAC streams get a second PPS for it.
 // -----------------------------------------------------------------------------
-static int release_encode()
+static int write_skip_picture(void)
 {
+    unsigned char nal[PACKED_HEADER_DWORDS * 6];
+    int entropy_mode = pic_param.pic_fields.bits.entropy_coding_mode_flag;
+    unsigned int size = 0;
+    bitstream bs;
     int i;
 
-    vaDestroySurfaces(va_dpy, &src_surface[0], SURFACE_NUM);
-    vaDestroySurfaces(va_dpy, &ref_surface[0], SURFACE_NUM);
+    fill_picture();
+    fill_slice();
 
-    for (i = 0; i < SURFACE_NUM; i++)
-        vaDestroyBuffer(va_dpy, coded_buf[i]);
+    if (entropy_mode) {
+        pic_param.pic_fields.bits.entropy_coding_mode_flag = 0;
+        pic_param.pic_parameter_set_id = 1;
+        slice_param.pic_parameter_set_id = 1;
 
-    vaDestroyContext(va_dpy, context_id);
-    vaDestroyConfig(va_dpy, config_id);
+        bitstream_init(&bs, packedslice_data, PACKED_HEADER_DWORDS);
+        nal_start_code_prefix(&bs);
+        nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
+        pps_rbsp(&bs);
+        bitstream_end(&bs);
+        size += mux_write(&mux, nal, bitstream_copy_nal(nal, (unsigned char *)packedslice_data, bs.bit_offset));
+    }
+
+    for (i = 0; i < frame_slices; i++) {
+        slice_range(i);
+        bitstream_init(&bs, packedslice_data, PACKED_HEADER_DWORDS);
+        slice_nal_header(&bs);
+        slice_header(&bs);
+        bitstream_put_ue(&bs, slice_param.num_macroblocks);     /* mb_skip_run */
+        rbsp_trailing_bits(&bs);
+        bitstream_end(&bs);
+        size += mux_write(&mux, nal, bitstream_copy_nal(nal, (unsigned char *)packedslice_data, bs.bit_offset));
+    }
+
+    pic_param.pic_fields.bits.entropy_coding_mode_flag = entropy_mode;
+    pic_param.pic_parameter_set_id = 0;
+    slice_param.pic_parameter_set_id = 0;
+
+    if (sw_enc)
+        sw_rate_control(size * 8);
+    frame_size += size;
+    print_progress(current_frame_encoding, size);
 
     return 0;
 }
 
 // -----------------------------------------------------------------------------
-//  Stops VA
+//  Content analysis of the converted picture, may turn a P picture into a
+//  scene cut IDR or a skipped static picture. B pictures are not reordered
+//  around it, so it only runs with ip_period 1.
 // -----------------------------------------------------------------------------
-static int deinit_va()
+static void analyse_picture(void)
 {
-    vaTerminate(va_dpy);
-    va_close_display_drm(va_dpy);
+    unsigned long long tmp = telemetry_now();
+
+    static_skip = 0;
+    scene_analyse(&scene, nv12, frame_width);
+
+    if (current_frame_type == FRAME_P && scenecut > 0 && scene.mean >= scenecut &&
+        current_frame_display - current_IDR_display >= frame_rate / 4) {
+        /* a new GOP starts, the next periodic IDR comes a full period later */
+        gop_start = current_frame_encoding;
+        encoding2display_order(0, intra_period, intra_idr_period, ip_period,
+                               &current_frame_display, &current_frame_type);
+        current_frame_display += gop_start;
+        scene_cuts++;
+    } else if (current_frame_type == FRAME_P && skip_static && !refresh_cycle &&
+               scene.max <= STATIC_MAX_DIFF && static_run < MIN(frame_rate, MaxPicOrderCntLsb / 2 - 1) &&
+               scene_static(&scene, nv12, frame_width, STATIC_MAX_DIFF, STATIC_MAX_SAD)) {
+        /* the block sums are only a first filter, the pixels decide. The run
+         * is limited since POC is derived from the previous reference */
+        static_skip = 1;
+        static_run++;
+        static_frames++;
+    }
+
+    if (!static_skip) {
+        static_run = 0;
+        scene_keep(&scene, nv12, frame_width);
+    }
+    telemetry_add(&tm_frame, TELEMETRY_ANALYSE, tmp);
+}
+
+// -----------------------------------------------------------------------------
+//  Frame number of the signalled frame: returns the number of frames missed
+//  since the last one, -1 if it was already taken
+// -----------------------------------------------------------------------------
+static int check_frame(void)
+{
+    uint64_t seq, time;
+    int gap = 0;
+
+    if (frameinfo_read(frame_info, &seq, &time) == -1) {
+        frame_time = 0;
+        return 0;
+    }
+    if (seq == frame_seq) {
+        frames_duplicated++;
+        return -1;
+    }
+    /* a lower number is a restart of the source */
+    if (frame_seq && seq > frame_seq)
+        gap = (int)MIN(seq - frame_seq - 1, 0x7fffffffULL);
+    frame_seq = seq;
+    frame_time = time;
+    frames_dropped += gap;
+    return gap;
+}
+
+// -----------------------------------------------------------------------------
+//  A missed frame: the previous picture is repeated by a skipped picture when
+//  possible, otherwise the last converted image is encoded again
+// -----------------------------------------------------------------------------
+static void repeat_picture(void)
+{
+    static_skip = (current_frame_type == FRAME_P && ip_period == 1 && !refresh_cycle &&
+                   static_run < MIN(frame_rate, MaxPicOrderCntLsb / 2 - 1));
+    if (static_skip)
+        static_run++;
+    else
+        static_run = 0;
+    frames_repeated++;
+}
+
+// -----------------------------------------------------------------------------
+//  Low latency mode: the P pictures of a refresh cycle are partly intra coded
+//  instead of sending periodic IDR pictures. The driver rolling intra refresh
+//  is used when available, otherwise one slice of each P picture is intra.
+// -----------------------------------------------------------------------------
+static void setup_intra_refresh(void)
+{
+    int units;
+
+    if (!low_latency)
+        return;
+
+    if (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_COLUMN)
+        units = frame_width_mbaligned / 16;
+    else if (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_ROW)
+        units = frame_height_mbaligned / 16;
+    else
+        units = frame_slices;
+    if (units < 2) {
+        printf("Intra refresh needs several slices, keeping periodic IDR pictures\n");
+        return;
+    }
+
+    /* rolling refresh covers the picture in about one second */
+    refresh_size = (intra_refresh == VA_ENC_INTRA_REFRESH_NONE) ? 1 : (units + frame_rate - 1) / frame_rate;
+    refresh_cycle = (units + refresh_size - 1) / refresh_size;
+    intra_period = 0;
+    intra_idr_period = 0;
+
+    printf("Intra refresh by %s, the picture is refreshed every %d frames\n",
+           (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_COLUMN) ? "columns" :
+           (intra_refresh == VA_ENC_INTRA_REFRESH_ROLLING_ROW) ? "rows" : "slices",
+           refresh_cycle);
+}
+
+// -----------------------------------------------------------------------------
+//  Encode the frame signalled as current_frame_encoding
+// -----------------------------------------------------------------------------
+static void encode_frame (const struct encoder_backend *backend)
+{
+    unsigned long long tmp;
+    double coded = frame_size;
+    struct timeval tv;
+    int type;
+
+    telemetry_begin(&tm_frame, current_frame_encoding);
+    if (frame_time) {
+        /* repeats take the times of the frames missed */
+        capture_time = frame_time - repeating * 1000000ULL / frame_rate;
+    } else {
+        gettimeofday(&tv, NULL);
+        capture_time = tv.tv_sec * 1000000ULL + tv.tv_usec;
+    }
+
+    if (roi_update(&rois))
+        roi_map(&rois, 16, frame_width_mbaligned / 16, frame_height_mbaligned / 16, roi_qp_map);
+
+    // process image
+    tmp = telemetry_now();
+    if (!srcyuv_nv12 && !repeating)
+        tfnv12 (frame_width, frame_height, srcyuv_ptr, nv12, nv12 + frame_width*frame_height);
+    telemetry_add(&tm_frame, TELEMETRY_CONVERT, tmp);
+
+    // compute this frame type
+    encoding2display_order(current_frame_encoding - gop_start, intra_period, intra_idr_period, ip_period,
+                           &current_frame_display, &current_frame_type);
+    current_frame_display += gop_start;
+    if (repeating)
+        repeat_picture();
+    else if (ip_period == 1 && (scenecut > 0 || skip_static))
+        analyse_picture();
+
+    if (current_frame_type == FRAME_IDR) {
+        numShortTerm = 0;
+        current_frame_num = 0;
+        current_IDR_display = current_frame_display;
+    }
+
+    if (static_skip)
+        write_skip_picture();
+    else
+        backend->encode_picture();
+    /* B pictures are presented up to ip_period - 1 frames after decoding */
+    tmp = telemetry_now();
+    mux_picture(&mux, capture_time, current_frame_display - current_frame_encoding + ip_period - 1,
+                current_frame_type == FRAME_IDR);
+    telemetry_add(&tm_frame, TELEMETRY_SAVE, tmp);
+
+    type = static_skip ? TELEMETRY_SKIP :
+           (current_frame_type == FRAME_IDR) ? TELEMETRY_IDR :
+           (current_frame_type == FRAME_I) ? TELEMETRY_I :
+           (current_frame_type == FRAME_B) ? TELEMETRY_B : TELEMETRY_P;
+    telemetry_end(&tm, &tm_frame, type, (unsigned int)(frame_size - coded));
+
+    update_ReferenceFrames();
+    frame_coded++;
+}
+
+// -----------------------------------------------------------------------------
+//  Encode the signalled frame after the frames missed before it, at most one
+//  second of them, so that the stream keeps the cadence of the source
+// -----------------------------------------------------------------------------
+static void encode_signalled (const struct encoder_backend *backend, int gap)
+{
+  // nothing to repeat before the first picture
+  if (current_frame_encoding == 0)
+    gap = 0;
+  for (repeating = MIN(gap, frame_rate); repeating > 0; repeating--) {
+    encode_frame (backend);
+    if (++current_frame_encoding == frame_count) {
+      repeating = 0;
+      return;
+    }
+  }
+  encode_frame (backend);
+  current_frame_encoding++;
+}
+
+// -----------------------------------------------------------------------------
+//  Commands are words separated by blanks, returns their number
+// -----------------------------------------------------------------------------
+static int split_command (char *line, char **argv, int max)
+{
+    int argc = 0;
+
+    while (argc < max && (argv[argc] = strtok(argc ? NULL : line, " \t")) != NULL)
+        argc++;
+    return argc;
+}
+
+// -----------------------------------------------------------------------------
+//  Bitrate changes, from the streamer forwarding its receiver reports or from
+//  the command socket of the service. Returns 0 if the command is not one
+//  of them. The VA driver gets the new bitrate with the next picture, the
+//  software backends use it at once.
+// -----------------------------------------------------------------------------
+static int rate_command (struct control_s *ctl, int argc, char **argv)
+{
+    long long rate = feedback_command(&feedback, argc, argv);
+
+    if (rate == 0)
+        return 0;
+    if (rate < 0) {
+        control_reply(ctl, "error bad arguments");
+    } else if (rc_mode == VA_RC_CQP) {
+        control_reply(ctl, "error constant QP");
+    } else {
+        if (rate != frame_bitrate) {
+            printf("\nBitrate %lld kbps (loss %.1f%%, jitter %.0f ms)\n",
+                   rate / 1000, feedback.loss * 100, feedback.jitter);
+            frame_bitrate = rate;
+            bitrate_changed = 1;
+        }
+        control_reply(ctl, "ok %lld", rate);
+    }
+    return 1;
+}
+
+static void poll_feedback (void)
+{
+    char *line, *argv[4];
+    int argc;
+
+    if (feedback_fn == NULL)
+        return;
+    control_wait(&feedback_ctl, 0);
+    while ((line = control_line(&feedback_ctl)) != NULL) {
+        argc = split_command(line, argv, 4);
+        if (argc && !rate_command(&feedback_ctl, argc, argv))
+            control_reply(&feedback_ctl, "error unknown command");
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  Encoding loop
+// -----------------------------------------------------------------------------
+static int encode_loop (const struct encoder_backend *backend)
+{
+  int gap = 0;
+
+  current_frame_encoding = 0;
+  while (current_frame_encoding < frame_count) {
+    // wait for an image to be ready, a frame signalled twice is taken once
+    do {
+      waitforimage ();
+    } while (!_done && (gap = check_frame ()) < 0);
+    if (_done) break;
+
+    poll_feedback ();
+
+    encode_signalled (backend, gap);
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Encoder service: VA context, surfaces and headers are set up once, then
+//  recordings start on the frame following the command. Commands are
+//    record start <file> ?frames?   record until stopped or for some frames
+//    record split <file>            go on in a new file, starting with an IDR
+//    record stop
+//    status
+//    quit
+// -----------------------------------------------------------------------------
+static int record_open (const char *fn, unsigned int frames)
+{
+    struct mux_s next;
+
+    if (mux_open(&next, fn, mux_forced, MUX_H264, frame_width, frame_height, frame_rate) == -1)
+        return -1;
+    mux_close(&mux);
+    mux = next;
+    free(coded_fn);
+    coded_fn = strdup(fn);
+
+    /* a new sequence starting with an IDR picture */
+    current_frame_encoding = 0;
+    gop_start = 0;
+    static_run = 0;
+    scene.valid = 0;
+    frame_count = frames ? frames : ~0U;
+    return 0;
+}
+
+static void record_close (void)
+{
+    if (mux.fp) {
+        mux_close(&mux);
+        printf("\nRecorded %lld frames in %s\n", current_frame_encoding, coded_fn);
+    }
+}
+
+static void daemon_command (struct control_s *ctl, char *line)
+{
+    char *argv[4];
+    int argc = split_command(line, argv, 4);
+
+    if (argc == 0)
+        return;
+
+    if (argc >= 3 && !strcmp(argv[0], "record") && !strcmp(argv[1], "start")) {
+        if (mux.fp)
+            control_reply(ctl, "error already recording %s", coded_fn);
+        else if (record_open(argv[2], argc == 4 ? atoi(argv[3]) : 0) == -1)
+            control_reply(ctl, "error %s: %s", argv[2], strerror(errno));
+        else
+            control_reply(ctl, "ok");
+    } else if (argc == 3 && !strcmp(argv[0], "record") && !strcmp(argv[1], "split")) {
+        unsigned long long n = current_frame_encoding;
+
+        if (!mux.fp)
+            control_reply(ctl, "error not recording");
+        else if (record_open(argv[2], 0) == -1)
+            control_reply(ctl, "error %s: %s", argv[2], strerror(errno));
+        else
+            control_reply(ctl, "ok %lld", n);
+    } else if (argc == 2 && !strcmp(argv[0], "record") && !strcmp(argv[1], "stop")) {
+        if (!mux.fp) {
+            control_reply(ctl, "error not recording");
+        } else {
+            control_reply(ctl, "ok %lld", current_frame_encoding);
+            record_close();
+        }
+    } else if (argc == 1 && !strcmp(argv[0], "status")) {
+        if (mux.fp)
+            control_reply(ctl, "recording %s %lld", coded_fn, current_frame_encoding);
+        else
+            control_reply(ctl, "idle");
+    } else if (argc == 1 && !strcmp(argv[0], "quit")) {
+        control_reply(ctl, "ok");
+        _done = 1;
+    } else if (!rate_command(ctl, argc, argv)) {
+        control_reply(ctl, "error unknown command");
+    }
+}
+
+static int daemon_loop (const struct encoder_backend *backend)
+{
+    struct control_s ctl;
+    sigset_t set, orig;
+    char *line;
+    int gap;
+
+    if (control_open(&ctl, control_fn) == -1) {
+        printf("Can't listen on %s: %s\n", control_fn, strerror(errno));
+        return -1;
+    }
+    printf("Waiting for commands on %s\n", control_fn);
+
+    // the signals are only let in while waiting, one coming while a command
+    // or a frame is handled is pending until then and cuts the wait short
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, &orig);
+
+    while (!_done) {
+        control_pwait(&ctl, 500, &orig);
+        while ((line = control_line(&ctl)) != NULL)
+            daemon_command(&ctl, line);
+        poll_feedback();
+        if (_sigusr2)
+            export_telemetry();
+
+        // frames are only converted and encoded while recording, they are
+        // numbered all along so that a recording does not start with a gap
+        if (!_sigusr1)
+            continue;
+        _sigusr1 = 0;
+        gap = check_frame();
+        if (mux.fp == NULL || gap < 0)
+            continue;
+
+        encode_signalled(backend, gap);
+        if (current_frame_encoding >= frame_count)
+            record_close();
+    }
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+
+    record_close();
+    control_close(&ctl);
     return 0;
 }
 
@@ -1940,13 +3357,17 @@ static int print_input()
     printf("INPUT: FrameRate    : %d\n", frame_rate);
     printf("INPUT: Bitrate      : %d\n", frame_bitrate);
     printf("INPUT: Slices       : %d\n", frame_slices);
+    printf("INPUT: LowLatency   : %s\n", low_latency ? "yes" : "no");
+    printf("INPUT: ROI          : %d regions, metadata %s\n", rois.n, rois.fn);
+    printf("INPUT: SceneCut     : %d, skip static %s\n", scenecut, skip_static ? "yes" : "no");
     printf("INPUT: IntraPeriod  : %d\n", intra_period);
     printf("INPUT: IDRPeriod    : %d\n", intra_idr_period);
     printf("INPUT: IpPeriod     : %d\n", ip_period);
     printf("INPUT: Initial QP   : %d\n", initial_qp);
     printf("INPUT: Min QP       : %d\n", minimal_qp);
     printf("INPUT: Source YUV   : %s (fourcc %s)\n", srcyuv_fn, fourcc_to_string(srcyuv_fourcc));
-    printf("INPUT: Coded Clip   : %s\n", coded_fn);
+    printf("INPUT: Coded Clip   : %s (%s)\n", coded_fn, mux_name(mux_format(coded_fn, mux_forced)));
+    printf("INPUT: Telemetry    : %s\n", telemetry_fn ? telemetry_fn : "none");
 
     printf("\n\n"); /* return back to startpoint */
 
@@ -1956,14 +3377,25 @@ static int print_input()
 // -----------------------------------------------------------------------------
 //  Dump statistics
 // -----------------------------------------------------------------------------
-static int print_performance(unsigned int PictureCount)
+static void print_stage(const char *name, int stage, unsigned int PictureCount)
 {
-    unsigned int others = 0;
-    double total_size = frame_width * frame_height * 1.5 * frame_count;
+    double ms = tm.stage[stage].sum / 1e6;
 
+    printf("PERFORMANCE:     %-19s: %.1f ms (%.3f, %.2f%% percent, p99 %.3f ms)\n",
+           name, ms, ms / PictureCount, ms / TotalTicks / 0.01,
+           telemetry_percentile(&tm.stage[stage], 99) / 1e6);
+}
+
+static int print_performance(unsigned int PictureCount)
+{
+    double others = TotalTicks;
+    double total_size = frame_width * frame_height * 1.5 * PictureCount;
+    int i;
 
-    others = TotalTicks - UploadPictureTicks - BeginPictureTicks
-             - RenderPictureTicks - EndPictureTicks - SyncPictureTicks - SavePictureTicks;
+    if (PictureCount == 0 || TotalTicks == 0)
+        return 0;
+    for (i = 0; i < TELEMETRY_STAGES; i++)
+        others -= tm.stage[i].sum / 1e6;
 
     printf("\n\n");
 
@@ -1972,30 +3404,31 @@ static int print_performance(unsigned int PictureCount)
            TotalTicks, ((double)  TotalTicks) / (double) PictureCount);
     printf("PERFORMANCE:   Compression ratio    : %d:1\n", (unsigned int)(total_size / frame_size));
 
-    printf("PERFORMANCE:     Processing         : %d ms (%.2f, %.2f%% percent)\n",
-           (int) ProcessPictureTicks, ((double)  ProcessPictureTicks) / (double) PictureCount,
-           ProcessPictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     UploadPicture      : %d ms (%.2f, %.2f%% percent)\n",
-           (int) UploadPictureTicks, ((double)  UploadPictureTicks) / (double) PictureCount,
-           UploadPictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     vaBeginPicture     : %d ms (%.2f, %.2f%% percent)\n",
-           (int) BeginPictureTicks, ((double)  BeginPictureTicks) / (double) PictureCount,
-           BeginPictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     vaRenderHeader     : %d ms (%.2f, %.2f%% percent)\n",
-           (int) RenderPictureTicks, ((double)  RenderPictureTicks) / (double) PictureCount,
-           RenderPictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     vaEndPicture       : %d ms (%.2f, %.2f%% percent)\n",
-           (int) EndPictureTicks, ((double)  EndPictureTicks) / (double) PictureCount,
-           EndPictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     vaSyncSurface      : %d ms (%.2f, %.2f%% percent)\n",
-           (int) SyncPictureTicks, ((double) SyncPictureTicks) / (double) PictureCount,
-           SyncPictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     SavePicture        : %d ms (%.2f, %.2f%% percent)\n",
-           (int) SavePictureTicks, ((double)  SavePictureTicks) / (double) PictureCount,
-           SavePictureTicks / (double) TotalTicks / 0.01);
-    printf("PERFORMANCE:     Others             : %d ms (%.2f, %.2f%% percent)\n",
-           (int) others, ((double) others) / (double) PictureCount,
-           others / (double) TotalTicks / 0.01);
+    printf("PERFORMANCE:   Scene cuts           : %d IDR, %d static frames skipped\n",
+           scene_cuts, static_frames);
+    printf("PERFORMANCE:   Source frames        : %d dropped, %d repeated, %d signalled twice\n",
+           frames_dropped, frames_repeated, frames_duplicated);
+    printf("PERFORMANCE:   Frame latency        : p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           telemetry_percentile(&tm.total, 50) / 1e6, telemetry_percentile(&tm.total, 99) / 1e6,
+           tm.total.max / 1e6);
+    for (i = 0; i < TELEMETRY_TYPES; i++) {
+        if (tm.type[i].count == 0)
+            continue;
+        printf("PERFORMANCE:     %-5s frames        : %llu, %.3f ms, p99 %.3f ms, %llu bytes per frame\n",
+               telemetry_type_name[i], tm.type[i].count, tm.type[i].sum / 1e6 / tm.type[i].count,
+               telemetry_percentile(&tm.type[i], 99) / 1e6, tm.bytes[i] / tm.type[i].count);
+    }
+
+    print_stage("Processing", TELEMETRY_CONVERT, PictureCount);
+    print_stage("Analysis", TELEMETRY_ANALYSE, PictureCount);
+    print_stage("UploadPicture", TELEMETRY_UPLOAD, PictureCount);
+    print_stage("vaBeginPicture", TELEMETRY_BEGIN, PictureCount);
+    print_stage("vaRenderHeader", TELEMETRY_RENDER, PictureCount);
+    print_stage("vaEndPicture", TELEMETRY_END, PictureCount);
+    print_stage("vaSyncSurface", TELEMETRY_SYNC, PictureCount);
+    print_stage("SavePicture", TELEMETRY_SAVE, PictureCount);
+    printf("PERFORMANCE:     Others             : %.1f ms (%.3f, %.2f%% percent)\n",
+           others, others / PictureCount, others / TotalTicks / 0.01);
 
     return 0;
 }
@@ -2006,38 +3439,69 @@ static int print_performance(unsigned int PictureCount)
 // -----------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
+    const struct encoder_backend *backend;
     unsigned int start;
 
     process_cmdline(argc, argv);
 
     print_input();
 
-
-    init_va();
-    setup_encode();
+    if (backend_type == BACKEND_NULL) {
+        backend = &null_backend;
+    } else if (backend_type == BACKEND_SW ||
+        (backend_type == BACKEND_AUTO && !probe_va())) {
+        backend = &sw_backend;
+    } else {
+        backend = &va_backend;
+    }
+    printf("Using %s encoder backend\n", backend->name);
+    backend->init();
+    setup_intra_refresh();
+    telemetry_init(&tm, telemetry_fn);
+    feedback_init(&feedback, frame_bitrate);
+    if (feedback_fn && control_open(&feedback_ctl, feedback_fn) == -1) {
+        printf("Can't listen on %s: %s\n", feedback_fn, strerror(errno));
+        free(feedback_fn);
+        feedback_fn = NULL;
+    }
 
     signal (SIGUSR1, sigusr1);
+    signal (SIGUSR2, sigusr2);
     signal (SIGINT, sigint);
 
-    waitforimage ();
-    start = GetTickCount();
+    if (control_fn) {
+        start = GetTickCount();
+        daemon_loop(backend);
+    } else {
+        waitforimage ();
+        check_frame ();
+        start = GetTickCount();
+        encode_loop(backend);
+    }
 
-    encode_loop();
-    
-    release_encode();
-    deinit_va();
+    backend->release();
+    if (feedback_fn)
+        control_close(&feedback_ctl);
 
     TotalTicks += GetTickCount() - start;
-    print_performance(frame_count);
+    print_performance(frame_coded);
+    if (telemetry_fn)
+        export_telemetry();
+    telemetry_free(&tm);
 
     free(srcyuv_fn);
     free(coded_fn);
+    free(control_fn);
+    free(feedback_fn);
+    free(telemetry_fn);
+    free(rois.fn);
+    free(roi_qp_map);
+    scene_free(&scene);
 
     if (srcyuv_fp)
         fclose(srcyuv_fp);
 
-    if (coded_fp)
-        fclose(coded_fp);
+    mux_close(&mux);
 
     return 0;
 }
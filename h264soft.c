@@ -0,0 +1,1325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bitstream.h"
+#include "h264soft.h"
+
+#define PAD             32      /* reference planes are edge extended by PAD pixels */
+#define SEARCH_RANGE    16      /* full pel search range around the start point */
+#define MAX_MVY         256     /* keeps vertical vectors inside level limits */
+#define MAX_LEVEL       2047    /* keeps level_prefix <= 15 as Baseline requires */
+
+#define MB_I16x16       0
+#define MB_P16x16       1
+#define MB_PSKIP        2
+
+#define SLICE_TYPE_P    0
+#define SLICE_TYPE_I    2
+
+#define PRED_V          0
+#define PRED_H          1
+#define PRED_DC         2
+#define PRED_PLANE      3
+
+/* informations kept for every macroblock, used by the neighbours */
+typedef struct {
+    int slice;                  /* slice the macroblock belongs to */
+    int ref;                    /* refIdxL0, -1 for intra */
+    int mvx, mvy;               /* quarter pel */
+    uint8_t nz[16];             /* luma TotalCoeff per 4x4 block, raster order */
+    uint8_t nzc[2][4];          /* chroma AC TotalCoeff per 4x4 block */
+} mbinfo;
+
+/* macroblock decision and quantized levels */
+typedef struct {
+    int type;
+    int pred;                   /* Intra16x16PredMode */
+    int cbp;                    /* luma in bits 0-3, chroma in bits 4-5 */
+    int mvx, mvy;               /* quarter pel */
+    int pmx, pmy;               /* motion vector predictor */
+    int16_t dc[16];             /* Intra16x16DCLevel, zigzag order */
+    int16_t ac[16][16];         /* luma levels per 4x4 block (raster), zigzag order */
+    int16_t cdc[2][4];          /* chroma DC levels */
+    int16_t cac[2][4][16];      /* chroma AC levels, zigzag order */
+} mbcode;
+
+typedef struct {
+    uint8_t *base[3];
+    uint8_t *plane[3];          /* top left pixel, PAD pixels inside base */
+} picture;
+
+struct __h264soft {
+    int mbw, mbh;
+    int width, height;          /* coded size */
+    int stride[2];              /* luma and chroma stride of the pictures */
+    uint8_t *src[3];            /* source planes, not padded */
+    picture pic[2];
+    int cur;                    /* picture being reconstructed, the other one is the reference */
+    int has_ref;
+    int slice;
+    mbinfo *mb;
+    int8_t *qp_delta;           /* QP offset of each macroblock */
+};
+
+// -----------------------------------------------------------------------------
+//   Tables
+// -----------------------------------------------------------------------------
+static const uint8_t zigzag[16] = { 0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15 };
+
+/* luma4x4BlkIdx to block position */
+static const uint8_t blk_x[16] = { 0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3 };
+static const uint8_t blk_y[16] = { 0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 3, 3, 2, 2, 3, 3 };
+
+static const uint8_t chroma_qp[52] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 29, 30,
+    31, 32, 32, 33, 34, 34, 35, 35, 36, 36, 37, 37, 37, 38, 38, 38,
+    39, 39, 39, 39
+};
+
+/* lagrangian multiplier for SAD based decisions */
+static const uint8_t lambda_tab[52] = {
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+     1,  1,  1,  1,  2,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5,  6,
+     6,  7,  8,  9, 10, 11, 13, 14, 16, 18, 20, 23, 25, 29, 32, 36,
+    40, 45, 51, 57
+};
+
+static const uint16_t quant_mf[6][3] = {
+    { 13107, 5243, 8066 }, { 11916, 4660, 7490 }, { 10082, 4194, 6554 },
+    {  9362, 3647, 5825 }, {  8192, 3355, 5243 }, {  7282, 2893, 4559 }
+};
+
+static const uint8_t dequant_v[6][3] = {
+    { 10, 16, 13 }, { 11, 18, 14 }, { 13, 20, 16 },
+    { 14, 23, 18 }, { 16, 25, 20 }, { 18, 29, 23 }
+};
+
+/* codeNum of coded_block_pattern for inter macroblocks, Table 9-4 */
+static const uint8_t golomb_to_inter_cbp[48] = {
+     0, 16,  1,  2,  4,  8, 32,  3,  5, 10, 12, 15, 47,  7, 11, 13,
+    14,  6,  9, 31, 35, 37, 42, 44, 33, 34, 36, 40, 39, 43, 45, 46,
+    17, 18, 20, 24, 19, 21, 26, 28, 23, 27, 29, 30, 22, 25, 38, 41
+};
+
+/* coeff_token, Table 9-5, indexed by TotalCoeff * 4 + TrailingOnes */
+static const uint8_t coeff_token_len[3][17 * 4] = {
+    {  1,  0,  0,  0,  6,  2,  0,  0,  8,  6,  3,  0,  9,  8,  7,  5,
+      10,  9,  8,  6, 11, 10,  9,  7, 13, 11, 10,  8, 13, 13, 11,  9,
+      13, 13, 13, 10, 14, 14, 13, 11, 14, 14, 14, 13, 15, 15, 14, 14,
+      15, 15, 15, 14, 16, 15, 15, 15, 16, 16, 16, 15, 16, 16, 16, 16,
+      16, 16, 16, 16 },
+    {  2,  0,  0,  0,  6,  2,  0,  0,  6,  5,  3,  0,  7,  6,  6,  4,
+       8,  6,  6,  4,  8,  7,  7,  5,  9,  8,  8,  6, 11,  9,  9,  6,
+      11, 11, 11,  7, 12, 11, 11,  9, 12, 12, 12, 11, 12, 12, 12, 11,
+      13, 13, 13, 12, 13, 13, 13, 13, 13, 14, 13, 13, 14, 14, 14, 13,
+      14, 14, 14, 14 },
+    {  4,  0,  0,  0,  6,  4,  0,  0,  6,  5,  4,  0,  6,  5,  5,  4,
+       7,  5,  5,  4,  7,  5,  5,  4,  7,  6,  6,  4,  7,  6,  6,  4,
+       8,  7,  7,  5,  8,  8,  7,  6,  9,  8,  8,  7,  9,  9,  8,  8,
+       9,  9,  9,  8, 10,  9,  9,  9, 10, 10, 10, 10, 10, 10, 10, 10,
+      10, 10, 10, 10 }
+};
+
+static const uint8_t coeff_token_bits[3][17 * 4] = {
+    {  1,  0,  0,  0,  5,  1,  0,  0,  7,  4,  1,  0,  7,  6,  5,  3,
+       7,  6,  5,  3,  7,  6,  5,  4, 15,  6,  5,  4, 11, 14,  5,  4,
+       8, 10, 13,  4, 15, 14,  9,  4, 11, 10, 13, 12, 15, 14,  9, 12,
+      11, 10, 13,  8, 15,  1,  9, 12, 11, 14, 13,  8,  7, 10,  9, 12,
+       4,  6,  5,  8 },
+    {  3,  0,  0,  0, 11,  2,  0,  0,  7,  7,  3,  0,  7, 10,  9,  5,
+       7,  6,  5,  4,  4,  6,  5,  6,  7,  6,  5,  8, 15,  6,  5,  4,
+      11, 14, 13,  4, 15, 10,  9,  4, 11, 14, 13, 12,  8, 10,  9,  8,
+      15, 14, 13, 12, 11, 10,  9, 12,  7, 11,  6,  8,  9,  8, 10,  1,
+       7,  6,  5,  4 },
+    { 15,  0,  0,  0, 15, 14,  0,  0, 11, 15, 13,  0,  8, 12, 14, 12,
+      15, 10, 11, 11, 11,  8,  9, 10,  9, 14, 13,  9,  8, 10,  9,  8,
+      15, 14, 13, 13, 11, 14, 10, 12, 15, 10, 13, 12, 11, 14,  9, 12,
+       8, 10, 13,  8, 13,  7,  9, 12,  9, 12, 11, 10,  5,  8,  7,  6,
+       1,  4,  3,  2 }
+};
+
+static const uint8_t chroma_dc_coeff_token_len[5 * 4] = {
+    2, 0, 0, 0, 6, 1, 0, 0, 6, 6, 3, 0, 6, 7, 7, 6, 6, 8, 8, 7
+};
+
+static const uint8_t chroma_dc_coeff_token_bits[5 * 4] = {
+    1, 0, 0, 0, 7, 1, 0, 0, 4, 6, 1, 0, 3, 3, 2, 5, 2, 3, 2, 0
+};
+
+/* total_zeros, Tables 9-7 and 9-8, indexed by TotalCoeff - 1 */
+static const uint8_t total_zeros_len[15][16] = {
+    { 1, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 9 },
+    { 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6 },
+    { 4, 3, 3, 3, 4, 4, 3, 3, 4, 5, 5, 6, 5, 6 },
+    { 5, 3, 4, 4, 3, 3, 3, 4, 3, 4, 5, 5, 5 },
+    { 4, 4, 4, 3, 3, 3, 3, 3, 4, 5, 4, 5 },
+    { 6, 5, 3, 3, 3, 3, 3, 3, 4, 3, 6 },
+    { 6, 5, 3, 3, 3, 2, 3, 4, 3, 6 },
+    { 6, 4, 5, 3, 2, 2, 3, 3, 6 },
+    { 6, 6, 4, 2, 2, 3, 2, 5 },
+    { 5, 5, 3, 2, 2, 2, 4 },
+    { 4, 4, 3, 3, 1, 3 },
+    { 4, 4, 2, 1, 3 },
+    { 3, 3, 1, 2 },
+    { 2, 2, 1 },
+    { 1, 1 }
+};
+
+static const uint8_t total_zeros_bits[15][16] = {
+    { 1, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 1 },
+    { 7, 6, 5, 4, 3, 5, 4, 3, 2, 3, 2, 3, 2, 1, 0 },
+    { 5, 7, 6, 5, 4, 3, 4, 3, 2, 3, 2, 1, 1, 0 },
+    { 3, 7, 5, 4, 6, 5, 4, 3, 3, 2, 2, 1, 0 },
+    { 5, 4, 3, 7, 6, 5, 4, 3, 2, 1, 1, 0 },
+    { 1, 1, 7, 6, 5, 4, 3, 2, 1, 1, 0 },
+    { 1, 1, 5, 4, 3, 3, 2, 1, 1, 0 },
+    { 1, 1, 1, 3, 3, 2, 2, 1, 0 },
+    { 1, 0, 1, 3, 2, 1, 1, 1 },
+    { 1, 0, 1, 3, 2, 1, 1 },
+    { 0, 1, 1, 2, 1, 3 },
+    { 0, 1, 1, 1, 1 },
+    { 0, 1, 1, 1 },
+    { 0, 1, 1 },
+    { 0, 1 }
+};
+
+static const uint8_t chroma_dc_total_zeros_len[3][4] = {
+    { 1, 2, 3, 3 }, { 1, 2, 2 }, { 1, 1 }
+};
+
+static const uint8_t chroma_dc_total_zeros_bits[3][4] = {
+    { 1, 1, 1, 0 }, { 1, 1, 0 }, { 1, 0 }
+};
+
+/* run_before, Table 9-10, indexed by Min(zerosLeft, 7) - 1 */
+static const uint8_t run_before_len[7][15] = {
+    { 1, 1 },
+    { 1, 2, 2 },
+    { 2, 2, 2, 2 },
+    { 2, 2, 2, 3, 3 },
+    { 2, 2, 3, 3, 3, 3 },
+    { 2, 3, 3, 3, 3, 3, 3 },
+    { 3, 3, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9, 10, 11 }
+};
+
+static const uint8_t run_before_bits[7][15] = {
+    { 1, 0 },
+    { 1, 1, 0 },
+    { 3, 2, 1, 0 },
+    { 3, 2, 1, 1, 0 },
+    { 3, 2, 3, 2, 1, 0 },
+    { 3, 0, 1, 3, 2, 5, 4 },
+    { 7, 6, 5, 4, 3, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1 }
+};
+
+/* tables derived at first use */
+static int quant_mf4[6][16];
+static int dequant_v4[6][16];
+static uint8_t inter_cbp_to_golomb[48];
+
+// -----------------------------------------------------------------------------
+//   Fill the per coefficient quantization tables
+// -----------------------------------------------------------------------------
+static void init_tables(void)
+{
+    int q, i;
+
+    for (q = 0; q < 6; q++) {
+        for (i = 0; i < 16; i++) {
+            int x = i & 3, y = i >> 2;
+            int k = ((x | y) & 1) == 0 ? 0 : (x & y & 1) ? 1 : 2;
+
+            quant_mf4[q][i] = quant_mf[q][k];
+            dequant_v4[q][i] = dequant_v[q][k];
+        }
+    }
+
+    for (i = 0; i < 48; i++)
+        inter_cbp_to_golomb[golomb_to_inter_cbp[i]] = i;
+}
+
+static inline uint8_t clip_pixel(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline int clip3(int lo, int hi, int v)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static inline int median3(int a, int b, int c)
+{
+    int mn = a < b ? a : b, mx = a < b ? b : a;
+
+    return c < mn ? mn : c > mx ? mx : c;
+}
+
+/* length of the se(v) code of val */
+static inline int se_bits(int val)
+{
+    unsigned int k = val > 0 ? 2 * val - 1 : -2 * val;
+
+    return 2 * (31 - __builtin_clz(k + 1)) + 1;
+}
+
+// -----------------------------------------------------------------------------
+//   Sum of absolute differences of two 16x16 blocks
+// -----------------------------------------------------------------------------
+static int sad16x16(const uint8_t *a, int astride, const uint8_t *b, int bstride)
+{
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i * astride));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i * bstride));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, y));
+    }
+    return _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+#else
+    int i, j, sad = 0;
+
+    for (i = 0; i < 16; i++, a += astride, b += bstride)
+        for (j = 0; j < 16; j++)
+            sad += abs(a[j] - b[j]);
+    return sad;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+//   4x4 forward core transform of (src - pred), raster order output
+// -----------------------------------------------------------------------------
+static void fdct4(const uint8_t *src, int sstride, const uint8_t *pred, int pstride, int *w)
+{
+    int t[16], i;
+
+    for (i = 0; i < 4; i++, src += sstride, pred += pstride) {
+        int d0 = src[0] - pred[0], d1 = src[1] - pred[1];
+        int d2 = src[2] - pred[2], d3 = src[3] - pred[3];
+        int s03 = d0 + d3, d03 = d0 - d3, s12 = d1 + d2, d12 = d1 - d2;
+
+        t[4 * i + 0] = s03 + s12;
+        t[4 * i + 1] = 2 * d03 + d12;
+        t[4 * i + 2] = s03 - s12;
+        t[4 * i + 3] = d03 - 2 * d12;
+    }
+
+    for (i = 0; i < 4; i++) {
+        int s03 = t[i] + t[12 + i], d03 = t[i] - t[12 + i];
+        int s12 = t[4 + i] + t[8 + i], d12 = t[4 + i] - t[8 + i];
+
+        w[i] = s03 + s12;
+        w[4 + i] = 2 * d03 + d12;
+        w[8 + i] = s03 - s12;
+        w[12 + i] = d03 - 2 * d12;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   4x4 inverse transform (8.5.12.2), result added to pred and stored in dst
+// -----------------------------------------------------------------------------
+static void idct4_add(const int *d, const uint8_t *pred, int pstride, uint8_t *dst, int dstride)
+{
+    int t[16], i;
+
+    for (i = 0; i < 4; i++) {
+        const int *r = d + 4 * i;
+        int e0 = r[0] + r[2], e1 = r[0] - r[2];
+        int e2 = (r[1] >> 1) - r[3], e3 = r[1] + (r[3] >> 1);
+
+        t[4 * i + 0] = e0 + e3;
+        t[4 * i + 1] = e1 + e2;
+        t[4 * i + 2] = e1 - e2;
+        t[4 * i + 3] = e0 - e3;
+    }
+
+    for (i = 0; i < 4; i++) {
+        int e0 = t[i] + t[8 + i], e1 = t[i] - t[8 + i];
+        int e2 = (t[4 + i] >> 1) - t[12 + i], e3 = t[4 + i] + (t[12 + i] >> 1);
+
+        dst[i] = clip_pixel(pred[i] + ((e0 + e3 + 32) >> 6));
+        dst[dstride + i] = clip_pixel(pred[pstride + i] + ((e1 + e2 + 32) >> 6));
+        dst[2 * dstride + i] = clip_pixel(pred[2 * pstride + i] + ((e1 - e2 + 32) >> 6));
+        dst[3 * dstride + i] = clip_pixel(pred[3 * pstride + i] + ((e0 - e3 + 32) >> 6));
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   4x4 Hadamard transform, in place
+// -----------------------------------------------------------------------------
+static void hadamard4(int *d)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        int *r = d + 4 * i;
+        int s01 = r[0] + r[1], d01 = r[0] - r[1], s23 = r[2] + r[3], d23 = r[2] - r[3];
+
+        r[0] = s01 + s23;
+        r[1] = s01 - s23;
+        r[2] = d01 - d23;
+        r[3] = d01 + d23;
+    }
+
+    for (i = 0; i < 4; i++) {
+        int s01 = d[i] + d[4 + i], d01 = d[i] - d[4 + i];
+        int s23 = d[8 + i] + d[12 + i], d23 = d[8 + i] - d[12 + i];
+
+        d[i] = s01 + s23;
+        d[4 + i] = s01 - s23;
+        d[8 + i] = d01 - d23;
+        d[12 + i] = d01 + d23;
+    }
+}
+
+static inline int quant(int w, int mf, int f, int qbits)
+{
+    int l = ((w < 0 ? -w : w) * mf + f) >> qbits;
+
+    if (l > MAX_LEVEL)
+        l = MAX_LEVEL;
+    return w < 0 ? -l : l;
+}
+
+// -----------------------------------------------------------------------------
+//   Quantize a 4x4 block into zigzag order starting at coefficient 'start',
+//   and rebuild the dequantized coefficients in 'w'. Returns TotalCoeff.
+// -----------------------------------------------------------------------------
+static int quant4x4(int *w, int16_t *level, int start, int qp, int f)
+{
+    int qbits = 15 + qp / 6, shift = qp / 6;
+    const int *mf = quant_mf4[qp % 6], *v = dequant_v4[qp % 6];
+    int k, n = 0;
+
+    for (k = start; k < 16; k++) {
+        int i = zigzag[k];
+        int l = quant(w[i], mf[i], f, qbits);
+
+        level[k] = l;
+        w[i] = l * v[i] * (1 << shift);
+        n += (l != 0);
+    }
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+//   Intra16x16 luma prediction (8.3.3), pred is 16x16 with stride 16
+// -----------------------------------------------------------------------------
+static void intra16_pred(const uint8_t *rec, int stride, int mode, int left, int top, uint8_t *pred)
+{
+    int x, y, sum = 0;
+
+    switch (mode) {
+    case PRED_V:
+        for (y = 0; y < 16; y++)
+            memcpy(pred + 16 * y, rec - stride, 16);
+        break;
+
+    case PRED_H:
+        for (y = 0; y < 16; y++)
+            memset(pred + 16 * y, rec[y * stride - 1], 16);
+        break;
+
+    case PRED_DC:
+        if (top)
+            for (x = 0; x < 16; x++)
+                sum += rec[x - stride];
+        if (left)
+            for (y = 0; y < 16; y++)
+                sum += rec[y * stride - 1];
+        if (top && left)
+            sum = (sum + 16) >> 5;
+        else if (top || left)
+            sum = (sum + 8) >> 4;
+        else
+            sum = 128;
+        memset(pred, sum, 256);
+        break;
+
+    case PRED_PLANE: {
+        const uint8_t *t = rec - stride;
+        int h = 0, v = 0, a, b, c;
+
+        for (x = 0; x < 8; x++) {
+            h += (x + 1) * (t[8 + x] - t[6 - x]);
+            v += (x + 1) * (rec[(8 + x) * stride - 1] - rec[(6 - x) * stride - 1]);
+        }
+        a = 16 * (rec[15 * stride - 1] + t[15]);
+        b = (5 * h + 32) >> 6;
+        c = (5 * v + 32) >> 6;
+        for (y = 0; y < 16; y++)
+            for (x = 0; x < 16; x++)
+                pred[16 * y + x] = clip_pixel((a + b * (x - 7) + c * (y - 7) + 16) >> 5);
+        break;
+    }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Chroma DC prediction (8.3.4.1 to 8.3.4.3), pred is 8x8 with stride 8
+// -----------------------------------------------------------------------------
+static void chroma_dc_pred(const uint8_t *rec, int stride, int left, int top, uint8_t *pred)
+{
+    int blk, i;
+
+    for (blk = 0; blk < 4; blk++) {
+        int xo = (blk & 1) * 4, yo = (blk >> 1) * 4;
+        int st = 0, sl = 0, dc, y;
+
+        for (i = 0; i < 4; i++) {
+            if (top)
+                st += rec[xo + i - stride];
+            if (left)
+                sl += rec[(yo + i) * stride - 1];
+        }
+
+        if (xo == yo) {
+            if (top && left)
+                dc = (st + sl + 4) >> 3;
+            else if (left)
+                dc = (sl + 2) >> 2;
+            else if (top)
+                dc = (st + 2) >> 2;
+            else
+                dc = 128;
+        } else if (xo > 0) {
+            dc = top ? (st + 2) >> 2 : left ? (sl + 2) >> 2 : 128;
+        } else {
+            dc = left ? (sl + 2) >> 2 : top ? (st + 2) >> 2 : 128;
+        }
+
+        for (y = 0; y < 4; y++)
+            memset(pred + 8 * (yo + y) + xo, dc, 4);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Inter prediction, full pel luma and 1/8 pel bilinear chroma (8.4.2.2)
+//   References are padded so fetches inside PAD behave like clamped ones.
+// -----------------------------------------------------------------------------
+static void mc_luma(const uint8_t *ref, int stride, uint8_t *pred)
+{
+    int y;
+
+    for (y = 0; y < 16; y++)
+        memcpy(pred + 16 * y, ref + y * stride, 16);
+}
+
+static void mc_chroma(const uint8_t *ref, int stride, int mvx, int mvy, uint8_t *pred)
+{
+    int fx = mvx & 7, fy = mvy & 7;
+    int wa = (8 - fx) * (8 - fy), wb = fx * (8 - fy), wc = (8 - fx) * fy, wd = fx * fy;
+    int x, y;
+
+    ref += (mvy >> 3) * stride + (mvx >> 3);
+    for (y = 0; y < 8; y++, ref += stride)
+        for (x = 0; x < 8; x++)
+            pred[8 * y + x] = (wa * ref[x] + wb * ref[x + 1] +
+                               wc * ref[stride + x] + wd * ref[stride + x + 1] + 32) >> 6;
+}
+
+// -----------------------------------------------------------------------------
+//   Neighbouring macroblock, NULL when not available for prediction
+// -----------------------------------------------------------------------------
+static mbinfo *neighbour(h264soft *enc, int mbx, int mby, int dx, int dy)
+{
+    mbinfo *m;
+
+    mbx += dx;
+    mby += dy;
+    if (mbx < 0 || mbx >= enc->mbw || mby < 0)
+        return NULL;
+
+    m = &enc->mb[mby * enc->mbw + mbx];
+    return m->slice == enc->slice ? m : NULL;
+}
+
+// -----------------------------------------------------------------------------
+//   Motion vector prediction for a 16x16 partition (8.4.1.3)
+// -----------------------------------------------------------------------------
+static void predict_mv(h264soft *enc, int mbx, int mby, int *px, int *py)
+{
+    const mbinfo *a = neighbour(enc, mbx, mby, -1, 0);
+    const mbinfo *b = neighbour(enc, mbx, mby, 0, -1);
+    const mbinfo *c = neighbour(enc, mbx, mby, 1, -1);
+    int ra, rb, rc;
+
+    if (!c)
+        c = neighbour(enc, mbx, mby, -1, -1);
+    if (!b && !c && a)
+        b = c = a;
+
+    ra = a ? a->ref : -1;
+    rb = b ? b->ref : -1;
+    rc = c ? c->ref : -1;
+
+    if ((ra == 0) + (rb == 0) + (rc == 0) == 1) {
+        const mbinfo *m = ra == 0 ? a : rb == 0 ? b : c;
+        *px = m->mvx;
+        *py = m->mvy;
+    } else {
+        *px = median3(ra >= 0 ? a->mvx : 0, rb >= 0 ? b->mvx : 0, rc >= 0 ? c->mvx : 0);
+        *py = median3(ra >= 0 ? a->mvy : 0, rb >= 0 ? b->mvy : 0, rc >= 0 ? c->mvy : 0);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Motion vector of a P_Skip macroblock (8.4.1.1)
+// -----------------------------------------------------------------------------
+static void skip_mv(h264soft *enc, int mbx, int mby, int *px, int *py)
+{
+    const mbinfo *a = neighbour(enc, mbx, mby, -1, 0);
+    const mbinfo *b = neighbour(enc, mbx, mby, 0, -1);
+
+    if (!a || !b ||
+        (a->ref == 0 && a->mvx == 0 && a->mvy == 0) ||
+        (b->ref == 0 && b->mvx == 0 && b->mvy == 0)) {
+        *px = *py = 0;
+        return;
+    }
+    predict_mv(enc, mbx, mby, px, py);
+}
+
+/* full pel vector keeps the prediction inside the padded reference */
+static int mv_valid(h264soft *enc, int mbx, int mby, int mx, int my)
+{
+    int x = mbx * 16 + mx, y = mby * 16 + my;
+
+    return x >= -PAD && x <= enc->width + PAD - 16 &&
+           y >= -PAD && y <= enc->height + PAD - 16 &&
+           my >= -MAX_MVY && my < MAX_MVY;
+}
+
+// -----------------------------------------------------------------------------
+//   Full pel motion search: best of a few predictors, then diamond refinement
+// -----------------------------------------------------------------------------
+static int motion_search(h264soft *enc, int mbx, int mby, int pmx, int pmy, int lambda,
+                         int *bmx, int *bmy)
+{
+    static const int dia[4][2] = { { 0, -1 }, { -1, 0 }, { 1, 0 }, { 0, 1 } };
+    int stride = enc->stride[0];
+    const uint8_t *src = enc->src[0] + mby * 16 * enc->width + mbx * 16;
+    const uint8_t *ref = enc->pic[!enc->cur].plane[0] + mby * 16 * stride + mbx * 16;
+    const mbinfo *nb[3] = {
+        neighbour(enc, mbx, mby, -1, 0),
+        neighbour(enc, mbx, mby, 0, -1),
+        neighbour(enc, mbx, mby, 1, -1)
+    };
+    int cand[5][2], ncand = 0;
+    int best = INT_MAX, mx = 0, my = 0, sx, sy, i, iter;
+
+    cand[ncand][0] = 0;
+    cand[ncand++][1] = 0;
+    cand[ncand][0] = pmx >> 2;
+    cand[ncand++][1] = pmy >> 2;
+    for (i = 0; i < 3; i++) {
+        if (nb[i] && nb[i]->ref == 0) {
+            cand[ncand][0] = nb[i]->mvx >> 2;
+            cand[ncand++][1] = nb[i]->mvy >> 2;
+        }
+    }
+
+#define MV_COST(x, y)                                                   \
+    (sad16x16(src, enc->width, ref + (y) * stride + (x), stride) +      \
+     lambda * (se_bits(4 * (x) - pmx) + se_bits(4 * (y) - pmy)))
+
+    for (i = 0; i < ncand; i++) {
+        int cost;
+
+        if (!mv_valid(enc, mbx, mby, cand[i][0], cand[i][1]))
+            continue;
+        cost = MV_COST(cand[i][0], cand[i][1]);
+        if (cost < best) {
+            best = cost;
+            mx = cand[i][0];
+            my = cand[i][1];
+        }
+    }
+
+    sx = mx;
+    sy = my;
+    for (iter = 0; iter < 2 * SEARCH_RANGE; iter++) {
+        int dir = -1;
+
+        for (i = 0; i < 4; i++) {
+            int x = mx + dia[i][0], y = my + dia[i][1], cost;
+
+            if (abs(x - sx) > SEARCH_RANGE || abs(y - sy) > SEARCH_RANGE ||
+                !mv_valid(enc, mbx, mby, x, y))
+                continue;
+            cost = MV_COST(x, y);
+            if (cost < best) {
+                best = cost;
+                dir = i;
+            }
+        }
+        if (dir < 0)
+            break;
+        mx += dia[dir][0];
+        my += dia[dir][1];
+    }
+
+    /* diagonal refinement */
+    sx = mx;
+    sy = my;
+    for (i = 0; i < 4; i++) {
+        int x = sx + (i & 1 ? 1 : -1), y = sy + (i & 2 ? 1 : -1), cost;
+
+        if (!mv_valid(enc, mbx, mby, x, y))
+            continue;
+        cost = MV_COST(x, y);
+        if (cost < best) {
+            best = cost;
+            mx = x;
+            my = y;
+        }
+    }
+#undef MV_COST
+
+    *bmx = mx;
+    *bmy = my;
+    return best;
+}
+
+// -----------------------------------------------------------------------------
+//   Chroma residual of one component, reconstruction is written to rec.
+//   Returns 1 when DC levels are not all zero, 2 when AC levels are not.
+// -----------------------------------------------------------------------------
+static int code_chroma(mbcode *mc, int comp, const uint8_t *src, int sstride, const uint8_t *pred,
+                       uint8_t *rec, int rstride, int qpc, int intra)
+{
+    int w[4][16], dc[4], i, ac = 0, nzdc = 0;
+    int qbits = 15 + qpc / 6;
+    int f = (1 << qbits) / (intra ? 3 : 6);
+    int mf0 = quant_mf4[qpc % 6][0], ls0 = 16 * dequant_v4[qpc % 6][0];
+
+    for (i = 0; i < 4; i++) {
+        int xo = (i & 1) * 4, yo = (i >> 1) * 4;
+
+        fdct4(src + yo * sstride + xo, sstride, pred + 8 * yo + xo, 8, w[i]);
+        ac += quant4x4(w[i], mc->cac[comp][i], 1, qpc, f);
+    }
+
+    /* 2x2 DC transform */
+    dc[0] = w[0][0] + w[1][0] + w[2][0] + w[3][0];
+    dc[1] = w[0][0] - w[1][0] + w[2][0] - w[3][0];
+    dc[2] = w[0][0] + w[1][0] - w[2][0] - w[3][0];
+    dc[3] = w[0][0] - w[1][0] - w[2][0] + w[3][0];
+    for (i = 0; i < 4; i++) {
+        mc->cdc[comp][i] = quant(dc[i], mf0, 2 * f, qbits + 1);
+        nzdc |= mc->cdc[comp][i];
+    }
+
+    /* reconstruction (8.5.11.2) */
+    {
+        int16_t *c = mc->cdc[comp];
+        int f0 = c[0] + c[1] + c[2] + c[3], f1 = c[0] - c[1] + c[2] - c[3];
+        int f2 = c[0] + c[1] - c[2] - c[3], f3 = c[0] - c[1] - c[2] + c[3];
+
+        w[0][0] = (f0 * ls0 * (1 << (qpc / 6))) >> 5;
+        w[1][0] = (f1 * ls0 * (1 << (qpc / 6))) >> 5;
+        w[2][0] = (f2 * ls0 * (1 << (qpc / 6))) >> 5;
+        w[3][0] = (f3 * ls0 * (1 << (qpc / 6))) >> 5;
+    }
+
+    for (i = 0; i < 4; i++) {
+        int xo = (i & 1) * 4, yo = (i >> 1) * 4;
+
+        idct4_add(w[i], pred + 8 * yo + xo, 8, rec + yo * rstride + xo, rstride);
+    }
+
+    return ac ? 2 : nzdc ? 1 : 0;
+}
+
+// -----------------------------------------------------------------------------
+//   Intra16x16 luma residual
+// -----------------------------------------------------------------------------
+static void code_luma_i16(mbcode *mc, const uint8_t *src, int sstride, const uint8_t *pred,
+                          uint8_t *rec, int rstride, int qp)
+{
+    int w[16][16], dc[16], b, ac = 0;
+    int qbits = 15 + qp / 6, f = (1 << qbits) / 3;
+    int mf0 = quant_mf4[qp % 6][0], ls0 = 16 * dequant_v4[qp % 6][0];
+
+    for (b = 0; b < 16; b++) {
+        int xo = (b & 3) * 4, yo = (b >> 2) * 4;
+
+        fdct4(src + yo * sstride + xo, sstride, pred + 16 * yo + xo, 16, w[b]);
+        dc[b] = w[b][0];
+        ac += quant4x4(w[b], mc->ac[b], 1, qp, f);
+    }
+
+    /* the DC coefficients are Hadamard transformed and halved */
+    hadamard4(dc);
+    for (b = 0; b < 16; b++) {
+        int t = dc[zigzag[b]];
+
+        t = t < 0 ? -((1 - t) >> 1) : (t + 1) >> 1;
+        mc->dc[b] = quant(t, mf0, 2 * f, qbits + 1);
+    }
+
+    mc->cbp = ac ? 15 : 0;
+
+    /* reconstruction (8.5.10) */
+    for (b = 0; b < 16; b++)
+        dc[zigzag[b]] = mc->dc[b];
+    hadamard4(dc);
+    for (b = 0; b < 16; b++) {
+        int xo = (b & 3) * 4, yo = (b >> 2) * 4;
+
+        if (qp >= 36)
+            w[b][0] = dc[b] * ls0 * (1 << (qp / 6 - 6));
+        else
+            w[b][0] = (dc[b] * ls0 + (1 << (5 - qp / 6))) >> (6 - qp / 6);
+        idct4_add(w[b], pred + 16 * yo + xo, 16, rec + yo * rstride + xo, rstride);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Inter luma residual, coded_block_pattern is set per 8x8 block
+// -----------------------------------------------------------------------------
+static void code_luma_inter(mbcode *mc, const uint8_t *src, int sstride, const uint8_t *pred,
+                            uint8_t *rec, int rstride, int qp)
+{
+    int w[16], b;
+    int f = (1 << (15 + qp / 6)) / 6;
+
+    mc->cbp = 0;
+    for (b = 0; b < 16; b++) {
+        int xo = (b & 3) * 4, yo = (b >> 2) * 4;
+
+        fdct4(src + yo * sstride + xo, sstride, pred + 16 * yo + xo, 16, w);
+        if (quant4x4(w, mc->ac[b], 0, qp, f))
+            mc->cbp |= 1 << ((b & 3) / 2 + 2 * (b >> 3));
+        idct4_add(w, pred + 16 * yo + xo, 16, rec + yo * rstride + xo, rstride);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Intra16x16 macroblock: mode decision and residual
+// -----------------------------------------------------------------------------
+static int intra16_decide(h264soft *enc, int mbx, int mby, uint8_t *pred, int *mode)
+{
+    int stride = enc->stride[0];
+    const uint8_t *src = enc->src[0] + mby * 16 * enc->width + mbx * 16;
+    const uint8_t *rec = enc->pic[enc->cur].plane[0] + mby * 16 * stride + mbx * 16;
+    int left = neighbour(enc, mbx, mby, -1, 0) != NULL;
+    int top = neighbour(enc, mbx, mby, 0, -1) != NULL;
+    int topleft = neighbour(enc, mbx, mby, -1, -1) != NULL;
+    uint8_t tmp[256];
+    int m, best = INT_MAX;
+
+    for (m = PRED_V; m <= PRED_PLANE; m++) {
+        int sad;
+
+        if ((m == PRED_V && !top) || (m == PRED_H && !left) ||
+            (m == PRED_PLANE && !(top && left && topleft)))
+            continue;
+        intra16_pred(rec, stride, m, left, top, tmp);
+        sad = sad16x16(src, enc->width, tmp, 16);
+        if (sad < best) {
+            best = sad;
+            *mode = m;
+            memcpy(pred, tmp, sizeof(tmp));
+        }
+    }
+    return best;
+}
+
+static void code_intra(h264soft *enc, int mbx, int mby, int qp, mbcode *mc, const uint8_t *pred)
+{
+    int cstride = enc->stride[1], cw = enc->width / 2;
+    uint8_t *rec = enc->pic[enc->cur].plane[0] + mby * 16 * enc->stride[0] + mbx * 16;
+    int left = neighbour(enc, mbx, mby, -1, 0) != NULL;
+    int top = neighbour(enc, mbx, mby, 0, -1) != NULL;
+    int c, cbpc = 0;
+
+    mc->type = MB_I16x16;
+    mc->mvx = mc->mvy = 0;
+    code_luma_i16(mc, enc->src[0] + mby * 16 * enc->width + mbx * 16, enc->width,
+                  pred, rec, enc->stride[0], qp);
+
+    for (c = 0; c < 2; c++) {
+        uint8_t *crec = enc->pic[enc->cur].plane[1 + c] + mby * 8 * cstride + mbx * 8;
+        uint8_t cpred[64];
+        int r;
+
+        chroma_dc_pred(crec, cstride, left, top, cpred);
+        r = code_chroma(mc, c, enc->src[1 + c] + mby * 8 * cw + mbx * 8, cw,
+                        cpred, crec, cstride, chroma_qp[qp], 1);
+        cbpc = r > cbpc ? r : cbpc;
+    }
+    mc->cbp |= cbpc << 4;
+}
+
+static void code_inter(h264soft *enc, int mbx, int mby, int qp, mbcode *mc, int mvx, int mvy)
+{
+    int stride = enc->stride[0], cstride = enc->stride[1], cw = enc->width / 2;
+    const picture *ref = &enc->pic[!enc->cur];
+    uint8_t *rec = enc->pic[enc->cur].plane[0] + mby * 16 * stride + mbx * 16;
+    uint8_t pred[256];
+    int c, cbpc = 0;
+
+    mc->type = MB_P16x16;
+    mc->mvx = mvx;
+    mc->mvy = mvy;
+
+    mc_luma(ref->plane[0] + (mby * 16 + (mvy >> 2)) * stride + mbx * 16 + (mvx >> 2), stride, pred);
+    code_luma_inter(mc, enc->src[0] + mby * 16 * enc->width + mbx * 16, enc->width,
+                    pred, rec, stride, qp);
+
+    for (c = 0; c < 2; c++) {
+        uint8_t *crec = enc->pic[enc->cur].plane[1 + c] + mby * 8 * cstride + mbx * 8;
+        int r;
+
+        mc_chroma(ref->plane[1 + c] + mby * 8 * cstride + mbx * 8, cstride, mvx, mvy, pred);
+        r = code_chroma(mc, c, enc->src[1 + c] + mby * 8 * cw + mbx * 8, cw,
+                        pred, crec, cstride, chroma_qp[qp], 0);
+        cbpc = r > cbpc ? r : cbpc;
+    }
+    mc->cbp |= cbpc << 4;
+}
+
+// -----------------------------------------------------------------------------
+//   Macroblock mode decision
+// -----------------------------------------------------------------------------
+static void encode_mb(h264soft *enc, int mbx, int mby, int slice_type, int qp, mbcode *mc)
+{
+    uint8_t ipred[256];
+    int imode = PRED_DC, isad, lambda = lambda_tab[qp];
+
+    if (slice_type == SLICE_TYPE_P && enc->has_ref) {
+        int stride = enc->stride[0];
+        const uint8_t *src = enc->src[0] + mby * 16 * enc->width + mbx * 16;
+        const uint8_t *ref = enc->pic[!enc->cur].plane[0] + mby * 16 * stride + mbx * 16;
+        int smx, smy, mx, my, cost, skip;
+
+        predict_mv(enc, mbx, mby, &mc->pmx, &mc->pmy);
+        skip_mv(enc, mbx, mby, &smx, &smy);
+        skip = mv_valid(enc, mbx, mby, smx >> 2, smy >> 2);
+
+        /* early skip: residual at the skip vector quantizes to nothing */
+        if (skip &&
+            sad16x16(src, enc->width, ref + (smy >> 2) * stride + (smx >> 2), stride) < 256 * lambda) {
+            code_inter(enc, mbx, mby, qp, mc, smx, smy);
+            if (mc->cbp == 0) {
+                mc->type = MB_PSKIP;
+                return;
+            }
+        }
+
+        cost = motion_search(enc, mbx, mby, mc->pmx, mc->pmy, lambda, &mx, &my);
+        isad = intra16_decide(enc, mbx, mby, ipred, &imode);
+        if (isad + 4 * lambda >= cost) {
+            code_inter(enc, mbx, mby, qp, mc, 4 * mx, 4 * my);
+            if (mc->cbp == 0 && skip && mc->mvx == smx && mc->mvy == smy)
+                mc->type = MB_PSKIP;
+            return;
+        }
+    } else {
+        intra16_decide(enc, mbx, mby, ipred, &imode);
+    }
+
+    mc->pred = imode;
+    code_intra(enc, mbx, mby, qp, mc, ipred);
+}
+
+// -----------------------------------------------------------------------------
+//   CAVLC residual_block() (7.3.5.3.2, 9.2)
+// -----------------------------------------------------------------------------
+static void put_level(bitstream *bs, int code, int suffix_length)
+{
+    if (suffix_length == 0) {
+        if (code < 14) {
+            bitstream_put_ui(bs, 1, code + 1);
+        } else if (code < 30) {
+            bitstream_put_ui(bs, 1, 15);
+            bitstream_put_ui(bs, code - 14, 4);
+        } else {
+            bitstream_put_ui(bs, 1, 16);
+            bitstream_put_ui(bs, code - 30, 12);
+        }
+    } else if (code < (15 << suffix_length)) {
+        bitstream_put_ui(bs, 1, (code >> suffix_length) + 1);
+        bitstream_put_ui(bs, code & ((1 << suffix_length) - 1), suffix_length);
+    } else {
+        bitstream_put_ui(bs, 1, 16);
+        bitstream_put_ui(bs, code - (15 << suffix_length), 12);
+    }
+}
+
+static void residual_block(bitstream *bs, const int16_t *coef, int max, int nc)
+{
+    int level[16], run[16];
+    int total = 0, t1 = 0, total_zeros = 0, zeros_left, suffix_length, i;
+
+    /* levels from the highest frequency */
+    for (i = max - 1; i >= 0 && !coef[i]; i--)
+        ;
+    for (; i >= 0; i--) {
+        if (coef[i]) {
+            level[total] = coef[i];
+            run[total++] = 0;
+        } else {
+            run[total - 1]++;
+            total_zeros++;
+        }
+    }
+    while (t1 < total && t1 < 3 && abs(level[t1]) == 1)
+        t1++;
+
+    /* coeff_token */
+    if (nc == -1)
+        bitstream_put_ui(bs, chroma_dc_coeff_token_bits[total * 4 + t1],
+                         chroma_dc_coeff_token_len[total * 4 + t1]);
+    else if (nc >= 8)
+        bitstream_put_ui(bs, total ? ((total - 1) << 2) | t1 : 3, 6);
+    else {
+        int tab = nc < 2 ? 0 : nc < 4 ? 1 : 2;
+        bitstream_put_ui(bs, coeff_token_bits[tab][total * 4 + t1],
+                         coeff_token_len[tab][total * 4 + t1]);
+    }
+
+    if (total == 0)
+        return;
+
+    for (i = 0; i < t1; i++)
+        bitstream_put_ui(bs, level[i] < 0, 1);     /* trailing_ones_sign_flag */
+
+    suffix_length = (total > 10 && t1 < 3);
+    for (i = t1; i < total; i++) {
+        int val = level[i], mag = abs(val);
+        int code = val > 0 ? 2 * val - 2 : -2 * val - 1;
+
+        if (i == t1 && t1 < 3)
+            code -= 2;
+        put_level(bs, code, suffix_length);
+
+        if (suffix_length == 0)
+            suffix_length = 1;
+        if (mag > (3 << (suffix_length - 1)) && suffix_length < 6)
+            suffix_length++;
+    }
+
+    if (total < max) {
+        if (max == 4)
+            bitstream_put_ui(bs, chroma_dc_total_zeros_bits[total - 1][total_zeros],
+                             chroma_dc_total_zeros_len[total - 1][total_zeros]);
+        else
+            bitstream_put_ui(bs, total_zeros_bits[total - 1][total_zeros],
+                             total_zeros_len[total - 1][total_zeros]);
+    }
+
+    zeros_left = total_zeros;
+    for (i = 0; i < total - 1 && zeros_left > 0; i++) {
+        int tab = (zeros_left < 7 ? zeros_left : 7) - 1;
+
+        bitstream_put_ui(bs, run_before_bits[tab][run[i]], run_before_len[tab][run[i]]);
+        zeros_left -= run[i];
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   nC of a 4x4 block from the neighbouring blocks TotalCoeff (9.2.1)
+// -----------------------------------------------------------------------------
+static int total_coeff_pred(int na, int nb)
+{
+    if (na >= 0 && nb >= 0)
+        return (na + nb + 1) >> 1;
+    if (na >= 0)
+        return na;
+    if (nb >= 0)
+        return nb;
+    return 0;
+}
+
+static int luma_nc(const mbinfo *cur, const mbinfo *left, const mbinfo *top, int bx, int by)
+{
+    int na = bx ? cur->nz[4 * by + bx - 1] : left ? left->nz[4 * by + 3] : -1;
+    int nb = by ? cur->nz[4 * (by - 1) + bx] : top ? top->nz[12 + bx] : -1;
+
+    return total_coeff_pred(na, nb);
+}
+
+static int chroma_nc(const mbinfo *cur, const mbinfo *left, const mbinfo *top, int c, int blk)
+{
+    int bx = blk & 1, by = blk >> 1;
+    int na = bx ? cur->nzc[c][blk - 1] : left ? left->nzc[c][blk + 1] : -1;
+    int nb = by ? cur->nzc[c][blk - 2] : top ? top->nzc[c][blk + 2] : -1;
+
+    return total_coeff_pred(na, nb);
+}
+
+static int count_levels(const int16_t *l, int start)
+{
+    int n = 0;
+
+    for (; start < 16; start++)
+        n += (l[start] != 0);
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+//   Record the macroblock for its neighbours
+// -----------------------------------------------------------------------------
+static void store_mbinfo(h264soft *enc, mbinfo *info, const mbcode *mc)
+{
+    int b, c;
+
+    info->slice = enc->slice;
+    info->ref = mc->type == MB_I16x16 ? -1 : 0;
+    info->mvx = mc->mvx;
+    info->mvy = mc->mvy;
+
+    for (b = 0; b < 16; b++) {
+        if (mc->type == MB_PSKIP)
+            info->nz[b] = 0;
+        else if (mc->type == MB_I16x16)
+            info->nz[b] = (mc->cbp & 15) ? count_levels(mc->ac[b], 1) : 0;
+        else
+            info->nz[b] = count_levels(mc->ac[b], 0);
+    }
+
+    for (c = 0; c < 2; c++)
+        for (b = 0; b < 4; b++)
+            info->nzc[c][b] = (mc->type != MB_PSKIP && (mc->cbp >> 4) == 2) ?
+                              count_levels(mc->cac[c][b], 1) : 0;
+}
+
+// -----------------------------------------------------------------------------
+//   macroblock_layer() of a non skipped macroblock (7.3.5)
+// -----------------------------------------------------------------------------
+static void write_mb(h264soft *enc, bitstream *bs, int mbx, int mby, int slice_type,
+                     const mbcode *mc, const mbinfo *cur, int dqp)
+{
+    const mbinfo *left = neighbour(enc, mbx, mby, -1, 0);
+    const mbinfo *top = neighbour(enc, mbx, mby, 0, -1);
+    int cbpl = mc->cbp & 15, cbpc = mc->cbp >> 4;
+    int i, c;
+
+    if (mc->type == MB_I16x16) {
+        int mb_type = 1 + mc->pred + 4 * cbpc + (cbpl ? 12 : 0);
+
+        bitstream_put_ue(bs, slice_type == SLICE_TYPE_P ? mb_type + 5 : mb_type);
+        bitstream_put_ue(bs, 0);                /* intra_chroma_pred_mode: DC */
+        bitstream_put_se(bs, dqp);              /* mb_qp_delta */
+
+        residual_block(bs, mc->dc, 16, luma_nc(cur, left, top, 0, 0));
+        if (cbpl)
+            for (i = 0; i < 16; i++)
+                residual_block(bs, mc->ac[4 * blk_y[i] + blk_x[i]] + 1, 15,
+                               luma_nc(cur, left, top, blk_x[i], blk_y[i]));
+    } else {
+        bitstream_put_ue(bs, 0);                /* mb_type: P_L0_16x16 */
+        bitstream_put_se(bs, mc->mvx - mc->pmx);  /* mvd_l0 */
+        bitstream_put_se(bs, mc->mvy - mc->pmy);
+        bitstream_put_ue(bs, inter_cbp_to_golomb[mc->cbp]);
+        if (mc->cbp == 0)
+            return;
+        bitstream_put_se(bs, dqp);              /* mb_qp_delta */
+
+        for (i = 0; i < 16; i++)
+            if (cbpl & (1 << (i >> 2)))
+                residual_block(bs, mc->ac[4 * blk_y[i] + blk_x[i]], 16,
+                               luma_nc(cur, left, top, blk_x[i], blk_y[i]));
+    }
+
+    if (cbpc)
+        for (c = 0; c < 2; c++)
+            residual_block(bs, mc->cdc[c], 4, -1);
+    if (cbpc == 2)
+        for (c = 0; c < 2; c++)
+            for (i = 0; i < 4; i++)
+                residual_block(bs, mc->cac[c][i] + 1, 15, chroma_nc(cur, left, top, c, i));
+}
+
+// -----------------------------------------------------------------------------
+//   Public interface
+// -----------------------------------------------------------------------------
+h264soft *h264soft_create(int width, int height)
+{
+    h264soft *enc;
+    int i, c;
+
+    if (quant_mf4[0][0] == 0)
+        init_tables();
+
+    enc = calloc(1, sizeof(*enc));
+    if (enc == NULL)
+        return NULL;
+
+    enc->mbw = (width + 15) / 16;
+    enc->mbh = (height + 15) / 16;
+    enc->width = enc->mbw * 16;
+    enc->height = enc->mbh * 16;
+    enc->stride[0] = enc->width + 2 * PAD;
+    enc->stride[1] = enc->width / 2 + 2 * PAD;
+
+    enc->src[0] = malloc(enc->width * enc->height * 3 / 2);
+    enc->src[1] = enc->src[0] + enc->width * enc->height;
+    enc->src[2] = enc->src[1] + enc->width * enc->height / 4;
+
+    for (i = 0; i < 2; i++) {
+        for (c = 0; c < 3; c++) {
+            int s = enc->stride[c ? 1 : 0], h = (c ? enc->height / 2 : enc->height) + 2 * PAD;
+
+            enc->pic[i].base[c] = calloc(s, h);
+            if (enc->pic[i].base[c])
+                enc->pic[i].plane[c] = enc->pic[i].base[c] + PAD * s + PAD;
+        }
+    }
+
+    enc->mb = malloc(enc->mbw * enc->mbh * sizeof(mbinfo));
+    enc->qp_delta = calloc(enc->mbw * enc->mbh, 1);
+
+    if (!enc->src[0] || !enc->mb || !enc->qp_delta || !enc->pic[0].base[0] || !enc->pic[0].base[1] ||
+        !enc->pic[0].base[2] || !enc->pic[1].base[0] || !enc->pic[1].base[1] ||
+        !enc->pic[1].base[2]) {
+        h264soft_destroy(enc);
+        return NULL;
+    }
+
+    for (i = 0; i < enc->mbw * enc->mbh; i++)
+        enc->mb[i].slice = -1;
+
+    return enc;
+}
+
+void h264soft_destroy(h264soft *enc)
+{
+    int i, c;
+
+    if (enc == NULL)
+        return;
+
+    for (i = 0; i < 2; i++)
+        for (c = 0; c < 3; c++)
+            free(enc->pic[i].base[c]);
+    free(enc->src[0]);
+    free(enc->mb);
+    free(enc->qp_delta);
+    free(enc);
+}
+
+void h264soft_load_nv12(h264soft *enc, const unsigned char *y, const unsigned char *uv,
+                        int width, int height)
+{
+    int cw = enc->width / 2, srccw = width / 2, srcch = height / 2;
+    int i, j;
+
+    for (i = 0; i < enc->height; i++) {
+        uint8_t *dst = enc->src[0] + i * enc->width;
+        const uint8_t *s = y + (i < height ? i : height - 1) * width;
+
+        memcpy(dst, s, width);
+        memset(dst + width, s[width - 1], enc->width - width);
+    }
+
+    for (i = 0; i < enc->height / 2; i++) {
+        uint8_t *u = enc->src[1] + i * cw, *v = enc->src[2] + i * cw;
+        const uint8_t *s = uv + (i < srcch ? i : srcch - 1) * srccw * 2;
+
+        for (j = 0; j < srccw; j++) {
+            u[j] = s[2 * j];
+            v[j] = s[2 * j + 1];
+        }
+        for (; j < cw; j++) {
+            u[j] = u[srccw - 1];
+            v[j] = v[srccw - 1];
+        }
+    }
+}
+
+void h264soft_set_qp_delta(h264soft *enc, const signed char *delta)
+{
+    if (delta)
+        memcpy(enc->qp_delta, delta, enc->mbw * enc->mbh);
+    else
+        memset(enc->qp_delta, 0, enc->mbw * enc->mbh);
+}
+
+void h264soft_encode_slice(h264soft *enc, bitstream *bs, int slice_type, int qp,
+                           int first_mb, int num_mb)
+{
+    mbcode mc;
+    int addr, skip_run = 0, last_qp;
+
+    assert(slice_type == SLICE_TYPE_P || slice_type == SLICE_TYPE_I);
+    assert(first_mb >= 0 && first_mb + num_mb <= enc->mbw * enc->mbh);
+
+    qp = clip3(0, 51, qp);
+    last_qp = qp;
+    enc->slice++;
+
+    for (addr = first_mb; addr < first_mb + num_mb; addr++) {
+        int mbx = addr % enc->mbw, mby = addr / enc->mbw;
+        int mb_qp = clip3(0, 51, qp + enc->qp_delta[addr]), dqp = 0;
+        mbinfo *info = &enc->mb[addr];
+
+        encode_mb(enc, mbx, mby, slice_type, mb_qp, &mc);
+        store_mbinfo(enc, info, &mc);
+
+        if (mc.type == MB_PSKIP) {
+            skip_run++;
+            continue;
+        }
+        if (slice_type == SLICE_TYPE_P) {
+            bitstream_put_ue(bs, skip_run);     /* mb_skip_run */
+            skip_run = 0;
+        }
+
+        /* QP only changes in macroblocks carrying mb_qp_delta, it wraps
+           around modulo 52 (7.4.5) */
+        if (mc.type == MB_I16x16 || mc.cbp) {
+            dqp = mb_qp - last_qp;
+            if (dqp > 25)
+                dqp -= 52;
+            else if (dqp < -26)
+                dqp += 52;
+            last_qp = mb_qp;
+        }
+        write_mb(enc, bs, mbx, mby, slice_type, &mc, info, dqp);
+    }
+
+    if (skip_run)
+        bitstream_put_ue(bs, skip_run);
+}
+
+// -----------------------------------------------------------------------------
+//   Replicate the picture borders into the padding
+// -----------------------------------------------------------------------------
+static void extend_plane(uint8_t *p, int stride, int w, int h)
+{
+    int y;
+
+    for (y = 0; y < h; y++) {
+        uint8_t *row = p + y * stride;
+
+        memset(row - PAD, row[0], PAD);
+        memset(row + w, row[w - 1], PAD);
+    }
+    for (y = 1; y <= PAD; y++) {
+        memcpy(p - PAD - y * stride, p - PAD, stride);
+        memcpy(p - PAD + (h - 1 + y) * stride, p - PAD + (h - 1) * stride, stride);
+    }
+}
+
+void h264soft_end_picture(h264soft *enc)
+{
+    picture *rec = &enc->pic[enc->cur];
+
+    extend_plane(rec->plane[0], enc->stride[0], enc->width, enc->height);
+    extend_plane(rec->plane[1], enc->stride[1], enc->width / 2, enc->height / 2);
+    extend_plane(rec->plane[2], enc->stride[1], enc->width / 2, enc->height / 2);
+
+    enc->cur = !enc->cur;
+    enc->has_ref = 1;
+}
@@ -0,0 +1,37 @@
+#ifndef __H264SOFT_H__
+#define __H264SOFT_H__
+
+#include "bitstream.h"
+
+/*
+ * Software H.264 macroblock layer encoder.
+ *
+ * It produces Constrained Baseline slice data: CAVLC entropy coding,
+ * Intra16x16, P_L0_16x16 and P_Skip macroblocks, one reference frame and
+ * full pel motion vectors. Deblocking must be disabled in the slice header
+ * (disable_deblocking_filter_idc = 1) since the reconstruction used as the
+ * next reference is not filtered.
+ *
+ * Parameter sets and slice headers are written by the caller, this module
+ * only appends slice_data() to the bitstream.
+ */
+typedef struct __h264soft h264soft;
+
+h264soft *h264soft_create(int width, int height);
+void h264soft_destroy(h264soft *enc);
+
+/* copy a NV12 image, width and height may be smaller than the coded size */
+void h264soft_load_nv12(h264soft *enc, const unsigned char *y, const unsigned char *uv,
+                        int width, int height);
+
+/* slice_type is 0 (P) or 2 (I), slices must be coded in increasing first_mb order */
+void h264soft_encode_slice(h264soft *enc, bitstream *bs, int slice_type, int qp,
+                           int first_mb, int num_mb);
+
+/* QP offset of every macroblock in raster order, NULL clears them */
+void h264soft_set_qp_delta(h264soft *enc, const signed char *delta);
+
+/* the reconstructed picture becomes the reference of the next P picture */
+void h264soft_end_picture(h264soft *enc);
+
+#endif
@@ -34,6 +34,12 @@ along with this library; if not, write to the Free Software Foundation, Inc.,
 #include <GroupsockHelper.hh>
 
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "NalSource.h"
 
 #define DEF_INPUT "test.h265"
 #define DEF_STREAM "testStream"
@@ -41,8 +47,12 @@ along with this library; if not, write to the Free Software Foundation, Inc.,
 UsageEnvironment* env;
 char const* inputFileName = DEF_INPUT;
 const char *streamName = DEF_STREAM;
-H265VideoStreamFramer* videoSource;
+FramedSource* videoSource;
+const char *socketPath = NULL;
+int listenSocket = -1;
 RTPSink* videoSink;
+const char *feedbackPath = NULL;
+int feedbackSocket = -1;
 
 void play(); // forward
 
@@ -53,10 +63,12 @@ void usage (int argc, char **argv, int optind)
 {
   const char *what = (optind > 0) ? "error" : "usage";
   const char *fmt =
-    "%s: %s [-i /path/to/file] [-s stream-name]\n"
+    "%s: %s [-i /path/to/file | -u /path/to/socket] [-s stream-name] [-c /path/to/socket]\n"
     "    -?                        Print this help message.\n"
     "    -i /path/to/file          Path to input raw h265 video file. Defaults to '%s'.\n"
-    "    -s stream-name            Name of stream used for RTSP URL. Defaults to '%s'\n";
+    "    -u /path/to/socket        Receive the NAL units of the encoder on this socket instead.\n"
+    "    -s stream-name            Name of stream used for RTSP URL. Defaults to '%s'\n"
+    "    -c /path/to/socket        Forward receiver reports to the encoder listening there (--feedback).\n";
 
   fprintf (stderr, fmt, what, argv[0], DEF_INPUT, DEF_STREAM);
   exit (optind > 0);
@@ -69,17 +81,95 @@ void usage (int argc, char **argv, int optind)
 void parse (int argc, char **argv)
 {
   int opt;
-  while ((opt = getopt (argc, argv, "?hi:s:")) != -1 ) {
+  while ((opt = getopt (argc, argv, "?hi:u:s:c:")) != -1 ) {
     switch( opt ) {
     case '?':  case 'h': usage (argc, argv, 0);
     case 'i':  inputFileName = optarg; break;
+    case 'u':  socketPath = optarg; break;
     case 's':  streamName = optarg; break;
+    case 'c':  feedbackPath = optarg; break;
     default:
       usage (argc, argv, optind);
     }
   }
 }
 
+// --------------------------------------------------------------------------
+//   Encoder feedback: the worst fraction lost and jitter of the RTCP
+//   receiver reports are sent to the encoder socket as a
+//   "feedback <loss> <jitter ms>" line. The encoder answers each line,
+//   only errors are shown. The connection is opened again on the next
+//   report when it is lost.
+// --------------------------------------------------------------------------
+void feedbackClose()
+{
+  env->taskScheduler().disableBackgroundHandling(feedbackSocket);
+  close(feedbackSocket);
+  feedbackSocket = -1;
+}
+
+void feedbackReply(void* /*clientData*/, int /*mask*/)
+{
+  char buf[512];
+  int n = recv(feedbackSocket, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+
+  if (n > 0) {
+    buf[n] = '\0';
+    if (!strncmp(buf, "error", 5))
+      *env << "Encoder feedback: " << buf;
+  } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+    feedbackClose();
+  }
+}
+
+int feedbackConnect()
+{
+  struct sockaddr_un addr;
+
+  if (feedbackSocket != -1)
+    return 0;
+  if (strlen(feedbackPath) >= sizeof(addr.sun_path))
+    return -1;
+
+  feedbackSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (feedbackSocket == -1)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, feedbackPath);
+  if (connect(feedbackSocket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(feedbackSocket);
+    feedbackSocket = -1;
+    return -1;
+  }
+  env->taskScheduler().setBackgroundHandling(feedbackSocket, SOCKET_READABLE, feedbackReply, NULL);
+  return 0;
+}
+
+void receiverReport(void* clientData)
+{
+  RTPSink* sink = (RTPSink*)clientData;
+  RTPTransmissionStatsDB::Iterator it(sink->transmissionStatsDB());
+  RTPTransmissionStats* stats;
+  double loss = 0, jitter = 0;
+  char line[64];
+  int n;
+
+  // fraction lost is in 1/256, jitter in RTP timestamp units
+  while ((stats = it.next()) != NULL) {
+    double l = stats->packetLossRatio() / 256.0;
+    double j = stats->jitter() * 1000.0 / sink->rtpTimestampFrequency();
+    if (l > loss) loss = l;
+    if (j > jitter) jitter = j;
+  }
+
+  if (feedbackConnect() == -1)
+    return;
+  n = snprintf(line, sizeof(line), "feedback %.3f %.1f\n", loss, jitter);
+  if (send(feedbackSocket, line, n, MSG_NOSIGNAL | MSG_DONTWAIT) != n)
+    feedbackClose();
+}
+
 // --------------------------------------------------------------------------
 //   Main program
 // --------------------------------------------------------------------------
@@ -110,7 +200,8 @@ int main(int argc, char** argv) {
   rtcpGroupsock.multicastSendOnly(); // we're a SSM source
 
   // Create a 'H265 Video RTP' sink from the RTP 'groupsock':
-  OutPacketBuffer::maxSize = 100000;
+  // room for a whole NAL unit, the discrete framer gets them in one piece
+  OutPacketBuffer::maxSize = 1000000;
   videoSink = H265VideoRTPSink::createNew(*env, &rtpGroupsock, 96);
 
   // Create (and start) a 'RTCP instance' for this RTP sink:
@@ -125,14 +216,21 @@ int main(int argc, char** argv) {
 			    videoSink, NULL /* we're a server */,
 			    True /* we're a SSM source */);
   // Note: This starts RTCP running automatically
+  if (feedbackPath != NULL)
+    rtcp->setRRHandler(receiverReport, videoSink);
 
   RTSPServer* rtspServer = RTSPServer::createNew(*env, 8554);
   if (rtspServer == NULL) {
     *env << "Failed to create RTSP server: " << env->getResultMsg() << "\n";
     exit(1);
   }
+  // once the RTSP port is ours, a second streamer would fail on it
+  if (socketPath != NULL && (listenSocket = NalSource::listenOn(socketPath)) == -1) {
+    *env << "Unable to listen on \"" << socketPath << "\": " << strerror(errno) << "\n";
+    exit(1);
+  }
   ServerMediaSession* sms
-    = ServerMediaSession::createNew(*env, streamName, inputFileName,
+    = ServerMediaSession::createNew(*env, streamName, socketPath ? socketPath : inputFileName,
 		   "Session streamed by \"testH265VideoStreamer\"",
 					   True /*SSM*/);
   sms->addSubsession(PassiveServerMediaSubsession::createNew(*videoSink, rtcp));
@@ -152,7 +250,7 @@ int main(int argc, char** argv) {
 }
 
 void afterPlaying(void* /*clientData*/) {
-  *env << "...done reading from file\n";
+  *env << (socketPath ? "...encoder gone\n" : "...done reading from file\n");
   videoSink->stopPlaying();
   Medium::close(videoSource);
   // Note that this also closes the input file that this source read from.
@@ -161,7 +259,29 @@ void afterPlaying(void* /*clientData*/) {
   play();
 }
 
+// --------------------------------------------------------------------------
+//   An encoder connected: its NAL units go to the discrete framer, which
+//   needs no start code and keeps the timestamps of the encoder. Waiting
+//   for the next one when it goes.
+// --------------------------------------------------------------------------
+void acceptEncoder(void* /*clientData*/, int /*mask*/) {
+  int fd = accept(listenSocket, NULL, NULL);
+  if (fd == -1)
+    return;
+  env->taskScheduler().disableBackgroundHandling(listenSocket);
+
+  videoSource = H265VideoStreamDiscreteFramer::createNew(*env, NalSource::createNew(*env, fd));
+  *env << "Encoder connected, streaming...\n";
+  videoSink->startPlaying(*videoSource, afterPlaying, videoSink);
+}
+
 void play() {
+  if (socketPath != NULL) {
+    *env << "Waiting for the encoder on \"" << socketPath << "\"...\n";
+    env->taskScheduler().setBackgroundHandling(listenSocket, SOCKET_READABLE, acceptEncoder, NULL);
+    return;
+  }
+
   // Open the input file as a 'byte-stream file source':
   ByteStreamFileSource* fileSource
     = ByteStreamFileSource::createNew(*env, inputFileName);
@@ -60,6 +60,15 @@
 
 #include "loadsurface.h"
 #include "bitstream.h"
+#include "roi.h"
+#include "scene.h"
+#include "mux.h"
+#include "telemetry.h"
+#include "frameinfo.h"
+#include "nv12.h"
+#include "vapool.h"
+#include "control.h"
+#include "feedback.h"
 
 #define NAL_REF_IDC_NONE        0
 #define NAL_REF_IDC_LOW         1
@@ -91,8 +100,7 @@ enum {
 
 static  int LCU_SIZE = 32;
 
-#define SURFACE_NUM 16 /* 16 surfaces for source YUV */
-#define SURFACE_NUM 16 /* 16 surfaces for reference */
+#define SURFACE_NUM VAPOOL_MAX /* at most 16 surfaces for source YUV and reference */
 enum NALUType {
 	       NALU_TRAIL_N        = 0x00, // Coded slice segment of a non-TSA, non-STSA trailing picture - slice_segment_layer_rbsp, VLC
 	       NALU_TRAIL_R        = 0x01, // Coded slice segment of a non-TSA, non-STSA trailing picture - slice_segment_layer_rbsp, VLC
@@ -430,6 +438,33 @@ static  int config_attrib_num = 0, enc_packed_header_idx;
 static  VASurfaceID src_surface[SURFACE_NUM];
 static  VABufferID  coded_buf[SURFACE_NUM];
 static  VASurfaceID ref_surface[SURFACE_NUM];
+static  struct vapool_s pool = { 1, 1, 0, 0 };  /* surfaces and coded buffers in use */
+static  unsigned int coded_buf_size[SURFACE_NUM];
+
+/* encoder backend, VA-API or the null one simulating it */
+#define BACKEND_VA      0
+#define BACKEND_NULL    1
+static  int backend_type = BACKEND_VA;
+
+struct encoder_backend {
+  const char *name;
+  void (*init)(void);                           /* allocate encoder ressources */
+  void (*upload)(unsigned char *nv12);          /* picture of current_slot */
+  void (*encode_picture)(void);                 /* encode it as current_frame_encoding */
+  void (*sync)(unsigned int slot);              /* wait until the picture of slot is coded */
+  unsigned int (*store)(unsigned int slot);     /* write its coded data, returns the size */
+  void (*release)(void);
+};
+static  const struct encoder_backend *backend;
+
+/* null backend: no VA call, a delay and synthetic slices instead */
+static  int null_delay = -1;            /* us per picture, -1 scales with the size */
+static  unsigned char *null_surface = NULL;
+static  unsigned int *null_slice_data = NULL;
+static  int null_slice_dwords = 0;
+static  unsigned char *null_coded[SURFACE_NUM];
+static  unsigned int null_coded_len[SURFACE_NUM];
+static  unsigned long long null_done[SURFACE_NUM];      /* end of the simulated encode */
 static  VAConfigID config_id;
 static  VAContextID context_id;
 static  struct ProfileTierParamSet protier_param;
@@ -450,11 +485,22 @@ static  int hevc_packedheader = 0;
 static  int hevc_maxref = 16;
 
 static  char *coded_fn = NULL, *srcyuv_fn = NULL;
-static  FILE *coded_fp = NULL, *srcyuv_fp = NULL;
+static  FILE *srcyuv_fp = NULL;
+static  struct mux_s mux;                /* coded stream in its container */
+static  int mux_forced = -1;            /* --mux, else from the file extension */
 static  unsigned long long srcyuv_frames = 0;
 static  int srcyuv_fourcc = VA_FOURCC_NV12;
 static  unsigned char *srcyuv_ptr = NULL;
 static  unsigned char *nv12 = NULL;
+static  int srcyuv_nv12 = 0;    /* source already converted by enchost */
+
+/* frame number and time of the source, frames signalled twice are encoded
+ * once, frames missed are counted and left to the capture times */
+static  struct frameinfo_s *frame_info = NULL;
+static  unsigned long long frame_seq = 0;       /* last frame taken */
+static  unsigned long long frame_time = 0;      /* its capture time, 0 if unknown */
+static  unsigned int frames_dropped = 0;
+static  unsigned int frames_duplicated = 0;
 
 static  int frame_width = 176;
 static  int frame_height = 144;
@@ -465,6 +511,17 @@ static  unsigned int frame_count = 60;
 static  unsigned int frame_coded = 0;
 static  unsigned int frame_bitrate = 0;
 static  unsigned int frame_slices = 1;
+static  struct roi_list_s rois;
+static  int roi_va_regions = 0;         /* regions supported by the driver */
+static  int roi_va_qp_delta = 0;        /* driver takes QP offsets, not priorities */
+static  VAEncROI roi_va[ROI_MAX];
+
+/* content analysis, off unless asked for: a scene cut starts a new GOP with
+ * an IDR picture */
+static  struct scene_s scene;
+static  int scenecut = 0;
+static  unsigned long long gop_start = 0;       /* encoding order of the last scene cut */
+static  unsigned int scene_cuts = 0;
 static  double frame_size = 0;
 static  int initial_qp = 26;
 static  int minimal_qp = 0;
@@ -487,7 +544,18 @@ static  unsigned long long current_frame_display = 0;
 static  unsigned long long current_IDR_display = 0;
 static  unsigned int current_frame_num = 0;
 static  int current_frame_type;
-#define current_slot (current_frame_display % SURFACE_NUM)
+#define current_slot (current_frame_display % pool.src)
+
+/* packed headers are written into static buffers, VPS, SPS and PPS don't
+ * change during the encoding session so they are only built once */
+#define PACKED_HEADER_DWORDS 1024
+static  unsigned int packedvideo_data[PACKED_HEADER_DWORDS];
+static  unsigned int packedseq_data[PACKED_HEADER_DWORDS];
+static  unsigned int packedpic_data[PACKED_HEADER_DWORDS];
+static  unsigned int packedslice_data[PACKED_HEADER_DWORDS];
+static  int packedvideo_bits = 0;
+static  int packedseq_bits = 0;
+static  int packedpic_bits = 0;
 
 static  int misc_priv_type = 0;
 static  int misc_priv_value = 0;
@@ -500,6 +568,9 @@ struct storage_task_t {
   void *next;
   unsigned long long display_order;
   unsigned long long encode_order;
+  unsigned long long capture_time;
+  int frame_type;
+  struct telemetry_frame_s tm;  /* stages timed so far */
 };
 static  struct storage_task_t *storage_task_header = NULL, *storage_task_tail = NULL;
 #define SRC_SURFACE_IN_ENCODING 0
@@ -511,14 +582,17 @@ static  pthread_cond_t  encode_cond = PTHREAD_COND_INITIALIZER;
 static  pthread_t encode_thread;
 
 /* for performance profiling */
-static unsigned int UploadPictureTicks = 0;
-static unsigned int BeginPictureTicks = 0;
-static unsigned int RenderPictureTicks = 0;
-static unsigned int EndPictureTicks = 0;
-static unsigned int SyncPictureTicks = 0;
-static unsigned int SavePictureTicks = 0;
-static unsigned int ProcessPictureTicks = 0;
 static unsigned int TotalTicks = 0;
+static struct telemetry_s tm;                   /* time of each stage, in ns */
+static struct telemetry_frame_s tm_frame;       /* frame being encoded */
+static char *telemetry_fn = NULL;
+static int _sigusr2 = 0;
+
+/* bitrate adapted to the receiver reports forwarded by the streamer */
+static char *feedback_fn = NULL;
+static struct control_s feedback_ctl;
+static struct feedback_s feedback;
+static int bitrate_changed = 0;
 
 // Default values
 #define DEF_INTRA_PERIOD 20
@@ -1469,15 +1543,18 @@ build_packed_pic_buffer(unsigned char **header_buffer)
 {
   bitstream bs;
 
-  bitstream_start(&bs);
-  nal_start_code_prefix(&bs, NALU_PPS);
-  nal_header(&bs, NALU_PPS);
-  pps_rbsp(&bs);
-  rbsp_trailing_bits(&bs);
-  bitstream_end(&bs);
+  if (packedpic_bits == 0) {
+    bitstream_init(&bs, packedpic_data, PACKED_HEADER_DWORDS);
+    nal_start_code_prefix(&bs, NALU_PPS);
+    nal_header(&bs, NALU_PPS);
+    pps_rbsp(&bs);
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+    packedpic_bits = bs.bit_offset;
+  }
 
-  *header_buffer = (unsigned char *)bs.buffer;
-  return bs.bit_offset;
+  *header_buffer = (unsigned char *)packedpic_data;
+  return packedpic_bits;
 }
 
 /* --------------------------------------------------------------------------
@@ -1488,15 +1565,18 @@ build_packed_video_buffer(unsigned char **header_buffer)
 {
   bitstream bs;
 
-  bitstream_start(&bs);
-  nal_start_code_prefix(&bs, NALU_VPS);
-  nal_header(&bs, NALU_VPS);
-  vps_rbsp(&bs);
-  rbsp_trailing_bits(&bs);
-  bitstream_end(&bs);
+  if (packedvideo_bits == 0) {
+    bitstream_init(&bs, packedvideo_data, PACKED_HEADER_DWORDS);
+    nal_start_code_prefix(&bs, NALU_VPS);
+    nal_header(&bs, NALU_VPS);
+    vps_rbsp(&bs);
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+    packedvideo_bits = bs.bit_offset;
+  }
 
-  *header_buffer = (unsigned char *)bs.buffer;
-  return bs.bit_offset;
+  *header_buffer = (unsigned char *)packedvideo_data;
+  return packedvideo_bits;
 }
 
 /* --------------------------------------------------------------------------
@@ -1507,15 +1587,18 @@ build_packed_seq_buffer(unsigned char **header_buffer)
 {
   bitstream bs;
 
-  bitstream_start(&bs);
-  nal_start_code_prefix(&bs, NALU_SPS);
-  nal_header(&bs, NALU_SPS);
-  sps_rbsp(&bs);
-  rbsp_trailing_bits(&bs);
-  bitstream_end(&bs);
+  if (packedseq_bits == 0) {
+    bitstream_init(&bs, packedseq_data, PACKED_HEADER_DWORDS);
+    nal_start_code_prefix(&bs, NALU_SPS);
+    nal_header(&bs, NALU_SPS);
+    sps_rbsp(&bs);
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+    packedseq_bits = bs.bit_offset;
+  }
 
-  *header_buffer = (unsigned char *)bs.buffer;
-  return bs.bit_offset;
+  *header_buffer = (unsigned char *)packedseq_data;
+  return packedseq_bits;
 }
 
 /* --------------------------------------------------------------------------
@@ -1527,14 +1610,14 @@ static int build_packed_slice_buffer(unsigned char **header_buffer)
   int is_idr = !!pic_param.pic_fields.bits.idr_pic_flag;
   int naluType = is_idr ? NALU_IDR_W_DLP : NALU_TRAIL_R;
 
-  bitstream_start(&bs);
+  bitstream_init(&bs, packedslice_data, PACKED_HEADER_DWORDS);
   nal_start_code_prefix(&bs, NALU_TRAIL_R);
   nal_header(&bs, naluType);
   sliceHeader_rbsp(&bs, &ssh, &sps, &pps, 0);
   rbsp_trailing_bits(&bs);
   bitstream_end(&bs);
 
-  *header_buffer = (unsigned char *)bs.buffer;
+  *header_buffer = (unsigned char *)packedslice_data;
   return bs.bit_offset;
 }
 
@@ -1759,6 +1842,18 @@ static int print_help(void)
   printf("   --profile 1: main 2 : main10\n");
   printf("   --p2b 1: enable 0 : disalbe(defalut)\n");
   printf("   --lowpower 1: enable 0 : disalbe(defalut)\n");
+  printf("   --slices <number> split pictures into slices of whole CTU rows\n");
+  printf("   --roi <x,y,w,h[,qp_delta]> region of interest, may be repeated\n");
+  printf("   --roifile <filename> regions of interest, default is <srcyuv>.roi\n");
+  printf("   --scenecut <number> mean luma difference starting a new GOP, 0 disables (default),\n");
+  printf("                        30 detects a switch to another scene\n");
+  printf("   --nv12 source is NV12 converted by enchost\n");
+  printf("   --mux <raw|mp4|ts|nal> container of the coded file, default from its extension\n");
+  printf("   --telemetry <file> per frame timing exported on exit and on SIGUSR2,\n");
+  printf("                      CSV records if file ends in .csv, else JSON histograms\n");
+  printf("   --backend <va|null> null simulates the hardware to measure the rest\n");
+  printf("   --null_delay <us> encode time simulated by the null backend (default 5 ms at 1080p)\n");
+  printf("   --feedback <socket> adapt the bitrate to the receiver reports forwarded by the streamer\n");
   return 0;
 }
 
@@ -1786,6 +1881,16 @@ static int process_cmdline(int argc, char *argv[])
 				     {"profile", required_argument, NULL, 17 },
 				     {"p2b", required_argument, NULL, 18 },
 				     {"lowpower", required_argument, NULL, 19 },
+				     {"slices", required_argument, NULL, 20 },
+				     {"roi", required_argument, NULL, 21 },
+				     {"roifile", required_argument, NULL, 22 },
+				     {"scenecut", required_argument, NULL, 23 },
+				     {"nv12", no_argument, NULL, 24 },
+				     {"mux", required_argument, NULL, 25 },
+				     {"telemetry", required_argument, NULL, 26 },
+				     {"backend", required_argument, NULL, 27 },
+				     {"null_delay", required_argument, NULL, 28 },
+				     {"feedback", required_argument, NULL, 29 },
 				     {NULL, no_argument, NULL, 0 }
   };
   int long_index;
@@ -1875,6 +1980,53 @@ static int process_cmdline(int argc, char *argv[])
     case 19:
       lowpower = atoi(optarg);
       break;
+    case 20:
+      frame_slices = atoi(optarg);
+      break;
+    case 21:
+      if (roi_parse(&rois, optarg) == -1) {
+	printf(" bad region of interest %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 22:
+      free(rois.fn);
+      rois.fn = strdup(optarg);
+      break;
+    case 23:
+      scenecut = atoi(optarg);
+      break;
+    case 24:
+      srcyuv_nv12 = 1;
+      break;
+    case 25:
+      mux_forced = mux_parse(optarg);
+      if (mux_forced == -1) {
+	print_help();
+	exit(1);
+      }
+      break;
+    case 26:
+      free(telemetry_fn);
+      telemetry_fn = strdup(optarg);
+      break;
+    case 27:
+      if (strcmp(optarg, "null") == 0)
+	backend_type = BACKEND_NULL;
+      else if (strcmp(optarg, "va") == 0)
+	backend_type = BACKEND_VA;
+      else {
+	print_help();
+	exit(1);
+      }
+      break;
+    case 28:
+      null_delay = atoi(optarg);
+      break;
+    case 29:
+      free(feedback_fn);
+      feedback_fn = strdup(optarg);
+      break;
 
     case ':':
     case '?':
@@ -1895,6 +2047,10 @@ static int process_cmdline(int argc, char *argv[])
     printf(" intra_idr_period must be a multiplier of intra_period\n");
     exit(0);
   }
+  if (frame_slices < 1) {
+    printf(" slices must be greater than 0\n");
+    exit(0);
+  }
   if (ip_period > 1) {
     frame_count -= (frame_count - 1) % ip_period;
   }
@@ -1904,6 +2060,10 @@ static int process_cmdline(int argc, char *argv[])
 
   /* open source file */
   if (!srcyuv_fn) srcyuv_fn = strdup("/tmp/frame");
+  if (!rois.fn) {
+    rois.fn = malloc(strlen(srcyuv_fn) + 5);
+    sprintf(rois.fn, "%s.roi", srcyuv_fn);
+  }
   srcyuv_fp = fopen(srcyuv_fn, "r");
 
   if (srcyuv_fp == NULL) {
@@ -1912,16 +2072,20 @@ static int process_cmdline(int argc, char *argv[])
   }
   else {
     srcyuv_frames = 1;  // <-- source file contains only one frame
-    int mmap_size = frame_width * frame_height * 4;
-    srcyuv_ptr = (unsigned char *)mmap(0, mmap_size, PROT_READ, MAP_SHARED,
+    int mmap_size = frame_width * frame_height * (srcyuv_nv12 ? 3 : 8) / 2;
+    size_t info_size = frameinfo_size(fileno(srcyuv_fp), mmap_size);
+    srcyuv_ptr = (unsigned char *)mmap(0, mmap_size + info_size, PROT_READ, MAP_SHARED,
 				       fileno(srcyuv_fp), 0);
     if (srcyuv_ptr == MAP_FAILED) {
       printf("Failed to mmap YUV file (%s)\n", strerror(errno));
       exit(1);
     }
+    if (info_size)
+      frame_info = (struct frameinfo_s *)(srcyuv_ptr + mmap_size);
 
-    nv12 = (unsigned char*) malloc( 3*mmap_size / 8);
-    if (nv12 == NULL) {
+    /* enchost converted the frame, it is encoded in place */
+    nv12 = srcyuv_nv12 ? srcyuv_ptr : (unsigned char*) malloc( 3*mmap_size / 8);
+    if (nv12 == NULL || scene_init(&scene, frame_width, frame_height, 0) == -1) {
       fprintf (stderr, "memory allocation error.\n");
       exit (1);
     }
@@ -1938,13 +2102,11 @@ static int process_cmdline(int argc, char *argv[])
   }
 
   /* store coded data into a file */
-  if (coded_fn) {
-    coded_fp = fopen(coded_fn, "w+");
-  } else {
+  if (coded_fn == NULL) {
     printf("Copy file string failed");
     exit(1);
   }
-  if (coded_fp == NULL) {
+  if (mux_open(&mux, coded_fn, mux_forced, MUX_HEVC, frame_width, frame_height, frame_rate) == -1) {
     printf("Open file %s failed, exit\n", coded_fn);
     exit(1);
   }
@@ -2150,8 +2312,29 @@ static int init_va(void)
 	   hevc_maxref & 0xffff, (hevc_maxref >> 16) & 0xffff);
   }
 
-  if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED)
+  if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED) {
     printf("Support %d slices\n", attrib[VAConfigAttribEncMaxSlices].value);
+    if (frame_slices > attrib[VAConfigAttribEncMaxSlices].value) {
+      frame_slices = attrib[VAConfigAttribEncMaxSlices].value;
+      printf("Using %d slices\n", frame_slices);
+    }
+  }
+
+  if (attrib[VAConfigAttribEncROI].value != VA_ATTRIB_NOT_SUPPORTED) {
+    VAConfigAttribValEncROI roi_attrib = { .value = attrib[VAConfigAttribEncROI].value };
+
+    printf("Support %d regions of interest\n", roi_attrib.bits.num_roi_regions);
+
+    roi_va_regions = roi_attrib.bits.num_roi_regions;
+    roi_va_qp_delta = roi_attrib.bits.roi_rc_qp_delta_support || rc_mode == VA_RC_CQP;
+    if (roi_va_regions) {
+      config_attrib[config_attrib_num].type = VAConfigAttribEncROI;
+      config_attrib[config_attrib_num].value = attrib[VAConfigAttribEncROI].value;
+      config_attrib_num++;
+    }
+  }
+  if (!roi_va_regions && (rois.n || access(rois.fn, F_OK) == 0))
+    printf("Regions of interest need VA ROI support, they are ignored\n");
 
   if (attrib[VAConfigAttribEncSliceStructure].value != VA_ATTRIB_NOT_SUPPORTED) {
     int tmp = attrib[VAConfigAttribEncSliceStructure].value;
@@ -2218,6 +2401,17 @@ static int init_va(void)
     config_attrib_num++;
   }
 #endif
+
+  /* slices are made of whole CTU rows, the CTU size is known now */
+  {
+    int lcu_size = use_block_sizes ? (1 << (block_sizes.log2_max_coding_tree_block_size_minus3 + 3)) : LCU_SIZE;
+    int rows = (frame_height + lcu_size - 1) / lcu_size;
+
+    if (frame_slices > rows) {
+      frame_slices = rows;
+      printf("Slices are made of CTU rows, using %d slices\n", frame_slices);
+    }
+  }
   free(entrypoints);
   return 0;
 }
@@ -2229,16 +2423,21 @@ static int setup_encode()
 {
   VAStatus va_status;
   VASurfaceID *tmp_surfaceid;
-  int codedbuf_size, i;
+  unsigned int i;
 
   va_status = vaCreateConfig(va_dpy, hevc_profile, entryPoint,
 			     &config_attrib[0], config_attrib_num, &config_id);
   CHECK_VASTATUS(va_status, "vaCreateConfig");
 
+  /* the storage thread works on one picture while the next ones are coded,
+     B pictures keep the previous anchor as well */
+  vapool_size(&pool, frame_width_aligned, frame_height_aligned, num_ref_frames + (ip_period > 1),
+	      encode_syncmode ? 1 : ip_period + 1, (rc_mode == VA_RC_CQP) ? 0 : frame_bitrate, frame_rate);
+
   /* create source surfaces */
   va_status = vaCreateSurfaces(va_dpy,
 			       VA_RT_FORMAT_YUV420, frame_width_aligned, frame_height_aligned,
-			       &src_surface[0], SURFACE_NUM,
+			       &src_surface[0], pool.src,
 			       NULL, 0);
   CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
@@ -2246,29 +2445,27 @@ static int setup_encode()
   va_status = vaCreateSurfaces(
 			       va_dpy,
 			       VA_RT_FORMAT_YUV420, frame_width_aligned, frame_height_aligned,
-			       &ref_surface[0], SURFACE_NUM,
+			       &ref_surface[0], pool.ref,
 			       NULL, 0
 			       );
   CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
-  tmp_surfaceid = calloc(2 * SURFACE_NUM, sizeof(VASurfaceID));
+  tmp_surfaceid = calloc(pool.src + pool.ref, sizeof(VASurfaceID));
   if (tmp_surfaceid) {
-    memcpy(tmp_surfaceid, src_surface, SURFACE_NUM * sizeof(VASurfaceID));
-    memcpy(tmp_surfaceid + SURFACE_NUM, ref_surface, SURFACE_NUM * sizeof(VASurfaceID));
+    memcpy(tmp_surfaceid, src_surface, pool.src * sizeof(VASurfaceID));
+    memcpy(tmp_surfaceid + pool.src, ref_surface, pool.ref * sizeof(VASurfaceID));
   }
 
   /* Create a context for this encode pipe */
   va_status = vaCreateContext(va_dpy, config_id,
 			      frame_width_aligned, frame_height_aligned,
 			      VA_PROGRESSIVE,
-			      tmp_surfaceid, 2 * SURFACE_NUM,
+			      tmp_surfaceid, pool.src + pool.ref,
 			      &context_id);
   CHECK_VASTATUS(va_status, "vaCreateContext");
   free(tmp_surfaceid);
 
-  codedbuf_size = ((long long int) frame_width_aligned * frame_height_aligned * 400) / (16 * 16);
-
-  for (i = 0; i < SURFACE_NUM; i++) {
+  for (i = 0; i < pool.src; i++) {
     /* create coded buffer once for all
      * other VA buffers which won't be used again after vaRenderPicture.
      * so APP can always vaCreateBuffer for every frame
@@ -2276,13 +2473,32 @@ static int setup_encode()
      * so VA won't maintain the coded buffer
      */
     va_status = vaCreateBuffer(va_dpy, context_id, VAEncCodedBufferType,
-			       codedbuf_size, 1, NULL, &coded_buf[i]);
+			       pool.coded_size, 1, NULL, &coded_buf[i]);
     CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    coded_buf_size[i] = pool.coded_size;
   }
+  vapool_report(&pool, frame_width_aligned, frame_height_aligned);
 
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  Reconstructed surface of the current picture: one that is not a reference
+ * --------------------------------------------------------------------------*/
+static VASurfaceID free_ref_surface()
+{
+  unsigned int i, j;
+
+  for (i = 0; i < pool.ref; i++) {
+    for (j = 0; j < numShortTerm; j++)
+      if (ReferenceFrames[j].picture_id == ref_surface[i])
+	break;
+    if (j == numShortTerm)
+      return ref_surface[i];
+  }
+  return ref_surface[0];
+}
+
 
 
 /* --------------------------------------------------------------------------
@@ -2388,6 +2604,43 @@ static int update_RefPicList(void)
 }
 
 
+/* --------------------------------------------------------------------------
+ *  Rate control parameters, with every sequence and when the bitrate
+ *  changes in the middle of one
+ * --------------------------------------------------------------------------*/
+static int render_rate_control(void)
+{
+  VABufferID rc_param_buf = VA_INVALID_ID;
+  VAStatus va_status;
+  VAEncMiscParameterBuffer *misc_param;
+  VAEncMiscParameterRateControl *misc_rate_ctrl;
+
+  va_status = vaCreateBuffer(va_dpy, context_id,
+			     VAEncMiscParameterBufferType,
+			     sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl),
+			     1, NULL, &rc_param_buf);
+  CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+  vaMapBuffer(va_dpy, rc_param_buf, (void **)&misc_param);
+  misc_param->type = VAEncMiscParameterTypeRateControl;
+  misc_rate_ctrl = (VAEncMiscParameterRateControl *)misc_param->data;
+  memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
+  misc_rate_ctrl->bits_per_second = frame_bitrate;
+  misc_rate_ctrl->target_percentage = 66;
+  misc_rate_ctrl->window_size = 1000;
+  misc_rate_ctrl->initial_qp = initial_qp;
+  misc_rate_ctrl->min_qp = minimal_qp;
+  misc_rate_ctrl->basic_unit_size = 0;
+  vaUnmapBuffer(va_dpy, rc_param_buf);
+
+  va_status = vaRenderPicture(va_dpy, context_id, &rc_param_buf, 1);
+  CHECK_VASTATUS(va_status, "vaRenderPicture");
+  vaDestroyBuffer(va_dpy, rc_param_buf);
+  bitrate_changed = 0;
+
+  return 0;
+}
+
 /* --------------------------------------------------------------------------
  *  
  * --------------------------------------------------------------------------*/
@@ -2395,12 +2648,9 @@ static int render_sequence(struct SeqParamSet *sps)
 {
 
   VABufferID seq_param_buf = VA_INVALID_ID;
-  VABufferID rc_param_buf = VA_INVALID_ID;
   VABufferID misc_param_tmpbuf = VA_INVALID_ID;
-  VABufferID render_id[2] = {VA_INVALID_ID};
   VAStatus va_status;
-  VAEncMiscParameterBuffer *misc_param, *misc_param_tmp;
-  VAEncMiscParameterRateControl *misc_rate_ctrl;
+  VAEncMiscParameterBuffer *misc_param_tmp;
   seq_param.general_profile_idc = sps->ptps.general_profile_idc;
   seq_param.general_level_idc = sps->ptps.general_level_idc;
   seq_param.general_tier_flag = (uint8_t)(sps->ptps.general_tier_flag);
@@ -2439,39 +2689,14 @@ static int render_sequence(struct SeqParamSet *sps)
 			     sizeof(seq_param), 1, &seq_param, &seq_param_buf);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-  va_status = vaCreateBuffer(va_dpy, context_id,
-			     VAEncMiscParameterBufferType,
-			     sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl),
-			     1, NULL, &rc_param_buf);
-  CHECK_VASTATUS(va_status, "vaCreateBuffer");
-
-  vaMapBuffer(va_dpy, rc_param_buf, (void **)&misc_param);
-  misc_param->type = VAEncMiscParameterTypeRateControl;
-  misc_rate_ctrl = (VAEncMiscParameterRateControl *)misc_param->data;
-  memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
-  misc_rate_ctrl->bits_per_second = frame_bitrate;
-  misc_rate_ctrl->target_percentage = 66;
-  misc_rate_ctrl->window_size = 1000;
-  misc_rate_ctrl->initial_qp = initial_qp;
-  misc_rate_ctrl->min_qp = minimal_qp;
-  misc_rate_ctrl->basic_unit_size = 0;
-  vaUnmapBuffer(va_dpy, rc_param_buf);
-
-  render_id[0] = seq_param_buf;
-  render_id[1] = rc_param_buf;
-
-  va_status = vaRenderPicture(va_dpy, context_id, &render_id[0], 2);
+  va_status = vaRenderPicture(va_dpy, context_id, &seq_param_buf, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
   if (seq_param_buf != VA_INVALID_ID) {
     vaDestroyBuffer(va_dpy, seq_param_buf);
     seq_param_buf = VA_INVALID_ID;
   }
 
-  if (rc_param_buf != VA_INVALID_ID) {
-    vaDestroyBuffer(va_dpy, rc_param_buf);
-    rc_param_buf = VA_INVALID_ID;
-  }
-
+  render_rate_control();
 
   if (misc_priv_type != 0) {
     va_status = vaCreateBuffer(va_dpy, context_id,
@@ -2510,7 +2735,7 @@ static int render_picture(struct PicParamSet *pps)
   pic_param.last_picture |= ((current_frame_encoding + 1) == frame_count) ? HEVC_LAST_PICTURE_EOSTREAM : 0;
   pic_param.coded_buf = coded_buf[current_slot];
 
-  pic_param.decoded_curr_pic.picture_id = ref_surface[current_slot];
+  pic_param.decoded_curr_pic.picture_id = free_ref_surface();
   pic_param.decoded_curr_pic.pic_order_cnt = calc_poc((current_frame_display - current_IDR_display) % MaxPicOrderCntLsb) * 2;
   pic_param.decoded_curr_pic.flags = 0;
   CurrentCurrPic = pic_param.decoded_curr_pic;
@@ -2606,8 +2831,6 @@ static int render_packedvideo(void)
   va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  free(packedvideo_buffer);
-
   if (packedvideo_para_bufid != VA_INVALID_ID) {
     vaDestroyBuffer(va_dpy, packedvideo_para_bufid);
     packedvideo_para_bufid = VA_INVALID_ID;
@@ -2658,8 +2881,6 @@ static int render_packedsequence(void)
   va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  free(packedseq_buffer);
-
   if (packedseq_para_bufid != VA_INVALID_ID) {
     vaDestroyBuffer(va_dpy, packedseq_para_bufid);
     packedseq_para_bufid = VA_INVALID_ID;
@@ -2710,8 +2931,6 @@ static int render_packedpicture(void)
   va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  free(packedpic_buffer);
-
   if (packedpic_para_bufid != VA_INVALID_ID) {
     vaDestroyBuffer(va_dpy, packedpic_para_bufid);
     packedpic_para_bufid = VA_INVALID_ID;
@@ -2724,6 +2943,52 @@ static int render_packedpicture(void)
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  Regions of interest, drivers without ROI support ignore them
+ * --------------------------------------------------------------------------*/
+static int render_roi(void)
+{
+  VAEncMiscParameterBuffer *misc_param;
+  VAEncMiscParameterBufferROI *misc_roi;
+  VABufferID roi_param_buf;
+  VAStatus va_status;
+  int i, n = MIN(rois.n, roi_va_regions);
+
+  if (n == 0)
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    roi_va[i].roi_rectangle.x = rois.r[i].x;
+    roi_va[i].roi_rectangle.y = rois.r[i].y;
+    roi_va[i].roi_rectangle.width = rois.r[i].w;
+    roi_va[i].roi_rectangle.height = rois.r[i].h;
+    /* a higher priority for a lower QP */
+    roi_va[i].roi_value = roi_va_qp_delta ? rois.r[i].delta : -rois.r[i].delta;
+  }
+
+  va_status = vaCreateBuffer(va_dpy, context_id,
+			     VAEncMiscParameterBufferType,
+			     sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterBufferROI),
+			     1, NULL, &roi_param_buf);
+  CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+  vaMapBuffer(va_dpy, roi_param_buf, (void **)&misc_param);
+  misc_param->type = VAEncMiscParameterTypeROI;
+  misc_roi = (VAEncMiscParameterBufferROI *)misc_param->data;
+  memset(misc_roi, 0, sizeof(*misc_roi));
+  misc_roi->num_roi = n;
+  misc_roi->max_delta_qp = 51;
+  misc_roi->min_delta_qp = -51;
+  misc_roi->roi = roi_va;
+  misc_roi->roi_flags.bits.roi_value_is_qp_delta = roi_va_qp_delta;
+  vaUnmapBuffer(va_dpy, roi_param_buf);
+
+  va_status = vaRenderPicture(va_dpy, context_id, &roi_param_buf, 1);
+  CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+  return 0;
+}
+
 /* --------------------------------------------------------------------------
  *  
  * --------------------------------------------------------------------------*/
@@ -2761,8 +3026,6 @@ static void render_packedslice()
   va_status = vaRenderPicture(va_dpy, context_id, render_id, 2);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  free(packedslice_buffer);
-
   if (packedslice_para_bufid != VA_INVALID_ID) {
     vaDestroyBuffer(va_dpy, packedslice_para_bufid);
     packedslice_para_bufid = VA_INVALID_ID;
@@ -2780,12 +3043,11 @@ static int render_slice(void)
 {
   VABufferID slice_param_buf = VA_INVALID_ID;
   VAStatus va_status;
+  int i, first_row, last_row;
   memset(&slice_param, 0x00, sizeof(VAEncSliceParameterBufferHEVC));
 
   update_RefPicList();
 
-  slice_param.slice_segment_address = 0;
-  slice_param.num_ctu_in_slice = ssh.picture_width_in_ctus * ssh.picture_height_in_ctus;
   slice_param.slice_type = ssh.slice_type;
   slice_param.slice_pic_parameter_set_id = ssh.slice_pic_parameter_set_id; // right???
 
@@ -2827,20 +3089,32 @@ static int render_slice(void)
   slice_param.slice_fields.bits.slice_loop_filter_across_slices_enabled_flag = ssh.slice_loop_filter_across_slices_enabled_flag;
   slice_param.slice_fields.bits.collocated_from_l0_flag = ssh.collocated_from_l0_flag;
 
-  if (hevc_packedheader &&
-      config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SLICE)
-    render_packedslice();
+  /* the picture rows are spread evenly over the slices */
+  for (i = 0; i < frame_slices; i++) {
+    first_row = i * ssh.picture_height_in_ctus / frame_slices;
+    last_row = (i + 1) * ssh.picture_height_in_ctus / frame_slices;
 
-  va_status = vaCreateBuffer(va_dpy, context_id, VAEncSliceParameterBufferType,
-			     sizeof(slice_param), 1, &slice_param, &slice_param_buf);
-  CHECK_VASTATUS(va_status, "vaCreateBuffer");;
+    ssh.slice_segment_address = first_row * ssh.picture_width_in_ctus;
+    ssh.first_slice_segment_in_pic_flag = ((ssh.slice_segment_address == 0) ? 1 : 0);
+    slice_param.slice_segment_address = ssh.slice_segment_address;
+    slice_param.num_ctu_in_slice = (last_row - first_row) * ssh.picture_width_in_ctus;
+    slice_param.slice_fields.bits.last_slice_of_pic_flag = (i == frame_slices - 1);
 
-  va_status = vaRenderPicture(va_dpy, context_id, &slice_param_buf, 1);
-  CHECK_VASTATUS(va_status, "vaRenderPicture");
+    if (hevc_packedheader &&
+	config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SLICE)
+      render_packedslice();
+
+    va_status = vaCreateBuffer(va_dpy, context_id, VAEncSliceParameterBufferType,
+			       sizeof(slice_param), 1, &slice_param, &slice_param_buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");;
 
-  if (slice_param_buf != VA_INVALID_ID) {
-    vaDestroyBuffer(va_dpy, slice_param_buf);
-    slice_param_buf = VA_INVALID_ID;
+    va_status = vaRenderPicture(va_dpy, context_id, &slice_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    if (slice_param_buf != VA_INVALID_ID) {
+      vaDestroyBuffer(va_dpy, slice_param_buf);
+      slice_param_buf = VA_INVALID_ID;
+    }
   }
 
   return 0;
@@ -2852,19 +3126,10 @@ static int render_slice(void)
 static int save_codeddata(unsigned long long display_order, unsigned long long encode_order)
 {
   static char *progress = "|/-\\";
-  VACodedBufferSegment *buf_list = NULL;
-  VAStatus va_status;
-  unsigned int coded_size = 0;
-
-  va_status = vaMapBuffer(va_dpy, coded_buf[display_order % SURFACE_NUM], (void **)(&buf_list));
-  CHECK_VASTATUS(va_status, "vaMapBuffer");
-  while (buf_list != NULL) {
-    coded_size += fwrite(buf_list->buf, 1, buf_list->size, coded_fp);
-    buf_list = (VACodedBufferSegment *) buf_list->next;
+  unsigned int coded_size;
 
-    frame_size += coded_size;
-  }
-  vaUnmapBuffer(va_dpy, coded_buf[display_order % SURFACE_NUM]);
+  coded_size = backend->store(display_order % pool.src);
+  frame_size += coded_size;
 
   printf ("\r      "); /* return back to startpoint */
   printf ("%c", progress[encode_order % 4]);
@@ -2872,9 +3137,8 @@ static int save_codeddata(unsigned long long display_order, unsigned long long e
   printf ("%08lld", encode_order);
   printf ("(%06d bytes coded)", coded_size);
   fflush (stdout);
-  fflush (coded_fp);
 
-  return 0;
+  return coded_size;
 }
 
 /* --------------------------------------------------------------------------
@@ -2905,14 +3169,14 @@ static struct storage_task_t * storage_task_dequeue(void)
 /* --------------------------------------------------------------------------
  *  
  * --------------------------------------------------------------------------*/
-static int storage_task_queue(unsigned long long display_order, unsigned long long encode_order)
+static int storage_task_queue(const struct storage_task_t *task)
 {
   struct storage_task_t *tmp;
 
   tmp = calloc(1, sizeof(struct storage_task_t));
   if (tmp) {
-    tmp->display_order = display_order;
-    tmp->encode_order = encode_order;
+    *tmp = *task;
+    tmp->next = NULL;
   }
 
   if (encode_syncmode == 0) {
@@ -2927,7 +3191,7 @@ static int storage_task_queue(unsigned long long display_order, unsigned long lo
     storage_task_tail = tmp;
   }
 
-  srcsurface_status[display_order % SURFACE_NUM] = SRC_SURFACE_IN_STORAGE;
+  srcsurface_status[task->display_order % pool.src] = SRC_SURFACE_IN_STORAGE;
   if (encode_syncmode == 0) {
     pthread_cond_signal(&encode_cond);
     pthread_mutex_unlock(&encode_mutex);
@@ -2937,24 +3201,51 @@ static int storage_task_queue(unsigned long long display_order, unsigned long lo
 }
 
 /* --------------------------------------------------------------------------
- *  
+ *  Telemetry export, on exit and on SIGUSR2. Frames are accounted for by
+ *  the storage task, which does the export as well.
  * --------------------------------------------------------------------------*/
-static void storage_task(unsigned long long display_order, unsigned long long encode_order)
+static void sigusr2 (int dummy)
 {
-  unsigned int tmp;
-  VAStatus va_status;
+  _sigusr2 = 1;
+}
 
-  tmp = GetTickCount();
-  va_status = vaSyncSurface(va_dpy, src_surface[display_order % SURFACE_NUM]);
-  CHECK_VASTATUS(va_status, "vaSyncSurface");
-  SyncPictureTicks += GetTickCount() - tmp;
-  tmp = GetTickCount();
-  save_codeddata(display_order, encode_order);
-  SavePictureTicks += GetTickCount() - tmp;
+static void export_telemetry ()
+{
+  _sigusr2 = 0;
+  if (telemetry_export (&tm) == -1)
+    printf ("\nCan't write telemetry to %s: %s\n", telemetry_fn, strerror (errno));
+}
+
+/* --------------------------------------------------------------------------
+ *  
+ * --------------------------------------------------------------------------*/
+static void storage_task(struct storage_task_t *task)
+{
+  unsigned long long display_order = task->display_order;
+  unsigned long long tmp;
+  unsigned int size;
+  int type;
+
+  tmp = telemetry_now();
+  backend->sync(display_order % pool.src);
+  telemetry_add(&task->tm, TELEMETRY_SYNC, tmp);
+  tmp = telemetry_now();
+  size = save_codeddata(display_order, task->encode_order);
+  /* B pictures are presented up to ip_period - 1 frames after decoding */
+  mux_picture(&mux, task->capture_time, display_order - task->encode_order + ip_period - 1,
+	      task->frame_type == FRAME_IDR);
+  telemetry_add(&task->tm, TELEMETRY_SAVE, tmp);
+
+  type = (task->frame_type == FRAME_IDR) ? TELEMETRY_IDR :
+    (task->frame_type == FRAME_I) ? TELEMETRY_I :
+    (task->frame_type == FRAME_B) ? TELEMETRY_B : TELEMETRY_P;
+  telemetry_end(&tm, &task->tm, type, size);
+  if (_sigusr2)
+    export_telemetry();
 
   if (encode_syncmode == 0) {
     pthread_mutex_lock(&encode_mutex);
-    srcsurface_status[display_order % SURFACE_NUM] = SRC_SURFACE_IN_ENCODING;
+    srcsurface_status[display_order % pool.src] = SRC_SURFACE_IN_ENCODING;
     pthread_mutex_unlock(&encode_mutex);
   }
 }
@@ -2975,7 +3266,7 @@ static void * storage_task_thread(void *t)
       continue;
     }
 
-    storage_task(current->display_order, current->encode_order);
+    storage_task(current);
 
     free(current);
 
@@ -2987,38 +3278,6 @@ static void * storage_task_thread(void *t)
   return 0;
 }
 
-/* --------------------------------------------------------------------------
- *  NV12 conversion
- *  in nv12 u and v are w/2*h/2 and interleaved
- * --------------------------------------------------------------------------*/
-void tfnv12 (int w, int h, unsigned char *rgba, unsigned char *y, unsigned char *uv)
-{
-  unsigned short ru[w], rv[w];
-  unsigned char *prgba, *py = y, *puv = uv;
-  int l, c, ww = w>>1;
-
-  memset (ru, 0, sizeof(ru));
-  memset (rv, 0, sizeof(rv));
-
-  for (l = 1; l <= h; ++l) {
-    prgba = rgba + (h-l)*w*4;
-    for (c = 0; c < w; ++c) {
-      // original 4 bytes pixels are YUVA
-      *py++ = *prgba++;
-      ru[c>>1] += *prgba++;
-      rv[c>>1] += *prgba++;
-      prgba++;
-    }
-    if ((l & 0x01) == 0) {
-      for (c = 0; c < ww; ++c) {
-        *puv++ = (unsigned char) (ru[c] >> 2) & 0xff;
-        *puv++ = (unsigned char) (rv[c] >> 2) & 0xff;
-        ru[c] = rv[c] = 0;
-      }
-    }
-  }
-}
-
 // @todo: move
 static int _sigusr1 = 0;
 static int _done = 0;
@@ -3068,13 +3327,102 @@ static void waitforimage ()
   }
 }
 
+// -----------------------------------------------------------------------------
+//  Content analysis of the converted picture, a P picture of a new scene
+//  becomes an IDR. Only with ip_period 1, B pictures are not reordered.
+// -----------------------------------------------------------------------------
+static void analyse_picture(void)
+{
+  unsigned long long tmp = telemetry_now();
+
+  scene_analyse(&scene, nv12, frame_width);
+
+  if (current_frame_type == FRAME_P && scene.mean >= scenecut &&
+      current_frame_display - current_IDR_display >= frame_rate / 4) {
+    /* a new GOP starts, the next periodic IDR comes a full period later */
+    gop_start = current_frame_encoding;
+    encoding2display_order(0, intra_period, intra_idr_period, ip_period,
+			   &current_frame_display, &current_frame_type);
+    current_frame_display += gop_start;
+    scene_cuts++;
+  }
+  scene_keep(&scene, nv12, frame_width);
+  telemetry_add(&tm_frame, TELEMETRY_ANALYSE, tmp);
+}
+
+// -----------------------------------------------------------------------------
+//  Frame number of the signalled frame: returns the number of frames missed
+//  since the last one, -1 if it was already taken
+// -----------------------------------------------------------------------------
+static int check_frame ()
+{
+  uint64_t seq, time;
+  int gap = 0;
+
+  if (frameinfo_read(frame_info, &seq, &time) == -1) {
+    frame_time = 0;
+    return 0;
+  }
+  if (seq == frame_seq) {
+    frames_duplicated++;
+    return -1;
+  }
+  /* a lower number is a restart of the source */
+  if (frame_seq && seq > frame_seq)
+    gap = (int)MIN(seq - frame_seq - 1, 0x7fffffffULL);
+  frame_seq = seq;
+  frame_time = time;
+  frames_dropped += gap;
+  return gap;
+}
+
+// -----------------------------------------------------------------------------
+//  Bitrate commands forwarded by the streamer, see feedback.h. The driver
+//  gets the new bitrate with the next picture.
+// -----------------------------------------------------------------------------
+static void poll_feedback ()
+{
+  char *line, *argv[4];
+  long long rate;
+  int argc;
+
+  if (feedback_fn == NULL)
+    return;
+  control_wait(&feedback_ctl, 0);
+  while ((line = control_line(&feedback_ctl)) != NULL) {
+    argc = 0;
+    while (argc < 4 && (argv[argc] = strtok(argc ? NULL : line, " \t")) != NULL)
+      argc++;
+    if (argc == 0)
+      continue;
+
+    rate = feedback_command(&feedback, argc, argv);
+    if (rate == 0) {
+      control_reply(&feedback_ctl, "error unknown command");
+    } else if (rate < 0) {
+      control_reply(&feedback_ctl, "error bad arguments");
+    } else if (rc_mode == VA_RC_CQP) {
+      control_reply(&feedback_ctl, "error constant QP");
+    } else {
+      if (rate != frame_bitrate) {
+	printf("\nBitrate %lld kbps (loss %.1f%%, jitter %.0f ms)\n",
+	       rate / 1000, feedback.loss * 100, feedback.jitter);
+	frame_bitrate = rate;
+	bitrate_changed = 1;
+      }
+      control_reply(&feedback_ctl, "ok %lld", rate);
+    }
+  }
+}
+
 // -----------------------------------------------------------------------------
 //  Encoding loop
 // -----------------------------------------------------------------------------
 static int encode_loop ()
 {
-  unsigned int tmp;
-  VAStatus va_status;
+  struct storage_task_t task;
+  unsigned long long tmp;
+  struct timeval tv;
   
   /* ready for encoding */
   memset(srcsurface_status, SRC_SURFACE_IN_ENCODING, sizeof(srcsurface_status));
@@ -3083,22 +3431,39 @@ static int encode_loop ()
   memset(&pic_param, 0, sizeof(pic_param));
   memset(&slice_param, 0, sizeof(slice_param));
 
+  /* parameter sets are the same for every frame */
+  fill_vps_header(&vps);
+  fill_sps_header(&sps, 0);
+  fill_pps_header(&pps, 0, 0);
+
   if (encode_syncmode == 0)
     pthread_create(&encode_thread, NULL, storage_task_thread, NULL);
   
   for (current_frame_encoding = 0; current_frame_encoding < frame_count; current_frame_encoding++) {
-    // wait for an image to be ready
-    waitforimage ();
+    // wait for an image to be ready, a frame signalled twice is taken once
+    do {
+      waitforimage ();
+    } while (!_done && check_frame () < 0);
     if (_done) break;
+    poll_feedback ();
+    telemetry_begin(&tm_frame, current_frame_encoding);
+    gettimeofday(&tv, NULL);
 
     // process image
-    tmp = GetTickCount ();
-    tfnv12 (frame_width, frame_height, srcyuv_ptr, nv12, nv12 + frame_width*frame_height);
-    ProcessPictureTicks += GetTickCount() - tmp;
+    tmp = telemetry_now();
+    if (!srcyuv_nv12)
+      tfnv12 (frame_width, frame_height, srcyuv_ptr, nv12, nv12 + frame_width*frame_height);
+    telemetry_add(&tm_frame, TELEMETRY_CONVERT, tmp);
     
+    // regions of interest published with the image
+    roi_update(&rois);
+
     // compute this frame type
-    encoding2display_order(current_frame_encoding, intra_period, intra_idr_period, ip_period,
+    encoding2display_order(current_frame_encoding - gop_start, intra_period, intra_idr_period, ip_period,
                            &current_frame_display, &current_frame_type);
+    current_frame_display += gop_start;
+    if (ip_period == 1 && scenecut > 0)
+      analyse_picture();
 
     // wait for slot to be ready for upload
     while (srcsurface_status[current_slot] != SRC_SURFACE_IN_ENCODING) {
@@ -3106,10 +3471,9 @@ static int encode_loop ()
     }
     
     // load image
-    tmp = GetTickCount ();
-    upload_surface_yuv (va_dpy, src_surface[current_slot], VA_FOURCC_NV12, frame_width, frame_height,
-			nv12, nv12 + frame_width*frame_height, NULL);
-    UploadPictureTicks += GetTickCount() - tmp;
+    tmp = telemetry_now();
+    backend->upload(nv12);
+    telemetry_add(&tm_frame, TELEMETRY_UPLOAD, tmp);
 
     if (current_frame_type == FRAME_IDR) {
       numShortTerm = 0;
@@ -3117,41 +3481,21 @@ static int encode_loop ()
       current_IDR_display = current_frame_display;
     }
 
-    // begin picture
-    tmp = GetTickCount();
-    va_status = vaBeginPicture(va_dpy, context_id, src_surface[current_slot]);
-    CHECK_VASTATUS(va_status, "vaBeginPicture");
-    BeginPictureTicks += GetTickCount() - tmp;
-    fill_vps_header(&vps);
-    fill_sps_header(&sps, 0);
-    fill_pps_header(&pps, 0, 0);
-
-    // encode image
-    tmp = GetTickCount();
-    if (current_frame_type == FRAME_IDR) {
-      render_sequence(&sps);
-      render_packedvideo();
-      render_packedsequence();
-    }
-    render_packedpicture();
-    render_picture(&pps);
-    fill_slice_header(0, &pps, &ssh);
-    render_slice();
-    RenderPictureTicks += GetTickCount() - tmp;
-
-    // end picture
-    tmp = GetTickCount();
-    va_status = vaEndPicture(va_dpy, context_id);
-    CHECK_VASTATUS(va_status, "vaEndPicture");;
-    EndPictureTicks += GetTickCount() - tmp;
+    backend->encode_picture();
 
     // store to file
+    memset(&task, 0, sizeof(task));
+    task.display_order = current_frame_display;
+    task.encode_order = current_frame_encoding;
+    task.capture_time = frame_time ? frame_time : tv.tv_sec * 1000000ULL + tv.tv_usec;
+    task.frame_type = current_frame_type;
+    task.tm = tm_frame;
     if (encode_syncmode) {
-      storage_task(current_frame_display, current_frame_encoding);
+      storage_task(&task);
     }
     else {
       /* queue the storage task queue */
-      storage_task_queue(current_frame_display, current_frame_encoding);
+      storage_task_queue(&task);
     }
     
     update_ReferenceFrames();
@@ -3172,10 +3516,10 @@ static int release_encode()
 {
   int i;
 
-  vaDestroySurfaces(va_dpy, &src_surface[0], SURFACE_NUM);
-  vaDestroySurfaces(va_dpy, &ref_surface[0], SURFACE_NUM);
+  vaDestroySurfaces(va_dpy, &src_surface[0], pool.src);
+  vaDestroySurfaces(va_dpy, &ref_surface[0], pool.ref);
 
-  for (i = 0; i < SURFACE_NUM; i++)
+  for (i = 0; i < pool.src; i++)
     vaDestroyBuffer(va_dpy, coded_buf[i]);
 
   vaDestroyContext(va_dpy, context_id);
@@ -3196,6 +3540,234 @@ static int deinit_va()
   return 0;
 }
 
+/* --------------------------------------------------------------------------
+ *  VA backend
+ * --------------------------------------------------------------------------*/
+static void va_backend_init ()
+{
+  init_va();
+  setup_encode();
+}
+
+static void va_upload (unsigned char *nv12)
+{
+  upload_surface_yuv (va_dpy, src_surface[current_slot], VA_FOURCC_NV12, frame_width, frame_height,
+		      nv12, nv12 + frame_width*frame_height, NULL);
+}
+
+static void va_encode_picture ()
+{
+  unsigned long long tmp;
+  VAStatus va_status;
+
+  // begin picture
+  tmp = telemetry_now();
+  va_status = vaBeginPicture(va_dpy, context_id, src_surface[current_slot]);
+  CHECK_VASTATUS(va_status, "vaBeginPicture");
+  telemetry_add(&tm_frame, TELEMETRY_BEGIN, tmp);
+
+  // encode image
+  tmp = telemetry_now();
+  if (current_frame_type == FRAME_IDR) {
+    render_sequence(&sps);
+    render_packedvideo();
+    render_packedsequence();
+  } else if (bitrate_changed) {
+    render_rate_control();
+  }
+  render_packedpicture();
+  render_picture(&pps);
+  render_roi();
+  fill_slice_header(0, &pps, &ssh);
+  render_slice();
+  telemetry_add(&tm_frame, TELEMETRY_RENDER, tmp);
+
+  // end picture
+  tmp = telemetry_now();
+  va_status = vaEndPicture(va_dpy, context_id);
+  CHECK_VASTATUS(va_status, "vaEndPicture");
+  telemetry_add(&tm_frame, TELEMETRY_END, tmp);
+}
+
+static void va_sync (unsigned int slot)
+{
+  VAStatus va_status;
+
+  va_status = vaSyncSurface(va_dpy, src_surface[slot]);
+  CHECK_VASTATUS(va_status, "vaSyncSurface");
+}
+
+static unsigned int va_store (unsigned int slot)
+{
+  VACodedBufferSegment *buf_list = NULL;
+  VAStatus va_status;
+  unsigned int coded_size = 0;
+  int overflow = 0;
+
+  va_status = vaMapBuffer(va_dpy, coded_buf[slot], (void **)(&buf_list));
+  CHECK_VASTATUS(va_status, "vaMapBuffer");
+  while (buf_list != NULL) {
+    overflow |= buf_list->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK;
+    coded_size += mux_write(&mux, buf_list->buf, buf_list->size);
+    buf_list = (VACodedBufferSegment *) buf_list->next;
+  }
+  vaUnmapBuffer(va_dpy, coded_buf[slot]);
+
+  /* the picture is already cut, the next ones get larger buffers as their
+     slot is released */
+  if (overflow && coded_buf_size[slot] == pool.coded_size && vapool_grow(&pool))
+    printf ("\nCoded buffer overflow, growing to %u KB\n", pool.coded_size / 1024);
+  if (coded_buf_size[slot] < pool.coded_size) {
+    vaDestroyBuffer(va_dpy, coded_buf[slot]);
+    va_status = vaCreateBuffer(va_dpy, context_id, VAEncCodedBufferType,
+			       pool.coded_size, 1, NULL, &coded_buf[slot]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    coded_buf_size[slot] = pool.coded_size;
+  }
+
+  return coded_size;
+}
+
+static void va_backend_release ()
+{
+  release_encode();
+  deinit_va();
+}
+
+static const struct encoder_backend va_backend = {
+  "va", va_backend_init, va_upload, va_encode_picture, va_sync, va_store, va_backend_release
+};
+
+/* --------------------------------------------------------------------------
+ *  Null backend
+ *  The pipeline runs without VA: the picture is copied as if uploaded, the
+ *  parameter sets are built as packed headers, and each slice gets a header
+ *  and filler bytes of the size a picture of its type takes at the bitrate.
+ *  The storage task waits for the simulated encode time. The stream is not
+ *  decodable.
+ * --------------------------------------------------------------------------*/
+static void null_backend_init ()
+{
+  unsigned int i;
+
+  if (hevc_profile == ~0 || hevc_profile == 0) {
+    hevc_profile = VAProfileHEVCMain;
+    real_hevc_profile = 1;
+  }
+  if (rc_mode == -1)
+    rc_mode = VA_RC_VBR;
+  hevc_packedheader = 1;
+  if (null_delay < 0)
+    null_delay = (long long) frame_width * frame_height * 5000 / (1920 * 1080);
+  printf("Simulated encode time %d us per picture\n", null_delay);
+
+  vapool_size(&pool, frame_width_aligned, frame_height_aligned, num_ref_frames + (ip_period > 1),
+	      encode_syncmode ? 1 : ip_period + 1, frame_bitrate, frame_rate);
+  null_surface = malloc(frame_width * frame_height * 3 / 2);
+  null_slice_dwords = pool.coded_max / 4 + PACKED_HEADER_DWORDS;
+  null_slice_data = malloc(null_slice_dwords * 4);
+  for (i = 0; i < pool.src; i++) {
+    /* emulation prevention bytes and parameter sets come on top of it */
+    null_coded[i] = malloc(null_slice_dwords * 6 + 3 * PACKED_HEADER_DWORDS * 4);
+    if (null_coded[i] == NULL)
+      null_surface = NULL;
+  }
+  if (null_surface == NULL || null_slice_data == NULL) {
+    fprintf (stderr, "memory allocation error.\n");
+    exit (1);
+  }
+}
+
+static void null_backend_release ()
+{
+  unsigned int i;
+
+  for (i = 0; i < pool.src; i++)
+    free (null_coded[i]);
+  free (null_slice_data);
+  free (null_surface);
+}
+
+static void null_upload (unsigned char *nv12)
+{
+  memcpy (null_surface, nv12, frame_width * frame_height * 3 / 2);
+}
+
+static void null_encode_picture ()
+{
+  unsigned char *header, *coded = null_coded[current_slot];
+  unsigned int size, len = 0;
+  unsigned long long tmp;
+  int bits, i, n;
+  bitstream bs;
+
+  tmp = telemetry_now();
+
+  pic_param.pic_fields.bits.idr_pic_flag = (current_frame_type == FRAME_IDR);
+  pic_param.decoded_curr_pic.pic_order_cnt = calc_poc((current_frame_display - current_IDR_display) % MaxPicOrderCntLsb) * 2;
+  pic_param.decoded_curr_pic.flags = 0;
+  CurrentCurrPic = pic_param.decoded_curr_pic;
+
+  if (current_frame_type == FRAME_IDR) {
+    bits = build_packed_video_buffer(&header);
+    len += bitstream_copy_nal(coded + len, header, bits);
+    bits = build_packed_seq_buffer(&header);
+    len += bitstream_copy_nal(coded + len, header, bits);
+  }
+  bits = build_packed_pic_buffer(&header);
+  len += bitstream_copy_nal(coded + len, header, bits);
+
+  /* a P picture at the mean size of the bitrate, an intra picture four times
+     as large and a B picture half of it */
+  size = frame_bitrate / 8 / frame_rate;
+  if (current_frame_type == FRAME_IDR || current_frame_type == FRAME_I)
+    size *= 4;
+  else if (current_frame_type == FRAME_B)
+    size /= 2;
+  size = MIN(size, pool.coded_max) / frame_slices;
+
+  fill_slice_header(0, &pps, &ssh);
+  for (i = 0; i < frame_slices; i++) {
+    ssh.slice_segment_address = i * ssh.picture_height_in_ctus / frame_slices * ssh.picture_width_in_ctus;
+    ssh.first_slice_segment_in_pic_flag = (i == 0);
+
+    bitstream_init(&bs, null_slice_data, null_slice_dwords);
+    nal_start_code_prefix(&bs, NALU_TRAIL_R);
+    nal_header(&bs, pic_param.pic_fields.bits.idr_pic_flag ? NALU_IDR_W_DLP : NALU_TRAIL_R);
+    sliceHeader_rbsp(&bs, &ssh, &sps, &pps, 0);
+    for (n = 0; n < size; n++)
+      bitstream_put_ui(&bs, 0xaa, 8);
+    rbsp_trailing_bits(&bs);
+    bitstream_end(&bs);
+    len += bitstream_copy_nal(coded + len, (unsigned char *)null_slice_data, bs.bit_offset);
+  }
+  null_coded_len[current_slot] = len;
+  null_done[current_slot] = telemetry_now() + null_delay * 1000ULL;
+  telemetry_add(&tm_frame, TELEMETRY_RENDER, tmp);
+}
+
+/* the simulated hardware is done with the picture */
+static void null_sync (unsigned int slot)
+{
+  unsigned long long now, done = null_done[slot];
+  struct timespec ts;
+
+  for (now = telemetry_now(); now < done; now = telemetry_now()) {
+    ts.tv_sec = (done - now) / 1000000000ULL;
+    ts.tv_nsec = (done - now) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static unsigned int null_store (unsigned int slot)
+{
+  return mux_write(&mux, null_coded[slot], null_coded_len[slot]);
+}
+
+static const struct encoder_backend null_backend = {
+  "null", null_backend_init, null_upload, null_encode_picture, null_sync, null_store, null_backend_release
+};
+
 /* --------------------------------------------------------------------------
  *  
  * --------------------------------------------------------------------------*/
@@ -3216,12 +3788,15 @@ static int print_input()
   printf("INPUT: Min QP       : %d\n", minimal_qp);
   printf("INPUT: P As B       : %d\n", p2b);
   printf("INPUT: lowpower     : %d\n", lowpower);
+  printf("INPUT: ROI          : %d regions, metadata %s\n", rois.n, rois.fn);
+  printf("INPUT: SceneCut     : %d\n", scenecut);
   printf("INPUT: Source YUV   : %s", srcyuv_fp ? "FILE" : "AUTO generated");
   if (srcyuv_fp)
     printf(":%s (fourcc %s)\n", srcyuv_fn, fourcc_to_string(srcyuv_fourcc));
   else
     printf("\n");
-  printf("INPUT: Coded Clip   : %s\n", coded_fn);
+  printf("INPUT: Coded Clip   : %s (%s)\n", coded_fn, mux_name(mux.format));
+  printf("INPUT: Telemetry    : %s\n", telemetry_fn ? telemetry_fn : "none");
 
   printf("\n\n"); /* return back to startpoint */
 
@@ -3231,13 +3806,25 @@ static int print_input()
 /* --------------------------------------------------------------------------
  *  
  * --------------------------------------------------------------------------*/
+static void print_stage(const char *name, int stage, unsigned int PictureCount)
+{
+  double ms = tm.stage[stage].sum / 1e6;
+
+  printf("PERFORMANCE:     %-19s: %.1f ms (%.3f, %.2f%% percent, p99 %.3f ms)\n",
+	 name, ms, ms / PictureCount, ms / TotalTicks / 0.01,
+	 telemetry_percentile(&tm.stage[stage], 99) / 1e6);
+}
+
 static int print_performance(unsigned int PictureCount)
 {
-  unsigned int others = 0;
+  double others = TotalTicks;
   double total_size = frame_width * frame_height * 1.5 * frame_count;
+  int i;
 
-  others = TotalTicks - UploadPictureTicks - BeginPictureTicks
-    - RenderPictureTicks - EndPictureTicks - SyncPictureTicks - SavePictureTicks;
+  if (PictureCount == 0 || TotalTicks == 0)
+    return 0;
+  for (i = 0; i < TELEMETRY_STAGES; i++)
+    others -= tm.stage[i].sum / 1e6;
 
   printf("\n\n");
 
@@ -3246,30 +3833,30 @@ static int print_performance(unsigned int PictureCount)
 	 TotalTicks, ((double)  TotalTicks) / (double) PictureCount);
   printf("PERFORMANCE:   Compression ratio    : %d:1\n", (unsigned int)(total_size / frame_size));
 
-  printf("PERFORMANCE:     Processing         : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) ProcessPictureTicks, ((double)  ProcessPictureTicks) / (double) PictureCount,
-	 ProcessPictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     UploadPicture      : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) UploadPictureTicks, ((double)  UploadPictureTicks) / (double) PictureCount,
-	 UploadPictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     vaBeginPicture     : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) BeginPictureTicks, ((double)  BeginPictureTicks) / (double) PictureCount,
-	 BeginPictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     vaRenderHeader     : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) RenderPictureTicks, ((double)  RenderPictureTicks) / (double) PictureCount,
-	 RenderPictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     vaEndPicture       : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) EndPictureTicks, ((double)  EndPictureTicks) / (double) PictureCount,
-	 EndPictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     vaSyncSurface      : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) SyncPictureTicks, ((double) SyncPictureTicks) / (double) PictureCount,
-	 SyncPictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     SavePicture        : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) SavePictureTicks, ((double)  SavePictureTicks) / (double) PictureCount,
-	 SavePictureTicks / (double) TotalTicks / 0.01);
-  printf("PERFORMANCE:     Others             : %d ms (%.2f, %.2f%% percent)\n",
-	 (int) others, ((double) others) / (double) PictureCount,
-	 others / (double) TotalTicks / 0.01);
+  printf("PERFORMANCE:   Scene cuts           : %d IDR\n", scene_cuts);
+  printf("PERFORMANCE:   Source frames        : %d dropped, %d signalled twice\n",
+	 frames_dropped, frames_duplicated);
+  printf("PERFORMANCE:   Frame latency        : p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+	 telemetry_percentile(&tm.total, 50) / 1e6, telemetry_percentile(&tm.total, 99) / 1e6,
+	 tm.total.max / 1e6);
+  for (i = 0; i < TELEMETRY_TYPES; i++) {
+    if (tm.type[i].count == 0)
+      continue;
+    printf("PERFORMANCE:     %-5s frames        : %llu, %.3f ms, p99 %.3f ms, %llu bytes per frame\n",
+	   telemetry_type_name[i], tm.type[i].count, tm.type[i].sum / 1e6 / tm.type[i].count,
+	   telemetry_percentile(&tm.type[i], 99) / 1e6, tm.bytes[i] / tm.type[i].count);
+  }
+
+  print_stage("Processing", TELEMETRY_CONVERT, PictureCount);
+  print_stage("Analysis", TELEMETRY_ANALYSE, PictureCount);
+  print_stage("UploadPicture", TELEMETRY_UPLOAD, PictureCount);
+  print_stage("vaBeginPicture", TELEMETRY_BEGIN, PictureCount);
+  print_stage("vaRenderHeader", TELEMETRY_RENDER, PictureCount);
+  print_stage("vaEndPicture", TELEMETRY_END, PictureCount);
+  print_stage("vaSyncSurface", TELEMETRY_SYNC, PictureCount);
+  print_stage("SavePicture", TELEMETRY_SAVE, PictureCount);
+  printf("PERFORMANCE:     Others             : %.1f ms (%.3f, %.2f%% percent)\n",
+	 others, others / PictureCount, others / TotalTicks / 0.01);
 
   if (encode_syncmode == 0)
     printf("(Multithread enabled, the timing is only for reference)\n");
@@ -3291,22 +3878,40 @@ int main(int argc, char **argv)
 
   start = GetTickCount();
 
-  init_va();
-  setup_encode();
+  backend = (backend_type == BACKEND_NULL) ? &null_backend : &va_backend;
+  backend->init();
+  telemetry_init(&tm, telemetry_fn);
+  feedback_init(&feedback, frame_bitrate);
+  if (feedback_fn && control_open(&feedback_ctl, feedback_fn) == -1) {
+    printf("Can't listen on %s: %s\n", feedback_fn, strerror(errno));
+    free(feedback_fn);
+    feedback_fn = NULL;
+  }
 
   signal (SIGUSR1, sigusr1);
+  signal (SIGUSR2, sigusr2);
   signal (SIGINT, sigint);
 
   waitforimage ();
+  check_frame ();
   start = GetTickCount();
 
   encode_loop();
 
-  release_encode();
-  deinit_va();
+  backend->release();
+  mux_close(&mux);
+  if (feedback_fn)
+    control_close(&feedback_ctl);
+  free(feedback_fn);
+  free(rois.fn);
+  scene_free(&scene);
 
   TotalTicks += GetTickCount() - start;
   print_performance(frame_count);
+  if (telemetry_fn)
+    export_telemetry();
+  telemetry_free(&tm);
+  free(telemetry_fn);
 
   return 0;
 }
@@ -5,33 +5,83 @@ char *inititp =
 "# -----------------------------------------------------------------------------\n"
 "\n"
 "# -----------------------------------------------------------------------------\n"
-"#   Takes a picture of current frame\n"
+"#   Takes a picture of current frame, written by the snapshot service of\n"
+"#   grab-jpeg which is started with the first one\n"
+"#   png file / jpeg file\n"
 "# -----------------------------------------------------------------------------\n"
-"proc image {type fout col} {\n"
+"proc snapd {} {\n"
 "    set w [width]\n"
 "    set h [height]\n"
-"    set pid [execbg ./grab-$type -s -w $w -h $h -o $fout]\n"
-"    after 100\n"
-"    colorspace $col\n"
-"    kill add $pid\n"
+"    execbg ./grab-jpeg -w $w -h $h -d /tmp/snapshot.sock\n"
+"}\n"
+"\n"
+"# the service is only started when there is none listening, not when it is\n"
+"# slow or fails, a second one would take over its socket\n"
+"proc nosnapd {res} {\n"
+"    expr {[string match {*No such file or directory} $res] || [string match {*Connection refused} $res]}\n"
+"}\n"
+"\n"
+"proc image {type fout} {\n"
+"    # the last frame stays in the file until the reply comes, which is sent\n"
+"    # once it is copied: the wait covers the copy, not the encoding\n"
+"    set tries 0\n"
+"    while {[catch {send -timeout 5000 /tmp/snapshot.sock $type $fout [frame]} res]} {\n"
+"        if {[nosnapd $res] == 0} {\n"
+"            error $res\n"
+"        }\n"
+"        if {$tries == 50} {\n"
+"            error $res\n"
+"        }\n"
+"        # started once, then tried until it listens\n"
+"        if {$tries == 0} {\n"
+"            snapd\n"
+"        }\n"
+"        incr tries\n"
+"        after 20\n"
+"    }\n"
+"    return $res\n"
 "}\n"
 "\n"
 "proc png {fout} {\n"
-"    image png $fout rgb\n"
+"    image png $fout\n"
 "}\n"
 "\n"
 "proc jpeg {fout} {\n"
-"    image jpeg $fout yuv\n"
+"    image jpeg $fout\n"
+"}\n"
+"\n"
+"# -----------------------------------------------------------------------------\n"
+"#   Burst and timelapse: n pictures, one frame out of every, written to\n"
+"#   numbered files by grab-jpeg, PNG if the pattern ends with .png\n"
+"#   burst /tmp/glitch-%04d.png 50 1\n"
+"# -----------------------------------------------------------------------------\n"
+"proc burst {pattern n every} {\n"
+"    set w [width]\n"
+"    set h [height]\n"
+"    execbg ./grab-jpeg -w $w -h $h -o $pattern -c $n -n $every\n"
+"}\n"
+"\n"
+"# -----------------------------------------------------------------------------\n"
+"#   MJPEG over HTTP, one frame out of every is encoded while there are\n"
+"#   clients: http://host:port/ streams, http://host:port/snapshot.jpg\n"
+"# -----------------------------------------------------------------------------\n"
+"proc mjpeg {port every} {\n"
+"    set w [width]\n"
+"    set h [height]\n"
+"    set pid [execbg ./grab-jpeg -w $w -h $h -m $port -n $every]\n"
+"    after 200\n"
+"    colorspace yuv\n"
+"    kill add $pid\n"
 "}\n"
 "\n"
 "# -----------------------------------------------------------------------------\n"
 "#   Video recording\n"
 "# -----------------------------------------------------------------------------\n"
-"proc video {type fout nframes} {\n"
+"proc video {type fout nframes args} {\n"
 "    set w [width]\n"
 "    set h [height]\n"
 "    set fps [fps]\n"
-"    set pid [execbg ./${type}enc -w $w -h $h -n $nframes -f $fps  -o $fout --rcmode CBR]\n"
+"    set pid [eval execbg ./${type}enc -w $w -h $h -n $nframes -f $fps  -o $fout --rcmode CBR $args]\n"
 "    after 200\n"
 "    colorspace yuv\n"
 "    kill add $pid\n"
@@ -46,36 +96,64 @@ char *inititp =
 "}\n"
 "\n"
 "# -----------------------------------------------------------------------------\n"
-"#   Video streaming\n"
+"#   H264 and H265 recording of the same frames, they are converted once\n"
+"#   by enchost and fed to both encoders\n"
 "# -----------------------------------------------------------------------------\n"
-"proc h264stream {nframes} {\n"
-"     execbg rm -f /tmp/h264fifo\n"
-"     execbg mkfifo /tmp/h264fifo\n"
-"     after 100\n"
-"     \n"
-"     h264 /tmp/h264fifo $nframes\n"
+"proc h264h265 {fout264 fout265 nframes} {\n"
+"    set w [width]\n"
+"    set h [height]\n"
+"    set fps [fps]\n"
+"    set s264 [list ./h264enc -o $fout264 --rcmode CBR]\n"
+"    set s265 [list ./h265enc -o $fout265 --rcmode CBR]\n"
+"    set pid [execbg ./enchost -w $w -h $h -n $nframes -f $fps -s $s264 -s $s265]\n"
+"    after 200\n"
+"    colorspace yuv\n"
+"    kill add $pid\n"
+"}\n"
 "\n"
+"# -----------------------------------------------------------------------------\n"
+"#   H264 encoder service, it stays ready and records on demand\n"
+"#   record start file ?nframes? / record split file / record stop\n"
+"# -----------------------------------------------------------------------------\n"
+"proc h264d {} {\n"
+"    set w [width]\n"
+"    set h [height]\n"
+"    set fps [fps]\n"
+"    set pid [execbg ./h264enc -w $w -h $h -f $fps --rcmode CBR --daemon /tmp/h264enc.sock]\n"
+"    after 200\n"
+"    colorspace yuv\n"
+"    kill add $pid\n"
+"}\n"
+"\n"
+"proc record {args} {\n"
+"    send /tmp/h264enc.sock record $args\n"
+"}\n"
+"\n"
+"# -----------------------------------------------------------------------------\n"
+"#   Video streaming, the encoder sends its NAL units to the streamer socket\n"
+"# -----------------------------------------------------------------------------\n"
+"proc h264stream {nframes} {\n"
 "     puts {--------------------------------------------}\n"
 "     puts {Note RTSP URL below to play stream}\n"
 "     puts {--------------------------------------------}\n"
-"     execbg ./h264streamer -s h264 -i /tmp/h264fifo\n"
+"     execbg ./h264streamer -s h264 -u /tmp/h264.sock\n"
 "     puts {--------------------------------------------}\n"
+"\n"
+"     # the encoder drops its pictures until the streamer listens\n"
+"     video h264 /tmp/h264.sock $nframes --mux nal\n"
 "}\n"
 "\n"
 "# -----------------------------------------------------------------------------\n"
 "#   Video streaming\n"
 "# -----------------------------------------------------------------------------\n"
 "proc h265stream {nframes} {\n"
-"     execbg rm -f /tmp/h265fifo\n"
-"     execbg mkfifo /tmp/h265fifo\n"
-"     after 100\n"
-"     \n"
-"     h265 /tmp/h265fifo $nframes\n"
-"\n"
 "     puts {--------------------------------------------}\n"
 "     puts {Note RTSP URL below to play stream}\n"
 "     puts {--------------------------------------------}\n"
-"     execbg ./h265streamer -s h265 -i /tmp/h265fifo\n"
+"     execbg ./h265streamer -s h265 -u /tmp/h265.sock\n"
 "     puts {--------------------------------------------}\n"
+"\n"
+"     # the encoder drops its pictures until the streamer listens\n"
+"     video h265 /tmp/h265.sock $nframes --mux nal\n"
 "}\n"
 ;
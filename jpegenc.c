@@ -45,6 +45,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <signal.h>
@@ -56,6 +57,11 @@
 #include <va/va.h>
 #include <va/va_enc_jpeg.h>
 #include "jpegenc_utils.h"
+#include "jpegsoft.h"
+#include "frameinfo.h"
+#include "mjpeg.h"
+#include "control.h"
+#include "pngwrite.h"
 
 #ifndef VA_FOURCC_I420
 #define VA_FOURCC_I420          0x30323449
@@ -87,6 +93,12 @@ void va_close_display_drm(VADisplay va_dpy);
 #define DEF_OUTPUT "/tmp/capture.jpeg"
 #define DEF_QUALITY 50
 #define DEF_FOURCC 5
+#define DEF_WORKERS 2
+#define DEF_RING 16
+
+#define BACKEND_AUTO 0
+#define BACKEND_VA 1
+#define BACKEND_SW 2
 
 char *g_input = DEF_INPUT;
 char *g_output = DEF_OUTPUT;
@@ -109,9 +121,22 @@ void usage( int argc, char *argv[], int optind )
   fprintf (stderr, "\t-h\t\tSets the height of the image (default %d).\n", DEF_HEIGHT);
   fprintf (stderr, "\t-f\t\tSets 4CC value 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA) (default %d).\n", DEF_FOURCC);
   fprintf (stderr, "\t-q\t\tSets quality of the image (default %d).\n", DEF_QUALITY);
+  fprintf (stderr, "\t-b\t\tSets the size of the image in bytes, the quality is searched from the last one found.\n");
   fprintf (stderr, "\t-s\t\tEncode input on SIGUSR1 signal. Wait at most 10 sec for signal.\n");
-
-  fprintf (stderr, "Example: %s -w 1024 -h 768 -i input_file.yuv -o output.jpeg -f 0 -q 50\n\n", argv[0]);
+  fprintf (stderr, "\t-e\t\tSets the encoder auto/va/sw, auto uses sw when VA-API can't encode JPEG (default auto).\n");
+  fprintf (stderr, "\t-t\t\tSets the number of threads of the sw encoder (default one per processor).\n");
+  fprintf (stderr, "\t-m\t\tServes the frames as MJPEG over HTTP on this [address:]port until interrupted (default address %s).\n", MJPEG_ADDRESS);
+  fprintf (stderr, "\t-n\t\tEncodes one frame out of n in MJPEG and capture modes (default 1).\n");
+  fprintf (stderr, "\t-d\t\tServes 'png|jpeg path ?frame?' snapshot requests on this Unix socket until interrupted.\n");
+  fprintf (stderr, "\t-j\t\tSets the number of snapshots encoded at once (default %d).\n", DEF_WORKERS);
+  fprintf (stderr, "\t-c\t\tCaptures this many frames to numbered files, PNG if the name ends with .png.\n");
+  fprintf (stderr, "\t-T\t\tCaptures frames for this many seconds.\n");
+  fprintf (stderr, "\t-r\t\tSets the number of frames waiting for the workers in capture mode (default %d).\n", DEF_RING);
+
+  fprintf (stderr, "Example: %s -w 1024 -h 768 -i input_file.yuv -o output.jpeg -f 0 -q 50\n", argv[0]);
+  fprintf (stderr, "         %s -w 1024 -h 768 -m 8080 -n 5\n", argv[0]);
+  fprintf (stderr, "         %s -w 1024 -h 768 -d /tmp/snapshot.sock\n", argv[0]);
+  fprintf (stderr, "         %s -w 1024 -h 768 -o /tmp/burst-%%04d.png -c 50\n\n", argv[0]);
 
   /* exit with error only if option parsing failed */
   exit(optind > 0);
@@ -570,52 +595,58 @@ int build_packed_jpeg_header_buffer(unsigned char **header_buffer, YUVComponentS
 
 /*
  * --------------------------------------------------------------------------
- *   Upload the yuv image from the file to the VASurface
+ *   Map the frame file, the encoders read the image in place. The frame
+ *   information record that may follow the pixels is mapped too.
+ * --------------------------------------------------------------------------
+ */
+unsigned char *map_input_frame(FILE *yuv_fp, int frame_size, size_t *map_size)
+{
+  struct stat st;
+  void *frame;
+
+  if (fstat(fileno(yuv_fp), &st) == -1 || st.st_size < frame_size) {
+    printf("ERROR......input file holds less than a frame\n");
+    return NULL;
+  }
+  *map_size = frame_size + frameinfo_size(fileno(yuv_fp), frame_size);
+  frame = mmap(0, *map_size, PROT_READ, MAP_SHARED, fileno(yuv_fp), 0);
+  if (frame == MAP_FAILED) {
+    printf("Failed to mmap input file (%s)\n", strerror(errno));
+    return NULL;
+  }
+  return frame;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Copy the mapped yuv image to the VASurface. Frames are stored bottom
+ *   up, each plane is flipped while it is copied.
  * --------------------------------------------------------------------------
  */
-void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_id, YUVComponentSpecs yuvComp, int picture_width, int picture_height, int frame_size)
+void upload_yuv_to_surface(VADisplay va_dpy, const unsigned char *frame, VASurfaceID surface_id, YUVComponentSpecs yuvComp, int picture_width, int picture_height)
 {
 
   VAImage surface_image;
   VAStatus va_status;
   void *surface_p = NULL;
-  unsigned char *newImageBuffer;
-  unsigned char *y_src, *u_src, *v_src;
+  const unsigned char *y_src, *u_src, *v_src;
   unsigned char *y_dst, *u_dst;
   int y_size = picture_width * picture_height;
   int u_size = 0;
   int row, col;
-  size_t n_items;
 
   //u_size is used for I420, NV12 formats only
   u_size = ((picture_width >> 1) * (picture_height >> 1));
 
-  newImageBuffer = malloc(frame_size);
-  if (newImageBuffer == NULL) {
-    printf("ERROR......upload_yuv_to_surface malloc failed");
-    exit(1);
-  }
-  memset(newImageBuffer, 0, frame_size);
-  
-  // frame is reversed last scanline comes first first
-  for (row = 0; row < picture_height; ++row) {
-    unsigned char *dst
-      = newImageBuffer + frame_size / picture_height * (picture_height - row - 1);
-    do {
-      n_items = fread(dst, frame_size / picture_height, 1, yuv_fp);
-    } while (n_items != 1);
-  }
-
-  
   va_status = vaDeriveImage(va_dpy, surface_id, &surface_image);
   CHECK_VASTATUS(va_status, "vaDeriveImage");
 
-  vaMapBuffer(va_dpy, surface_image.buf, &surface_p);
-  assert(VA_STATUS_SUCCESS == va_status);
+  va_status = vaMapBuffer(va_dpy, surface_image.buf, &surface_p);
+  CHECK_VASTATUS(va_status, "vaMapBuffer");
 
-  y_src = newImageBuffer;
-  u_src = newImageBuffer + y_size; /* UV offset for NV12 */
-  v_src = newImageBuffer + y_size + u_size;
+  // last scanline of each plane comes first
+  y_src = frame + (size_t)(picture_height - 1) * picture_width;
+  u_src = frame + y_size + (size_t)(picture_height / 2 - 1) * picture_width; /* UV plane for NV12 */
 
   y_dst = surface_p + surface_image.offsets[0];
   u_dst = surface_p + surface_image.offsets[1]; /* UV offset for NV12 */
@@ -624,34 +655,36 @@ void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_i
       (yuvComp.fourcc_val == VA_FOURCC_Y800)) {
 
     /* Y plane */
-    for (row = 0; row < surface_image.height; row++) {
-      memcpy(y_dst, y_src, surface_image.width);
+    for (row = 0; row < picture_height; row++) {
+      memcpy(y_dst, y_src, picture_width);
       y_dst += surface_image.pitches[0];
-      y_src += picture_width;
+      y_src -= picture_width;
     }
 
     if (yuvComp.num_components > 1) {
 
       switch (yuvComp.fourcc_val) {
       case VA_FOURCC_NV12: {
-	for (row = 0; row < surface_image.height / 2; row++) {
-	  memcpy(u_dst, u_src, surface_image.width);
+	for (row = 0; row < picture_height / 2; row++) {
+	  memcpy(u_dst, u_src, picture_width);
 	  u_dst += surface_image.pitches[1];
-	  u_src += (picture_width);
+	  u_src -= picture_width;
 	}
 	break;
       }
 
       case VA_FOURCC_I420: {
-	for (row = 0; row < surface_image.height / 2; row++) {
-	  for (col = 0; col < surface_image.width / 2; col++) {
+	u_src = frame + y_size + (size_t)(picture_height / 2 - 1) * (picture_width / 2);
+	v_src = u_src + u_size;
+	for (row = 0; row < picture_height / 2; row++) {
+	  for (col = 0; col < picture_width / 2; col++) {
 	    u_dst[col * 2] = u_src[col];
 	    u_dst[col * 2 + 1] = v_src[col];
 	  }
 
 	  u_dst += surface_image.pitches[1];
-	  u_src += (picture_width / 2);
-	  v_src += (picture_width / 2);
+	  u_src -= (picture_width / 2);
+	  v_src -= (picture_width / 2);
 	}
 	break;
       }
@@ -659,24 +692,25 @@ void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_i
     }//end of if check
   } else if ((yuvComp.fourcc_val == VA_FOURCC_UYVY) || (yuvComp.fourcc_val == VA_FOURCC_YUY2)) {
 
-    for (row = 0; row < surface_image.height; row++) {
-      memcpy(y_dst, y_src, surface_image.width * 2);
+    y_src = frame + (size_t)(picture_height - 1) * picture_width * 2;
+    for (row = 0; row < picture_height; row++) {
+      memcpy(y_dst, y_src, picture_width * 2);
       y_dst += surface_image.pitches[0];
-      y_src += picture_width * 2;
+      y_src -= picture_width * 2;
     }
 
   } else if (yuvComp.fourcc_val == VA_FOURCC_RGBA) {
 
-    for (row = 0; row < surface_image.height; row++) {
-      memcpy(y_dst, y_src, surface_image.width * 4);
+    y_src = frame + (size_t)(picture_height - 1) * picture_width * 4;
+    for (row = 0; row < picture_height; row++) {
+      memcpy(y_dst, y_src, picture_width * 4);
       y_dst += surface_image.pitches[0];
-      y_src += picture_width * 4;
+      y_src -= picture_width * 4;
     }
   }
 
   vaUnmapBuffer(va_dpy, surface_image.buf);
   vaDestroyImage(va_dpy, surface_image.image_id);
-  free(newImageBuffer);
 }
 
 
@@ -774,53 +808,119 @@ void init_yuv_component(YUVComponentSpecs *yuvComponent, int yuv_type, int *surf
 
 /*
  * --------------------------------------------------------------------------
- *   JPEG encoder
+ *   Output of the encoders, grown as needed
  * --------------------------------------------------------------------------
  */
-int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int picture_height, int frame_size, int yuv_type, int quality)
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  size_t alloc;
+} JPEGOutput;
+
+int jpeg_output_put(JPEGOutput *out, const void *p, size_t n)
 {
-  int num_entrypoints, enc_entrypoint;
-  int major_ver, minor_ver;
-  int surface_type;
-  VAEntrypoint entrypoints[5];
-  VASurfaceAttrib fourcc;
-  VAConfigAttrib attrib[2];
-  VADisplay   va_dpy;
-  VAStatus va_status;
+  unsigned char *data;
+  size_t alloc;
+
+  if (out->size + n > out->alloc) {
+    alloc = (out->size + n) * 2;
+    data = realloc(out->data, alloc);
+    if (data == NULL)
+      return -1;
+    out->data = data;
+    out->alloc = alloc;
+  }
+  memcpy(out->data + out->size, p, n);
+  out->size += n;
+  return 0;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Packed JPEG header, built again only when the picture size, quality
+ *   or restart interval change
+ * --------------------------------------------------------------------------
+ */
+typedef struct {
+  int picture_width;
+  int picture_height;
+  int quality;
+  int restart_interval;
+  unsigned char *buffer;
+  unsigned int length_in_bits;
+} JPEGHeaderCache;
+
+unsigned char *cached_jpeg_header(JPEGHeaderCache *cache, YUVComponentSpecs yuvComp, int picture_width, int picture_height,
+				  int restart_interval, int quality, unsigned int *length_in_bits)
+{
+  if (cache->buffer == NULL || cache->picture_width != picture_width || cache->picture_height != picture_height ||
+      cache->quality != quality || cache->restart_interval != restart_interval) {
+    free(cache->buffer);
+    cache->buffer = NULL;
+    cache->length_in_bits = build_packed_jpeg_header_buffer(&cache->buffer, yuvComp, picture_width, picture_height,
+							    restart_interval, quality);
+    cache->picture_width = picture_width;
+    cache->picture_height = picture_height;
+    cache->quality = quality;
+    cache->restart_interval = restart_interval;
+  }
+  *length_in_bits = cache->length_in_bits;
+  return cache->buffer;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   VA JPEG encoder: the config, surface, context, coded buffer and the
+ *   buffers that don't depend on the picture are kept from one picture to
+ *   the next
+ * --------------------------------------------------------------------------
+ */
+typedef struct {
+  VADisplay va_dpy;
   VAConfigID config_id;
   VASurfaceID surface_id;
   VAContextID context_id;
-  VABufferID pic_param_buf_id;                /* Picture parameter id*/
-  VABufferID slice_param_buf_id;              /* Slice parameter id, only 1 slice per frame in jpeg encode */
   VABufferID codedbuf_buf_id;                 /* Output buffer id, compressed data */
-  VABufferID packed_raw_header_param_buf_id;  /* Header parameter buffer id */
-  VABufferID packed_raw_header_buf_id;        /* Header buffer id */
   VABufferID qmatrix_buf_id;                  /* Quantization Matrix id */
   VABufferID huffmantable_buf_id;             /* Huffman table id*/
+  VABufferID slice_param_buf_id;              /* Slice parameter id, only 1 slice per frame in jpeg encode */
   VAEncPictureParameterBufferJPEG pic_param;  /* Picture parameter buffer */
   VAEncSliceParameterBufferJPEG slice_param;  /* Slice parameter buffer */
   VAQMatrixBufferJPEG quantization_param;     /* Quantization Matrix buffer */
   VAHuffmanTableBufferJPEGBaseline hufftable_param; /* Huffmantable buffer */
   YUVComponentSpecs yuvComponent;
-  int writeToFile = 1;
+  JPEGHeaderCache header;
+  int picture_width;
+  int picture_height;
+} JPEGEncoderVA;
 
-  //Clamp the quality factor value to [1,100]
-  if (quality >= 100) quality = 100;
-  if (quality <= 0) quality = 1;
+int jpegenc_va_open(JPEGEncoderVA *va, int picture_width, int picture_height, int frame_size, int yuv_type)
+{
+  int num_entrypoints, enc_entrypoint;
+  int major_ver, minor_ver;
+  int surface_type;
+  VAEntrypoint entrypoints[5];
+  VASurfaceAttrib fourcc;
+  VAConfigAttrib attrib[2];
+  VAStatus va_status;
+
+  memset(va, 0, sizeof(*va));
+  va->picture_width = picture_width;
+  va->picture_height = picture_height;
 
   fourcc.type = VASurfaceAttribPixelFormat;
   fourcc.flags = VA_SURFACE_ATTRIB_SETTABLE;
   fourcc.value.type = VAGenericValueTypeInteger;
 
-  init_yuv_component(&yuvComponent, yuv_type, &surface_type, &fourcc);
+  init_yuv_component(&va->yuvComponent, yuv_type, &surface_type, &fourcc);
 
   /* 1. Initialize the va driver */
-  va_dpy = va_open_display_drm();
-  va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
+  va->va_dpy = va_open_display_drm();
+  va_status = vaInitialize(va->va_dpy, &major_ver, &minor_ver);
   assert(va_status == VA_STATUS_SUCCESS);
 
   /* 2. Query for the entrypoints for the JPEGBaseline profile */
-  va_status = vaQueryConfigEntrypoints(va_dpy, VAProfileJPEGBaseline, entrypoints, &num_entrypoints);
+  va_status = vaQueryConfigEntrypoints(va->va_dpy, VAProfileJPEGBaseline, entrypoints, &num_entrypoints);
   CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
   // We need picture level encoding (VAEntrypointEncPicture). Find if it is supported.
   for (enc_entrypoint = 0; enc_entrypoint < num_entrypoints; enc_entrypoint++) {
@@ -835,7 +935,7 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
   /* 3. Query for the Render Target format supported */
   attrib[0].type = VAConfigAttribRTFormat;
   attrib[1].type = VAConfigAttribEncJPEG;
-  vaGetConfigAttributes(va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture, &attrib[0], 2);
+  vaGetConfigAttributes(va->va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture, &attrib[0], 2);
 
   // RT should be one of below.
   if (!((attrib[0].value & VA_RT_FORMAT_YUV420) || (attrib[0].value & VA_RT_FORMAT_YUV422) || (attrib[0].value & VA_RT_FORMAT_RGB32)
@@ -857,169 +957,1119 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
 
   /* 4. Create Config for the profile=VAProfileJPEGBaseline, entrypoint=VAEntrypointEncPicture,
    * with RT format attribute */
-  va_status = vaCreateConfig(va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture,
-			     &attrib[0], 2, &config_id);
+  va_status = vaCreateConfig(va->va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture,
+			     &attrib[0], 2, &va->config_id);
   CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
 
   /* 5. Create Surface for the input picture */
-  va_status = vaCreateSurfaces(va_dpy, surface_type, picture_width, picture_height,
-			       &surface_id, 1, &fourcc, 1);
+  va_status = vaCreateSurfaces(va->va_dpy, surface_type, picture_width, picture_height,
+			       &va->surface_id, 1, &fourcc, 1);
   CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
-  //Map the input yuv file to the input surface created with the surface_id
-  upload_yuv_to_surface(va_dpy, yuv_fp, surface_id, yuvComponent, picture_width, picture_height, frame_size);
-
   /* 6. Create Context for the encode pipe*/
-  va_status = vaCreateContext(va_dpy, config_id, picture_width, picture_height,
-			      VA_PROGRESSIVE, &surface_id, 1, &context_id);
+  va_status = vaCreateContext(va->va_dpy, va->config_id, picture_width, picture_height,
+			      VA_PROGRESSIVE, &va->surface_id, 1, &va->context_id);
   CHECK_VASTATUS(va_status, "vaCreateContext");
 
   /* Create buffer for Encoded data to be stored */
-  va_status =  vaCreateBuffer(va_dpy, context_id, VAEncCodedBufferType,
-			      frame_size, 1, NULL, &codedbuf_buf_id);
+  va_status =  vaCreateBuffer(va->va_dpy, va->context_id, VAEncCodedBufferType,
+			      frame_size, 1, NULL, &va->codedbuf_buf_id);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-  //Initialize the picture parameter buffer
-  pic_param.coded_buf = codedbuf_buf_id;
-  jpegenc_pic_param_init(&pic_param, picture_width, picture_height, quality, yuvComponent);
-
-  /* 7. Create buffer for the picture parameter */
-  va_status = vaCreateBuffer(va_dpy, context_id, VAEncPictureParameterBufferType,
-			     sizeof(VAEncPictureParameterBufferJPEG), 1, &pic_param, &pic_param_buf_id);
-  CHECK_VASTATUS(va_status, "vaCreateBuffer");
+  //Load the QMatrix and the Huffman Tables, they don't depend on the picture
+  jpegenc_qmatrix_init(&va->quantization_param, va->yuvComponent);
+  jpegenc_hufftable_init(&va->hufftable_param, va->yuvComponent);
 
-  //Load the QMatrix
-  jpegenc_qmatrix_init(&quantization_param, yuvComponent);
+  //Initialize the slice parameter buffer
+  jpegenc_slice_param_init(&va->slice_param, va->yuvComponent);
 
   /* 8. Create buffer for Quantization Matrix */
-  va_status = vaCreateBuffer(va_dpy, context_id, VAQMatrixBufferType,
-			     sizeof(VAQMatrixBufferJPEG), 1, &quantization_param, &qmatrix_buf_id);
+  va_status = vaCreateBuffer(va->va_dpy, va->context_id, VAQMatrixBufferType,
+			     sizeof(VAQMatrixBufferJPEG), 1, &va->quantization_param, &va->qmatrix_buf_id);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-  //Load the Huffman Tables
-  jpegenc_hufftable_init(&hufftable_param, yuvComponent);
-
   /* 9. Create buffer for Huffman Tables */
-  va_status = vaCreateBuffer(va_dpy, context_id, VAHuffmanTableBufferType,
-			     sizeof(VAHuffmanTableBufferJPEGBaseline), 1, &hufftable_param, &huffmantable_buf_id);
+  va_status = vaCreateBuffer(va->va_dpy, va->context_id, VAHuffmanTableBufferType,
+			     sizeof(VAHuffmanTableBufferJPEGBaseline), 1, &va->hufftable_param, &va->huffmantable_buf_id);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-  //Initialize the slice parameter buffer
-  jpegenc_slice_param_init(&slice_param, yuvComponent);
-
   /* 10. Create buffer for slice parameter */
-  va_status = vaCreateBuffer(va_dpy, context_id, VAEncSliceParameterBufferType,
-			     sizeof(slice_param), 1, &slice_param, &slice_param_buf_id);
+  va_status = vaCreateBuffer(va->va_dpy, va->context_id, VAEncSliceParameterBufferType,
+			     sizeof(va->slice_param), 1, &va->slice_param, &va->slice_param_buf_id);
+  CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+  return 0;
+}
+
+void jpegenc_va_close(JPEGEncoderVA *va)
+{
+  vaDestroyBuffer(va->va_dpy, va->qmatrix_buf_id);
+  vaDestroyBuffer(va->va_dpy, va->huffmantable_buf_id);
+  vaDestroyBuffer(va->va_dpy, va->slice_param_buf_id);
+  vaDestroyBuffer(va->va_dpy, va->codedbuf_buf_id);
+  vaDestroySurfaces(va->va_dpy, &va->surface_id, 1);
+  vaDestroyContext(va->va_dpy, va->context_id);
+  vaDestroyConfig(va->va_dpy, va->config_id);
+  vaTerminate(va->va_dpy);
+  va_close_display_drm(va->va_dpy);
+  free(va->header.buffer);
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Encode a frame with VA, the JPEG file is appended to out. A NULL frame
+ *   encodes the one uploaded by the previous call again. Only the picture
+ *   parameters and the packed header are given for each picture, the
+ *   quantization, Huffman and slice buffers are those of the encoder.
+ * --------------------------------------------------------------------------
+ */
+int jpegenc_va_encode(JPEGEncoderVA *va, const unsigned char *frame, int quality, JPEGOutput *out)
+{
+  VAStatus va_status;
+  VABufferID pic_param_buf_id;                /* Picture parameter id*/
+  VABufferID packed_raw_header_param_buf_id;  /* Header parameter buffer id */
+  VABufferID packed_raw_header_buf_id;        /* Header buffer id */
+  VASurfaceStatus surface_status;
+  VACodedBufferSegment *coded_buffer_segment;
+  int ret = 0;
+
+  //Clamp the quality factor value to [1,100]
+  if (quality >= 100) quality = 100;
+  if (quality <= 0) quality = 1;
+
+  //Map the input yuv file to the input surface created with the surface_id
+  if (frame)
+    upload_yuv_to_surface(va->va_dpy, frame, va->surface_id, va->yuvComponent, va->picture_width, va->picture_height);
+
+  //Initialize the picture parameter buffer
+  va->pic_param.coded_buf = va->codedbuf_buf_id;
+  jpegenc_pic_param_init(&va->pic_param, va->picture_width, va->picture_height, quality, va->yuvComponent);
+
+  /* 7. Create buffer for the picture parameter */
+  va_status = vaCreateBuffer(va->va_dpy, va->context_id, VAEncPictureParameterBufferType,
+			     sizeof(VAEncPictureParameterBufferJPEG), 1, &va->pic_param, &pic_param_buf_id);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
   //Pack headers and send using Raw data buffer
   VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
   unsigned int length_in_bits;
-  unsigned char *packed_header_buffer = NULL;
+  unsigned char *packed_header_buffer;
 
-  length_in_bits = build_packed_jpeg_header_buffer(&packed_header_buffer, yuvComponent, picture_width, picture_height, slice_param.restart_interval, quality);
+  packed_header_buffer = cached_jpeg_header(&va->header, va->yuvComponent, va->picture_width, va->picture_height,
+					    va->slice_param.restart_interval, quality, &length_in_bits);
   packed_header_param_buffer.type = VAEncPackedHeaderRawData;
   packed_header_param_buffer.bit_length = length_in_bits;
   packed_header_param_buffer.has_emulation_bytes = 0;
 
   /* 11. Create raw buffer for header */
-  va_status = vaCreateBuffer(va_dpy,
-			     context_id,
+  va_status = vaCreateBuffer(va->va_dpy,
+			     va->context_id,
 			     VAEncPackedHeaderParameterBufferType,
 			     sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
 			     &packed_raw_header_param_buf_id);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-  va_status = vaCreateBuffer(va_dpy,
-			     context_id,
+  va_status = vaCreateBuffer(va->va_dpy,
+			     va->context_id,
 			     VAEncPackedHeaderDataBufferType,
 			     (length_in_bits + 7) / 8, 1, packed_header_buffer,
 			     &packed_raw_header_buf_id);
   CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
   /* 12. Begin picture */
-  va_status = vaBeginPicture(va_dpy, context_id, surface_id);
+  va_status = vaBeginPicture(va->va_dpy, va->context_id, va->surface_id);
   CHECK_VASTATUS(va_status, "vaBeginPicture");
 
   /* 13. Render picture for all the VA buffers created */
-  va_status = vaRenderPicture(va_dpy, context_id, &pic_param_buf_id, 1);
+  va_status = vaRenderPicture(va->va_dpy, va->context_id, &pic_param_buf_id, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  va_status = vaRenderPicture(va_dpy, context_id, &qmatrix_buf_id, 1);
+  va_status = vaRenderPicture(va->va_dpy, va->context_id, &va->qmatrix_buf_id, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  va_status = vaRenderPicture(va_dpy, context_id, &huffmantable_buf_id, 1);
+  va_status = vaRenderPicture(va->va_dpy, va->context_id, &va->huffmantable_buf_id, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  va_status = vaRenderPicture(va_dpy, context_id, &slice_param_buf_id, 1);
+  va_status = vaRenderPicture(va->va_dpy, va->context_id, &va->slice_param_buf_id, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  va_status = vaRenderPicture(va_dpy, context_id, &packed_raw_header_param_buf_id, 1);
+  va_status = vaRenderPicture(va->va_dpy, va->context_id, &packed_raw_header_param_buf_id, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  va_status = vaRenderPicture(va_dpy, context_id, &packed_raw_header_buf_id, 1);
+  va_status = vaRenderPicture(va->va_dpy, va->context_id, &packed_raw_header_buf_id, 1);
   CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-  va_status = vaEndPicture(va_dpy, context_id);
+  va_status = vaEndPicture(va->va_dpy, va->context_id);
   CHECK_VASTATUS(va_status, "vaEndPicture");
 
-  if (writeToFile) {
-    VASurfaceStatus surface_status;
-    size_t w_items;
-    VACodedBufferSegment *coded_buffer_segment;
-    unsigned char *coded_mem;
-    int slice_data_length;
+  va_status = vaSyncSurface(va->va_dpy, va->surface_id);
+  CHECK_VASTATUS(va_status, "vaSyncSurface");
+
+  surface_status = 0;
+  va_status = vaQuerySurfaceStatus(va->va_dpy, va->surface_id, &surface_status);
+  CHECK_VASTATUS(va_status, "vaQuerySurfaceStatus");
 
-    va_status = vaSyncSurface(va_dpy, surface_id);
-    CHECK_VASTATUS(va_status, "vaSyncSurface");
+  va_status = vaMapBuffer(va->va_dpy, va->codedbuf_buf_id, (void **)(&coded_buffer_segment));
+  CHECK_VASTATUS(va_status, "vaMapBuffer");
 
-    surface_status = 0;
-    va_status = vaQuerySurfaceStatus(va_dpy, surface_id, &surface_status);
-    CHECK_VASTATUS(va_status, "vaQuerySurfaceStatus");
+  if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
+    printf("ERROR......Coded buffer too small\n");
+    ret = -1;
+  } else if (jpeg_output_put(out, coded_buffer_segment->buf, coded_buffer_segment->size) == -1) {
+    printf("ERROR......jpegenc_va_encode malloc failed\n");
+    ret = -1;
+  }
+
+  va_status = vaUnmapBuffer(va->va_dpy, va->codedbuf_buf_id);
+  CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+
+  vaDestroyBuffer(va->va_dpy, pic_param_buf_id);
+  vaDestroyBuffer(va->va_dpy, packed_raw_header_param_buf_id);
+  vaDestroyBuffer(va->va_dpy, packed_raw_header_buf_id);
 
-    va_status = vaMapBuffer(va_dpy, codedbuf_buf_id, (void **)(&coded_buffer_segment));
-    CHECK_VASTATUS(va_status, "vaMapBuffer");
+  return ret;
+}
 
-    coded_mem = coded_buffer_segment->buf;
+/*
+ * --------------------------------------------------------------------------
+ *   Is there a VA driver able to encode JPEG pictures?
+ * --------------------------------------------------------------------------
+ */
+int probe_va(void)
+{
+  VAEntrypoint *entrypoints;
+  VADisplay va_dpy;
+  int num_entrypoints, major_ver, minor_ver, i, found = 0;
 
-    if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
-      vaUnmapBuffer(va_dpy, codedbuf_buf_id);
-      printf("ERROR......Coded buffer too small\n");
+  va_dpy = va_open_display_drm();
+  if (va_dpy == NULL)
+    return 0;
+  if (vaInitialize(va_dpy, &major_ver, &minor_ver) == VA_STATUS_SUCCESS) {
+    entrypoints = malloc(vaMaxNumEntrypoints(va_dpy) * sizeof(*entrypoints));
+    if (entrypoints &&
+	vaQueryConfigEntrypoints(va_dpy, VAProfileJPEGBaseline, entrypoints, &num_entrypoints) == VA_STATUS_SUCCESS) {
+      for (i = 0; i < num_entrypoints; i++)
+	if (entrypoints[i] == VAEntrypointEncPicture)
+	  found = 1;
     }
+    free(entrypoints);
+    vaTerminate(va_dpy);
+  }
+  va_close_display_drm(va_dpy);
+  return found;
+}
 
+/*
+ * --------------------------------------------------------------------------
+ *   Quantization table in natural order scaled to the quality, the same
+ *   way build_packed_jpeg_header_buffer() writes it
+ * --------------------------------------------------------------------------
+ */
+void scale_quant_table(uint8_t *q, const uint8_t *base, int quality)
+{
+  uint32_t temp;
+  int i;
 
-    slice_data_length = coded_buffer_segment->size;
+  quality = (quality < 50) ? (5000 / quality) : (200 - (quality * 2));
+  for (i = 0; i < NUM_QUANT_ELEMENTS; i++) {
+    temp = (base[i] * quality) / 100;
+    temp = (temp > 255) ? 255 : temp;
+    temp = (temp < 1) ? 1 : temp;
+    q[i] = (uint8_t)temp;
+  }
+}
 
-    do {
-      w_items = fwrite(coded_mem, slice_data_length, 1, jpeg_fp);
-    } while (w_items != 1);
+/*
+ * --------------------------------------------------------------------------
+ *   Software JPEG encoder: the headers are the ones given to the VA driver,
+ *   with 4:2:0 chroma for the YUVA frames and restart markers between the
+ *   stripes coded by each thread
+ * --------------------------------------------------------------------------
+ */
+typedef struct {
+  jpegsoft *enc;
+  YUVComponentSpecs yuvComponent;
+  JPEGHeaderCache header;
+  int picture_width;
+  int picture_height;
+  int quality;
+} JPEGEncoderSW;
 
-    va_status = vaUnmapBuffer(va_dpy, codedbuf_buf_id);
-    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+void jpegenc_sw_quality(JPEGEncoderSW *sw, int quality)
+{
+  uint8_t luma_quant[NUM_QUANT_ELEMENTS], chroma_quant[NUM_QUANT_ELEMENTS];
+  const uint8_t *quant[2] = { luma_quant, chroma_quant };
+
+  scale_quant_table(luma_quant, jpeg_luma_quant, quality);
+  scale_quant_table(chroma_quant, jpeg_chroma_quant, quality);
+  jpegsoft_set_quant(sw->enc, quant);
+  sw->quality = quality;
+}
+
+int jpegenc_sw_open(JPEGEncoderSW *sw, int picture_width, int picture_height, int yuv_type, int threads)
+{
+  static const int formats[] = { JPEGSOFT_I420, JPEGSOFT_NV12, JPEGSOFT_UYVY, JPEGSOFT_YUY2, JPEGSOFT_Y8, JPEGSOFT_YUVA };
+  const uint8_t *dc[2] = { jpeg_hufftable_luma_dc, jpeg_hufftable_chroma_dc };
+  const uint8_t *ac[2] = { jpeg_hufftable_luma_ac, jpeg_hufftable_chroma_ac };
+  uint8_t flat[NUM_QUANT_ELEMENTS];
+  const uint8_t *quant[2] = { flat, flat };
+  VASurfaceAttrib fourcc;
+  int surface_type, ncomp, hs, vs;
+
+  memset(sw, 0, sizeof(*sw));
+  sw->picture_width = picture_width;
+  sw->picture_height = picture_height;
+
+  // the tables are set for each quality
+  memset(flat, 1, sizeof(flat));
+  sw->enc = jpegsoft_create(picture_width, picture_height, formats[yuv_type], quant, dc, ac, threads);
+  if (sw->enc == NULL) {
+    printf("ERROR......jpegenc_sw_open malloc failed");
+    exit(1);
   }
 
-  vaDestroyBuffer(va_dpy, pic_param_buf_id);
-  vaDestroyBuffer(va_dpy, qmatrix_buf_id);
-  vaDestroyBuffer(va_dpy, slice_param_buf_id);
-  vaDestroyBuffer(va_dpy, huffmantable_buf_id);
-  vaDestroyBuffer(va_dpy, codedbuf_buf_id);
-  vaDestroyBuffer(va_dpy, packed_raw_header_param_buf_id);
-  vaDestroyBuffer(va_dpy, packed_raw_header_buf_id);
-  vaDestroySurfaces(va_dpy, &surface_id, 1);
-  vaDestroyContext(va_dpy, context_id);
-  vaDestroyConfig(va_dpy, config_id);
-  vaTerminate(va_dpy);
-  va_close_display_drm(va_dpy);
+  init_yuv_component(&sw->yuvComponent, yuv_type, &surface_type, &fourcc);
+  jpegsoft_sampling(sw->enc, &ncomp, &hs, &vs);
+  sw->yuvComponent.y_h_subsample = hs;
+  sw->yuvComponent.y_v_subsample = vs;
+  return 0;
+}
+
+void jpegenc_sw_close(JPEGEncoderSW *sw)
+{
+  jpegsoft_destroy(sw->enc);
+  free(sw->header.buffer);
+}
+
+int jpegenc_sw_encode(JPEGEncoderSW *sw, const unsigned char *frame, int quality, JPEGOutput *out)
+{
+  const unsigned char *data, *header_buffer;
+  unsigned int length_in_bits;
+  size_t size;
+
+  //Clamp the quality factor value to [1,100]
+  if (quality >= 100) quality = 100;
+  if (quality <= 0) quality = 1;
+  if (quality != sw->quality)
+    jpegenc_sw_quality(sw, quality);
+
+  // frame is reversed last scanline comes first
+  data = jpegsoft_encode(sw->enc, frame, 1, &size);
 
+  header_buffer = cached_jpeg_header(&sw->header, sw->yuvComponent, sw->picture_width, sw->picture_height,
+				     jpegsoft_restart_interval(sw->enc), quality, &length_in_bits);
+
+  if (data == NULL ||
+      jpeg_output_put(out, header_buffer, (length_in_bits + 7) / 8) == -1 ||
+      jpeg_output_put(out, data, size) == -1) {
+    printf("ERROR......jpegenc_sw_encode malloc failed\n");
+    return -1;
+  }
   return 0;
 }
 
+/*
+ * --------------------------------------------------------------------------
+ *   Either encoder
+ * --------------------------------------------------------------------------
+ */
+typedef struct {
+  int backend;
+  JPEGEncoderVA va;
+  JPEGEncoderSW sw;
+  int frame_size;
+  unsigned char *copy;          /* frame held for a software search */
+} JPEGEncoder;
+
+int jpegenc_open(JPEGEncoder *e, int backend, int picture_width, int picture_height, int frame_size, int yuv_type, int threads)
+{
+  e->backend = backend;
+  e->frame_size = frame_size;
+  e->copy = NULL;
+  if (backend == BACKEND_SW)
+    return jpegenc_sw_open(&e->sw, picture_width, picture_height, yuv_type, threads);
+  return jpegenc_va_open(&e->va, picture_width, picture_height, frame_size, yuv_type);
+}
+
+int jpegenc_encode(JPEGEncoder *e, const unsigned char *frame, int quality, JPEGOutput *out)
+{
+  if (e->backend == BACKEND_SW)
+    return jpegenc_sw_encode(&e->sw, frame, quality, out);
+  return jpegenc_va_encode(&e->va, frame, quality, out);
+}
+
+void jpegenc_close(JPEGEncoder *e)
+{
+  free(e->copy);
+  if (e->backend == BACKEND_SW)
+    jpegenc_sw_close(&e->sw);
+  else
+    jpegenc_va_close(&e->va);
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Target size: bisection on the quality with the real encoder, starting
+ *   from the quality found last time. A picture within budget bytes and
+ *   using more than BUDGET_SLACK of it is taken at once, so a source that
+ *   did not change much is encoded once. Returns the quality of the picture
+ *   left in out, 1 if even that one is too big, -1 on error.
+ * --------------------------------------------------------------------------
+ */
+#define BUDGET_SLACK 0.9
+
+int encode_to_budget(JPEGEncoder *e, const unsigned char *frame, size_t budget, int quality, JPEGOutput *out, int *attempts)
+{
+  JPEGOutput attempt = { NULL, 0, 0 }, tmp;
+  int lo = 0, hi = 100, best = 0, fits;
+
+  //Clamp the quality factor value to [1,100]
+  if (quality >= 100) quality = 100;
+  if (quality <= 0) quality = 1;
+
+  // offscreen may write the next frame meanwhile, every attempt encodes the
+  // frame as it was at the first one: on the VA surface, or copied for the
+  // software encoder
+  if (e->backend == BACKEND_SW) {
+    if (e->copy == NULL && (e->copy = malloc(e->frame_size)) == NULL)
+      return -1;
+    memcpy(e->copy, frame, e->frame_size);
+    frame = e->copy;
+  }
+
+  for (*attempts = 0; lo < hi; quality = (lo + hi + 1) / 2) {
+    attempt.size = 0;
+    if (jpegenc_encode(e, frame, quality, &attempt) != 0) {
+      free(attempt.data);
+      return -1;
+    }
+    (*attempts)++;
+    if (e->backend != BACKEND_SW)
+      frame = NULL;
+
+    // keep the largest picture within budget, or the last one until one is
+    fits = attempt.size <= budget;
+    if (fits || best == 0) {
+      tmp = *out;
+      *out = attempt;
+      attempt = tmp;
+    }
+    if (!fits) {
+      hi = quality - 1;
+      continue;
+    }
+    best = lo = quality;
+    if (out->size >= budget * BUDGET_SLACK)
+      break;
+  }
+  free(attempt.data);
+  return best ? best : 1;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Quality found for a source and budget, kept in <input>.quality for
+ *   the next snapshots. Returns the default quality if there is none.
+ * --------------------------------------------------------------------------
+ */
+int load_quality(const char *input, size_t budget, int quality)
+{
+  char fn[4096];
+  unsigned long b;
+  int q;
+  FILE *fp;
+
+  snprintf(fn, sizeof(fn), "%s.quality", input);
+  fp = fopen(fn, "r");
+  if (fp == NULL)
+    return quality;
+  if (fscanf(fp, "%lu %d", &b, &q) == 2 && b == budget && q >= 1 && q <= 100)
+    quality = q;
+  fclose(fp);
+  return quality;
+}
+
+void save_quality(const char *input, size_t budget, int quality)
+{
+  char fn[4096];
+  FILE *fp;
+
+  snprintf(fn, sizeof(fn), "%s.quality", input);
+  fp = fopen(fn, "w");
+  if (fp == NULL)
+    return;
+  fprintf(fp, "%zu %d\n", budget, quality);
+  fclose(fp);
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   JPEG encoder, at the given quality or within budget bytes
+ * --------------------------------------------------------------------------
+ */
+int encode_input_image(const unsigned char *frame, FILE *jpeg_fp, int picture_width, int picture_height, int frame_size,
+		       int yuv_type, int quality, size_t budget, int backend, int threads)
+{
+  JPEGEncoder e;
+  JPEGOutput out = { NULL, 0, 0 };
+  int ret, attempts;
+
+  jpegenc_open(&e, backend, picture_width, picture_height, frame_size, yuv_type, threads);
+  if (budget) {
+    ret = encode_to_budget(&e, frame, budget, load_quality(g_input, budget, quality), &out, &attempts);
+    if (ret > 0) {
+      printf("Quality %d, %zu bytes in %d attempts%s\n", ret, out.size, attempts,
+	     (out.size > budget) ? ", can't get within budget" : "");
+      save_quality(g_input, budget, ret);
+      ret = 0;
+    }
+  }
+  else
+    ret = jpegenc_encode(&e, frame, quality, &out);
+
+  if (ret == 0 && fwrite(out.data, out.size, 1, jpeg_fp) != 1) {
+    printf("ERROR......can't write the JPEG file\n");
+    ret = -1;
+  }
+  jpegenc_close(&e);
+  free(out.data);
+  return ret;
+}
+
+static volatile sig_atomic_t _frames = 0;
+static volatile sig_atomic_t _done = 0;
+
 /* --------------------------------------------------------------------------
  *  signal handler
+ *  offscreen signals every frame with SIGUSR1
  * --------------------------------------------------------------------------*/
 void sigusr1 (int dummy)
 {
-  /* nothing */
+  _frames++;
+}
+
+void sigint (int dummy)
+{
+  _done = 1;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Continuous mode: every Nth frame is encoded while there are HTTP
+ *   clients, with the same encoder context and packed header
+ * --------------------------------------------------------------------------
+ */
+int mjpeg_loop(const unsigned char *frame, const volatile struct frameinfo_s *fi, const char *address, int port, int every,
+	       int backend, int picture_width, int picture_height, int frame_size, int yuv_type, int quality,
+	       size_t budget, int threads)
+{
+  struct mjpeg_s m;
+  JPEGEncoder e;
+  JPEGOutput out = { NULL, 0, 0 };
+  struct timespec start_time, finish_time;
+  uint64_t seq, time, last = 0, next = 0;
+  unsigned long pictures = 0, attempts = 0;
+  double total_ms = 0;
+  int ret, n;
+
+  if (address == NULL)
+    address = MJPEG_ADDRESS;
+  if (mjpeg_open(&m, address, port) == -1) {
+    printf("Can't listen on %s port %d (%s)\n", address, port, strerror(errno));
+    return -1;
+  }
+  jpegenc_open(&e, backend, picture_width, picture_height, frame_size, yuv_type, threads);
+  printf("Serving MJPEG on http://%s:%d/ (one picture on /snapshot.jpg)\n", address, port);
+
+  signal (SIGUSR1, sigusr1);
+  signal (SIGINT, sigint);
+  signal (SIGTERM, sigint);
+
+  while (!_done) {
+    mjpeg_poll(&m, 20);
+
+    // new frame? the record tells, else the signals of offscreen
+    if (frameinfo_read(fi, &seq, &time) == -1)
+      seq = _frames;
+    if (seq == last)
+      continue;
+    last = seq;
+    if (seq < next)
+      continue;
+
+    if (mjpeg_clients(&m) == 0) {
+      // nobody to send it to, don't encode and don't keep a stale picture
+      mjpeg_flush(&m);
+      continue;
+    }
+    next = seq + every;
+
+    out.size = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (budget) {
+      // the next picture starts from this quality
+      ret = encode_to_budget(&e, frame, budget, quality, &out, &n);
+      if (ret > 0) {
+	quality = ret;
+	attempts += n;
+	ret = 0;
+      }
+    }
+    else {
+      ret = jpegenc_encode(&e, frame, quality, &out);
+      attempts++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish_time);
+    if (ret == 0)
+      mjpeg_push(&m, out.data, out.size);
+
+    pictures++;
+    total_ms += (finish_time.tv_sec - start_time.tv_sec) * 1e3 + (finish_time.tv_nsec - start_time.tv_nsec) / 1e6;
+  }
+
+  if (pictures)
+    printf("%lu pictures encoded, %.1f ms and %.1f attempts each\n",
+	   pictures, total_ms / pictures, (double)attempts / pictures);
+  jpegenc_close(&e);
+  mjpeg_close(&m);
+  free(out.data);
+  return 0;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Snapshot service: "png|jpeg path ?frame?" requests on a Unix socket,
+ *   one per connection. A first line is sent once the frame is copied, a
+ *   second one once the picture is written. The frame is copied as soon
+ *   as it is published, or at once when the request names the last one:
+ *   that is what offscreen does, it renders nothing until the first line
+ *   comes. Copies are encoded by a pool of workers, each with its own
+ *   JPEG encoder.
+ * --------------------------------------------------------------------------
+ */
+#define SNAPSHOT_TIMEOUT 10000          /* ms to wait for a frame */
+#define SNAPSHOT_LEVEL 6                /* same as grab-png */
+#define MAX_WORKERS 16
+
+typedef struct {
+  int refs;
+  uint64_t seq;
+  int colorspace;
+  unsigned char *pixels;
+} SnapshotFrame;
+
+typedef struct SnapshotRequest {
+  struct SnapshotRequest *next;
+  int fd;                               /* client waiting for the reply */
+  int png;
+  char path[CONTROL_LINE];
+  uint64_t want;                        /* first frame that will do */
+  SnapshotFrame *frame;
+  struct timespec start;
+} SnapshotRequest;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  SnapshotRequest *head, *tail;         /* requests with a frame, waiting for a worker */
+  int done;
+  unsigned char **spare;                /* pixels of frames no longer used */
+  int nspare;
+  int keep;                             /* spare pixels kept for the next copies */
+  int ring;                             /* copy to spare pixels only, never allocate */
+  unsigned long written;                /* pictures written */
+  double encode_ms;                     /* and their encoding time */
+  pthread_t tid[MAX_WORKERS];
+  int workers;
+  int backend;
+  int picture_width;
+  int picture_height;
+  int frame_size;
+  int yuv_type;
+  int quality;
+  size_t budget;
+  int threads;
+} SnapshotService;
+
+double elapsed_ms(const struct timespec *from)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) * 1e3 + (now.tv_nsec - from->tv_nsec) / 1e6;
+}
+
+void snapshot_reply(SnapshotRequest *r, const char *fmt, ...)
+{
+  char msg[CONTROL_LINE];
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
+  va_end(ap);
+  if (n > (int)sizeof(msg) - 2)
+    n = sizeof(msg) - 2;
+  printf("%.*s\n", n, msg);
+  msg[n++] = '\n';
+  if (r->fd != -1) {
+    send(r->fd, msg, n, MSG_NOSIGNAL);
+    close(r->fd);
+  }
+  free(r);
+}
+
+/* the frame is copied, the client may go on while the picture is written */
+void snapshot_ack(SnapshotRequest *r)
+{
+  char msg[CONTROL_LINE];
+  int n;
+
+  n = snprintf(msg, sizeof(msg), "%s frame %llu copied in %.1f ms\n", r->path,
+	       (unsigned long long)r->frame->seq, elapsed_ms(&r->start));
+  if (n > (int)sizeof(msg) - 1)
+    n = sizeof(msg) - 1;
+  if (r->fd != -1)
+    send(r->fd, msg, n, MSG_NOSIGNAL);
+}
+
+void snapshot_release(SnapshotService *s, SnapshotFrame *f)
+{
+  pthread_mutex_lock(&s->lock);
+  if (--f->refs == 0) {
+    // the pixels are kept for the next copy, a fresh malloc faults in every page
+    if (s->nspare < s->keep)
+      s->spare[s->nspare++] = f->pixels;
+    else
+      free(f->pixels);
+    free(f);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Copy frame seq, again if another one was published meanwhile. This is
+ *   best effort: offscreen reads the next frame into the mapping before it
+ *   publishes it, so a copy overlapping that read is torn and not seen
+ *   here. Only a request naming the last frame is safe, offscreen renders
+ *   nothing until it is acknowledged. NULL when there are no pixels to copy
+ *   it to: out of memory, or a full ring.
+ * --------------------------------------------------------------------------
+ */
+SnapshotFrame *snapshot_grab(SnapshotService *s, const unsigned char *frame, const volatile struct frameinfo_s *fi,
+			     uint64_t seq)
+{
+  SnapshotFrame *f;
+  uint64_t now, time;
+  int retry;
+
+  f = calloc(1, sizeof(*f));
+  if (f == NULL)
+    return NULL;
+  pthread_mutex_lock(&s->lock);
+  if (s->nspare)
+    f->pixels = s->spare[--s->nspare];
+  pthread_mutex_unlock(&s->lock);
+  if (f->pixels == NULL && !s->ring)
+    f->pixels = malloc(s->frame_size);
+  if (f->pixels == NULL) {
+    free(f);
+    return NULL;
+  }
+
+  f->refs = 1;
+  for (retry = 0; retry < 4; retry++) {
+    f->colorspace = fi->colorspace;
+    memcpy(f->pixels, frame, s->frame_size);
+    if (frameinfo_read(fi, &now, &time) == 0) {
+      if (now == seq)
+	break;
+      seq = now;
+    }
+  }
+  f->seq = seq;
+  return f;
+}
+
+void *snapshot_worker(void *arg)
+{
+  SnapshotService *s = arg;
+  SnapshotRequest *r;
+  SnapshotFrame *f;
+  JPEGEncoder e;
+  JPEGOutput out = { NULL, 0, 0 };
+  struct timespec start_time;
+  const unsigned char *src;
+  unsigned char *yuva = NULL;
+  struct stat st;
+  size_t size;
+  FILE *fp;
+  int opened = 0, quality = s->quality, ret, n;
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (s->head == NULL && !s->done)
+      pthread_cond_wait(&s->cond, &s->lock);
+    r = s->head;
+    if (r != NULL && (s->head = r->next) == NULL)
+      s->tail = NULL;
+    pthread_mutex_unlock(&s->lock);
+    if (r == NULL)
+      break;
+
+    f = r->frame;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (r->png) {
+      ret = pngwrite_save(r->path, f->pixels, s->picture_width, s->picture_height, s->picture_width * 4,
+			  PNGWRITE_FLIP | ((f->colorspace == FRAMEINFO_YUV) ? PNGWRITE_YUV : 0),
+			  SNAPSHOT_LEVEL, PNGWRITE_UP, s->threads);
+      size = (ret == 0 && stat(r->path, &st) == 0) ? st.st_size : 0;
+    }
+    else {
+      if (!opened)
+	opened = jpegenc_open(&e, s->backend, s->picture_width, s->picture_height, s->frame_size, s->yuv_type, s->threads) == 0;
+      src = f->pixels;
+      if (f->colorspace == FRAMEINFO_RGB) {
+	if (yuva == NULL)
+	  yuva = malloc(s->frame_size);
+	if (yuva != NULL)
+	  jpegsoft_rgba_yuva(src, yuva, s->picture_width * s->picture_height);
+	src = yuva;
+      }
+
+      out.size = 0;
+      errno = ENOMEM;
+      ret = -1;
+      if (opened && src != NULL) {
+	if (s->budget) {
+	  ret = encode_to_budget(&e, src, s->budget, quality, &out, &n);
+	  if (ret > 0) {
+	    quality = ret;
+	    ret = 0;
+	  }
+	}
+	else
+	  ret = jpegenc_encode(&e, src, quality, &out);
+      }
+      if (ret == 0) {
+	fp = fopen(r->path, "wb");
+	if (fp == NULL || fwrite(out.data, out.size, 1, fp) != 1)
+	  ret = -1;
+	if (fp != NULL && fclose(fp) != 0)
+	  ret = -1;
+      }
+      size = out.size;
+    }
+
+    if (ret == 0) {
+      pthread_mutex_lock(&s->lock);
+      s->written++;
+      s->encode_ms += elapsed_ms(&start_time);
+      pthread_mutex_unlock(&s->lock);
+    }
+
+    // requests of a capture have no client, only errors are printed
+    if (ret != 0)
+      snapshot_reply(r, "error %s: %s", r->path, strerror(errno));
+    else if (r->fd != -1)
+      snapshot_reply(r, "%s %zu bytes, frame %llu in %.1f ms (encoded in %.1f ms)", r->path, size,
+		     (unsigned long long)f->seq, elapsed_ms(&r->start), elapsed_ms(&start_time));
+    else
+      free(r);
+    snapshot_release(s, f);
+  }
+
+  if (opened)
+    jpegenc_close(&e);
+  free(yuva);
+  free(out.data);
+  return NULL;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Parse a request, the client is handed over to it. NULL when the
+ *   request is wrong, the client got the error and may send another one.
+ * --------------------------------------------------------------------------
+ */
+SnapshotRequest *snapshot_request(struct control_s *c, char *line, const volatile struct frameinfo_s *fi)
+{
+  SnapshotRequest *r;
+  char *type, *path, *seq, *end, *save;
+  uint64_t last, time;
+
+  type = strtok_r(line, " \t", &save);
+  path = strtok_r(NULL, " \t", &save);
+  seq = strtok_r(NULL, " \t", &save);
+  if (type == NULL || path == NULL || strtok_r(NULL, " \t", &save) != NULL ||
+      (strcmp(type, "png") && strcmp(type, "jpeg"))) {
+    control_reply(c, "error expecting png|jpeg path ?frame?");
+    return NULL;
+  }
+  r = calloc(1, sizeof(*r));
+  if (r == NULL) {
+    control_reply(c, "error out of memory");
+    return NULL;
+  }
+
+  r->png = !strcmp(type, "png");
+  snprintf(r->path, sizeof(r->path), "%s", path);
+  if (seq != NULL) {
+    r->want = strtoull(seq, &end, 10);
+    if (*end != 0) {
+      control_reply(c, "error expecting a frame number, got '%s'", seq);
+      free(r);
+      return NULL;
+    }
+  }
+  else {
+    // the next frame, the one there may be overwritten while it is copied
+    r->want = (frameinfo_read(fi, &last, &time) == 0) ? last + 1 : 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+  r->fd = c->cfd;
+  c->cfd = -1;
+  return r;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Workers and spare pixels, the settings of the encoders are already in
+ *   s. A ring preallocates keep frames and never copies to more.
+ * --------------------------------------------------------------------------
+ */
+int snapshot_start(SnapshotService *s, int workers, int keep, int ring)
+{
+  int i;
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->keep = keep;
+  s->ring = ring;
+  s->spare = calloc(keep, sizeof(*s->spare));
+  if (s->spare == NULL)
+    return -1;
+  for (s->nspare = 0; ring && s->nspare < keep; s->nspare++) {
+    // touched now so that the first copies don't fault in every page
+    s->spare[s->nspare] = malloc(s->frame_size);
+    if (s->spare[s->nspare] == NULL)
+      return -1;
+    memset(s->spare[s->nspare], 0, s->frame_size);
+  }
+
+  if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&s->tid[i], NULL, snapshot_worker, s) != 0)
+      break;
+    s->workers++;
+  }
+  return s->workers ? 0 : -1;
+}
+
+void snapshot_queue(SnapshotService *s, SnapshotRequest *r, SnapshotFrame *f)
+{
+  r->frame = f;
+  r->next = NULL;
+  pthread_mutex_lock(&s->lock);
+  f->refs++;
+  if (s->tail)
+    s->tail->next = r;
+  else
+    s->head = r;
+  s->tail = r;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* the workers are done with the requests queued */
+void snapshot_stop(SnapshotService *s)
+{
+  int i;
+
+  pthread_mutex_lock(&s->lock);
+  s->done = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  for (i = 0; i < s->workers; i++)
+    pthread_join(s->tid[i], NULL);
+  for (i = 0; i < s->nspare; i++)
+    free(s->spare[i]);
+  free(s->spare);
+}
+
+int snapshot_loop(const unsigned char *frame, const volatile struct frameinfo_s *fi, const char *path, int workers,
+		  SnapshotService *s)
+{
+  SnapshotRequest *pending = NULL, *r, **pr;
+  SnapshotFrame *f;
+  struct control_s c;
+  uint64_t seq, time;
+  char *line;
+
+  if (control_open(&c, path) == -1) {
+    printf("Can't listen on %s (%s)\n", path, strerror(errno));
+    return -1;
+  }
+  if (snapshot_start(s, workers, 1, 0) == -1) {
+    printf("Can't start the snapshot workers\n");
+    snapshot_stop(s);
+    control_close(&c);
+    return -1;
+  }
+  printf("Snapshot service on %s, %d workers\n", path, s->workers);
+
+  signal (SIGINT, sigint);
+  signal (SIGTERM, sigint);
+  // started by offscreen with the first snapshot, it does not outlive it
+  prctl (PR_SET_PDEATHSIG, SIGTERM);
+
+  while (!_done) {
+    control_wait(&c, pending ? 2 : 100);
+    while (c.cfd != -1 && (line = control_line(&c)) != NULL) {
+      r = snapshot_request(&c, line, fi);
+      if (r != NULL) {
+	r->next = pending;
+	pending = r;
+      }
+    }
+    if (pending == NULL || frameinfo_read(fi, &seq, &time) == -1)
+      seq = 0;
+
+    // a single copy for every request the last frame will do for
+    f = NULL;
+    for (pr = &pending; (r = *pr) != NULL; ) {
+      if (r->want > seq) {
+	if (elapsed_ms(&r->start) < SNAPSHOT_TIMEOUT) {
+	  pr = &r->next;
+	  continue;
+	}
+	*pr = r->next;
+	snapshot_reply(r, "error %s: no frame", r->path);
+	continue;
+      }
+      *pr = r->next;
+      if (f == NULL && (f = snapshot_grab(s, frame, fi, seq)) == NULL) {
+	snapshot_reply(r, "error %s: out of memory", r->path);
+	continue;
+      }
+      r->frame = f;
+      snapshot_ack(r);
+      snapshot_queue(s, r, f);
+    }
+    if (f != NULL)
+      snapshot_release(s, f);
+  }
+
+  // the requests given to the workers are done, not the others
+  while ((r = pending) != NULL) {
+    pending = r->next;
+    snapshot_reply(r, "error %s: shutting down", r->path);
+  }
+  snapshot_stop(s);
+  control_close(&c);
+  return 0;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *   Burst and timelapse: one frame out of every is copied to a ring as
+ *   soon as it is published, count pictures or for seconds, and written
+ *   by the workers to pattern numbered from 0. The capture never waits
+ *   for the workers: a frame coming while the ring is full is dropped and
+ *   its number skipped.
+ * --------------------------------------------------------------------------
+ */
+/*
+ * --------------------------------------------------------------------------
+ *   The file names of a capture are printed with the -o pattern: it must
+ *   hold a single %d conversion, with an optional 0 flag and width, and no
+ *   other % but %%.
+ * --------------------------------------------------------------------------
+ */
+int capture_pattern_ok(const char *pattern)
+{
+  const char *p;
+  int n = 0;
+
+  for (p = pattern; (p = strchr(p, '%')) != NULL; p++) {
+    if (p[1] == '%') {
+      p++;
+      continue;
+    }
+    p++;
+    if (*p == '0')
+      p++;
+    while (*p >= '0' && *p <= '9')
+      p++;
+    if (*p != 'd')
+      return 0;
+    n++;
+  }
+  return n == 1;
+}
+
+int capture_loop(const unsigned char *frame, const volatile struct frameinfo_s *fi, const char *pattern, int count,
+		 double seconds, int every, int ring, int workers, SnapshotService *s)
+{
+  SnapshotRequest *r;
+  SnapshotFrame *f;
+  struct timespec start_time;
+  uint64_t seq, time, last = 0, next = 0;
+  unsigned long dropped = 0, missed = 0;
+  int n = 0;
+  const char *ext = strrchr(pattern, '.');
+  int png = ext && !strcmp(ext, ".png");
+
+  if (snapshot_start(s, workers, ring, 1) == -1) {
+    printf("Can't allocate a ring of %d frames\n", ring);
+    snapshot_stop(s);
+    return -1;
+  }
+  printf("Capturing to %s, ring of %d frames, %d workers\n", pattern, ring, s->workers);
+
+  // offscreen may signal us, else the record is polled
+  signal (SIGUSR1, sigusr1);
+  signal (SIGINT, sigint);
+  signal (SIGTERM, sigint);
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  while (!_done && (count <= 0 || n < count) && (seconds <= 0 || elapsed_ms(&start_time) < seconds * 1e3)) {
+    if (frameinfo_read(fi, &seq, &time) == -1 || seq == last) {
+      usleep(1000);
+      continue;
+    }
+    if (last && seq > last + 1)
+      missed += seq - last - 1;
+    last = seq;
+    if (seq < next)
+      continue;
+    next = seq + every;
+
+    f = snapshot_grab(s, frame, fi, seq);
+    if (f == NULL) {
+      dropped++;
+      n++;
+      continue;
+    }
+    r = calloc(1, sizeof(*r));
+    if (r != NULL) {
+      r->fd = -1;
+      r->png = png;
+      snprintf(r->path, sizeof(r->path), pattern, n);
+      r->start = start_time;
+      snapshot_queue(s, r, f);
+    }
+    else
+      dropped++;
+    snapshot_release(s, f);
+    n++;
+  }
+
+  snapshot_stop(s);
+  printf("%lu pictures written in %.1f s, %.1f ms each, %lu dropped (workers behind), %lu frames missed\n",
+	 s->written, elapsed_ms(&start_time) / 1e3, s->written ? s->encode_ms / s->written : 0.0, dropped, missed);
+  return 0;
 }
 
 /*
@@ -1031,8 +2081,21 @@ int main(int argc, char *argv[])
 {
   FILE *yuv_fp;
   FILE *jpeg_fp;
-  clock_t start_time, finish_time;
-  unsigned int duration;
+  unsigned char *frame;
+  size_t map_size;
+  struct timespec start_time, finish_time;
+  int backend = BACKEND_AUTO;
+  int threads = 0;
+  char *address = NULL;
+  int port = 0;
+  int every = 1;
+  char *daemon = NULL;
+  int workers = DEF_WORKERS;
+  int count = 0;
+  double seconds = 0;
+  int ring = DEF_RING;
+  SnapshotService service;
+  long budget = 0;
   unsigned int yuv_type = DEF_FOURCC;
   int quality = DEF_QUALITY;
   unsigned int picture_width = DEF_WIDTH;
@@ -1041,16 +2104,39 @@ int main(int argc, char *argv[])
   int waitforsig = 0;
   int opt;
   
-  while ( (opt = getopt( argc, argv, "?si:o:w:h:f:q:")) != -1 ) {
+  while ( (opt = getopt( argc, argv, "?si:o:w:h:f:q:b:e:t:m:n:d:j:c:T:r:")) != -1 ) {
     switch( opt ) {
     case '?':  usage( argc, argv, 0); break;
     case 'i':  g_input = optarg; break;
     case 'o':  g_output = optarg; break;
     case 'w':  picture_width = atoi(optarg); break;
-    case 'f':  yuv_type = atoi(argv[5]); break;
+    case 'f':  yuv_type = atoi(optarg); break;
     case 'h':  picture_height = atoi(optarg); break;
-    case 'q':  quality = atoi(argv[6]); break;
+    case 'q':  quality = atoi(optarg); break;
+    case 'b':  budget = atol(optarg); break;
     case 's':  waitforsig = 1; break;
+    case 'e':
+      if (!strcmp(optarg, "auto")) backend = BACKEND_AUTO;
+      else if (!strcmp(optarg, "va")) backend = BACKEND_VA;
+      else if (!strcmp(optarg, "sw")) backend = BACKEND_SW;
+      else usage(argc, argv, optind);
+      break;
+    case 't':  threads = atoi(optarg); break;
+    case 'm':
+      if ((address = strrchr(optarg, ':')) != NULL) {
+	*address = 0;
+	port = atoi(address + 1);
+	address = optarg;
+      }
+      else
+	port = atoi(optarg);
+      break;
+    case 'n':  every = atoi(optarg); break;
+    case 'd':  daemon = optarg; break;
+    case 'j':  workers = atoi(optarg); break;
+    case 'c':  count = atoi(optarg); break;
+    case 'T':  seconds = atof(optarg); break;
+    case 'r':  ring = atoi(optarg); break;
     default:
       usage(argc, argv, optind);
     }
@@ -1106,7 +2192,53 @@ int main(int argc, char *argv[])
     exit(1);
   }
   puts("The output file was opened successfully.");
-    
+
+  frame = map_input_frame(yuv_fp, frame_size, &map_size);
+  if (frame == NULL) {
+    fclose(yuv_fp);
+    exit(1);
+  }
+
+  if (backend == BACKEND_AUTO) {
+    backend = probe_va() ? BACKEND_VA : BACKEND_SW;
+    if (backend == BACKEND_SW)
+      puts("VA-API can't encode JPEG, falling back to software encoder");
+  }
+
+  if (daemon || count > 0 || seconds > 0) {
+    memset(&service, 0, sizeof(service));
+    service.backend = backend;
+    service.picture_width = picture_width;
+    service.picture_height = picture_height;
+    service.frame_size = frame_size;
+    service.yuv_type = yuv_type;
+    service.quality = quality;
+    service.budget = (budget > 0) ? budget : 0;
+    service.threads = threads;
+
+    // the record tells the frames apart and gives their colorspace
+    if (map_size == frame_size || yuv_type != 5)
+      printf("Snapshot service and capture need RGBA frames written by offscreen\n");
+    else if (daemon)
+      snapshot_loop(frame, (struct frameinfo_s *)(frame + frame_size), daemon, (workers < 1) ? 1 : workers, &service);
+    else if (!capture_pattern_ok(g_output))
+      printf("Capture needs a numbered output file name with a single %%d like /tmp/burst-%%04d.png\n");
+    else
+      capture_loop(frame, (struct frameinfo_s *)(frame + frame_size), g_output, count, seconds,
+		   (every < 1) ? 1 : every, (ring < 1) ? 1 : ring, (workers < 1) ? 1 : workers, &service);
+    munmap(frame, map_size);
+    fclose(yuv_fp);
+    return 0;
+  }
+
+  if (port) {
+    mjpeg_loop(frame, (map_size > frame_size) ? (struct frameinfo_s *)(frame + frame_size) : NULL,
+	       address, port, (every < 1) ? 1 : every, backend, picture_width, picture_height, frame_size, yuv_type, quality,
+	       (budget > 0) ? budget : 0, threads);
+    munmap(frame, map_size);
+    fclose(yuv_fp);
+    return 0;
+  }
 
   jpeg_fp = fopen (g_output, "wb");
   if (jpeg_fp == NULL) {
@@ -1115,13 +2247,15 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  start_time = clock();
-  encode_input_image(yuv_fp, jpeg_fp, picture_width, picture_height, frame_size, yuv_type, quality);
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  encode_input_image(frame, jpeg_fp, picture_width, picture_height, frame_size, yuv_type, quality,
+		     (budget > 0) ? budget : 0, backend, threads);
+  munmap(frame, map_size);
   if (yuv_fp != NULL) fclose(yuv_fp);
   if (jpeg_fp != NULL) fclose(jpeg_fp);
-  finish_time = clock();
-  duration = finish_time - start_time;
-  printf("Encoding finished in %u ticks\n", duration);
+  clock_gettime(CLOCK_MONOTONIC, &finish_time);
+  printf("Encoding finished in %.1f ms\n",
+	 (finish_time.tv_sec - start_time.tv_sec) * 1e3 + (finish_time.tv_nsec - start_time.tv_nsec) / 1e6);
 
   return 0;
 }
@@ -0,0 +1,658 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "jpegsoft.h"
+
+#define MAX_THREADS         16
+#define STRIPES_PER_THREAD  4       /* more stripes than threads balances the load */
+#define MAX_RESTART         65535   /* Ri is 16 bits */
+#define MCU_MAX_BYTES       (6 * 512)   /* a MCU with every code at its longest, stuffed */
+
+/* natural order index of the zigzag coefficients */
+static const uint8_t zigzag[64] = {
+    0,   1,   8,   16,  9,   2,   3,   10,
+    17,  24,  32,  25,  18,  11,  4,   5,
+    12,  19,  26,  33,  40,  48,  41,  34,
+    27,  20,  13,  6,   7,   14,  21,  28,
+    35,  42,  49,  56,  57,  50,  43,  36,
+    29,  22,  15,  23,  30,  37,  44,  51,
+    58,  59,  52,  45,  38,  31,  39,  46,
+    53,  60,  61,  54,  47,  55,  62,  63
+};
+
+typedef struct {
+    uint16_t code[256];
+    uint8_t size[256];
+} hufftable;
+
+/* entropy coded data of a stripe */
+typedef struct {
+    uint8_t *data;
+    size_t len, max;
+} stripebuf;
+
+typedef struct {
+    stripebuf *sb;
+    uint64_t acc;
+    int nbits;
+} bitwriter;
+
+typedef struct {
+    jpegsoft *enc;
+    uint8_t *plane[3];          /* one MCU row of each component, padded to whole MCUs */
+    pthread_t thread;
+} worker;
+
+struct __jpegsoft {
+    int width, height, format;
+    int ncomp, hs, vs;          /* components and luma sampling factors */
+    int mcux, mcuy;             /* MCUs per row and per column */
+    int pw[2];                  /* luma and chroma width of the MCU row planes */
+    int rows;                   /* MCU rows per stripe */
+    int nstripes;
+    float recip[2][64];         /* 1 / divisors, in the layout of the DCT output */
+    uint8_t order[64];          /* DCT output index of the zigzag coefficients */
+    hufftable dc[2], ac[2];
+    int nworkers;
+    worker *workers;
+    stripebuf *stripes;
+    uint8_t *out;
+    size_t outmax;
+
+    /* image being coded */
+    const uint8_t *src;
+    int flip;
+    int next;                   /* next stripe to code */
+};
+
+// -----------------------------------------------------------------------------
+//   Huffman codes of a table given as counts per length and values (C.2)
+// -----------------------------------------------------------------------------
+static void build_huffman(hufftable *t, const uint8_t *spec)
+{
+    const uint8_t *bits = spec + 1, *vals = spec + 17;
+    unsigned int code = 0;
+    int len, i, k = 0;
+
+    memset(t, 0, sizeof(*t));
+    for (len = 1; len <= 16; len++) {
+        for (i = 0; i < bits[len - 1]; i++, k++) {
+            t->code[vals[k]] = code++;
+            t->size[vals[k]] = len;
+        }
+        code <<= 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Bit writer, 0xff bytes are followed by a stuffed 0. The stripe buffer is
+//   grown before each MCU so that the writer never checks it.
+// -----------------------------------------------------------------------------
+static void reserve(stripebuf *sb, size_t n)
+{
+    if (sb->len + n <= sb->max)
+        return;
+    sb->max = (sb->max + n) * 2;
+    sb->data = realloc(sb->data, sb->max);
+}
+
+static inline void put_bits(bitwriter *bw, unsigned int code, int size)
+{
+    uint8_t b;
+
+    bw->acc = (bw->acc << size) | code;
+    bw->nbits += size;
+    while (bw->nbits >= 8) {
+        bw->nbits -= 8;
+        b = (uint8_t)(bw->acc >> bw->nbits);
+        bw->sb->data[bw->sb->len++] = b;
+        if (b == 0xff)
+            bw->sb->data[bw->sb->len++] = 0;
+    }
+}
+
+/* the end of a stripe is padded with 1 bits */
+static void flush_bits(bitwriter *bw)
+{
+    if (bw->nbits)
+        put_bits(bw, (1 << (8 - bw->nbits)) - 1, 8 - bw->nbits);
+}
+
+static inline int magnitude(int v)
+{
+    return v ? 32 - __builtin_clz(abs(v)) : 0;
+}
+
+// -----------------------------------------------------------------------------
+//   Forward DCT (Arai, Agui and Nakajima) of 8 values spaced by stride, the
+//   outputs are scaled by the factors folded in the quantization.
+// -----------------------------------------------------------------------------
+#define FDCT8(T, d, s, ADD, SUB, MUL, K)                                 \
+    do {                                                                \
+        T t0 = ADD(d[0], d[7 * s]), t7 = SUB(d[0], d[7 * s]);           \
+        T t1 = ADD(d[s], d[6 * s]), t6 = SUB(d[s], d[6 * s]);           \
+        T t2 = ADD(d[2 * s], d[5 * s]), t5 = SUB(d[2 * s], d[5 * s]);   \
+        T t3 = ADD(d[3 * s], d[4 * s]), t4 = SUB(d[3 * s], d[4 * s]);   \
+        T t10 = ADD(t0, t3), t13 = SUB(t0, t3);                         \
+        T t11 = ADD(t1, t2), t12 = SUB(t1, t2);                         \
+        T z1, z2, z3, z4, z5, z11, z13;                                 \
+                                                                        \
+        d[0] = ADD(t10, t11);                                           \
+        d[4 * s] = SUB(t10, t11);                                       \
+        z1 = MUL(ADD(t12, t13), K(0.707106781f));                       \
+        d[2 * s] = ADD(t13, z1);                                        \
+        d[6 * s] = SUB(t13, z1);                                        \
+                                                                        \
+        t10 = ADD(t4, t5);                                              \
+        t11 = ADD(t5, t6);                                              \
+        t12 = ADD(t6, t7);                                              \
+        z5 = MUL(SUB(t10, t12), K(0.382683433f));                       \
+        z2 = ADD(MUL(t10, K(0.541196100f)), z5);                        \
+        z4 = ADD(MUL(t12, K(1.306562965f)), z5);                        \
+        z3 = MUL(t11, K(0.707106781f));                                 \
+        z11 = ADD(t7, z3);                                              \
+        z13 = SUB(t7, z3);                                              \
+        d[5 * s] = ADD(z13, z2);                                        \
+        d[3 * s] = SUB(z13, z2);                                        \
+        d[1 * s] = ADD(z11, z4);                                        \
+        d[7 * s] = SUB(z11, z4);                                        \
+    } while (0)
+
+#define F_ADD(a, b)     ((a) + (b))
+#define F_SUB(a, b)     ((a) - (b))
+#define F_MUL(a, b)     ((a) * (b))
+#define F_K(k)          (k)
+
+// -----------------------------------------------------------------------------
+//   DCT and quantization of a 8x8 block. Coefficient (u, v), u horizontal,
+//   is stored at u * 8 + v.
+// -----------------------------------------------------------------------------
+static void fdct_quant(const uint8_t *p, int stride, const float *recip, int16_t *out)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 bias = _mm_set1_ps(128.0f);
+    __m128 r[16], t;
+    int i;
+
+    /* r[2 * y + h] holds the columns 4h to 4h + 3 of row y */
+    for (i = 0; i < 8; i++, p += stride) {
+        __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+        r[2 * i] = _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)), bias);
+        r[2 * i + 1] = _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)), bias);
+    }
+
+    /* columns, then rows once transposed */
+    for (i = 0; i < 2; i++) {
+        __m128 *d = r + i;
+        FDCT8(__m128, d, 2, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_set1_ps);
+    }
+    _MM_TRANSPOSE4_PS(r[0], r[2], r[4], r[6]);
+    _MM_TRANSPOSE4_PS(r[1], r[3], r[5], r[7]);
+    _MM_TRANSPOSE4_PS(r[8], r[10], r[12], r[14]);
+    _MM_TRANSPOSE4_PS(r[9], r[11], r[13], r[15]);
+    for (i = 0; i < 4; i++) {
+        t = r[2 * i + 1];
+        r[2 * i + 1] = r[8 + 2 * i];
+        r[8 + 2 * i] = t;
+    }
+    for (i = 0; i < 2; i++) {
+        __m128 *d = r + i;
+        FDCT8(__m128, d, 2, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_set1_ps);
+    }
+
+    /* r[2 * u + h] now holds v = 4h to 4h + 3 of horizontal frequency u */
+    for (i = 0; i < 8; i++) {
+        __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(r[2 * i], _mm_loadu_ps(recip + 8 * i)));
+        __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(r[2 * i + 1], _mm_loadu_ps(recip + 8 * i + 4)));
+        _mm_storeu_si128((__m128i *)(out + 8 * i), _mm_packs_epi32(lo, hi));
+    }
+#else
+    float d[64];
+    int x, y;
+
+    for (y = 0; y < 8; y++, p += stride)
+        for (x = 0; x < 8; x++)
+            d[8 * y + x] = p[x] - 128.0f;
+    for (x = 0; x < 8; x++) {
+        float *c = d + x;
+        FDCT8(float, c, 8, F_ADD, F_SUB, F_MUL, F_K);
+    }
+    for (y = 0; y < 8; y++) {
+        float *c = d + 8 * y;
+        FDCT8(float, c, 1, F_ADD, F_SUB, F_MUL, F_K);
+    }
+    for (y = 0; y < 8; y++)
+        for (x = 0; x < 8; x++)
+            out[8 * x + y] = (int16_t)lrintf(d[8 * y + x] * recip[8 * x + y]);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+//   Huffman coding of a block (F.1.2)
+// -----------------------------------------------------------------------------
+static void encode_block(bitwriter *bw, const int16_t *coef, const uint8_t *order, int *pred,
+                         const hufftable *dc, const hufftable *ac)
+{
+    int diff, v, n, k, run = 0;
+
+    diff = coef[order[0]] - *pred;
+    *pred = coef[order[0]];
+    n = magnitude(diff);
+    put_bits(bw, dc->code[n], dc->size[n]);
+    if (n)
+        put_bits(bw, (diff < 0 ? diff - 1 : diff) & ((1 << n) - 1), n);
+
+    for (k = 1; k < 64; k++) {
+        v = coef[order[k]];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        /* baseline AC coefficients take at most 10 bits */
+        v = (v > 1023) ? 1023 : (v < -1023) ? -1023 : v;
+        while (run > 15) {
+            put_bits(bw, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        n = magnitude(v);
+        put_bits(bw, ac->code[(run << 4) | n], ac->size[(run << 4) | n]);
+        put_bits(bw, (v < 0 ? v - 1 : v) & ((1 << n) - 1), n);
+        run = 0;
+    }
+    if (run)
+        put_bits(bw, ac->code[0], ac->size[0]);
+}
+
+// -----------------------------------------------------------------------------
+//   Source rows, clamped to the image so that the last MCUs repeat its edges
+// -----------------------------------------------------------------------------
+static const uint8_t *src_row(const jpegsoft *enc, const uint8_t *plane, size_t bpr, int rows, int y)
+{
+    if (y >= rows)
+        y = rows - 1;
+    return plane + (size_t)(enc->flip ? rows - 1 - y : y) * bpr;
+}
+
+static void pad_row(uint8_t *row, int n, int width)
+{
+    if (n > 0 && n < width)
+        memset(row + n, row[n - 1], width - n);
+}
+
+// -----------------------------------------------------------------------------
+//   Two rows of YUVA pixels to two luma rows and a row of each chroma, the
+//   chroma is the mean of 2x2 pixels
+// -----------------------------------------------------------------------------
+static void yuva_420(const uint8_t *a, const uint8_t *b, int w, uint8_t *ya, uint8_t *yb,
+                     uint8_t *u, uint8_t *v)
+{
+    int x = 0, x1;
+
+#ifdef __SSE2__
+    const __m128i m = _mm_set1_epi32(0xff), one = _mm_set1_epi16(1), two = _mm_set1_epi32(2);
+
+    for (; x + 16 <= w; x += 16) {
+        __m128i pa[4], pb[4], s[2], c;
+        int i, sh;
+
+        for (i = 0; i < 4; i++) {
+            pa[i] = _mm_loadu_si128((const __m128i *)(a + 4 * x + 16 * i));
+            pb[i] = _mm_loadu_si128((const __m128i *)(b + 4 * x + 16 * i));
+        }
+        _mm_storeu_si128((__m128i *)(ya + x),
+                         _mm_packus_epi16(_mm_packs_epi32(_mm_and_si128(pa[0], m), _mm_and_si128(pa[1], m)),
+                                          _mm_packs_epi32(_mm_and_si128(pa[2], m), _mm_and_si128(pa[3], m))));
+        _mm_storeu_si128((__m128i *)(yb + x),
+                         _mm_packus_epi16(_mm_packs_epi32(_mm_and_si128(pb[0], m), _mm_and_si128(pb[1], m)),
+                                          _mm_packs_epi32(_mm_and_si128(pb[2], m), _mm_and_si128(pb[3], m))));
+
+        /* U in bits 8-15, V in bits 16-23: vertical sums in 16 bits, then
+         * horizontal pairs added by madd */
+        for (sh = 8; sh <= 16; sh += 8) {
+            for (i = 0; i < 2; i++) {
+                __m128i ra = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(pa[2 * i], sh), m),
+                                             _mm_and_si128(_mm_srli_epi32(pa[2 * i + 1], sh), m));
+                __m128i rb = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(pb[2 * i], sh), m),
+                                             _mm_and_si128(_mm_srli_epi32(pb[2 * i + 1], sh), m));
+                s[i] = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_add_epi16(ra, rb), one), two), 2);
+            }
+            c = _mm_packs_epi32(s[0], s[1]);
+            _mm_storel_epi64((__m128i *)((sh == 8 ? u : v) + x / 2), _mm_packus_epi16(c, c));
+        }
+    }
+#endif
+    for (; x < w; x += 2) {
+        x1 = (x + 1 < w) ? x + 1 : x;
+        ya[x] = a[4 * x];
+        yb[x] = b[4 * x];
+        ya[x1] = a[4 * x1];
+        yb[x1] = b[4 * x1];
+        u[x / 2] = (a[4 * x + 1] + a[4 * x1 + 1] + b[4 * x + 1] + b[4 * x1 + 1] + 2) >> 2;
+        v[x / 2] = (a[4 * x + 2] + a[4 * x1 + 2] + b[4 * x + 2] + b[4 * x1 + 2] + 2) >> 2;
+    }
+}
+
+/* interleaved chroma of NV12 */
+static void split_uv(const uint8_t *uv, int n, uint8_t *u, uint8_t *v)
+{
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i m = _mm_set1_epi16(0xff);
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(uv + 2 * x));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(uv + 2 * x + 16));
+        _mm_storeu_si128((__m128i *)(u + x), _mm_packus_epi16(_mm_and_si128(p0, m), _mm_and_si128(p1, m)));
+        _mm_storeu_si128((__m128i *)(v + x), _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8)));
+    }
+#endif
+    for (; x < n; x++) {
+        u[x] = uv[2 * x];
+        v[x] = uv[2 * x + 1];
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   One MCU row of the source to the planes of the worker
+// -----------------------------------------------------------------------------
+static void load_mcu_row(jpegsoft *enc, worker *wk, int my)
+{
+    int w = enc->width, h = enc->height, cw = w / 2, ch = h / 2;
+    int y0 = my * 8 * enc->vs, pw = enc->pw[0], cpw = enc->pw[1];
+    uint8_t *py = wk->plane[0], *pu = wk->plane[1], *pv = wk->plane[2];
+    const uint8_t *s, *t;
+    int i, x;
+
+    switch (enc->format) {
+    case JPEGSOFT_YUVA:
+        for (i = 0; i < 8; i++) {
+            s = src_row(enc, enc->src, (size_t)w * 4, h, y0 + 2 * i);
+            t = src_row(enc, enc->src, (size_t)w * 4, h, y0 + 2 * i + 1);
+            yuva_420(s, t, w, py + 2 * i * pw, py + (2 * i + 1) * pw, pu + i * cpw, pv + i * cpw);
+            pad_row(py + 2 * i * pw, w, pw);
+            pad_row(py + (2 * i + 1) * pw, w, pw);
+            pad_row(pu + i * cpw, (w + 1) / 2, cpw);
+            pad_row(pv + i * cpw, (w + 1) / 2, cpw);
+        }
+        break;
+
+    case JPEGSOFT_I420:
+    case JPEGSOFT_NV12:
+        for (i = 0; i < 16; i++) {
+            memcpy(py + i * pw, src_row(enc, enc->src, w, h, y0 + i), w);
+            pad_row(py + i * pw, w, pw);
+        }
+        for (i = 0; i < 8; i++) {
+            if (enc->format == JPEGSOFT_I420) {
+                memcpy(pu + i * cpw, src_row(enc, enc->src + (size_t)w * h, cw, ch, my * 8 + i), cw);
+                memcpy(pv + i * cpw, src_row(enc, enc->src + (size_t)w * h + (size_t)cw * ch, cw, ch, my * 8 + i), cw);
+            } else {
+                split_uv(src_row(enc, enc->src + (size_t)w * h, cw * 2, ch, my * 8 + i), cw,
+                         pu + i * cpw, pv + i * cpw);
+            }
+            pad_row(pu + i * cpw, cw, cpw);
+            pad_row(pv + i * cpw, cw, cpw);
+        }
+        break;
+
+    case JPEGSOFT_YUY2:
+    case JPEGSOFT_UYVY:
+        /* Y0 U Y1 V or U Y0 V Y1 */
+        for (i = 0; i < 8; i++) {
+            const int yo = (enc->format == JPEGSOFT_YUY2) ? 0 : 1, co = 1 - yo;
+
+            s = src_row(enc, enc->src, (size_t)w * 2, h, y0 + i);
+            for (x = 0; x < w; x++)
+                py[i * pw + x] = s[2 * x + yo];
+            for (x = 0; x < cw; x++) {
+                pu[i * cpw + x] = s[4 * x + co];
+                pv[i * cpw + x] = s[4 * x + co + 2];
+            }
+            pad_row(py + i * pw, w, pw);
+            pad_row(pu + i * cpw, cw, cpw);
+            pad_row(pv + i * cpw, cw, cpw);
+        }
+        break;
+
+    case JPEGSOFT_Y8:
+        for (i = 0; i < 8; i++) {
+            memcpy(py + i * pw, src_row(enc, enc->src, w, h, y0 + i), w);
+            pad_row(py + i * pw, w, pw);
+        }
+        break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Code a stripe, DC predictions start again after each restart marker
+// -----------------------------------------------------------------------------
+static void code_stripe(worker *wk, int s)
+{
+    jpegsoft *enc = wk->enc;
+    stripebuf *sb = enc->stripes + s;
+    bitwriter bw = { sb, 0, 0 };
+    int16_t coef[64];
+    int pred[3] = { 0, 0, 0 };
+    int my, mx, bx, by, end = (s + 1) * enc->rows;
+
+    sb->len = 0;
+    if (end > enc->mcuy)
+        end = enc->mcuy;
+    for (my = s * enc->rows; my < end; my++) {
+        load_mcu_row(enc, wk, my);
+        for (mx = 0; mx < enc->mcux; mx++) {
+            reserve(sb, MCU_MAX_BYTES);
+            for (by = 0; by < enc->vs; by++) {
+                for (bx = 0; bx < enc->hs; bx++) {
+                    fdct_quant(wk->plane[0] + by * 8 * enc->pw[0] + (mx * enc->hs + bx) * 8, enc->pw[0],
+                               enc->recip[0], coef);
+                    encode_block(&bw, coef, enc->order, &pred[0], &enc->dc[0], &enc->ac[0]);
+                }
+            }
+            if (enc->ncomp == 1)
+                continue;
+            fdct_quant(wk->plane[1] + mx * 8, enc->pw[1], enc->recip[1], coef);
+            encode_block(&bw, coef, enc->order, &pred[1], &enc->dc[1], &enc->ac[1]);
+            fdct_quant(wk->plane[2] + mx * 8, enc->pw[1], enc->recip[1], coef);
+            encode_block(&bw, coef, enc->order, &pred[2], &enc->dc[1], &enc->ac[1]);
+        }
+    }
+    flush_bits(&bw);
+}
+
+static void *worker_main(void *arg)
+{
+    worker *wk = arg;
+    int s;
+
+    while ((s = __sync_fetch_and_add(&wk->enc->next, 1)) < wk->enc->nstripes)
+        code_stripe(wk, s);
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+//   Encoder
+// -----------------------------------------------------------------------------
+jpegsoft *jpegsoft_create(int width, int height, int format, const uint8_t *quant[2],
+                          const uint8_t *dc[2], const uint8_t *ac[2], int threads)
+{
+    jpegsoft *enc;
+    int i, n;
+
+    if (width <= 0 || height <= 0 || format < JPEGSOFT_YUVA || format > JPEGSOFT_Y8)
+        return NULL;
+    enc = calloc(1, sizeof(*enc));
+    if (enc == NULL)
+        return NULL;
+
+    enc->width = width;
+    enc->height = height;
+    enc->format = format;
+    enc->ncomp = (format == JPEGSOFT_Y8) ? 1 : 3;
+    enc->hs = (format == JPEGSOFT_Y8) ? 1 : 2;
+    enc->vs = (format == JPEGSOFT_Y8 || format == JPEGSOFT_YUY2 || format == JPEGSOFT_UYVY) ? 1 : 2;
+    enc->mcux = (width + 8 * enc->hs - 1) / (8 * enc->hs);
+    enc->mcuy = (height + 8 * enc->vs - 1) / (8 * enc->vs);
+    enc->pw[0] = enc->mcux * 8 * enc->hs;
+    enc->pw[1] = enc->mcux * 8;
+
+    for (i = 0; i < 64; i++) {
+        n = zigzag[i];
+        enc->order[i] = (n & 7) * 8 + (n >> 3);
+    }
+    jpegsoft_set_quant(enc, quant);
+    for (i = 0; i < 2; i++) {
+        build_huffman(&enc->dc[i], dc[i]);
+        build_huffman(&enc->ac[i], ac[i]);
+    }
+
+    /* stripes of whole MCU rows, at most MAX_RESTART MCUs each */
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (threads < 1) ? 1 : (threads > MAX_THREADS) ? MAX_THREADS : threads;
+    if (threads > enc->mcuy)
+        threads = enc->mcuy;
+    n = (threads == 1) ? 1 : threads * STRIPES_PER_THREAD;
+    if (n > enc->mcuy)
+        n = enc->mcuy;
+    enc->rows = (enc->mcuy + n - 1) / n;
+    if (n > 1 && enc->rows * enc->mcux > MAX_RESTART)
+        enc->rows = MAX_RESTART / enc->mcux;
+    enc->nstripes = (enc->mcuy + enc->rows - 1) / enc->rows;
+
+    enc->nworkers = threads;
+    enc->workers = calloc(threads, sizeof(worker));
+    enc->stripes = calloc(enc->nstripes, sizeof(stripebuf));
+    if (enc->workers == NULL || enc->stripes == NULL) {
+        jpegsoft_destroy(enc);
+        return NULL;
+    }
+    for (i = 0; i < threads; i++) {
+        enc->workers[i].enc = enc;
+        enc->workers[i].plane[0] = malloc((size_t)enc->pw[0] * 8 * enc->vs);
+        enc->workers[i].plane[1] = malloc((size_t)enc->pw[1] * 8);
+        enc->workers[i].plane[2] = malloc((size_t)enc->pw[1] * 8);
+        if (!enc->workers[i].plane[0] || !enc->workers[i].plane[1] || !enc->workers[i].plane[2]) {
+            jpegsoft_destroy(enc);
+            return NULL;
+        }
+    }
+    return enc;
+}
+
+void jpegsoft_set_quant(jpegsoft *enc, const uint8_t *quant[2])
+{
+    double aan[8];
+    int i, u, v;
+
+    /* the AAN outputs are scaled by aan[u] * aan[v] * 8 */
+    aan[0] = 1.0;
+    for (i = 1; i < 8; i++)
+        aan[i] = cos(i * M_PI / 16) * M_SQRT2;
+    for (v = 0; v < 8; v++) {
+        for (u = 0; u < 8; u++) {
+            for (i = 0; i < 2; i++)
+                enc->recip[i][u * 8 + v] = 1.0 / (quant[i][v * 8 + u] * aan[u] * aan[v] * 8.0);
+        }
+    }
+}
+
+void jpegsoft_destroy(jpegsoft *enc)
+{
+    int i;
+
+    if (enc == NULL)
+        return;
+    for (i = 0; enc->workers && i < enc->nworkers; i++) {
+        free(enc->workers[i].plane[0]);
+        free(enc->workers[i].plane[1]);
+        free(enc->workers[i].plane[2]);
+    }
+    for (i = 0; enc->stripes && i < enc->nstripes; i++)
+        free(enc->stripes[i].data);
+    free(enc->workers);
+    free(enc->stripes);
+    free(enc->out);
+    free(enc);
+}
+
+void jpegsoft_sampling(const jpegsoft *enc, int *ncomp, int *hs, int *vs)
+{
+    *ncomp = enc->ncomp;
+    *hs = enc->hs;
+    *vs = enc->vs;
+}
+
+int jpegsoft_restart_interval(const jpegsoft *enc)
+{
+    return (enc->nstripes > 1) ? enc->rows * enc->mcux : 0;
+}
+
+const unsigned char *jpegsoft_encode(jpegsoft *enc, const unsigned char *src, int flip, size_t *size)
+{
+    size_t len = 2;
+    uint8_t *o;
+    int i, started = 1;
+
+    enc->src = src;
+    enc->flip = flip;
+    enc->next = 0;
+    for (i = 1; i < enc->nworkers; i++) {
+        if (pthread_create(&enc->workers[i].thread, NULL, worker_main, enc->workers + i) != 0)
+            break;
+        started++;
+    }
+    worker_main(enc->workers);
+    for (i = 1; i < started; i++)
+        pthread_join(enc->workers[i].thread, NULL);
+
+    /* stripes separated by RST0-7 markers, then EOI */
+    for (i = 0; i < enc->nstripes; i++)
+        len += enc->stripes[i].len + 2;
+    if (len > enc->outmax) {
+        free(enc->out);
+        enc->out = malloc(len);
+        enc->outmax = enc->out ? len : 0;
+        if (enc->out == NULL)
+            return NULL;
+    }
+    o = enc->out;
+    for (i = 0; i < enc->nstripes; i++) {
+        memcpy(o, enc->stripes[i].data, enc->stripes[i].len);
+        o += enc->stripes[i].len;
+        if (i < enc->nstripes - 1) {
+            *o++ = 0xff;
+            *o++ = 0xd0 + (i & 7);
+        }
+    }
+    *o++ = 0xff;
+    *o++ = 0xd9;
+    *size = o - enc->out;
+    return enc->out;
+}
+
+void jpegsoft_rgba_yuva(const unsigned char *src, unsigned char *dst, size_t n)
+{
+    int r, g, b, u, v;
+    size_t i;
+
+    for (i = 0; i < 4 * n; i += 4) {
+        r = src[i];
+        g = src[i + 1];
+        b = src[i + 2];
+        u = (-11056 * r - 21712 * g + 32768 * b + (128 << 16) + 32768) >> 16;
+        v = (32768 * r - 27440 * g - 5328 * b + (128 << 16) + 32768) >> 16;
+        dst[i] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+        dst[i + 1] = (u > 255) ? 255 : u;
+        dst[i + 2] = (v > 255) ? 255 : v;
+        dst[i + 3] = src[i + 3];
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __JPEGSOFT_H__
+#define __JPEGSOFT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Software baseline JPEG encoder.
+ *
+ * It produces the entropy coded segment of a single interleaved scan, the
+ * headers are written by the caller with the tables given here. The image
+ * is cut in stripes of whole MCU rows ended by restart markers, stripes are
+ * coded in parallel and concatenated. Chroma is subsampled 2x2 (2x1 for the
+ * 4:2:2 sources), Y8 gives a single component.
+ */
+typedef struct __jpegsoft jpegsoft;
+
+/* source formats */
+#define JPEGSOFT_YUVA   0       /* 4 bytes per pixel Y, U, V, A as written by offscreen */
+#define JPEGSOFT_I420   1
+#define JPEGSOFT_NV12   2
+#define JPEGSOFT_YUY2   3
+#define JPEGSOFT_UYVY   4
+#define JPEGSOFT_Y8     5
+
+/*
+ * quant: luma and chroma quantization tables in natural order, already
+ * scaled to the quality. dc, ac: luma and chroma Huffman tables laid out
+ * like the header tables (TcTh, 16 counts, values). threads 0 uses every
+ * processor.
+ */
+jpegsoft *jpegsoft_create(int width, int height, int format, const uint8_t *quant[2],
+                          const uint8_t *dc[2], const uint8_t *ac[2], int threads);
+void jpegsoft_destroy(jpegsoft *enc);
+
+/* new quantization tables, for the next images */
+void jpegsoft_set_quant(jpegsoft *enc, const uint8_t *quant[2]);
+
+/* components and luma sampling factors for the frame header */
+void jpegsoft_sampling(const jpegsoft *enc, int *ncomp, int *hs, int *vs);
+
+/* restart interval in MCUs for the DRI segment, 0 if there is one stripe */
+int jpegsoft_restart_interval(const jpegsoft *enc);
+
+/*
+ * Code an image, planes follow each other for planar formats. flip when
+ * the first row in memory is the bottom of the image. Returns the entropy
+ * coded data followed by EOI, owned by the encoder, and its size.
+ */
+const unsigned char *jpegsoft_encode(jpegsoft *enc, const unsigned char *src, int flip, size_t *size);
+
+/*
+ * n RGBA pixels to YUVA with the rgb2yuv of the shaders (JFIF, full range),
+ * for frames rendered in the rgb colorspace. src and dst may be the same.
+ */
+void jpegsoft_rgba_yuva(const unsigned char *src, unsigned char *dst, size_t n);
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef __MJPEG_H__
+#define __MJPEG_H__
+
+/*
+ * Motion JPEG over HTTP.
+ *
+ * A small single threaded server: GET /snapshot.jpg returns the last
+ * picture and closes, any other path streams the pictures as they come
+ * in a multipart/x-mixed-replace response. Pictures are shared by the
+ * clients and sent without blocking, a client still busy with a picture
+ * skips the ones coded meanwhile and goes on with the last one, so a slow
+ * client never stalls the encoder or the others.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MJPEG_CLIENTS   256
+#define MJPEG_REQUEST   1024
+#define MJPEG_BOUNDARY  "offscreenframe"
+#define MJPEG_ADDRESS   "127.0.0.1"     /* local clients only unless told */
+
+struct mjpeg_picture_s {
+    int refs;
+    size_t size;
+    unsigned char data[];
+};
+
+struct mjpeg_client_s {
+    int fd;
+    int snapshot;               /* close once the picture is sent */
+    int streaming;              /* request read, answer started */
+    char req[MJPEG_REQUEST];    /* request read so far */
+    int len;
+    char head[256];             /* HTTP or part header being sent */
+    int hlen;
+    struct mjpeg_picture_s *pic;        /* picture being sent, NULL if idle */
+    size_t off;                 /* bytes of head + picture + tail sent */
+    unsigned long long sent;    /* number of the last picture sent */
+};
+
+struct mjpeg_s {
+    int lfd;
+    int nclients;
+    struct mjpeg_client_s c[MJPEG_CLIENTS];
+    struct mjpeg_picture_s *last;
+    unsigned long long count;   /* number of the last picture */
+};
+
+static void mjpeg_unref(struct mjpeg_picture_s *pic)
+{
+    if (pic && --pic->refs == 0)
+        free(pic);
+}
+
+// -----------------------------------------------------------------------------
+//  Listen on TCP port of the IPv4 address, MJPEG_ADDRESS when NULL. Returns
+//  -1 on error.
+// -----------------------------------------------------------------------------
+static int mjpeg_open(struct mjpeg_s *m, const char *address, int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+
+    memset(m, 0, sizeof(*m));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address ? address : MJPEG_ADDRESS, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    m->lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (m->lfd == -1)
+        return -1;
+    setsockopt(m->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(m->lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(m->lfd, 64) == -1) {
+        close(m->lfd);
+        return -1;
+    }
+    return 0;
+}
+
+static void mjpeg_drop(struct mjpeg_s *m, int i)
+{
+    close(m->c[i].fd);
+    mjpeg_unref(m->c[i].pic);
+    m->c[i] = m->c[--m->nclients];
+}
+
+static void mjpeg_close(struct mjpeg_s *m)
+{
+    while (m->nclients)
+        mjpeg_drop(m, 0);
+    mjpeg_unref(m->last);
+    close(m->lfd);
+}
+
+// -----------------------------------------------------------------------------
+//  Number of clients waiting for pictures
+// -----------------------------------------------------------------------------
+static int mjpeg_clients(const struct mjpeg_s *m)
+{
+    int i, n = 0;
+
+    for (i = 0; i < m->nclients; i++)
+        n += m->c[i].streaming;
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+//  Start sending the last picture to an idle client
+// -----------------------------------------------------------------------------
+static void mjpeg_start(struct mjpeg_s *m, struct mjpeg_client_s *c)
+{
+    if (c->pic || m->last == NULL || c->sent == m->count)
+        return;
+    if (c->snapshot)
+        c->hlen = snprintf(c->head, sizeof(c->head),
+                           "HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\n"
+                           "Content-Length: %zu\r\nCache-Control: no-cache\r\n\r\n", m->last->size);
+    else
+        c->hlen = snprintf(c->head, sizeof(c->head),
+                           "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+                           m->last->size);
+    c->pic = m->last;
+    c->pic->refs++;
+    c->sent = m->count;
+    c->off = 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Send what the socket takes, returns -1 if the client is to be dropped
+// -----------------------------------------------------------------------------
+static int mjpeg_send(struct mjpeg_s *m, struct mjpeg_client_s *c)
+{
+    static const char tail[] = "\r\n";
+    size_t tlen = c->snapshot ? 0 : 2;
+    struct iovec iov[3];
+    struct msghdr msg;
+    size_t off = c->off;
+    ssize_t n;
+    int cnt = 0;
+
+    while (c->pic) {
+        if (off < (size_t)c->hlen) {
+            iov[cnt].iov_base = c->head + off;
+            iov[cnt++].iov_len = c->hlen - off;
+            off = c->hlen;
+        }
+        if (off < c->hlen + c->pic->size) {
+            iov[cnt].iov_base = c->pic->data + off - c->hlen;
+            iov[cnt++].iov_len = c->hlen + c->pic->size - off;
+            off = c->hlen + c->pic->size;
+        }
+        if (off < c->hlen + c->pic->size + tlen) {
+            iov[cnt].iov_base = (char *)tail + off - c->hlen - c->pic->size;
+            iov[cnt++].iov_len = c->hlen + c->pic->size + tlen - off;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        n = (cnt == 0) ? 0 : sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        c->off += n;
+        if (c->off < c->hlen + c->pic->size + tlen)
+            return 0;
+
+        /* picture done, go on with a newer one if any */
+        mjpeg_unref(c->pic);
+        c->pic = NULL;
+        if (c->snapshot)
+            return -1;
+        mjpeg_start(m, c);
+        off = c->off;
+        cnt = 0;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  A whole request was read: answer it
+// -----------------------------------------------------------------------------
+static int mjpeg_request(struct mjpeg_s *m, struct mjpeg_client_s *c)
+{
+    static const char head[] =
+        "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nPragma: no-cache\r\n"
+        "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n\r\n";
+
+    if (strncmp(c->req, "GET ", 4))
+        return -1;
+    c->snapshot = !strncmp(c->req + 4, "/snapshot", 9);
+    c->streaming = 1;
+    if (!c->snapshot && send(c->fd, head, sizeof(head) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(head) - 1)
+        return -1;
+    mjpeg_start(m, c);
+    return mjpeg_send(m, c);
+}
+
+// -----------------------------------------------------------------------------
+//  Accept clients, read their requests and send pending data, waiting at
+//  most timeout ms. Returns -1 when interrupted by a signal, 0 otherwise.
+// -----------------------------------------------------------------------------
+static int mjpeg_poll(struct mjpeg_s *m, int timeout)
+{
+    struct pollfd pfd[MJPEG_CLIENTS + 1];
+    struct mjpeg_client_s *c;
+    int i, n, fd;
+
+    pfd[0].fd = (m->nclients < MJPEG_CLIENTS) ? m->lfd : -1;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < m->nclients; i++) {
+        pfd[i + 1].fd = m->c[i].fd;
+        pfd[i + 1].events = m->c[i].pic ? POLLOUT : POLLIN;
+    }
+    if (poll(pfd, m->nclients + 1, timeout) == -1)
+        return (errno == EINTR) ? -1 : 0;
+
+    /* from the end, dropping a client moves the last one in its place */
+    for (i = m->nclients - 1; i >= 0; i--) {
+        c = &m->c[i];
+        if (pfd[i + 1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            mjpeg_drop(m, i);
+            continue;
+        }
+        if (pfd[i + 1].revents & POLLOUT) {
+            if (mjpeg_send(m, c) == -1)
+                mjpeg_drop(m, i);
+            continue;
+        }
+        if (!(pfd[i + 1].revents & POLLIN))
+            continue;
+        n = read(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len);
+        if (n <= 0 || (!c->streaming && (c->len += n) == sizeof(c->req) - 1)) {
+            /* gone, or a request too long for us */
+            mjpeg_drop(m, i);
+            continue;
+        }
+        if (c->streaming)
+            continue;
+        c->req[c->len] = 0;
+        if ((strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) && mjpeg_request(m, c) == -1)
+            mjpeg_drop(m, i);
+    }
+
+    if (pfd[0].revents & POLLIN) {
+        while (m->nclients < MJPEG_CLIENTS &&
+               (fd = accept(m->lfd, NULL, NULL)) != -1) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            memset(&m->c[m->nclients], 0, sizeof(m->c[0]));
+            m->c[m->nclients++].fd = fd;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Forget the last picture when it gets too old to be given to new clients,
+//  they wait for the next one
+// -----------------------------------------------------------------------------
+static void mjpeg_flush(struct mjpeg_s *m)
+{
+    mjpeg_unref(m->last);
+    m->last = NULL;
+}
+
+// -----------------------------------------------------------------------------
+//  New picture, sent to every idle client. The data is copied.
+// -----------------------------------------------------------------------------
+static int mjpeg_push(struct mjpeg_s *m, const unsigned char *jpeg, size_t size)
+{
+    struct mjpeg_picture_s *pic;
+    int i;
+
+    pic = malloc(sizeof(*pic) + size);
+    if (pic == NULL)
+        return -1;
+    pic->refs = 1;
+    pic->size = size;
+    memcpy(pic->data, jpeg, size);
+    mjpeg_unref(m->last);
+    m->last = pic;
+    m->count++;
+
+    for (i = m->nclients - 1; i >= 0; i--) {
+        if (!m->c[i].streaming || m->c[i].pic)
+            continue;
+        mjpeg_start(m, &m->c[i]);
+        if (mjpeg_send(m, &m->c[i]) == -1)
+            mjpeg_drop(m, i);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,973 @@
+#ifndef __MUX_H__
+#define __MUX_H__
+
+/*
+ * Output containers of the encoders.
+ *
+ * Access units are written as Annex-B byte streams by the encoders and stored
+ * in one of:
+ *
+ *   raw    the byte stream as is, written as soon as it is coded
+ *   mp4    fragmented MP4, an init segment then a moof/mdat pair per GOP. The
+ *          sample table of each fragment is written with it and the random
+ *          access index (mfra) built along the way is appended on close.
+ *   ts     MPEG-2 transport stream, one PES per access unit
+ *   nal    the NAL units of each access unit, with its presentation time, to
+ *          a streamer listening on a Unix socket (see nalsock.h). When the
+ *          streamer goes away, or is not there yet, the pictures are dropped
+ *          until it is back.
+ *
+ * Timestamps are derived from the capture time of each frame, in 90 kHz
+ * units. The decode time follows the capture time, the presentation time
+ * adds the reordering delay given by the encoder in frame periods.
+ *
+ * Parameter sets stay in the samples (avc3/hev1 sample entries) since the
+ * H264 encoder writes a second PPS in the middle of the stream.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nalsock.h"
+
+#define MUX_RAW             0
+#define MUX_MP4             1
+#define MUX_TS              2
+#define MUX_NAL             3
+
+#define MUX_H264            0
+#define MUX_HEVC            1
+
+#define MUX_TIMESCALE       90000
+#define MUX_FRAGMENT_MAX    2       /* seconds, when key pictures are rare */
+
+#define MUX_TS_PMT_PID      0x1000
+#define MUX_TS_PID          0x100
+#define MUX_TS_DELAY        9000    /* PCR ahead of DTS, 100 ms */
+
+struct mux_buf_s {
+    unsigned char *p;
+    size_t len, size;
+};
+
+struct mux_sample_s {
+    unsigned int size;
+    unsigned int duration;
+    int cts;                    /* presentation - decode time */
+    int key;
+};
+
+struct mux_ra_s {
+    unsigned long long time;    /* decode time of the key sample */
+    unsigned long long offset;  /* file offset of its moof */
+};
+
+struct mux_s {
+    FILE *fp;
+    int format, codec;
+    int width, height;
+    unsigned int frame_ticks;   /* frame period in 90 kHz units */
+    unsigned long long offset;  /* bytes written */
+
+    unsigned long long t0;      /* capture time of the first picture, us */
+    unsigned long long dts;     /* decode time of the last picture */
+    unsigned int pictures;
+
+    struct mux_buf_s au;        /* access unit being written */
+
+    /* mp4 */
+    struct mux_buf_s mdat;      /* samples of the fragment, length prefixed */
+    struct mux_sample_s *samples;
+    int nsamples, max_samples;
+    unsigned long long frag_dts;
+    unsigned int sequence;
+    struct mux_ra_s *ra;
+    int nra, max_ra;
+
+    /* ts */
+    unsigned char cc[3];        /* continuity counters: PAT, PMT, video */
+
+    /* nal */
+    char *path;                 /* socket of the streamer */
+    int lost;                   /* streamer gone, reconnect before sending */
+};
+
+// -----------------------------------------------------------------------------
+//  Growing buffer and big endian writers
+// -----------------------------------------------------------------------------
+static int mux_grow(struct mux_buf_s *b, size_t n)
+{
+    unsigned char *p;
+    size_t size = b->size ? b->size : 4096;
+
+    if (b->len + n <= b->size)
+        return 0;
+    while (size < b->len + n)
+        size *= 2;
+    p = realloc(b->p, size);
+    if (p == NULL)
+        return -1;
+    b->p = p;
+    b->size = size;
+    return 0;
+}
+
+static void mux_put(struct mux_buf_s *b, const void *data, size_t n)
+{
+    if (mux_grow(b, n) == 0) {
+        memcpy(b->p + b->len, data, n);
+        b->len += n;
+    }
+}
+
+static void mux_u8(struct mux_buf_s *b, unsigned int v)
+{
+    unsigned char c = v;
+
+    mux_put(b, &c, 1);
+}
+
+static void mux_u16(struct mux_buf_s *b, unsigned int v)
+{
+    mux_u8(b, v >> 8);
+    mux_u8(b, v);
+}
+
+static void mux_u32(struct mux_buf_s *b, unsigned int v)
+{
+    mux_u16(b, v >> 16);
+    mux_u16(b, v);
+}
+
+static void mux_u64(struct mux_buf_s *b, unsigned long long v)
+{
+    mux_u32(b, v >> 32);
+    mux_u32(b, v);
+}
+
+static void mux_zero(struct mux_buf_s *b, int n)
+{
+    while (n-- > 0)
+        mux_u8(b, 0);
+}
+
+/* box header, the size is patched by mux_box_end */
+static size_t mux_box(struct mux_buf_s *b, const char *type)
+{
+    size_t start = b->len;
+
+    mux_u32(b, 0);
+    mux_put(b, type, 4);
+    return start;
+}
+
+static size_t mux_fullbox(struct mux_buf_s *b, const char *type, int version, unsigned int flags)
+{
+    size_t start = mux_box(b, type);
+
+    mux_u32(b, (version << 24) | flags);
+    return start;
+}
+
+static void mux_box_end(struct mux_buf_s *b, size_t start)
+{
+    size_t size = b->len - start;
+
+    if (b->p && start + 4 <= b->len) {
+        b->p[start] = size >> 24;
+        b->p[start + 1] = size >> 16;
+        b->p[start + 2] = size >> 8;
+        b->p[start + 3] = size;
+    }
+}
+
+static int mux_flush(struct mux_s *m, struct mux_buf_s *b)
+{
+    size_t n = fwrite(b->p, 1, b->len, m->fp);
+    int ret = (n == b->len) ? 0 : -1;
+
+    m->offset += n;
+    b->len = 0;
+    return ret;
+}
+
+// -----------------------------------------------------------------------------
+//  Annex-B parsing: next NAL unit of buf, *nal and *size exclude the start code
+// -----------------------------------------------------------------------------
+static const unsigned char *mux_next_nal(const unsigned char *p, const unsigned char *end,
+                                         const unsigned char **nal, size_t *size)
+{
+    const unsigned char *q;
+
+    while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+        p++;
+    if (p + 3 > end)
+        return NULL;
+    p += 3;
+    for (q = p; q + 3 <= end; q++)
+        if (q[0] == 0 && q[1] == 0 && (q[2] == 1 || (q[2] == 0 && q + 4 <= end && q[3] == 1)))
+            break;
+    if (q + 3 > end)
+        q = end;
+    *nal = p;
+    *size = q - p;
+    return q;
+}
+
+static int mux_nal_type(const struct mux_s *m, const unsigned char *nal)
+{
+    return (m->codec == MUX_HEVC) ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+}
+
+// -----------------------------------------------------------------------------
+//  Decoder configuration records, from the parameter sets of the first key
+//  access unit
+// -----------------------------------------------------------------------------
+static void mux_avcc(struct mux_s *m, struct mux_buf_s *b)
+{
+    const unsigned char *p = m->au.p, *end = m->au.p + m->au.len, *nal;
+    const unsigned char *sps = NULL, *pps = NULL;
+    size_t size, sps_size = 0, pps_size = 0;
+    size_t box;
+
+    while ((p = mux_next_nal(p, end, &nal, &size)) != NULL) {
+        if (mux_nal_type(m, nal) == 7 && sps == NULL && size >= 4)
+            sps = nal, sps_size = size;
+        if (mux_nal_type(m, nal) == 8 && pps == NULL)
+            pps = nal, pps_size = size;
+    }
+    if (sps == NULL || pps == NULL)
+        return;
+
+    box = mux_box(b, "avcC");
+    mux_u8(b, 1);                       /* configurationVersion */
+    mux_u8(b, sps[1]);                  /* AVCProfileIndication */
+    mux_u8(b, sps[2]);                  /* profile_compatibility */
+    mux_u8(b, sps[3]);                  /* AVCLevelIndication */
+    mux_u8(b, 0xff);                    /* lengthSizeMinusOne = 3 */
+    mux_u8(b, 0xe1);                    /* one SPS */
+    mux_u16(b, sps_size);
+    mux_put(b, sps, sps_size);
+    mux_u8(b, 1);                       /* one PPS */
+    mux_u16(b, pps_size);
+    mux_put(b, pps, pps_size);
+    if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144) {
+        mux_u8(b, 0xfd);                /* chroma_format 4:2:0 */
+        mux_u8(b, 0xf8);                /* bit_depth_luma_minus8 */
+        mux_u8(b, 0xf8);                /* bit_depth_chroma_minus8 */
+        mux_u8(b, 0);                   /* no SPS extension */
+    }
+    mux_box_end(b, box);
+}
+
+static void mux_hvcc(struct mux_s *m, struct mux_buf_s *b)
+{
+    const unsigned char *p, *end = m->au.p + m->au.len, *nal;
+    unsigned char ptl[16];
+    size_t size, box;
+    int type, i, n;
+
+    /* general profile_tier_level of the SPS, without emulation prevention */
+    memset(ptl, 0, sizeof(ptl));
+    for (p = m->au.p; (p = mux_next_nal(p, end, &nal, &size)) != NULL; ) {
+        if (mux_nal_type(m, nal) != 33)
+            continue;
+        for (i = 2, n = 0; i < size && n < sizeof(ptl); i++) {
+            if (i >= 4 && nal[i] == 3 && nal[i - 1] == 0 && nal[i - 2] == 0)
+                continue;
+            ptl[n++] = nal[i];
+        }
+        break;
+    }
+
+    box = mux_box(b, "hvcC");
+    mux_u8(b, 1);                       /* configurationVersion */
+    mux_put(b, ptl + 1, 12);            /* profile, compatibility, constraints, level */
+    mux_u16(b, 0xf000);                 /* min_spatial_segmentation_idc */
+    mux_u8(b, 0xfc);                    /* parallelismType */
+    mux_u8(b, 0xfd);                    /* chroma_format 4:2:0 */
+    mux_u8(b, 0xf8);                    /* bit_depth_luma_minus8 */
+    mux_u8(b, 0xf8);                    /* bit_depth_chroma_minus8 */
+    mux_u16(b, 0);                      /* avgFrameRate */
+    mux_u8(b, 0x0f);                    /* one temporal layer, 4 bytes lengths */
+    mux_u8(b, 3);                       /* VPS, SPS and PPS arrays */
+    for (type = 32; type <= 34; type++) {
+        for (p = m->au.p; (p = mux_next_nal(p, end, &nal, &size)) != NULL; )
+            if (mux_nal_type(m, nal) == type)
+                break;
+        mux_u8(b, type);                /* array_completeness 0, in band sets allowed */
+        mux_u16(b, p ? 1 : 0);
+        if (p) {
+            mux_u16(b, size);
+            mux_put(b, nal, size);
+        }
+    }
+    mux_box_end(b, box);
+}
+
+// -----------------------------------------------------------------------------
+//  MP4 init segment: ftyp and moov without samples
+// -----------------------------------------------------------------------------
+static void mux_matrix(struct mux_buf_s *b)
+{
+    mux_u32(b, 0x00010000); mux_u32(b, 0); mux_u32(b, 0);
+    mux_u32(b, 0); mux_u32(b, 0x00010000); mux_u32(b, 0);
+    mux_u32(b, 0); mux_u32(b, 0); mux_u32(b, 0x40000000);
+}
+
+static int mux_mp4_init(struct mux_s *m)
+{
+    struct mux_buf_s b = { NULL, 0, 0 };
+    size_t moov, trak, mdia, minf, dinf, dref, stbl, stsd, entry, mvex, box;
+    int ret;
+
+    box = mux_box(&b, "ftyp");
+    mux_put(&b, "iso5", 4);
+    mux_u32(&b, 512);
+    mux_put(&b, "iso5iso6mp41", 12);
+    mux_box_end(&b, box);
+
+    moov = mux_box(&b, "moov");
+
+    box = mux_fullbox(&b, "mvhd", 0, 0);
+    mux_u32(&b, 0);                     /* creation_time */
+    mux_u32(&b, 0);                     /* modification_time */
+    mux_u32(&b, MUX_TIMESCALE);
+    mux_u32(&b, 0);                     /* duration, given by the fragments */
+    mux_u32(&b, 0x00010000);            /* rate */
+    mux_u16(&b, 0x0100);                /* volume */
+    mux_zero(&b, 10);
+    mux_matrix(&b);
+    mux_zero(&b, 24);
+    mux_u32(&b, 2);                     /* next_track_ID */
+    mux_box_end(&b, box);
+
+    trak = mux_box(&b, "trak");
+    box = mux_fullbox(&b, "tkhd", 0, 3);
+    mux_u32(&b, 0);
+    mux_u32(&b, 0);
+    mux_u32(&b, 1);                     /* track_ID */
+    mux_u32(&b, 0);
+    mux_u32(&b, 0);                     /* duration */
+    mux_zero(&b, 8);
+    mux_u16(&b, 0);                     /* layer */
+    mux_u16(&b, 0);                     /* alternate_group */
+    mux_u16(&b, 0);                     /* volume */
+    mux_u16(&b, 0);
+    mux_matrix(&b);
+    mux_u32(&b, m->width << 16);
+    mux_u32(&b, m->height << 16);
+    mux_box_end(&b, box);
+
+    mdia = mux_box(&b, "mdia");
+    box = mux_fullbox(&b, "mdhd", 0, 0);
+    mux_u32(&b, 0);
+    mux_u32(&b, 0);
+    mux_u32(&b, MUX_TIMESCALE);
+    mux_u32(&b, 0);
+    mux_u16(&b, 0x55c4);                /* und */
+    mux_u16(&b, 0);
+    mux_box_end(&b, box);
+    box = mux_fullbox(&b, "hdlr", 0, 0);
+    mux_u32(&b, 0);
+    mux_put(&b, "vide", 4);
+    mux_zero(&b, 12);
+    mux_put(&b, "VideoHandler", 13);
+    mux_box_end(&b, box);
+
+    minf = mux_box(&b, "minf");
+    box = mux_fullbox(&b, "vmhd", 0, 1);
+    mux_zero(&b, 8);
+    mux_box_end(&b, box);
+    dinf = mux_box(&b, "dinf");
+    dref = mux_fullbox(&b, "dref", 0, 0);
+    mux_u32(&b, 1);
+    box = mux_fullbox(&b, "url ", 0, 1);    /* data in this file */
+    mux_box_end(&b, box);
+    mux_box_end(&b, dref);
+    mux_box_end(&b, dinf);
+
+    stbl = mux_box(&b, "stbl");
+    stsd = mux_fullbox(&b, "stsd", 0, 0);
+    mux_u32(&b, 1);
+    entry = mux_box(&b, (m->codec == MUX_HEVC) ? "hev1" : "avc3");
+    mux_zero(&b, 6);
+    mux_u16(&b, 1);                     /* data_reference_index */
+    mux_zero(&b, 16);
+    mux_u16(&b, m->width);
+    mux_u16(&b, m->height);
+    mux_u32(&b, 0x00480000);            /* 72 dpi */
+    mux_u32(&b, 0x00480000);
+    mux_u32(&b, 0);
+    mux_u16(&b, 1);                     /* frame_count */
+    mux_zero(&b, 32);                   /* compressorname */
+    mux_u16(&b, 0x0018);                /* depth */
+    mux_u16(&b, 0xffff);
+    if (m->codec == MUX_HEVC)
+        mux_hvcc(m, &b);
+    else
+        mux_avcc(m, &b);
+    mux_box_end(&b, entry);
+    mux_box_end(&b, stsd);
+    box = mux_fullbox(&b, "stts", 0, 0); mux_u32(&b, 0); mux_box_end(&b, box);
+    box = mux_fullbox(&b, "stsc", 0, 0); mux_u32(&b, 0); mux_box_end(&b, box);
+    box = mux_fullbox(&b, "stsz", 0, 0); mux_u32(&b, 0); mux_u32(&b, 0); mux_box_end(&b, box);
+    box = mux_fullbox(&b, "stco", 0, 0); mux_u32(&b, 0); mux_box_end(&b, box);
+    mux_box_end(&b, stbl);
+    mux_box_end(&b, minf);
+    mux_box_end(&b, mdia);
+    mux_box_end(&b, trak);
+
+    mvex = mux_box(&b, "mvex");
+    box = mux_fullbox(&b, "trex", 0, 0);
+    mux_u32(&b, 1);                     /* track_ID */
+    mux_u32(&b, 1);                     /* default_sample_description_index */
+    mux_zero(&b, 12);
+    mux_box_end(&b, box);
+    mux_box_end(&b, mvex);
+    mux_box_end(&b, moov);
+
+    ret = mux_flush(m, &b);
+    free(b.p);
+    return ret;
+}
+
+// -----------------------------------------------------------------------------
+//  MP4 fragment: moof with the sample table then mdat
+// -----------------------------------------------------------------------------
+static int mux_mp4_fragment(struct mux_s *m)
+{
+    struct mux_buf_s b = { NULL, 0, 0 };
+    size_t moof, traf, trun, box, data_offset;
+    int i, ret;
+
+    if (m->nsamples == 0)
+        return 0;
+
+    /* index of the fragments starting on a key picture */
+    if (m->samples[0].key) {
+        if (m->nra == m->max_ra) {
+            struct mux_ra_s *ra = realloc(m->ra, (m->max_ra + 64) * sizeof(*ra));
+
+            if (ra) {
+                m->ra = ra;
+                m->max_ra += 64;
+            }
+        }
+        if (m->nra < m->max_ra) {
+            m->ra[m->nra].time = m->frag_dts;
+            m->ra[m->nra].offset = m->offset;
+            m->nra++;
+        }
+    }
+
+    moof = mux_box(&b, "moof");
+    box = mux_fullbox(&b, "mfhd", 0, 0);
+    mux_u32(&b, ++m->sequence);
+    mux_box_end(&b, box);
+
+    traf = mux_box(&b, "traf");
+    box = mux_fullbox(&b, "tfhd", 0, 0x020000);     /* default-base-is-moof */
+    mux_u32(&b, 1);
+    mux_box_end(&b, box);
+    box = mux_fullbox(&b, "tfdt", 1, 0);
+    mux_u64(&b, m->frag_dts);
+    mux_box_end(&b, box);
+
+    /* duration, size, flags and composition offset of every sample */
+    trun = mux_fullbox(&b, "trun", 0, 0x000f01);
+    mux_u32(&b, m->nsamples);
+    data_offset = b.len;
+    mux_u32(&b, 0);
+    for (i = 0; i < m->nsamples; i++) {
+        mux_u32(&b, m->samples[i].duration);
+        mux_u32(&b, m->samples[i].size);
+        mux_u32(&b, m->samples[i].key ? 0x02000000 : 0x01010000);
+        mux_u32(&b, m->samples[i].cts);
+    }
+    mux_box_end(&b, trun);
+    mux_box_end(&b, traf);
+    mux_box_end(&b, moof);
+
+    if (b.p) {
+        size_t offset = b.len - moof + 8;
+
+        b.p[data_offset] = offset >> 24;
+        b.p[data_offset + 1] = offset >> 16;
+        b.p[data_offset + 2] = offset >> 8;
+        b.p[data_offset + 3] = offset;
+    }
+    mux_u32(&b, m->mdat.len + 8);
+    mux_put(&b, "mdat", 4);
+
+    ret = mux_flush(m, &b);
+    if (ret == 0)
+        ret = mux_flush(m, &m->mdat);
+    fflush(m->fp);
+    free(b.p);
+
+    m->mdat.len = 0;
+    m->nsamples = 0;
+    return ret;
+}
+
+static int mux_mp4_sample(struct mux_s *m, unsigned long long dts, int cts, int key)
+{
+    const unsigned char *p = m->au.p, *end = m->au.p + m->au.len, *nal;
+    struct mux_sample_s *s;
+    size_t size, start;
+    int ret = 0;
+
+    if (m->offset == 0)
+        ret = mux_mp4_init(m);
+
+    /* the previous sample lasts until this one */
+    if (m->nsamples)
+        m->samples[m->nsamples - 1].duration = dts - m->dts;
+
+    if (m->nsamples && (key || dts - m->frag_dts >= MUX_FRAGMENT_MAX * MUX_TIMESCALE))
+        ret |= mux_mp4_fragment(m);
+
+    if (m->nsamples == m->max_samples) {
+        s = realloc(m->samples, (m->max_samples + 64) * sizeof(*s));
+        if (s == NULL)
+            return -1;
+        m->samples = s;
+        m->max_samples += 64;
+    }
+    if (m->nsamples == 0)
+        m->frag_dts = dts;
+
+    /* NAL units get a 4 bytes length instead of their start code */
+    start = m->mdat.len;
+    while ((p = mux_next_nal(p, end, &nal, &size)) != NULL) {
+        mux_u32(&m->mdat, size);
+        mux_put(&m->mdat, nal, size);
+    }
+
+    s = m->samples + m->nsamples++;
+    s->size = m->mdat.len - start;
+    s->duration = m->frame_ticks;
+    s->cts = cts;
+    s->key = key;
+    return ret;
+}
+
+static int mux_mp4_close(struct mux_s *m)
+{
+    struct mux_buf_s b = { NULL, 0, 0 };
+    size_t mfra, box;
+    int i, ret;
+
+    ret = mux_mp4_fragment(m);
+
+    mfra = mux_box(&b, "mfra");
+    box = mux_fullbox(&b, "tfra", 1, 0);
+    mux_u32(&b, 1);                     /* track_ID */
+    mux_u32(&b, 0);                     /* 1 byte traf, trun and sample numbers */
+    mux_u32(&b, m->nra);
+    for (i = 0; i < m->nra; i++) {
+        mux_u64(&b, m->ra[i].time);
+        mux_u64(&b, m->ra[i].offset);
+        mux_u8(&b, 1);
+        mux_u8(&b, 1);
+        mux_u8(&b, 1);
+    }
+    mux_box_end(&b, box);
+    box = mux_fullbox(&b, "mfro", 0, 0);
+    mux_u32(&b, b.len - mfra + 4);
+    mux_box_end(&b, box);
+    mux_box_end(&b, mfra);
+
+    ret |= mux_flush(m, &b);
+    free(b.p);
+    return ret;
+}
+
+// -----------------------------------------------------------------------------
+//  MPEG-TS: PAT and PMT before every key picture, PCR on every PES
+// -----------------------------------------------------------------------------
+static unsigned int mux_crc32(const unsigned char *p, size_t n)
+{
+    unsigned int crc = 0xffffffff;
+    int i;
+
+    while (n--) {
+        crc ^= (unsigned int)*p++ << 24;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+/* one packet of the payload, returns the number of bytes it carries */
+static size_t mux_ts_packet(struct mux_s *m, struct mux_buf_s *b, int pid, int cc, int start,
+                            const unsigned long long *pcr, int rai,
+                            const unsigned char *data, size_t len)
+{
+    int flags = (rai ? 0x40 : 0) | (pcr ? 0x10 : 0);
+    size_t n = (len < 184) ? len : 184;
+    int af = -1;
+
+    if (flags || n < 184) {
+        size_t room = 184 - (flags ? (pcr ? 8 : 2) : 1);
+
+        if (n > room)
+            n = room;
+        af = 183 - n;                   /* adaptation_field_length */
+    }
+
+    mux_u8(b, 0x47);
+    mux_u16(b, (start ? 0x4000 : 0) | pid);
+    mux_u8(b, ((af >= 0) ? 0x30 : 0x10) | (m->cc[cc]++ & 0x0f));
+    if (af >= 0) {
+        int stuffing = af;
+
+        mux_u8(b, af);
+        if (af > 0) {
+            mux_u8(b, flags);
+            stuffing--;
+        }
+        if (pcr) {
+            unsigned long long base = *pcr & 0x1ffffffffULL;
+
+            mux_u32(b, base >> 1);
+            mux_u16(b, ((base & 1) << 15) | 0x7e00);    /* extension 0 */
+            stuffing -= 6;
+        }
+        while (stuffing-- > 0)
+            mux_u8(b, 0xff);
+    }
+    mux_put(b, data, n);
+    return n;
+}
+
+static void mux_ts_section(struct mux_s *m, struct mux_buf_s *b, int pid, int cc,
+                           struct mux_buf_s *s)
+{
+    unsigned char payload[184];
+    unsigned int crc = mux_crc32(s->p, s->len);
+
+    /* pointer_field, section, CRC, stuffing */
+    memset(payload, 0xff, sizeof(payload));
+    payload[0] = 0;
+    memcpy(payload + 1, s->p, s->len);
+    payload[s->len + 1] = crc >> 24;
+    payload[s->len + 2] = crc >> 16;
+    payload[s->len + 3] = crc >> 8;
+    payload[s->len + 4] = crc;
+    mux_ts_packet(m, b, pid, cc, 1, NULL, 0, payload, sizeof(payload));
+}
+
+static void mux_ts_tables(struct mux_s *m, struct mux_buf_s *b)
+{
+    struct mux_buf_s s = { NULL, 0, 0 };
+
+    mux_u8(&s, 0x00);                   /* program_association_section */
+    mux_u16(&s, 0xb000 | 13);
+    mux_u16(&s, 1);                     /* transport_stream_id */
+    mux_u8(&s, 0xc1);                   /* version 0, current */
+    mux_u16(&s, 0);
+    mux_u16(&s, 1);                     /* program_number */
+    mux_u16(&s, 0xe000 | MUX_TS_PMT_PID);
+    mux_ts_section(m, b, 0, 0, &s);
+
+    s.len = 0;
+    mux_u8(&s, 0x02);                   /* TS_program_map_section */
+    mux_u16(&s, 0xb000 | 18);
+    mux_u16(&s, 1);
+    mux_u8(&s, 0xc1);
+    mux_u16(&s, 0);
+    mux_u16(&s, 0xe000 | MUX_TS_PID);   /* PCR_PID */
+    mux_u16(&s, 0xf000);
+    mux_u8(&s, (m->codec == MUX_HEVC) ? 0x24 : 0x1b);
+    mux_u16(&s, 0xe000 | MUX_TS_PID);
+    mux_u16(&s, 0xf000);
+    mux_ts_section(m, b, MUX_TS_PMT_PID, 1, &s);
+    free(s.p);
+}
+
+static void mux_ts_timestamp(struct mux_buf_s *b, int prefix, unsigned long long t)
+{
+    t &= 0x1ffffffffULL;
+    mux_u8(b, (prefix << 4) | ((t >> 29) & 0x0e) | 1);
+    mux_u16(b, ((t >> 14) & 0xfffe) | 1);
+    mux_u16(b, ((t << 1) & 0xfffe) | 1);
+}
+
+static int mux_ts_pes(struct mux_s *m, unsigned long long dts, int cts, int key)
+{
+    static const unsigned char aud_h264[] = { 0, 0, 0, 1, 0x09, 0xf0 };
+    static const unsigned char aud_hevc[] = { 0, 0, 0, 1, 0x46, 0x01, 0x50 };
+    struct mux_buf_s b = { NULL, 0, 0 }, pes = { NULL, 0, 0 };
+    unsigned long long pcr = dts;
+    size_t done;
+    int ret;
+
+    dts += MUX_TS_DELAY;
+    if (key || m->pictures == 1)
+        mux_ts_tables(m, &b);
+
+    /* PES header and access unit delimiter */
+    mux_u32(&pes, 0x000001e0);
+    mux_u16(&pes, 0);                   /* unbounded */
+    mux_u8(&pes, 0x84);                 /* data_alignment_indicator */
+    mux_u8(&pes, cts ? 0xc0 : 0x80);
+    mux_u8(&pes, cts ? 10 : 5);
+    mux_ts_timestamp(&pes, cts ? 3 : 2, dts + cts);
+    if (cts)
+        mux_ts_timestamp(&pes, 1, dts);
+    if (m->codec == MUX_HEVC)
+        mux_put(&pes, aud_hevc, sizeof(aud_hevc));
+    else
+        mux_put(&pes, aud_h264, sizeof(aud_h264));
+    mux_put(&pes, m->au.p, m->au.len);
+
+    done = mux_ts_packet(m, &b, MUX_TS_PID, 2, 1, &pcr, key, pes.p, pes.len);
+    while (done < pes.len)
+        done += mux_ts_packet(m, &b, MUX_TS_PID, 2, 0, NULL, 0, pes.p + done, pes.len - done);
+
+    ret = mux_flush(m, &b);
+    fflush(m->fp);
+    free(b.p);
+    free(pes.p);
+    return ret;
+}
+
+// -----------------------------------------------------------------------------
+//  nal: the NAL units of the access unit, each one after its header
+// -----------------------------------------------------------------------------
+static int mux_nal_connect(const char *fn)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(fn) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, fn);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// -----------------------------------------------------------------------------
+//  The streamer closing the socket must not kill the encoder with SIGPIPE
+// -----------------------------------------------------------------------------
+static int mux_nal_put(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Send the access unit. Once the streamer is gone the pictures are dropped,
+//  the socket is connected again at each one until it is back. Decoders
+//  resume on the next IDR or recovery point.
+// -----------------------------------------------------------------------------
+static int mux_nal_send(struct mux_s *m, unsigned long long time)
+{
+    const unsigned char *p = m->au.p, *end = m->au.p + m->au.len, *nal;
+    struct nalsock_s head;
+    size_t size;
+    int fd;
+
+    if (m->lost) {
+        fd = mux_nal_connect(m->path);
+        if (fd == -1)
+            return -1;
+        /* the stream keeps its FILE, on the new connection */
+        dup2(fd, fileno(m->fp));
+        close(fd);
+        m->lost = 0;
+        fprintf(stderr, "\nStreamer on %s is back\n", m->path);
+    }
+
+    while ((p = mux_next_nal(p, end, &nal, &size)) != NULL) {
+        if (size == 0)
+            continue;
+        head.magic = NALSOCK_MAGIC;
+        head.size = size;
+        head.time = time;
+        if (mux_nal_put(fileno(m->fp), &head, sizeof(head)) == -1 || mux_nal_put(fileno(m->fp), nal, size) == -1) {
+            fprintf(stderr, "\nStreamer on %s is gone (%s), pictures are dropped until it is back\n",
+                    m->path, strerror(errno));
+            m->lost = 1;
+            return -1;
+        }
+        m->offset += sizeof(head) + size;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Container of a file: forced when format >= 0, else nal for a socket or
+//  from its extension
+// -----------------------------------------------------------------------------
+static int mux_format(const char *fn, int format)
+{
+    const char *ext = strrchr(fn, '.');
+    struct stat st;
+
+    if (format >= 0)
+        return format;
+    if (stat(fn, &st) == 0 && S_ISSOCK(st.st_mode))
+        return MUX_NAL;
+    if (ext && (!strcmp(ext, ".mp4") || !strcmp(ext, ".m4v") || !strcmp(ext, ".m4s")))
+        return MUX_MP4;
+    if (ext && !strcmp(ext, ".ts"))
+        return MUX_TS;
+    return MUX_RAW;
+}
+
+static int mux_parse(const char *str)
+{
+    if (!strcmp(str, "raw"))
+        return MUX_RAW;
+    if (!strcmp(str, "mp4"))
+        return MUX_MP4;
+    if (!strcmp(str, "ts"))
+        return MUX_TS;
+    if (!strcmp(str, "nal"))
+        return MUX_NAL;
+    return -1;
+}
+
+static const char *mux_name(int format)
+{
+    return (format == MUX_MP4) ? "mp4" : (format == MUX_TS) ? "ts" : (format == MUX_NAL) ? "nal" : "raw";
+}
+
+// -----------------------------------------------------------------------------
+//  Open fn, returns -1 on error
+// -----------------------------------------------------------------------------
+static int mux_open(struct mux_s *m, const char *fn, int format, int codec,
+                    int width, int height, int frame_rate)
+{
+    int fd;
+
+    memset(m, 0, sizeof(*m));
+    m->format = mux_format(fn, format);
+    if (m->format == MUX_NAL) {
+        fd = mux_nal_connect(fn);
+        if (fd == -1 && (errno == ENOENT || errno == ECONNREFUSED)) {
+            /* streamer not up yet, the stream starts as if it were gone and
+               the unconnected socket is replaced once it is there */
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            m->lost = 1;
+            if (fd != -1)
+                fprintf(stderr, "\nNo streamer on %s yet, pictures are dropped until it is there\n", fn);
+        }
+        if (fd == -1)
+            return -1;
+        m->fp = fdopen(fd, "w");
+        m->path = strdup(fn);
+        if (m->fp == NULL || m->path == NULL) {
+            if (m->fp)
+                fclose(m->fp);
+            else
+                close(fd);
+            m->fp = NULL;
+            free(m->path);
+            return -1;
+        }
+    }
+    else {
+        m->fp = fopen(fn, "w+");
+        if (m->fp == NULL)
+            return -1;
+    }
+    m->codec = codec;
+    m->width = width;
+    m->height = height;
+    m->frame_ticks = MUX_TIMESCALE / (frame_rate > 0 ? frame_rate : 30);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Coded data of the current access unit, raw streams are written at once
+// -----------------------------------------------------------------------------
+static size_t mux_write(struct mux_s *m, const void *data, size_t len)
+{
+    if (m->format == MUX_RAW) {
+        len = fwrite(data, 1, len, m->fp);
+        fflush(m->fp);
+        m->offset += len;
+        return len;
+    }
+    mux_put(&m->au, data, len);
+    return len;
+}
+
+// -----------------------------------------------------------------------------
+//  End of the access unit captured at capture_time (us), presented reorder
+//  frame periods after being decoded
+// -----------------------------------------------------------------------------
+static int mux_picture(struct mux_s *m, unsigned long long capture_time, int reorder, int key)
+{
+    unsigned long long dts;
+    int cts, ret = 0;
+
+    if (m->pictures == 0)
+        m->t0 = capture_time;
+    dts = (capture_time - m->t0) * 9 / 100;
+    /* decode times are strictly increasing whatever the clock does */
+    if (m->pictures++ && dts <= m->dts)
+        dts = m->dts + 1;
+    cts = (reorder > 0) ? reorder * m->frame_ticks : 0;
+
+    if (m->format == MUX_MP4)
+        ret = mux_mp4_sample(m, dts, cts, key);
+    else if (m->format == MUX_TS)
+        ret = mux_ts_pes(m, dts, cts, key);
+    else if (m->format == MUX_NAL)
+        ret = mux_nal_send(m, capture_time + cts * 100ULL / 9);
+    m->dts = dts;
+    m->au.len = 0;
+    return ret;
+}
+
+static int mux_close(struct mux_s *m)
+{
+    int ret = 0;
+
+    if (m->fp == NULL)
+        return 0;
+    if (m->format == MUX_MP4)
+        ret = mux_mp4_close(m);
+    if (fclose(m->fp) != 0)
+        ret = -1;
+    m->fp = NULL;
+    free(m->au.p);
+    free(m->mdat.p);
+    free(m->samples);
+    free(m->ra);
+    free(m->path);
+    return ret;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __NALSOCK_H__
+#define __NALSOCK_H__
+
+/*
+ * NAL units sent by the encoders to the streamers over a Unix socket.
+ *
+ * The streamer listens, an encoder whose output is that socket connects and
+ * sends each NAL unit of an access unit, without its start code, as soon as
+ * the access unit is coded. A NAL unit is preceded by this header. time is
+ * the presentation time of the access unit, so the RTP timestamps follow the
+ * capture of the frames instead of being estimated from the stream.
+ */
+#include <stdint.h>
+
+#define NALSOCK_MAGIC       0x6c616e6f      /* "onal" */
+
+struct nalsock_s {
+    uint32_t magic;
+    uint32_t size;              /* bytes of the NAL unit that follows */
+    uint64_t time;              /* presentation time, microseconds since the Epoch */
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __NV12_H__
+#define __NV12_H__
+
+/*
+ * Conversion of the frames of offscreen to NV12.
+ *
+ * In YUV mode offscreen writes 4 bytes YUVA pixels, bottom row first as read
+ * back from OpenGL. The encoders and enchost turn them into NV12: the luma
+ * plane then w/2 x h/2 interleaved u and v, averaged on 2x2 pixels, top row
+ * first.
+ */
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+//  Convert the w x h YUVA image to the y and uv planes of an NV12 picture
+// -----------------------------------------------------------------------------
+static void tfnv12(int w, int h, const unsigned char *yuva, unsigned char *y, unsigned char *uv)
+{
+    unsigned short ru[w], rv[w];
+    const unsigned char *p;
+    unsigned char *py = y, *puv = uv;
+    int l, c, ww = w >> 1;
+
+    memset(ru, 0, sizeof(ru));
+    memset(rv, 0, sizeof(rv));
+
+    for (l = 1; l <= h; ++l) {
+        p = yuva + (h - l) * w * 4;
+        for (c = 0; c < w; ++c, p += 4) {
+            *py++ = p[0];
+            ru[c >> 1] += p[1];
+            rv[c >> 1] += p[2];
+        }
+        if ((l & 0x01) == 0) {
+            for (c = 0; c < ww; ++c) {
+                *puv++ = (unsigned char)(ru[c] >> 2);
+                *puv++ = (unsigned char)(rv[c] >> 2);
+                ru[c] = rv[c] = 0;
+            }
+        }
+    }
+}
+
+#endif
@@ -40,6 +40,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 /*
  * Graphic headers - implementation in header
@@ -59,6 +61,11 @@
 #define PICOL_IMPLEMENTATION
 #include "picol.h"
 
+/*
+ * Frame number and time appended to the image
+ */
+#include "frameinfo.h"
+
 typedef struct picolInterp picol_t;
 
 
@@ -71,6 +78,7 @@ typedef struct picolInterp picol_t;
 #define DEF_FPS 20
 #define DEF_OUTPUT "/tmp/frame"
 #define DEF_SHADER "shaders/plasma.frag"
+#define DEF_SEND_TIMEOUT 2000   /* ms the render loop waits for a reply */
 
 #define YUV 1
 #define RGB 0
@@ -110,6 +118,8 @@ struct state_s
   char *out;                      // name of output file
   int  outfd;                     // current output file mmaped
   image_t img;                    // current image
+  struct frameinfo_s *info;       // frame information after the image
+  uint64_t seq;                   // number of the last frame published
 
   // OpenGL / GLES objects    
   GLuint fb;                      // framebuffer
@@ -122,6 +132,7 @@ struct state_s
   GLint  u_colorspace;            // uniform
   GLTtext *msg;                   // message to display
   char  *smsg;                    // string content of message
+  int   roi_w, roi_h;             // message box published in <out>.roi
   GLuint prog;                    // current GLSLprogram
 
   int fps;                        // video framerate
@@ -161,6 +172,8 @@ picolResult cmd_stats (picolInterp *itp, int argc, const char *argv[], void *pd)
 picolResult cmd_execbg (picolInterp *itp, int argc, const char *argv[], void *pd);
 picolResult cmd_width (picolInterp *itp, int argc, const char *argv[], void *pd);
 picolResult cmd_height (picolInterp *itp, int argc, const char *argv[], void *pd);
+picolResult cmd_frame (picolInterp *itp, int argc, const char *argv[], void *pd);
+picolResult cmd_send (picolInterp *itp, int argc, const char *argv[], void *pd);
 void do_kill (state_t *st);
 
 // --------------------------------------------------------------------------
@@ -173,7 +186,7 @@ extern char *inititp;
 // --------------------------------------------------------------------------
 static int nblk (int w, int h)
 {
-   int sz = (w*h*PIXSZ + BLKSZ-1)/BLKSZ;
+   int sz = (w*h*PIXSZ + sizeof(struct frameinfo_s) + BLKSZ-1)/BLKSZ;
    return sz;
 }
 
@@ -212,6 +225,7 @@ static int initout (state_t *st)
   printf("The output file was mapped to memory successfully.\n");
   
   st->img.stride = st->img.w;
+  st->info = (struct frameinfo_s *) (st->img.pixels + st->img.w * st->img.h);
   st->outfd = fbfd;
   
   return fbfd;
@@ -454,6 +468,7 @@ int glinit(state_t *st)
    }
    st->msg = gltCreateText();
    st->smsg = strdup ("[clock format [clock seconds]]");
+   st->roi_w = st->roi_h = -1;
    
    /*
     * Compile shader
@@ -481,6 +496,8 @@ int glinit(state_t *st)
    picolRegisterCmd (st->itp, "execbg", cmd_execbg, st);
    picolRegisterCmd (st->itp, "width", cmd_width, st);
    picolRegisterCmd (st->itp, "height", cmd_height, st);
+   picolRegisterCmd (st->itp, "frame", cmd_frame, st);
+   picolRegisterCmd (st->itp, "send", cmd_send, st);
    
    if (picolEval (st->itp, inititp) != PICOL_OK) {
      fprintf (stderr, "Interpreter init failed.\n");
@@ -649,6 +666,32 @@ int waitmsec (state_t *st, struct timeval *start, int msec)
   return 0;
 }
   
+// --------------------------------------------------------------------------
+//   Publish the message box as a region of interest for the encoders.
+//   The file is replaced only when the box changes.
+// --------------------------------------------------------------------------
+static void publish_roi (state_t *st, int w, int h)
+{
+  char fn[BLKSZ], tmp[BLKSZ];
+  FILE *f;
+
+  if (w == st->roi_w && h == st->roi_h) return;
+  st->roi_w = w;
+  st->roi_h = h;
+
+  snprintf (fn, sizeof(fn), "%s.roi", st->out);
+  snprintf (tmp, sizeof(tmp), "%s.roi.tmp", st->out);
+  f = fopen (tmp, "w");
+  if (f == NULL) {
+    perror ("fopen()");
+    return;
+  }
+  // x y width height, the text is drawn in the top left corner
+  if (w > 0 && h > 0) fprintf (f, "0 0 %d %d\n", w, h);
+  fclose (f);
+  if (rename (tmp, fn) == -1) perror ("rename()");
+}
+
 // --------------------------------------------------------------------------
 //   GL initialisation and rendering
 // --------------------------------------------------------------------------
@@ -702,6 +745,11 @@ int renderloop (state_t *st)
       if (picolEval (st->itp, buf) == PICOL_OK) {
 	gltSetText(st->msg, st->itp->result);
 	gltDrawText2D (st->msg, 0.0f, 0.0f, 1.0f); // x=0.0, y=0.0, scale=1.0
+	publish_roi (st, (int) gltGetTextWidth (st->msg, 1.0f) + 1,
+		     (int) gltGetTextHeight (st->msg, 1.0f) + 1);
+      }
+      else {
+	publish_roi (st, 0, 0);
       }
       gltEndDraw ();
       glUseProgram (0);
@@ -710,6 +758,11 @@ int renderloop (state_t *st)
       glFlush ();
       glReadPixels (0, 0, st->img.w, st->img.h, GL_RGBA, GL_UNSIGNED_BYTE, st->img.pixels);
 
+      // -- number the frame so that readers can tell missed and repeated frames
+      gettimeofday (&now, NULL);
+      frameinfo_publish (st->info, ++st->seq, now.tv_sec * 1000000ULL + now.tv_usec, st->fps,
+			 (st->colorspace == YUV) ? FRAMEINFO_YUV : FRAMEINFO_RGB);
+
       // -- send sigusr1 to tell new frame is ready
       do_kill (st);
 
@@ -805,7 +858,9 @@ picolResult cmd_help (picolInterp *itp, int argc, const char *argv[], void *pd)
       "stats" "\n"
       "width" "\n"
       "height" "\n"
+      "frame" "\n"
       "execbg cmd ?arg1? ... ?argn?" "\n"
+      "send ?-nowait? ?-timeout ms? socket word ?word? ..." "\n"
       "help ?topic?" "\n"
       "quit ?status?" "\n";
     return result (itp, PICOL_OK, helpmsg);
@@ -866,11 +921,21 @@ picolResult cmd_help (picolInterp *itp, int argc, const char *argv[], void *pd)
 	"Returns current height.";
       return result (itp, PICOL_OK, helpmsg);
     }
+    if (!strcmp (argv[1], "frame")) {
+      char *helpmsg =
+	"Returns the number of the last frame in the frame file. It stays there until the current command returns.";
+      return result (itp, PICOL_OK, helpmsg);
+    }
     if (!strcmp (argv[1], "execbg")) {
       char *helpmsg =
 	"Forks command in background and returns its PID.";
       return result (itp, PICOL_OK, helpmsg);
     }
+    if (!strcmp (argv[1], "send")) {
+      char *helpmsg =
+	"Sends a command line made of the words to the Unix socket of a service, like 'h264enc --daemon', and returns its reply. Rendering stops while waiting, at most 'ms' milliseconds (2000 by default). With -nowait the command is sent and the reply is not read.";
+      return result (itp, PICOL_OK, helpmsg);
+    }
   }
   return result (itp, PICOL_ERR, "unknown help topic");
 }
@@ -1136,6 +1201,99 @@ picolResult cmd_height (picolInterp *itp, int argc, const char *argv[], void *pd
   return result (itp, PICOL_OK, "%d", state->img.h);
 }
 
+// --------------------------------------------------------------------------
+//   Retrieve number of the last frame published
+// --------------------------------------------------------------------------
+picolResult cmd_frame (picolInterp *itp, int argc, const char *argv[], void *pd)
+{
+  state_t *state = pd;
+  
+  if (argc != 1) {
+    return wrong_num_args (itp, 1, argv, "");
+  }
+  return result (itp, PICOL_OK, "%llu", (unsigned long long) state->seq);
+}
+
+// --------------------------------------------------------------------------
+//   Send a command to a service listening on a Unix socket
+// --------------------------------------------------------------------------
+picolResult cmd_send (picolInterp *itp, int argc, const char *argv[], void *pd)
+{
+  struct sockaddr_un addr;
+  struct timeval start, now;
+  struct pollfd pfd;
+  char line[512], reply[512];
+  int fd, i, n = 0, len = 0, o = 1, nowait = 0, timeout = DEF_SEND_TIMEOUT, left;
+
+  // options before the socket
+  for (; o < argc && argv[o][0] == '-'; ++o) {
+    if (!strcmp (argv[o], "-nowait")) {
+      nowait = 1;
+    }
+    else if (!strcmp (argv[o], "-timeout") && o+1 < argc) {
+      timeout = atoi (argv[++o]);
+    }
+    else break;
+  }
+  if (argc - o < 2) {
+    return wrong_num_args (itp, 1, argv, "?-nowait? ?-timeout ms? socket word ?word? ...");
+  }
+  if (strlen (argv[o]) >= sizeof(addr.sun_path)) {
+    return result (itp, PICOL_ERR, "socket path too long");
+  }
+  for (i = o+1; i < argc && n < (int) sizeof(line); ++i) {
+    n += snprintf (line + n, sizeof(line) - n, "%s%s", argv[i], (i < argc-1) ? " " : "\n");
+  }
+  if (n >= (int) sizeof(line)) {
+    return result (itp, PICOL_ERR, "command too long");
+  }
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return result (itp, PICOL_ERR, "socket() failed: %s", strerror (errno));
+  }
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, argv[o]);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      send (fd, line, n, MSG_NOSIGNAL) != n) {
+    close (fd);
+    return result (itp, PICOL_ERR, "%s: %s", argv[o], strerror (errno));
+  }
+  if (nowait) {
+    close (fd);
+    return result (itp, PICOL_OK, "");
+  }
+
+  // the reply is a single line, the render loop does not wait for it forever
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  gettimeofday (&start, NULL);
+  while (len < (int) sizeof(reply) - 1) {
+    gettimeofday (&now, NULL);
+    left = timeout - ((now.tv_sec - start.tv_sec)*1000000 + (now.tv_usec - start.tv_usec))/1000;
+    if (left <= 0) {
+      close (fd);
+      return result (itp, PICOL_ERR, "%s: no reply within %d ms", argv[o], timeout);
+    }
+    n = poll (&pfd, 1, left);
+    if (n == -1 && errno != EINTR) break;
+    if (n <= 0) continue;
+    n = read (fd, reply + len, sizeof(reply) - 1 - len);
+    if (n <= 0) break;
+    len += n;
+    if (reply[len-1] == '\n') break;
+  }
+  close (fd);
+  while (len > 0 && (reply[len-1] == '\n' || reply[len-1] == '\r')) len--;
+  reply[len] = 0;
+
+  if (len == 0) {
+    return result (itp, PICOL_ERR, "%s: no reply", argv[o]);
+  }
+  return result (itp, strncmp (reply, "error", 5) ? PICOL_OK : PICOL_ERR, "%s", reply);
+}
+
 // --------------------------------------------------------------------------
 //   Command parser and evaluator
 // --------------------------------------------------------------------------
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "pngwrite.h"
+
+#define MAX_THREADS         16
+#define BANDS_PER_THREAD    4       /* more bands than threads balances the load */
+#define MIN_BAND_ROWS       16
+#define WINDOW              32768   /* deflate dictionary */
+
+/* filtered and deflated rows */
+typedef struct {
+    int first, last;            /* rows */
+    uint8_t *out;               /* deflate blocks, after the zlib header for the first band */
+    size_t len;
+    uLong adler;                /* of the filtered rows of the band */
+    size_t raw;                 /* their size */
+    int err;
+} band;
+
+typedef struct {
+    const uint8_t *rgba;
+    int width, height, pitch, flip, yuv;
+    int level, filter;
+    size_t rowbytes;            /* filter byte + 3 * width */
+    int nbands;
+    band *bands;
+    int next;                   /* next band to code */
+} job;
+
+// -----------------------------------------------------------------------------
+//   RGBA to RGB, the alpha is dropped. dst has 4 bytes of slack.
+// -----------------------------------------------------------------------------
+static void rgba_rgb(const uint8_t *src, uint8_t *dst, int w)
+{
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i m0 = _mm_setr_epi32(0xffffff, 0, 0, 0), m1 = _mm_setr_epi32(0, 0xffffff, 0, 0);
+    const __m128i m2 = _mm_setr_epi32(0, 0, 0xffffff, 0), m3 = _mm_setr_epi32(0, 0, 0, 0xffffff);
+
+    /* 4 pixels, moved down by 0, 1, 2 and 3 bytes over the alpha bytes */
+    for (; x + 4 <= w; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_and_si128(p, m0), _mm_srli_si128(_mm_and_si128(p, m1), 1)),
+                                 _mm_or_si128(_mm_srli_si128(_mm_and_si128(p, m2), 2),
+                                              _mm_srli_si128(_mm_and_si128(p, m3), 3)));
+        _mm_storeu_si128((__m128i *)(dst + 3 * x), r);
+    }
+#endif
+    for (; x < w; x++) {
+        dst[3 * x] = src[4 * x];
+        dst[3 * x + 1] = src[4 * x + 1];
+        dst[3 * x + 2] = src[4 * x + 2];
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   YUVA to RGB, inverse of the rgb2yuv of the shaders (JFIF, full range),
+//   16 bits fixed point
+// -----------------------------------------------------------------------------
+static inline uint8_t clamp255(int v)
+{
+    return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+static void yuva_rgb(const uint8_t *src, uint8_t *dst, int w)
+{
+    int x, y, u, v;
+
+    for (x = 0; x < w; x++) {
+        y = (src[4 * x] << 16) + 32768;
+        u = src[4 * x + 1] - 128;
+        v = src[4 * x + 2] - 128;
+        dst[3 * x] = clamp255((y + 91881 * v) >> 16);
+        dst[3 * x + 1] = clamp255((y - 22554 * u - 46802 * v) >> 16);
+        dst[3 * x + 2] = clamp255((y + 116130 * u) >> 16);
+    }
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+// -----------------------------------------------------------------------------
+//   Filter a RGB row of n bytes, prev is the row above (zeros for the first
+//   one). out[0] gets the filter type.
+// -----------------------------------------------------------------------------
+static void filter_row(int type, const uint8_t *cur, const uint8_t *prev, int n, uint8_t *out)
+{
+    int i;
+
+    out[0] = type;
+    out++;
+    switch (type) {
+    case PNGWRITE_NONE:
+        memcpy(out, cur, n);
+        break;
+    case PNGWRITE_SUB:
+        memcpy(out, cur, 3);
+        for (i = 3; i < n; i++)
+            out[i] = cur[i] - cur[i - 3];
+        break;
+    case PNGWRITE_UP:
+        for (i = 0; i < n; i++)
+            out[i] = cur[i] - prev[i];
+        break;
+    case PNGWRITE_AVG:
+        for (i = 0; i < 3; i++)
+            out[i] = cur[i] - (prev[i] >> 1);
+        for (; i < n; i++)
+            out[i] = cur[i] - ((cur[i - 3] + prev[i]) >> 1);
+        break;
+    case PNGWRITE_PAETH:
+        for (i = 0; i < 3; i++)
+            out[i] = cur[i] - prev[i];
+        for (; i < n; i++)
+            out[i] = cur[i] - paeth(cur[i - 3], prev[i], prev[i - 3]);
+        break;
+    }
+}
+
+/* sum of the filtered bytes taken as signed, the usual guess of what
+   deflates best */
+static unsigned long row_cost(const uint8_t *f, int n)
+{
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 1; i <= n; i++)
+        sum += (f[i] < 128) ? f[i] : 256 - f[i];
+    return sum;
+}
+
+static void filter_best(const uint8_t *cur, const uint8_t *prev, int n, uint8_t *out, uint8_t *tmp)
+{
+    unsigned long cost, best;
+    int type;
+
+    filter_row(PNGWRITE_NONE, cur, prev, n, out);
+    best = row_cost(out, n);
+    for (type = PNGWRITE_SUB; type <= PNGWRITE_PAETH; type++) {
+        filter_row(type, cur, prev, n, tmp);
+        cost = row_cost(tmp, n);
+        if (cost < best) {
+            best = cost;
+            memcpy(out, tmp, n + 1);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//   Filter and deflate a band. The rows above it that fill the window are
+//   filtered too, as the band above does, to prime the dictionary.
+// -----------------------------------------------------------------------------
+static void code_band(job *j, int b)
+{
+    band *bd = j->bands + b;
+    int n = 3 * j->width, pre, y, i, ret;
+    size_t rb = j->rowbytes, dict;
+    uint8_t *rgb[2], *tmp, *filtered, *p;
+    const uint8_t *src;
+    z_stream zs;
+
+    pre = (WINDOW + rb - 1) / rb;
+    if (pre > bd->first)
+        pre = bd->first;
+    rgb[0] = calloc(1, n + 4);
+    rgb[1] = calloc(1, n + 4);
+    tmp = malloc(rb);
+    filtered = malloc(rb * (bd->last - bd->first + pre));
+    if (!rgb[0] || !rgb[1] || !tmp || !filtered) {
+        bd->err = ENOMEM;
+        goto done;
+    }
+
+    /* row above the first one filtered, zeros for the top of the image */
+    y = bd->first - pre;
+    i = 0;
+    if (y > 0) {
+        src = j->rgba + (size_t)(j->flip ? j->height - y : y - 1) * j->pitch;
+        (j->yuv ? yuva_rgb : rgba_rgb)(src, rgb[1], j->width);
+    }
+    for (p = filtered; y < bd->last; y++, p += rb, i ^= 1) {
+        src = j->rgba + (size_t)(j->flip ? j->height - 1 - y : y) * j->pitch;
+        (j->yuv ? yuva_rgb : rgba_rgb)(src, rgb[i], j->width);
+        if (j->filter == PNGWRITE_ADAPTIVE)
+            filter_best(rgb[i], rgb[i ^ 1], n, p, tmp);
+        else
+            filter_row(j->filter, rgb[i], rgb[i ^ 1], n, p);
+    }
+
+    bd->raw = rb * (bd->last - bd->first);
+    dict = rb * pre;
+    bd->adler = adler32(adler32(0, NULL, 0), filtered + dict, bd->raw);
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, j->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        bd->err = ENOMEM;
+        goto done;
+    }
+    if (dict > WINDOW)
+        deflateSetDictionary(&zs, filtered + dict - WINDOW, WINDOW);
+    else if (dict)
+        deflateSetDictionary(&zs, filtered, dict);
+
+    /* the first band starts with the zlib header, the next ones go on with
+       a byte aligned empty stored block, only the last one is final */
+    bd->out = malloc(deflateBound(&zs, bd->raw) + 16);
+    if (bd->out == NULL) {
+        deflateEnd(&zs);
+        bd->err = ENOMEM;
+        goto done;
+    }
+    if (b == 0) {
+        bd->out[0] = 0x78;
+        bd->out[1] = ((j->level < 2) ? 0 : (j->level < 6) ? 1 : (j->level == 6) ? 2 : 3) << 6;
+        bd->out[1] += (31 - (0x7800 + bd->out[1]) % 31) % 31;
+        bd->len = 2;
+    }
+    zs.next_in = filtered + dict;
+    zs.avail_in = bd->raw;
+    zs.next_out = bd->out + bd->len;
+    zs.avail_out = deflateBound(&zs, bd->raw) + 14;
+    ret = deflate(&zs, (b == j->nbands - 1) ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_ERROR || zs.avail_in || zs.avail_out == 0)
+        bd->err = EIO;
+    bd->len = zs.next_out - bd->out;
+    deflateEnd(&zs);
+
+done:
+    free(rgb[0]);
+    free(rgb[1]);
+    free(tmp);
+    free(filtered);
+}
+
+static void *worker_main(void *arg)
+{
+    job *j = arg;
+    int b;
+
+    while ((b = __sync_fetch_and_add(&j->next, 1)) < j->nbands)
+        code_band(j, b);
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+//   Chunks
+// -----------------------------------------------------------------------------
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int write_chunk(FILE *fp, const char *type, const uint8_t *data, size_t len,
+                       const uint8_t *more, size_t morelen)
+{
+    uint8_t b[8];
+    uLong crc;
+
+    put32(b, len + morelen);
+    memcpy(b + 4, type, 4);
+    crc = crc32(crc32(0, NULL, 0), b + 4, 4);
+    if (len)
+        crc = crc32(crc, data, len);
+    if (more)
+        crc = crc32(crc, more, morelen);
+    if (fwrite(b, 8, 1, fp) != 1 ||
+        (len && fwrite(data, len, 1, fp) != 1) ||
+        (morelen && fwrite(more, morelen, 1, fp) != 1))
+        return -1;
+    put32(b, crc);
+    return (fwrite(b, 4, 1, fp) == 1) ? 0 : -1;
+}
+
+int pngwrite_save(const char *filename, const unsigned char *rgba, int width, int height, int pitch,
+                  int flags, int level, int filter, int threads)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    pthread_t tid[MAX_THREADS];
+    uint8_t ihdr[13], adler[4];
+    uLong a;
+    job j;
+    FILE *fp;
+    int i, rows, started = 0, err = 0;
+
+    if (width <= 0 || height <= 0 || filter < PNGWRITE_NONE || filter > PNGWRITE_ADAPTIVE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (threads < 1) ? 1 : (threads > MAX_THREADS) ? MAX_THREADS : threads;
+
+    memset(&j, 0, sizeof(j));
+    j.rgba = rgba;
+    j.width = width;
+    j.height = height;
+    j.pitch = pitch;
+    j.flip = (flags & PNGWRITE_FLIP) != 0;
+    j.yuv = (flags & PNGWRITE_YUV) != 0;
+    j.level = (level < 0 || level > 9) ? 6 : level;   /* zlib default */
+    j.filter = filter;
+    j.rowbytes = 1 + 3 * (size_t)width;
+
+    /* bands of rows, one when there is a single thread */
+    j.nbands = (threads == 1) ? 1 : threads * BANDS_PER_THREAD;
+    if (j.nbands > height / MIN_BAND_ROWS)
+        j.nbands = (height / MIN_BAND_ROWS > 0) ? height / MIN_BAND_ROWS : 1;
+    rows = (height + j.nbands - 1) / j.nbands;
+    j.nbands = (height + rows - 1) / rows;
+    j.bands = calloc(j.nbands, sizeof(band));
+    if (j.bands == NULL)
+        return -1;
+    for (i = 0; i < j.nbands; i++) {
+        j.bands[i].first = i * rows;
+        j.bands[i].last = (i == j.nbands - 1) ? height : (i + 1) * rows;
+    }
+
+    if (threads > j.nbands)
+        threads = j.nbands;
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tid[i], NULL, worker_main, &j) != 0)
+            break;
+        started++;
+    }
+    worker_main(&j);
+    for (i = 1; i <= started; i++)
+        pthread_join(tid[i], NULL);
+
+    /* Adler-32 of the whole stream from the ones of the bands */
+    a = j.bands[0].adler;
+    for (i = 0; i < j.nbands; i++) {
+        if (j.bands[i].err)
+            err = j.bands[i].err;
+        if (i)
+            a = adler32_combine(a, j.bands[i].adler, j.bands[i].raw);
+    }
+    put32(adler, a);
+
+    put32(ihdr, width);
+    put32(ihdr + 4, height);
+    ihdr[8] = 8;                /* bit depth */
+    ihdr[9] = 2;                /* truecolour */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    fp = err ? NULL : fopen(filename, "wb");
+    if (fp == NULL) {
+        if (!err)
+            err = errno;
+    }
+    else {
+        /* an IDAT per band, the last one ends with the Adler-32 */
+        if (fwrite(signature, 8, 1, fp) != 1 || write_chunk(fp, "IHDR", ihdr, 13, NULL, 0) == -1)
+            err = errno ? errno : EIO;
+        for (i = 0; !err && i < j.nbands; i++) {
+            if (write_chunk(fp, "IDAT", j.bands[i].out, j.bands[i].len,
+                            (i == j.nbands - 1) ? adler : NULL, (i == j.nbands - 1) ? 4 : 0) == -1)
+                err = errno ? errno : EIO;
+        }
+        if (!err && write_chunk(fp, "IEND", NULL, 0, NULL, 0) == -1)
+            err = errno ? errno : EIO;
+        if (fclose(fp) != 0 && !err)
+            err = errno;
+    }
+
+    for (i = 0; i < j.nbands; i++)
+        free(j.bands[i].out);
+    free(j.bands);
+    errno = err;
+    return err ? -1 : 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __PNGWRITE_H__
+#define __PNGWRITE_H__
+
+/*
+ * Parallel PNG writer.
+ *
+ * The opaque RGBA frame is written as 8 bit RGB. The image is cut in bands
+ * of rows, each band is filtered and deflated by a thread into its own run
+ * of deflate blocks, primed with the end of the band above as dictionary,
+ * and the runs are stitched into a single zlib stream as pigz does.
+ */
+
+/* row filters, PNGWRITE_ADAPTIVE picks the best one for each row */
+#define PNGWRITE_NONE       0
+#define PNGWRITE_SUB        1
+#define PNGWRITE_UP         2
+#define PNGWRITE_AVG        3
+#define PNGWRITE_PAETH      4
+#define PNGWRITE_ADAPTIVE   5
+
+/* flags */
+#define PNGWRITE_FLIP       1       /* rows are stored bottom up */
+#define PNGWRITE_YUV        2       /* pixels are full range BT.601 Y, U, V, A */
+
+/*
+ * Write the width x height RGBA image to filename, rows are pitch bytes
+ * apart. YUV pixels, as offscreen renders them in its yuv colorspace, are
+ * converted back to RGB. level is the zlib level, threads 0 uses every
+ * processor. Returns 0 or -1 with errno set.
+ */
+int pngwrite_save(const char *filename, const unsigned char *rgba, int width, int height, int pitch,
+                  int flags, int level, int filter, int threads);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef __ROI_H__
+#define __ROI_H__
+
+/*
+ * Regions of interest of the encoders.
+ *
+ * Regions come from the command line (--roi x,y,w,h[,delta]) and from a
+ * metadata file written by offscreen with the bounding box of the overlay
+ * text, one region per line:
+ *
+ *     x y width height [qp_delta]
+ *
+ * Regions whose delta is beyond +-51 are rejected. Coordinates are pixels of the encoded picture, top left origin. The file is
+ * replaced (rename) by its writer and checked before every picture.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define ROI_MAX             16
+#define ROI_DEFAULT_DELTA   -6
+#define ROI_MAX_DELTA       51      /* the whole QP range */
+
+struct roi_s {
+    int x, y, w, h;
+    int delta;                  /* QP offset, negative improves quality */
+};
+
+struct roi_list_s {
+    int n;                      /* number of regions */
+    int nfixed;                 /* regions given on the command line */
+    struct roi_s r[ROI_MAX];
+    char *fn;                   /* metadata file, NULL if none */
+    struct timespec mtime;      /* modification time of the file last read */
+    ino_t ino;
+};
+
+// -----------------------------------------------------------------------------
+//  Parse "x,y,w,h[,delta]" from the command line
+// -----------------------------------------------------------------------------
+static int roi_parse(struct roi_list_s *l, const char *s)
+{
+    struct roi_s *r = &l->r[l->n];
+    int n;
+
+    if (l->n >= ROI_MAX)
+        return -1;
+    r->delta = ROI_DEFAULT_DELTA;
+    n = sscanf(s, "%d,%d,%d,%d,%d", &r->x, &r->y, &r->w, &r->h, &r->delta);
+    if (n < 4 || r->w <= 0 || r->h <= 0 || abs(r->delta) > ROI_MAX_DELTA)
+        return -1;
+    l->nfixed = ++l->n;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  Read the metadata file again when it was replaced, returns 1 when the
+//  regions changed
+// -----------------------------------------------------------------------------
+static int roi_update(struct roi_list_s *l)
+{
+    struct stat st;
+    char line[128];
+    FILE *f;
+
+    if (l->fn == NULL)
+        return 0;
+
+    if (stat(l->fn, &st) == -1) {
+        /* no file, no region from the metadata */
+        if (l->ino == 0)
+            return 0;
+        l->ino = 0;
+        l->n = l->nfixed;
+        return 1;
+    }
+    if (st.st_ino == l->ino &&
+        st.st_mtim.tv_sec == l->mtime.tv_sec && st.st_mtim.tv_nsec == l->mtime.tv_nsec)
+        return 0;
+
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    l->n = l->nfixed;
+
+    f = fopen(l->fn, "r");
+    if (f == NULL)
+        return 1;
+    while (l->n < ROI_MAX && fgets(line, sizeof(line), f)) {
+        struct roi_s *r = &l->r[l->n];
+
+        r->delta = ROI_DEFAULT_DELTA;
+        if (line[0] == '#' || sscanf(line, "%d %d %d %d %d", &r->x, &r->y, &r->w, &r->h, &r->delta) < 4)
+            continue;
+        if (r->w > 0 && r->h > 0 && abs(r->delta) <= ROI_MAX_DELTA)
+            l->n++;
+    }
+    fclose(f);
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+//  QP offset of each block of a bw x bh grid of block x block pixels, where
+//  regions overlap the strongest offset wins
+// -----------------------------------------------------------------------------
+static void roi_map(const struct roi_list_s *l, int block, int bw, int bh, signed char *map)
+{
+    int i, x, y;
+
+    memset(map, 0, bw * bh);
+    for (i = 0; i < l->n; i++) {
+        const struct roi_s *r = &l->r[i];
+        int x0 = r->x / block, y0 = r->y / block;
+        int x1 = (r->x + r->w + block - 1) / block, y1 = (r->y + r->h + block - 1) / block;
+
+        for (y = (y0 < 0 ? 0 : y0); y < y1 && y < bh; y++)
+            for (x = (x0 < 0 ? 0 : x0); x < x1 && x < bw; x++)
+                if (abs(r->delta) > abs(map[y * bw + x]))
+                    map[y * bw + x] = r->delta;
+    }
+}
+
+#endif
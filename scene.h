@@ -0,0 +1,152 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+/*
+ * Content analysis of the encoders.
+ *
+ * The luma plane is reduced to the sums of its blocks of SCENE_BLOCK x
+ * SCENE_BLOCK pixels and compared with the reduction of the last coded
+ * picture. The mean absolute difference detects scene cuts. A static
+ * picture is then confirmed on the pixels of each SCENE_MB x SCENE_MB block
+ * against a copy of the last coded luma plane, so that a blinking cursor or
+ * a few changed characters are not averaged away in the block sums.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#define SCENE_BLOCK     4
+#define SCENE_MB        16
+
+struct scene_s {
+    int bw, bh;                 /* size of the reduced picture in blocks */
+    unsigned short *cur;        /* block sums of the analysed picture */
+    unsigned short *ref;        /* block sums of the last coded picture */
+    unsigned char *luma;        /* luma of the last coded picture, for scene_static */
+    int width, height;
+    int valid;                  /* ref holds a picture */
+    int mean;                   /* mean absolute difference, in luma levels */
+    int max;                    /* largest difference of a block, in luma levels */
+};
+
+// -----------------------------------------------------------------------------
+//  Allocate the reduced pictures, and the copy of the luma plane when static
+//  pictures are detected, returns -1 on error
+// -----------------------------------------------------------------------------
+static int scene_init(struct scene_s *s, int width, int height, int keep_luma)
+{
+    s->bw = width / SCENE_BLOCK;
+    s->bh = height / SCENE_BLOCK;
+    s->width = width;
+    s->height = height;
+    s->cur = malloc(s->bw * s->bh * sizeof(unsigned short));
+    s->ref = malloc(s->bw * s->bh * sizeof(unsigned short));
+    s->luma = keep_luma ? malloc(width * height) : NULL;
+    s->valid = 0;
+    return (s->cur && s->ref && (s->luma || !keep_luma)) ? 0 : -1;
+}
+
+static void scene_free(struct scene_s *s)
+{
+    free(s->cur);
+    free(s->ref);
+    free(s->luma);
+}
+
+// -----------------------------------------------------------------------------
+//  Compare a luma plane with the last coded picture, sets mean and max
+// -----------------------------------------------------------------------------
+static void scene_analyse(struct scene_s *s, const unsigned char *y, int stride)
+{
+    unsigned long long total = 0;
+    int bx, by, i, j, max = 0;
+
+    for (by = 0; by < s->bh; by++) {
+        unsigned short *cur = s->cur + by * s->bw;
+
+        memset(cur, 0, s->bw * sizeof(unsigned short));
+        for (j = 0; j < SCENE_BLOCK; j++) {
+            const unsigned char *p = y + (by * SCENE_BLOCK + j) * stride;
+
+            for (bx = 0; bx < s->bw; bx++, p += SCENE_BLOCK)
+                for (i = 0; i < SCENE_BLOCK; i++)
+                    cur[bx] += p[i];
+        }
+        if (s->valid) {
+            const unsigned short *ref = s->ref + by * s->bw;
+
+            for (bx = 0; bx < s->bw; bx++) {
+                int d = abs(cur[bx] - ref[bx]);
+
+                total += d;
+                if (d > max)
+                    max = d;
+            }
+        }
+    }
+
+    if (s->valid) {
+        s->mean = total / ((unsigned long long)s->bw * s->bh * SCENE_BLOCK * SCENE_BLOCK);
+        s->max = max / (SCENE_BLOCK * SCENE_BLOCK);
+    } else {
+        /* nothing to compare with, like a scene cut */
+        s->mean = s->max = 255;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  The analysed picture is unchanged: no pixel of a block differs by more
+//  than maxdiff from the last coded picture and the sum of the differences
+//  of a block stays within maxsad. Identical rows are skipped with memcmp.
+// -----------------------------------------------------------------------------
+static int scene_static(struct scene_s *s, const unsigned char *y, int stride, int maxdiff, int maxsad)
+{
+    int bx, by, i, j;
+
+    if (!s->valid || !s->luma)
+        return 0;
+
+    for (by = 0; by < s->height; by += SCENE_MB) {
+        int bh = (s->height - by < SCENE_MB) ? s->height - by : SCENE_MB;
+
+        for (bx = 0; bx < s->width; bx += SCENE_MB) {
+            int bw = (s->width - bx < SCENE_MB) ? s->width - bx : SCENE_MB;
+            int sad = 0;
+
+            for (j = 0; j < bh; j++) {
+                const unsigned char *p = y + (by + j) * stride + bx;
+                const unsigned char *q = s->luma + (by + j) * s->width + bx;
+
+                if (!memcmp(p, q, bw))
+                    continue;
+                for (i = 0; i < bw; i++) {
+                    int d = abs(p[i] - q[i]);
+
+                    if (d > maxdiff)
+                        return 0;
+                    sad += d;
+                }
+            }
+            if (sad > maxsad)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+//  The analysed picture is coded, it becomes the reference of the next ones
+// -----------------------------------------------------------------------------
+static void scene_keep(struct scene_s *s, const unsigned char *y, int stride)
+{
+    unsigned short *tmp = s->ref;
+    int j;
+
+    s->ref = s->cur;
+    s->cur = tmp;
+    s->valid = 1;
+    if (s->luma)
+        for (j = 0; j < s->height; j++)
+            memcpy(s->luma + j * s->width, y + j * stride, s->width);
+}
+
+#endif
@@ -25,11 +25,28 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 
 #include <SDL2/SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "frameinfo.h"
+
+// NV12 needs SDL_UpdateNVTexture, older SDL gets the three planes of IYUV
+#if SDL_VERSION_ATLEAST(2,0,16)
+#define YUV_FORMAT SDL_PIXELFORMAT_NV12
+#else
+#define YUV_FORMAT SDL_PIXELFORMAT_IYUV
+#endif
 
 #define DEF_WIDTH 720
 #define DEF_HEIGHT 576
@@ -45,6 +62,349 @@ int g_height = DEF_HEIGHT;
 int g_fps = DEF_FPS;
 char *g_input = DEF_INPUT;
 
+Uint32 g_frame_event = (Uint32) -1;
+
+#define REPORT_MS 5000
+#define MAX_TILES 64
+#define OVERLAY_SCALE 2
+
+// --------------------------------------------------------------------------
+//   An input, shown in a tile of the window
+// --------------------------------------------------------------------------
+struct tile_s {
+  char *input;
+  int width, height;
+  int fd;
+  char *pixels;
+  size_t mapsz;
+  struct frameinfo_s *info;	// NULL if the file has no record
+  SDL_Texture *img;
+  int colorspace, texyuv;
+  uint64_t last;		// number of the frame shown
+  uint64_t time;		// its capture time, 0 if unknown
+  int fresh;			// uploaded since the last present
+  int missed;
+  int frames;			// shown since the last fps update
+  double fps;
+};
+
+struct tile_s g_tiles[MAX_TILES];
+int g_ntiles = 0;
+int g_overlay = 0;
+
+// --------------------------------------------------------------------------
+//   offscreen signals every frame with SIGUSR1 once we are registered with
+//   'kill add pid'. The signal is blocked in every thread and taken here,
+//   the display thread gets an event.
+// --------------------------------------------------------------------------
+int SDLCALL
+SignalFunc(void *data)
+{
+  sigset_t *set = data;
+  SDL_Event e;
+  int sig;
+
+  while (sigwait (set, &sig) == 0) {
+    memset (&e, 0, sizeof(e));
+    e.type = g_frame_event;
+    SDL_PushEvent (&e);
+  }
+  return 0;
+}
+
+// --------------------------------------------------------------------------
+//   Two rows of YUVA pixels to two luma rows and a row of chroma, the mean
+//   of 2x2 pixels, interleaved for NV12 (uv) or in two planes (u and v)
+// --------------------------------------------------------------------------
+void yuva_420(const Uint8 *a, const Uint8 *b, int w, Uint8 *ya, Uint8 *yb, Uint8 *uv, Uint8 *u, Uint8 *v)
+{
+  int x = 0, x1, cu, cv;
+
+#ifdef __SSE2__
+  const __m128i m = _mm_set1_epi32 (0xff), one = _mm_set1_epi16 (1), two = _mm_set1_epi32 (2);
+
+  for (; x + 16 <= w; x += 16) {
+    __m128i pa[4], pb[4], s[2], c[2];
+    int i, k;
+
+    for (i = 0; i < 4; i++) {
+      pa[i] = _mm_loadu_si128 ((const __m128i *)(a + 4*x + 16*i));
+      pb[i] = _mm_loadu_si128 ((const __m128i *)(b + 4*x + 16*i));
+    }
+    _mm_storeu_si128 ((__m128i *)(ya + x),
+		      _mm_packus_epi16 (_mm_packs_epi32 (_mm_and_si128 (pa[0], m), _mm_and_si128 (pa[1], m)),
+					_mm_packs_epi32 (_mm_and_si128 (pa[2], m), _mm_and_si128 (pa[3], m))));
+    _mm_storeu_si128 ((__m128i *)(yb + x),
+		      _mm_packus_epi16 (_mm_packs_epi32 (_mm_and_si128 (pb[0], m), _mm_and_si128 (pb[1], m)),
+					_mm_packs_epi32 (_mm_and_si128 (pb[2], m), _mm_and_si128 (pb[3], m))));
+
+    // U in bits 8-15, V in bits 16-23: vertical sums in 16 bits, then
+    // horizontal pairs added by madd
+    for (k = 0; k < 2; k++) {
+      for (i = 0; i < 2; i++) {
+	__m128i ra = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (pa[2*i], 8 + 8*k), m),
+				      _mm_and_si128 (_mm_srli_epi32 (pa[2*i + 1], 8 + 8*k), m));
+	__m128i rb = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (pb[2*i], 8 + 8*k), m),
+				      _mm_and_si128 (_mm_srli_epi32 (pb[2*i + 1], 8 + 8*k), m));
+	s[i] = _mm_srai_epi32 (_mm_add_epi32 (_mm_madd_epi16 (_mm_add_epi16 (ra, rb), one), two), 2);
+      }
+      c[k] = _mm_packs_epi32 (s[0], s[1]);
+      c[k] = _mm_packus_epi16 (c[k], c[k]);
+    }
+    if (uv) {
+      _mm_storeu_si128 ((__m128i *)(uv + x), _mm_unpacklo_epi8 (c[0], c[1]));
+    }
+    else {
+      _mm_storel_epi64 ((__m128i *)(u + x/2), c[0]);
+      _mm_storel_epi64 ((__m128i *)(v + x/2), c[1]);
+    }
+  }
+#endif
+  for (; x < w; x += 2) {
+    x1 = (x + 1 < w) ? x + 1 : x;
+    ya[x] = a[4*x];
+    yb[x] = b[4*x];
+    ya[x1] = a[4*x1];
+    yb[x1] = b[4*x1];
+    cu = (a[4*x + 1] + a[4*x1 + 1] + b[4*x + 1] + b[4*x1 + 1] + 2) >> 2;
+    cv = (a[4*x + 2] + a[4*x1 + 2] + b[4*x + 2] + b[4*x1 + 2] + 2) >> 2;
+    if (uv) {
+      uv[x] = cu;
+      uv[x + 1] = cv;
+    }
+    else {
+      u[x/2] = cu;
+      v[x/2] = cv;
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+//   Texture for the colorspace of the frames: YUV frames are shown as they
+//   are, the GPU does the conversion. RGBA if the renderer can't.
+// --------------------------------------------------------------------------
+void create_texture(SDL_Renderer *renderer, struct tile_s *t, int yuv)
+{
+  SDL_Texture *img = NULL;
+
+  if (yuv) {
+    // offscreen converts with the full range BT.601 matrix of JPEG
+    SDL_SetYUVConversionMode (SDL_YUV_CONVERSION_JPEG);
+    img = SDL_CreateTexture(renderer, YUV_FORMAT, SDL_TEXTUREACCESS_STREAMING, t->width, t->height);
+  }
+  t->texyuv = (img != NULL);
+  if (img == NULL) {
+    img = SDL_CreateTexture(renderer,
+			    SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
+			    t->width, t->height);
+  }
+  t->img = img;
+}
+
+// --------------------------------------------------------------------------
+//   Copy the frame to the texture, once and flipped since the frame is
+//   bottom up. YUV frames are subsampled to 4:2:0 in planes, 1.5 bytes per
+//   pixel instead of 4. Returns -1 if the texture can't be updated.
+// --------------------------------------------------------------------------
+int upload_frame(struct tile_s *t, int yuv, Uint8 *planes)
+{
+  const Uint8 *a, *b;
+  Uint8 *py = planes, *pu, *pv;
+  void *dst;
+  int w = t->width, h = t->height;
+  int pitch, y, cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+  if (yuv) {
+    pu = py + (size_t) w*h;
+    pv = pu + (size_t) cw*ch;
+    for (y = 0; y < h; y += 2) {
+      a = (const Uint8 *) t->pixels + (size_t)(h - 1 - y)*w*4;
+      b = (y + 1 < h) ? a - (size_t) w*4 : a;
+      if (YUV_FORMAT == SDL_PIXELFORMAT_NV12) {
+	yuva_420 (a, b, w, py + (size_t) y*w, py + (size_t)(y + 1 < h ? y + 1 : y)*w,
+		  pu + (size_t)(y/2)*cw*2, NULL, NULL);
+      }
+      else {
+	yuva_420 (a, b, w, py + (size_t) y*w, py + (size_t)(y + 1 < h ? y + 1 : y)*w,
+		  NULL, pu + (size_t)(y/2)*cw, pv + (size_t)(y/2)*cw);
+      }
+    }
+#if SDL_VERSION_ATLEAST(2,0,16)
+    return SDL_UpdateNVTexture (t->img, NULL, py, w, pu, cw*2);
+#else
+    return SDL_UpdateYUVTexture (t->img, NULL, py, w, pu, cw, pv, cw);
+#endif
+  }
+
+  if (SDL_LockTexture (t->img, NULL, &dst, &pitch) < 0) {
+    return -1;
+  }
+  for (y = 0; y < h; ++y) {
+    memcpy ((char *) dst + y*pitch, t->pixels + (size_t)(h - 1 - y)*w*4, w*4);
+  }
+  SDL_UnlockTexture (t->img);
+  return 0;
+}
+
+// --------------------------------------------------------------------------
+//   Map the file of the input, and its frame information record if any
+// --------------------------------------------------------------------------
+void open_tile(struct tile_s *t)
+{
+  size_t size = (size_t) t->width*t->height*4;
+
+  t->fd = open( t->input, O_RDWR );
+  if (t->fd == -1) {
+    fprintf(stderr, "Error: cannot open output file %s: %s\n", t->input, strerror(errno));
+    exit(1);
+  }
+  // the frame information record after the pixels, if any, tells new frames
+  t->mapsz = size + frameinfo_size(t->fd, size);
+  t->pixels = (char *)mmap(0, t->mapsz, PROT_READ, MAP_SHARED, t->fd, 0);
+  if (t->pixels == MAP_FAILED) {
+    fprintf(stderr, "Error: failed to map output file %s to memory: %s\n", t->input, strerror(errno));
+    exit(1);
+  }
+  t->info = (t->mapsz > size) ? (struct frameinfo_s *)(t->pixels + size) : NULL;
+}
+
+// --------------------------------------------------------------------------
+//   Upload the frame of the input, unless it is the one already shown.
+//   Returns 1 if the texture was updated.
+// --------------------------------------------------------------------------
+int update_tile(SDL_Renderer *renderer, struct tile_s *t, int wakeup, Uint8 *planes)
+{
+  uint64_t seq, time, check;
+  int retry;
+
+  if (frameinfo_read(t->info, &seq, &time) == 0) {
+    if (seq == t->last)
+      return 0;
+    if (t->last && seq > t->last + 1)
+      t->missed += seq - t->last - 1;
+    // 'colorspace' at offscreen prompt, a texture for the new one
+    if (t->info->colorspace != t->colorspace) {
+      t->colorspace = t->info->colorspace;
+      SDL_DestroyTexture(t->img);
+      create_texture(renderer, t, t->colorspace == FRAMEINFO_YUV);
+    }
+    // copied again if the next frame came meanwhile
+    for (retry = 0; retry < 3; ++retry) {
+      if (upload_frame (t, t->texyuv, planes) == -1 ||
+	  frameinfo_read(t->info, &check, &time) == -1 || check == seq)
+	break;
+      seq = check;
+    }
+    t->last = seq;
+    t->time = time;
+  }
+  else {
+    // no record, every wakeup is taken as a new frame
+    if (!wakeup)
+      return 0;
+    upload_frame (t, 0, planes);
+    t->time = 0;
+  }
+  t->fresh = 1;
+  t->frames++;
+  return 1;
+}
+
+// --------------------------------------------------------------------------
+//   Grid of n tiles, as many columns as rows or one more
+// --------------------------------------------------------------------------
+void grid(int n, int *cols, int *rows)
+{
+  for (*cols = 1; *cols * *cols < n; ++*cols);
+  *rows = (n + *cols - 1) / *cols;
+}
+
+// --------------------------------------------------------------------------
+//   Place of tile i in a window of w x h pixels, centered in its cell with
+//   the aspect of its frames. The renderer scales the texture.
+// --------------------------------------------------------------------------
+void tile_rect(int i, int w, int h, SDL_Rect *r)
+{
+  struct tile_s *t = &g_tiles[i];
+  int cols, rows, cw, ch;
+
+  grid(g_ntiles, &cols, &rows);
+  cw = w / cols;
+  ch = h / rows;
+  if ((long) t->width*ch > (long) t->height*cw) {
+    r->w = cw;
+    r->h = (long) cw*t->height / t->width;
+  }
+  else {
+    r->h = ch;
+    r->w = (long) ch*t->width / t->height;
+  }
+  r->x = (i % cols)*cw + (cw - r->w)/2;
+  r->y = (i / cols)*ch + (ch - r->h)/2;
+}
+
+// --------------------------------------------------------------------------
+//   Text of the overlay in a 3x5 font, a glyph is 5 rows of 3 bits, an
+//   octal digit per row.
+// --------------------------------------------------------------------------
+void draw_text(SDL_Renderer *renderer, int x, int y, const char *s)
+{
+  static const struct { char c; int rows; } font[] = {
+    { '0', 075557 }, { '1', 026227 }, { '2', 071747 }, { '3', 071717 },
+    { '4', 055711 }, { '5', 074717 }, { '6', 074757 }, { '7', 071111 },
+    { '8', 075757 }, { '9', 075717 }, { '.', 000002 }, { '-', 000700 },
+    { 'm', 007755 }, { 's', 034216 }, { 'f', 034644 }, { 'p', 006564 },
+  };
+  SDL_Rect px[15];
+  int i, n, bit;
+
+  for (; *s; ++s, x += 4*OVERLAY_SCALE) {
+    for (i = 0; i < sizeof(font)/sizeof(font[0]) && font[i].c != *s; ++i);
+    if (i == sizeof(font)/sizeof(font[0]))
+      continue;
+    for (n = 0, bit = 0; bit < 15; ++bit) {
+      if (font[i].rows & (040000 >> bit)) {
+	px[n].x = x + (bit % 3)*OVERLAY_SCALE;
+	px[n].y = y + (bit / 3)*OVERLAY_SCALE;
+	px[n].w = px[n].h = OVERLAY_SCALE;
+	n++;
+      }
+    }
+    SDL_RenderFillRects(renderer, px, n);
+  }
+}
+
+// --------------------------------------------------------------------------
+//   Age of the frame shown and frame rate of the input in the corner of its
+//   tile, in red once the frame is older than a second
+// --------------------------------------------------------------------------
+void draw_overlay(SDL_Renderer *renderer, struct tile_s *t, const SDL_Rect *r, uint64_t now)
+{
+  SDL_Rect box;
+  char text[32];
+  long age = -1;
+
+  if (t->time && now > t->time)
+    age = (now - t->time) / 1000;
+  if (age >= 0)
+    snprintf (text, sizeof(text), "%ld ms %.1f fps", age, t->fps);
+  else
+    snprintf (text, sizeof(text), "- ms %.1f fps", t->fps);
+
+  box.x = r->x;
+  box.y = r->y;
+  box.w = (4*strlen(text) + 1)*OVERLAY_SCALE;
+  box.h = 7*OVERLAY_SCALE;
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  SDL_RenderFillRect(renderer, &box);
+  if (age > 1000)
+    SDL_SetRenderDrawColor(renderer, 255, 64, 64, 255);
+  else
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+  draw_text(renderer, box.x + OVERLAY_SCALE, box.y + OVERLAY_SCALE, text);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+}
+
 
 int SDLCALL
 ThreadFunc(void *data)
@@ -53,72 +413,175 @@ ThreadFunc(void *data)
   // variable declarations
   SDL_Window *win = NULL;
   SDL_Renderer *renderer = NULL;
-  SDL_Texture *img = NULL;
-  char *pixels = NULL;
-  int fbfd;
+  SDL_Rect bounds, r;
+  struct tile_s *t;
+  Uint8 *planes = NULL;
+  struct timeval now;
+  uint64_t time;
+  Uint32 report, ticks, fps_tick;
+  size_t size = 0;
+  int cols, rows, ww = 0, wh = 0, ow, oh;
+  int i, done = 0, redraw, wakeup, updated;
+  int shown = 0, skipped = 0, missed = 0;
+  double latency, lat_sum = 0.0, lat_max = 0.0;
+
+  // a mosaic starts with cells of the largest frame, shrunk to the screen
+  grid(g_ntiles, &cols, &rows);
+  for (i = 0; i < g_ntiles; ++i) {
+    t = &g_tiles[i];
+    if (t->width > ww) ww = t->width;
+    if (t->height > wh) wh = t->height;
+    if ((size_t) t->width*t->height + 2*(size_t)((t->width + 1)/2)*((t->height + 1)/2) > size)
+      size = (size_t) t->width*t->height + 2*(size_t)((t->width + 1)/2)*((t->height + 1)/2);
+  }
+  ww *= cols;
+  wh *= rows;
+  if (g_ntiles > 1 && SDL_GetDisplayUsableBounds(0, &bounds) == 0 && (ww > bounds.w || wh > bounds.h)) {
+    if ((long) ww*bounds.h > (long) wh*bounds.w) {
+      wh = (long) wh*bounds.w / ww;
+      ww = bounds.w;
+    }
+    else {
+      ww = (long) ww*bounds.h / wh;
+      wh = bounds.h;
+    }
+  }
   
   // create the window and renderer
   // note that the renderer is accelerated
   puts("create window");
-  win = SDL_CreateWindow("video capture", g_x, g_y, g_width, g_height, 0);
+  win = SDL_CreateWindow("video capture", g_x, g_y, ww, wh, (g_ntiles > 1) ? SDL_WINDOW_RESIZABLE : 0);
 
+  // a mosaic presents once per refresh whatever the number of inputs
   puts("create renderer");
-  renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED);
+  renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | ((g_ntiles > 1) ? SDL_RENDERER_PRESENTVSYNC : 0));
 
   puts("create texture");
-  img = SDL_CreateTexture(renderer,
-			  SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
-			  g_width, g_height);
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+  for (i = 0; i < g_ntiles; ++i) {
+    g_tiles[i].colorspace = FRAMEINFO_RGB;
+    create_texture(renderer, &g_tiles[i], 0);
+  }
   // Display window
   SDL_ShowWindow(win);
 
   puts("mmap video source");
-  fbfd = open( g_input, O_RDWR );
-  if (fbfd == -1) {
-    perror("Error: cannot open output file");
-    exit(1);
+  for (i = 0; i < g_ntiles; ++i) {
+    open_tile(&g_tiles[i]);
   }
-  puts("The output file was opened successfully.");
-  pixels = (char *)mmap(0, g_width*g_height*4, PROT_READ, MAP_SHARED, fbfd, 0);
-  if (pixels == MAP_FAILED) {
-    perror("Error: failed to map output file to memory");
+  // planes of the largest frame, uploads are done one after the other
+  planes = malloc(size);
+  if (planes == NULL) {
+    perror("Error: malloc()");
     exit(1);
   }
   puts("The output file was mapped to memory successfully.\n");
+  printf("Enter 'kill add %d' at offscreen prompt to display each frame as soon as it is ready.\n", getpid());
   
   
   // main loop
   puts("entering main loop");
-  while (1) {
-    // event handling
+  report = SDL_GetTicks() + REPORT_MS;
+  fps_tick = SDL_GetTicks() + 1000;
+  while (!done) {
+    // event handling, the frame event or the timeout look for new frames
     SDL_Event e;
+    redraw = 0;
+    wakeup = 1;
     if ( SDL_WaitEventTimeout(&e,1000/g_fps) ) {
-      if (e.type == SDL_QUIT)
-	break;
-      else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_ESCAPE)
+      // every pending event, the inputs are then looked at once
+      wakeup = 0;
+      do {
+	if (e.type == SDL_QUIT)
+	  done = 1;
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_ESCAPE)
+	  done = 1;
+	else if (e.type == SDL_WINDOWEVENT)
+	  redraw = 1;
+	else if (e.type == g_frame_event)
+	  wakeup = 1;
+      } while ( SDL_PollEvent(&e) );
+      if (done)
 	break;
     } 
+
+    // update the tiles with a new frame, the others keep their texture
+    updated = 0;
+    for (i = 0; i < g_ntiles; ++i) {
+      updated += update_tile(renderer, &g_tiles[i], wakeup, planes);
+    }
+    if (updated)
+      redraw = 1;
+    else
+      skipped += wakeup;
+
+    ticks = SDL_GetTicks();
+    if (SDL_TICKS_PASSED(ticks, fps_tick)) {
+      for (i = 0; i < g_ntiles; ++i) {
+	g_tiles[i].fps = g_tiles[i].frames * 1000.0 / (ticks - fps_tick + 1000);
+	g_tiles[i].frames = 0;
+      }
+      fps_tick = ticks + 1000;
+      // the age of a stalled input goes on
+      redraw |= g_overlay;
+    }
+    if (!redraw)
+      continue;
 		
     // clear the screen
     SDL_RenderClear(renderer);
 
-    // update video frame
-    SDL_UpdateTexture( img, NULL, pixels, g_width*4 );
-    
-    // copy the texture to the rendering context
-    //SDL_RenderCopy(renderer, img, NULL, NULL);
-    SDL_RenderCopyEx(renderer, img, NULL, NULL, 0.0, NULL, SDL_FLIP_VERTICAL);
+    // copy the textures to the rendering context
+    SDL_GetRendererOutputSize(renderer, &ow, &oh);
+    gettimeofday (&now, NULL);
+    time = now.tv_sec * 1000000ULL + now.tv_usec;
+    for (i = 0; i < g_ntiles; ++i) {
+      tile_rect(i, ow, oh, &r);
+      SDL_RenderCopy(renderer, g_tiles[i].img, NULL, &r);
+      if (g_overlay)
+	draw_overlay(renderer, &g_tiles[i], &r, time);
+    }
     
     // flip the backbuffer
     // this means that everything that we prepared behind the screens is actually shown
     SDL_RenderPresent(renderer);
+
+    // latency from the capture of the frame by offscreen
+    gettimeofday (&now, NULL);
+    for (i = 0; i < g_ntiles; ++i) {
+      t = &g_tiles[i];
+      if (t->fresh && t->time) {
+	latency = (now.tv_sec * 1000000ULL + now.tv_usec - t->time) / 1000.0;
+	lat_sum += latency;
+	if (latency > lat_max) lat_max = latency;
+	shown++;
+      }
+      t->fresh = 0;
+    }
+    if (SDL_TICKS_PASSED(SDL_GetTicks(), report)) {
+      for (i = 0; i < g_ntiles; ++i) {
+	missed += g_tiles[i].missed;
+	g_tiles[i].missed = 0;
+      }
+      if (shown) {
+	printf ("%d frames shown, latency %.1f ms (max %.1f), %d missed, %d wakeups without a new frame\n",
+		shown, lat_sum / shown, lat_max, missed, skipped);
+      }
+      shown = skipped = missed = 0;
+      lat_sum = lat_max = 0.0;
+      report = SDL_GetTicks() + REPORT_MS;
+    }
   }
 	
-  SDL_DestroyTexture(img);
+  for (i = 0; i < g_ntiles; ++i) {
+    t = &g_tiles[i];
+    SDL_DestroyTexture(t->img);
+    munmap( t->pixels, t->mapsz );
+    close(t->fd);
+  }
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(win);
-  munmap( pixels, g_width*g_height*4 );
-  close(fbfd);
+  free(planes);
   
   return 0;
 }
@@ -131,16 +594,18 @@ ThreadFunc(void *data)
 void usage( int argc, char *argv[], int optind )
 {
   char *what = (optind > 0) ? "error" : "usage";
-  fprintf( stderr, "%s: %s [-?] -i file [-f fps] [-x x] [-y y] [-w width] [-h height]\n",
+  fprintf( stderr, "%s: %s [-?] -i file[:WIDTHxHEIGHT] [-i ...] [-f fps] [-x x] [-y y] [-w width] [-h height] [-o]\n",
 	   what, argv[0]);
   
   fprintf( stderr, "\t-?\t\tPrints this message.\n");
-  fprintf( stderr, "\t-i\t\tSets input video frame file (default %s).\n",DEF_INPUT);
+  fprintf( stderr, "\t-i\t\tSets input video frame file (default %s), with its geometry\n", DEF_INPUT);
+  fprintf( stderr, "\t\t\tif not the one of -w and -h. Up to %d inputs are shown in a grid.\n", MAX_TILES);
   fprintf( stderr, "\t-f\t\tSets the video framerate (default %d).\n", DEF_FPS);
   fprintf( stderr, "\t-w\t\tSets the width of the image (default %d).\n", DEF_WIDTH);
   fprintf( stderr, "\t-h\t\tSets the height of the image (default %d).\n", DEF_HEIGHT);
   fprintf( stderr, "\t-x\t\tSets the x position of the window (default %d).\n", DEF_WINX);
   fprintf( stderr, "\t-y\t\tSets the y position of the window (default %d).\n", DEF_WINY);
+  fprintf( stderr, "\t-o\t\tShows the age of the frame and the framerate of each input.\n");
   /* exit with error only if option parsng failed */
   exit(optind > 0);
 }
@@ -151,22 +616,53 @@ void usage( int argc, char *argv[], int optind )
 int main (int argc, char *argv[])
 {
   SDL_Thread *thread;
-  int opt;
+  sigset_t set;
+  char *p;
+  int i, opt;
   
-  while ( (opt = getopt( argc, argv, "?i:f:w:h:x:y:")) != -1 ) {
+  while ( (opt = getopt( argc, argv, "?i:f:w:h:x:y:o")) != -1 ) {
     switch( opt ) {
     case '?':  usage( argc, argv, 0); break;
-    case 'i':  g_input = optarg; break;
+    case 'i':
+      if (g_ntiles == MAX_TILES) {
+	fprintf(stderr, "Error: more than %d inputs.\n", MAX_TILES);
+	exit(1);
+      }
+      g_tiles[g_ntiles++].input = optarg;
+      break;
     case 'w':  g_width = atoi(optarg); break;
     case 'h':  g_height = atoi(optarg); break;
     case 'f':  g_fps = atoi(optarg); break;
     case 'x':  g_x = atoi(optarg); break;
     case 'y':  g_y = atoi(optarg); break;
+    case 'o':  g_overlay = 1; break;
     default:
       usage(argc, argv, optind);
     }
   }
+  if (g_ntiles == 0) {
+    g_tiles[g_ntiles++].input = g_input;
+  }
+  // -w and -h give the geometry of the inputs without one
+  for (i = 0; i < g_ntiles; ++i) {
+    struct tile_s *t = &g_tiles[i];
+    t->width = g_width;
+    t->height = g_height;
+    p = strrchr(t->input, ':');
+    if (p && sscanf(p + 1, "%dx%d", &t->width, &t->height) == 2) {
+      *p = 0;
+    }
+    if (t->width <= 0 || t->height <= 0) {
+      fprintf(stderr, "Error: bad geometry for %s.\n", t->input);
+      exit(1);
+    }
+  }
   
+  // SIGUSR1 is blocked before any thread starts, they all inherit it
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
   // Initialize SDL.
   puts("init sdl");
   if (SDL_Init(0) < 0) {
@@ -178,6 +674,12 @@ int main (int argc, char *argv[])
     return 1;
   }
 
+  g_frame_event = SDL_RegisterEvents(1);
+  if (SDL_CreateThread(SignalFunc, "signals", &set) == NULL) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't create thread: %s\n", SDL_GetError());
+    exit(1);
+  }
+
   thread = SDL_CreateThread(ThreadFunc, "One", "#1");
   if (thread == NULL) {
     SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't create thread: %s\n", SDL_GetError());
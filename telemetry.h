@@ -0,0 +1,288 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+/*
+ * Per frame timing of the encoders.
+ *
+ * Every stage of a frame is timed with CLOCK_MONOTONIC in nanoseconds. The
+ * frame records go to histograms of each stage, of the whole frame and of
+ * each frame type, and the last TELEMETRY_RING records are kept. They are
+ * exported on exit, and on SIGUSR2 by the encoders, as JSON (summary and
+ * histograms) or CSV (one line per frame) after the file extension.
+ *
+ * Histogram buckets are log-linear: TELEMETRY_SUB buckets per power of two
+ * from 1 us, so a percentile is known within 1/TELEMETRY_SUB of its value.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TELEMETRY_CONVERT   0
+#define TELEMETRY_ANALYSE   1
+#define TELEMETRY_UPLOAD    2
+#define TELEMETRY_BEGIN     3
+#define TELEMETRY_RENDER    4
+#define TELEMETRY_END       5
+#define TELEMETRY_SYNC      6
+#define TELEMETRY_SAVE      7
+#define TELEMETRY_STAGES    8
+
+#define TELEMETRY_P         0
+#define TELEMETRY_B         1
+#define TELEMETRY_I         2
+#define TELEMETRY_IDR       3
+#define TELEMETRY_SKIP      4
+#define TELEMETRY_TYPES     5
+
+#define TELEMETRY_SUB       8
+#define TELEMETRY_MIN_LOG2  10      /* 1 us */
+#define TELEMETRY_BUCKETS   (25 * TELEMETRY_SUB)
+#define TELEMETRY_RING      16384
+
+static const char *telemetry_stage_name[TELEMETRY_STAGES] = {
+    "convert", "analyse", "upload", "begin", "render", "end", "sync", "save"
+};
+static const char *telemetry_type_name[TELEMETRY_TYPES] = {
+    "P", "B", "I", "IDR", "skip"
+};
+
+struct telemetry_frame_s {
+    unsigned long long frame;   /* encode order */
+    unsigned long long start;   /* CLOCK_MONOTONIC when the frame was taken */
+    unsigned long long ns[TELEMETRY_STAGES];
+    unsigned long long total;   /* from start to the data stored */
+    unsigned int bytes;
+    int type;
+};
+
+struct telemetry_hist_s {
+    unsigned long long count, sum, max;
+    unsigned int bucket[TELEMETRY_BUCKETS];
+};
+
+struct telemetry_s {
+    char *fn;                   /* export file, NULL if none */
+    unsigned long long frames;
+    struct telemetry_hist_s stage[TELEMETRY_STAGES];
+    struct telemetry_hist_s total;
+    struct telemetry_hist_s type[TELEMETRY_TYPES];
+    unsigned long long bytes[TELEMETRY_TYPES];
+    struct telemetry_frame_s *ring;
+};
+
+static unsigned long long telemetry_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// -----------------------------------------------------------------------------
+//  Frame records
+// -----------------------------------------------------------------------------
+static void telemetry_begin(struct telemetry_frame_s *f, unsigned long long frame)
+{
+    memset(f, 0, sizeof(*f));
+    f->frame = frame;
+    f->start = telemetry_now();
+}
+
+/* time spent in stage since the given telemetry_now() */
+static void telemetry_add(struct telemetry_frame_s *f, int stage, unsigned long long since)
+{
+    f->ns[stage] += telemetry_now() - since;
+}
+
+// -----------------------------------------------------------------------------
+//  Histograms
+// -----------------------------------------------------------------------------
+static int telemetry_bucket(unsigned long long ns)
+{
+    int log2 = 0, b;
+
+    if (ns < (1ULL << TELEMETRY_MIN_LOG2))
+        return 0;
+    while (ns >> (log2 + 1))
+        log2++;
+    /* the power of two, then TELEMETRY_SUB steps up to the next one */
+    b = (log2 - TELEMETRY_MIN_LOG2) * TELEMETRY_SUB +
+        (int)((ns >> (log2 - 3)) & (TELEMETRY_SUB - 1)) + 1;
+    return (b < TELEMETRY_BUCKETS) ? b : TELEMETRY_BUCKETS - 1;
+}
+
+/* upper bound of a bucket in ns */
+static unsigned long long telemetry_bucket_ns(int b)
+{
+    int log2, sub;
+
+    if (b == 0)
+        return 1ULL << TELEMETRY_MIN_LOG2;
+    log2 = (b - 1) / TELEMETRY_SUB + TELEMETRY_MIN_LOG2;
+    sub = (b - 1) % TELEMETRY_SUB;
+    return (1ULL << log2) + ((unsigned long long)(sub + 1) << (log2 - 3));
+}
+
+static void telemetry_hist_add(struct telemetry_hist_s *h, unsigned long long ns)
+{
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->bucket[telemetry_bucket(ns)]++;
+}
+
+/* percentile p (0-100) in ns, bounded by the largest value seen */
+static unsigned long long telemetry_percentile(const struct telemetry_hist_s *h, double p)
+{
+    unsigned long long seen = 0, rank = (unsigned long long)(h->count * p / 100.0 + 0.5);
+    int b;
+
+    if (h->count == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < TELEMETRY_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= rank)
+            break;
+    }
+    return (b < TELEMETRY_BUCKETS && telemetry_bucket_ns(b) < h->max) ? telemetry_bucket_ns(b) : h->max;
+}
+
+static int telemetry_init(struct telemetry_s *t, const char *fn)
+{
+    memset(t, 0, sizeof(*t));
+    t->fn = fn ? strdup(fn) : NULL;
+    t->ring = calloc(TELEMETRY_RING, sizeof(struct telemetry_frame_s));
+    return t->ring ? 0 : -1;
+}
+
+static void telemetry_free(struct telemetry_s *t)
+{
+    free(t->fn);
+    free(t->ring);
+}
+
+// -----------------------------------------------------------------------------
+//  The frame is stored: account for it
+// -----------------------------------------------------------------------------
+static void telemetry_end(struct telemetry_s *t, struct telemetry_frame_s *f, int type, unsigned int bytes)
+{
+    int i;
+
+    f->total = telemetry_now() - f->start;
+    f->type = type;
+    f->bytes = bytes;
+
+    for (i = 0; i < TELEMETRY_STAGES; i++)
+        telemetry_hist_add(&t->stage[i], f->ns[i]);
+    telemetry_hist_add(&t->total, f->total);
+    telemetry_hist_add(&t->type[type], f->total);
+    t->bytes[type] += bytes;
+    if (t->ring)
+        t->ring[t->frames % TELEMETRY_RING] = *f;
+    t->frames++;
+}
+
+// -----------------------------------------------------------------------------
+//  Export
+// -----------------------------------------------------------------------------
+static void telemetry_json_hist(FILE *fp, const struct telemetry_hist_s *h)
+{
+    int b, first = 1;
+
+    fprintf(fp, "{\"count\": %llu, \"sum_ns\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+            "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"histogram\": [",
+            h->count, h->sum, h->count ? h->sum / h->count : 0,
+            telemetry_percentile(h, 50), telemetry_percentile(h, 90),
+            telemetry_percentile(h, 99), h->max);
+    /* [upper bound in ns, count] of the buckets in use */
+    for (b = 0; b < TELEMETRY_BUCKETS; b++) {
+        if (h->bucket[b] == 0)
+            continue;
+        fprintf(fp, "%s[%llu, %u]", first ? "" : ", ", telemetry_bucket_ns(b), h->bucket[b]);
+        first = 0;
+    }
+    fprintf(fp, "]}");
+}
+
+static void telemetry_json(struct telemetry_s *t, FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "{\n  \"frames\": %llu,\n  \"total\": ", t->frames);
+    telemetry_json_hist(fp, &t->total);
+    fprintf(fp, ",\n  \"stages\": {\n");
+    for (i = 0; i < TELEMETRY_STAGES; i++) {
+        fprintf(fp, "    \"%s\": ", telemetry_stage_name[i]);
+        telemetry_json_hist(fp, &t->stage[i]);
+        fprintf(fp, "%s\n", (i < TELEMETRY_STAGES - 1) ? "," : "");
+    }
+    fprintf(fp, "  },\n  \"types\": {\n");
+    for (i = 0; i < TELEMETRY_TYPES; i++) {
+        fprintf(fp, "    \"%s\": {\"bytes\": %llu, \"mean_bytes\": %llu, \"time\": ",
+                telemetry_type_name[i], t->bytes[i],
+                t->type[i].count ? t->bytes[i] / t->type[i].count : 0);
+        telemetry_json_hist(fp, &t->type[i]);
+        fprintf(fp, "}%s\n", (i < TELEMETRY_TYPES - 1) ? "," : "");
+    }
+    fprintf(fp, "  }\n}\n");
+}
+
+static void telemetry_csv(struct telemetry_s *t, FILE *fp)
+{
+    unsigned long long n;
+    int i;
+
+    fprintf(fp, "frame,type,bytes");
+    for (i = 0; i < TELEMETRY_STAGES; i++)
+        fprintf(fp, ",%s_ns", telemetry_stage_name[i]);
+    fprintf(fp, ",total_ns\n");
+
+    /* oldest record kept first */
+    for (n = (t->frames > TELEMETRY_RING) ? t->frames - TELEMETRY_RING : 0; n < t->frames; n++) {
+        const struct telemetry_frame_s *f = t->ring + n % TELEMETRY_RING;
+
+        fprintf(fp, "%llu,%s,%u", f->frame, telemetry_type_name[f->type], f->bytes);
+        for (i = 0; i < TELEMETRY_STAGES; i++)
+            fprintf(fp, ",%llu", f->ns[i]);
+        fprintf(fp, ",%llu\n", f->total);
+    }
+}
+
+/* written to a temporary file renamed at the end, returns -1 on error */
+static int telemetry_export(struct telemetry_s *t)
+{
+    const char *ext;
+    char *tmp;
+    FILE *fp;
+    int ret;
+
+    if (t->fn == NULL || t->ring == NULL)
+        return 0;
+    tmp = malloc(strlen(t->fn) + 5);
+    if (tmp == NULL)
+        return -1;
+    sprintf(tmp, "%s.tmp", t->fn);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        free(tmp);
+        return -1;
+    }
+
+    ext = strrchr(t->fn, '.');
+    if (ext && !strcmp(ext, ".csv"))
+        telemetry_csv(t, fp);
+    else
+        telemetry_json(t, fp);
+
+    ret = fclose(fp);
+    if (ret == 0)
+        ret = rename(tmp, t->fn);
+    free(tmp);
+    return ret ? -1 : 0;
+}
+
+#endif
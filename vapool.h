@@ -0,0 +1,67 @@
+#ifndef __VAPOOL_H__
+#define __VAPOOL_H__
+
+/*
+ * Sizes of the VA surfaces and coded buffers of an encoder.
+ *
+ * Source surfaces and their coded buffers are needed for the pictures in
+ * flight between upload and storage. A reconstructed picture is kept while
+ * it is a reference, plus the one being coded. Coded buffers start at eight
+ * times the mean frame size of the bitrate and grow up to the worst case
+ * when the driver reports an overflow.
+ */
+#include <stdio.h>
+
+#define VAPOOL_MAX          16      /* SURFACE_NUM of the encoders */
+#define VAPOOL_MIN_CODED    (64 * 1024)
+
+struct vapool_s {
+    unsigned int src;           /* source surfaces and coded buffers */
+    unsigned int ref;           /* reconstructed surfaces */
+    unsigned int coded_size;    /* bytes of a coded buffer */
+    unsigned int coded_max;     /* worst case */
+};
+
+// -----------------------------------------------------------------------------
+//  Sizes for a w x h aligned picture, bitrate 0 takes the worst case for
+//  the coded buffers (constant QP)
+// -----------------------------------------------------------------------------
+static void vapool_size(struct vapool_s *p, int w, int h, unsigned int refs, unsigned int depth,
+                        unsigned int bitrate, int fps)
+{
+    unsigned long long size;
+
+    p->src = (depth < 1) ? 1 : (depth > VAPOOL_MAX) ? VAPOOL_MAX : depth;
+    p->ref = (refs + 1 > VAPOOL_MAX) ? VAPOOL_MAX : refs + 1;
+
+    /* 400 bytes per 16x16 block is more than any picture can take */
+    p->coded_max = (unsigned int)((unsigned long long)w * h * 400 / (16 * 16));
+    size = (bitrate && fps > 0) ? (unsigned long long)bitrate / fps : p->coded_max;
+    size = (size + 4095) & ~4095ULL;
+    if (size < VAPOOL_MIN_CODED)
+        size = VAPOOL_MIN_CODED;
+    p->coded_size = (size < p->coded_max) ? (unsigned int)size : p->coded_max;
+}
+
+/* doubles the coded buffer size, returns 0 if it is already the worst case */
+static int vapool_grow(struct vapool_s *p)
+{
+    if (p->coded_size >= p->coded_max)
+        return 0;
+    p->coded_size = (p->coded_size > p->coded_max / 2) ? p->coded_max : p->coded_size * 2;
+    return 1;
+}
+
+static void vapool_report(const struct vapool_s *p, int w, int h)
+{
+    /* NV12 surfaces, drivers may add some padding */
+    double surface = w * h * 1.5 / (1024 * 1024);
+    double used = (p->src + p->ref) * surface + p->src * (double)p->coded_size / (1024 * 1024);
+    double fixed = 2 * VAPOOL_MAX * surface + VAPOOL_MAX * (double)p->coded_max / (1024 * 1024);
+
+    printf("VA memory: %u source and %u reference surfaces (%.1f MB), %u coded buffers of %u KB, "
+           "%.1f MB instead of %.1f MB\n",
+           p->src, p->ref, (p->src + p->ref) * surface, p->src, p->coded_size / 1024, used, fixed);
+}
+
+#endif